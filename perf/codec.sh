@@ -0,0 +1,8 @@
+#!/bin/sh
+
+# Compare the compression ratio and speed of the scrollback codecs.
+# Run from the build tree's perf directory, after "make check".
+
+[ $# -gt 0 ] || set -- "$(dirname "$0")/UTF-8-demo.txt"
+
+exec ../src/vtestream-file "$@"
@@ -29,6 +29,60 @@
  * VteRing: A buffer ring
  */
 
+/* Initial number of thawed rows kept, has to be a power of two */
+#define VTE_RING_CACHED_ROWS 64
+
+/* Row records are indexed in groups of this many rows */
+#define VTE_RING_ROW_INDEX_INTERVAL 64
+
+/* The history is rewrapped on this many threads at most */
+#define VTE_RING_REWRAP_MAX_THREADS 8
+
+/* Frozen rows are searched in blocks of this many rows, at least */
+#define VTE_RING_SEARCH_BLOCK_ROWS 1024
+
+/* The frozen rows are searched on this many threads at most, each taking
+ * at least a block */
+#define VTE_RING_SEARCH_MAX_THREADS 8
+
+/* The text index has a bitmap of 1 << VTE_RING_TEXT_INDEX_BITS bits per this
+ * many bytes of text_stream, both powers of two, and keeps this many bitmaps
+ * at most: 8MB for the last 128MB of text. */
+#define VTE_RING_TEXT_INDEX_BLOCK_SIZE 16384
+#define VTE_RING_TEXT_INDEX_BITS 13
+#define VTE_RING_TEXT_INDEX_BITMAP_SIZE ((1 << VTE_RING_TEXT_INDEX_BITS) / 8)
+#define VTE_RING_TEXT_INDEX_MAX_BLOCKS 8192
+
+/* Trigrams looked up in the text index per search, at most */
+#define VTE_RING_TEXT_QUERY_MAX 32
+
+#define VTE_VARINT_MAX_SIZE 10
+#define VTE_ROW_RECORD_MAX_SIZE (2 * VTE_VARINT_MAX_SIZE)
+#define VTE_ATTR_CHANGE_MAX_SIZE (2 * VTE_VARINT_MAX_SIZE + 1)
+
+/* Source of row and ring generations, shared by all the rings,
+ * so that no two of them are ever the same */
+static guint32 _vte_ring_last_generation = 0;
+
+static inline guint32
+_vte_ring_next_generation (void)
+{
+	if (G_UNLIKELY (++_vte_ring_last_generation == 0))
+		_vte_ring_last_generation++;
+	return _vte_ring_last_generation;
+}
+
+/* Give the writable @row a new generation, whenever it's handed out for
+ * changing or its contents are replaced. Whatever is derived from a row's
+ * contents can be kept as long as its generation stays the same.
+ * Frozen rows don't change, they're covered by ring->generation instead. */
+static inline VteRowData *
+_vte_ring_touch_row (VteRowData *row)
+{
+	row->generation = _vte_ring_next_generation ();
+	return row;
+}
+
 #ifdef VTE_DEBUG
 static void
 _vte_ring_validate (VteRing * ring)
@@ -49,6 +103,96 @@ _vte_ring_validate (VteRing * ring)
 #define _vte_ring_validate(ring) G_STMT_START {} G_STMT_END
 #endif
 
+/* Frozen rows are cached in a direct-mapped table. As consecutive rows
+ * map to different slots, scrolling through the history only thaws the
+ * rows that newly came into view. */
+static void
+_vte_ring_alloc_cached_rows (VteRing *ring, gulong n)
+{
+	gulong i;
+
+	ring->cached_rows = g_new (VteRowData, n);
+	ring->cached_row_nums = g_new (gulong, n);
+	ring->cached_rows_mask = n - 1;
+	for (i = 0; i < n; i++) {
+		_vte_row_data_init (&ring->cached_rows[i]);
+		ring->cached_row_nums[i] = (gulong) -1;
+	}
+}
+
+static void
+_vte_ring_free_cached_rows (VteRing *ring)
+{
+	gulong i;
+
+	for (i = 0; i <= ring->cached_rows_mask; i++)
+		_vte_row_data_fini (&ring->cached_rows[i]);
+	g_free (ring->cached_rows);
+	g_free (ring->cached_row_nums);
+}
+
+static void
+_vte_ring_invalidate_cached_rows (VteRing *ring)
+{
+	gulong i;
+
+	for (i = 0; i <= ring->cached_rows_mask; i++)
+		ring->cached_row_nums[i] = (gulong) -1;
+}
+
+static VteStream *
+_vte_ring_new_stream (VteRing *ring)
+{
+	if (ring->streams_in_memory)
+		return _vte_memory_stream_new (TRUE);
+	else
+		return _vte_file_stream_new ();
+}
+
+/* Append the bytes of @from in [@offset, @end) to @stream, which ends at @offset */
+static void
+_vte_ring_append_stream (VteStream *stream, VteStream *from, gsize offset, gsize end)
+{
+	char buf[4096];
+
+	while (offset < end) {
+		gsize len = MIN (sizeof (buf), end - offset);
+		if (!_vte_stream_read (from, offset, buf, len))
+			memset (buf, 0, len);
+		_vte_stream_append (stream, buf, len);
+		offset += len;
+	}
+}
+
+/* Move the contents of a stream to a new one of the current kind */
+static VteStream *
+_vte_ring_migrate_stream (VteRing *ring, VteStream *old_stream)
+{
+	VteStream *stream = _vte_ring_new_stream (ring);
+
+	_vte_stream_reset (stream, _vte_stream_tail (old_stream));
+	_vte_ring_append_stream (stream, old_stream, _vte_stream_tail (old_stream), _vte_stream_head (old_stream));
+
+	g_object_unref (old_stream);
+	return stream;
+}
+
+static void _vte_ring_rewrap_wait (VteRing *ring);
+static void _vte_ring_drop_rewrap_jobs (VteRing *ring);
+
+/* Stop rewrapping the history, it's left wrapped as it is */
+static void
+_vte_ring_cancel_rewrap (VteRing *ring)
+{
+	_vte_ring_drop_rewrap_jobs (ring);
+	if (ring->rewrap_row_stream != NULL) {
+		g_object_unref (ring->rewrap_row_stream);
+		g_object_unref (ring->rewrap_row_index_stream);
+		ring->rewrap_row_stream = ring->rewrap_row_index_stream = NULL;
+	}
+	ring->rewrap_columns = 0;
+	ring->rewrap_end = 0;
+}
 
 void
 _vte_ring_init (VteRing *ring, gulong max_rows, gboolean has_streams)
@@ -62,21 +206,20 @@ _vte_ring_init (VteRing *ring, gulong max_rows, gboolean has_streams)
 	ring->mask = 31;
 	ring->array = (VteRowData *) g_malloc0 (sizeof (ring->array[0]) * (ring->mask + 1));
 
+	/* The streams are created when the first rows are frozen */
 	ring->has_streams = has_streams;
-	if (has_streams) {
-		ring->attr_stream = _vte_file_stream_new ();
-		ring->text_stream = _vte_file_stream_new ();
-		ring->row_stream = _vte_file_stream_new ();
-	} else {
-		ring->attr_stream = ring->text_stream = ring->row_stream = NULL;
-	}
+	ring->attr_stream = ring->text_stream = ring->row_stream = ring->row_index_stream = NULL;
 
 	ring->last_attr_text_start_offset = 0;
 	ring->last_attr.i = basic_cell.i.attr;
 	ring->utf8_buffer = g_string_sized_new (128);
+	ring->attr_buffer = g_string_sized_new (128);
+	ring->row_buffer = g_string_sized_new (128);
+	ring->row_index_buffer = g_string_sized_new (128);
+	ring->row_reader.position = (gulong) -1;
 
-	_vte_row_data_init (&ring->cached_row);
-	ring->cached_row_num = (gulong) -1;
+	_vte_ring_alloc_cached_rows (ring, has_streams ? VTE_RING_CACHED_ROWS : 1);
+	ring->generation = _vte_ring_next_generation ();
 
         ring->visible_rows = 0;
 
@@ -93,24 +236,23 @@ _vte_ring_fini (VteRing *ring)
 
 	g_free (ring->array);
 
-	if (ring->has_streams) {
+	_vte_ring_cancel_rewrap (ring);
+	if (ring->attr_stream != NULL) {
 		g_object_unref (ring->attr_stream);
 		g_object_unref (ring->text_stream);
 		g_object_unref (ring->row_stream);
+		g_object_unref (ring->row_index_stream);
 	}
+	g_free (ring->text_index);
 
 	g_string_free (ring->utf8_buffer, TRUE);
+	g_string_free (ring->attr_buffer, TRUE);
+	g_string_free (ring->row_buffer, TRUE);
+	g_string_free (ring->row_index_buffer, TRUE);
 
-	_vte_row_data_fini (&ring->cached_row);
+	_vte_ring_free_cached_rows (ring);
 }
 
-typedef struct _VteRowRecord {
-	gsize text_start_offset;  /* offset where text of this row begins */
-	gsize attr_start_offset;  /* offset of the first character's attributes */
-	int soft_wrapped: 1;      /* end of line is not '\n' */
-	int is_ascii: 1;          /* for rewrapping speedup: guarantees that line contains 32..126 bytes only. Can be 0 even when ascii only. */
-} VteRowRecord;
-
 /* Represents a cell position, see ../doc/rewrap.txt */
 typedef struct _VteCellTextOffset {
 	gsize text_offset;    /* byte offset in text_stream (or perhaps beyond) */
@@ -118,97 +260,264 @@ typedef struct _VteCellTextOffset {
 	gint eol_cells;       /* -1 if over a character, >=0 if at EOL or beyond */
 } VteCellTextOffset;
 
+/*
+ * Storage format:
+ *
+ * Row records are stored as two varints: the growth of the text offset
+ * since the previous row, shifted left by 2 with soft_wrapped and is_ascii
+ * in the low bits; and the growth of the attr offset. They can only be
+ * decoded sequentially, so row_index_stream has a VteRowIndexEntry for every
+ * VTE_RING_ROW_INDEX_INTERVAL'th row since the streams were last reset.
+ *
+ * Attr changes are stored as two varints: the text end offset, and the attr
+ * XOR'ed with the basic one. They are followed by a byte containing the size
+ * of the whole record, so that they can be read backwards too.
+ */
+
+typedef struct _VteRowIndexEntry {
+	gsize row_offset;  /* offset of the row's record in row_stream */
+	VteRowRecord prev; /* the previous record, that this one is relative to */
+} VteRowIndexEntry;
+
+static inline char *
+_vte_varint_put (char *p, guint64 v)
+{
+	while (v >= 0x80) {
+		*p++ = (char) (v | 0x80);
+		v >>= 7;
+	}
+	*p++ = (char) v;
+	return p;
+}
+
+static inline gboolean
+_vte_varint_get (const char **p, const char *end, guint64 *v)
+{
+	const char *q = *p;
+	guint64 result = 0;
+	int shift;
+
+	for (shift = 0; q < end && shift < 64; shift += 7) {
+		guchar c = *q++;
+		result |= (guint64) (c & 0x7F) << shift;
+		if (!(c & 0x80)) {
+			*p = q;
+			*v = result;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static inline gsize
+_vte_ring_row_index_offset (VteRing *ring, gulong position)
+{
+	return ring->row_index_origin_offset +
+	       (position - ring->row_index_origin) / VTE_RING_ROW_INDEX_INTERVAL * sizeof (VteRowIndexEntry);
+}
+
+/* Decode the record following @record, which is overwritten */
 static gboolean
-_vte_ring_read_row_record (VteRing *ring, VteRowRecord *record, gulong position)
+_vte_ring_decode_row_record (const char **p, const char *end, VteRowRecord *record)
 {
-	return _vte_stream_read (ring->row_stream, position * sizeof (*record), (char *) record, sizeof (*record));
+	guint64 text_delta, attr_delta;
+
+	if (!_vte_varint_get (p, end, &text_delta) || !_vte_varint_get (p, end, &attr_delta))
+		return FALSE;
+
+	record->text_start_offset += text_delta >> 2;
+	record->attr_start_offset += attr_delta;
+	record->soft_wrapped = (text_delta & 2) != 0;
+	record->is_ascii = (text_delta & 1) != 0;
+	return TRUE;
 }
 
+/* Append @record to ring->row_buffer, to be appended to @row_stream, relative to @prev
+ * which is then updated. If @index, its entry is appended to ring->row_index_buffer. */
 static void
-_vte_ring_append_row_record (VteRing *ring, const VteRowRecord *record, gulong position)
+_vte_ring_encode_row_record (VteRing *ring, VteStream *row_stream, VteRowRecord *prev,
+			     gboolean index, const VteRowRecord *record)
 {
-	_vte_stream_append (ring->row_stream, (const char *) record, sizeof (*record));
+	GString *buffer = ring->row_buffer;
+	gsize len = buffer->len;
+	char *p;
+
+	if (index) {
+		VteRowIndexEntry entry;
+
+		memset (&entry, 0, sizeof (entry));
+		entry.row_offset = _vte_stream_head (row_stream) + len;
+		entry.prev = *prev;
+		g_string_append_len (ring->row_index_buffer, (const char *) &entry, sizeof (entry));
+	}
+
+	g_string_set_size (buffer, len + VTE_ROW_RECORD_MAX_SIZE);
+	p = buffer->str + len;
+	p = _vte_varint_put (p, ((guint64) (record->text_start_offset - prev->text_start_offset) << 2) |
+				(record->soft_wrapped ? 2 : 0) | (record->is_ascii ? 1 : 0));
+	p = _vte_varint_put (p, record->attr_start_offset - prev->attr_start_offset);
+	g_string_truncate (buffer, p - buffer->str);
+
+	*prev = *record;
 }
 
+/* Append the pending row records and index entries to the given streams */
 static void
-_vte_ring_freeze_row (VteRing *ring, gulong position, const VteRowData *row)
+_vte_ring_flush_row_records (VteRing *ring, VteStream *row_stream, VteStream *row_index_stream)
 {
-	VteRowRecord record;
-	VteCell *cell;
-	GString *buffer = ring->utf8_buffer;
-	int i;
+	_vte_stream_append (row_stream, ring->row_buffer->str, ring->row_buffer->len);
+	if (ring->row_index_buffer->len)
+		_vte_stream_append (row_index_stream, ring->row_index_buffer->str, ring->row_index_buffer->len);
+	g_string_truncate (ring->row_buffer, 0);
+	g_string_truncate (ring->row_index_buffer, 0);
+}
 
-	_vte_debug_print (VTE_DEBUG_RING, "Freezing row %lu.\n", position);
+/* Decode the next record */
+static gboolean
+_vte_ring_next_row_record (VteRing *ring, VteRowRecordReader *reader, VteRowRecord *record)
+{
+	char buf[VTE_ROW_RECORD_MAX_SIZE];
+	const char *p = buf;
+	gsize len, head = _vte_stream_head (ring->row_stream);
 
-        g_assert(ring->has_streams);
+	if (G_UNLIKELY (reader->row_offset >= head))
+		return FALSE;
 
-	memset(&record, 0, sizeof (record));
-	record.text_start_offset = _vte_stream_head (ring->text_stream);
-	record.attr_start_offset = _vte_stream_head (ring->attr_stream);
-	record.is_ascii = 1;
+	len = MIN (sizeof (buf), head - reader->row_offset);
+	if (!_vte_stream_read (ring->row_stream, reader->row_offset, buf, len))
+		return FALSE;
+	if (!_vte_ring_decode_row_record (&p, buf + len, &reader->record))
+		return FALSE;
 
-	g_string_set_size (buffer, 0);
-	for (i = 0, cell = row->cells; i < row->len; i++, cell++) {
-		VteIntCellAttr attr;
-		int num_chars;
+	reader->row_offset += p - buf;
+	reader->position++;
+	*record = reader->record;
+	return TRUE;
+}
 
-		/* Attr storage:
-		 *
-		 * 1. We don't store attrs for fragments.  They can be
-		 * reconstructed using the columns of their start cell.
-		 *
-		 * 2. We store one attr per vteunistr character starting
-		 * from the second character, with columns=0.
-		 *
-		 * That's enough to reconstruct the attrs, and to store
-		 * the text in real UTF-8.
-		 */
-		attr.s = cell->attr;
-		if (G_LIKELY (!attr.s.fragment)) {
-			VteCellAttrChange attr_change;
+/* Set up @reader to read the record of the row at @position next. It continues
+ * from where the last lookup ended if that's close, otherwise from the index. */
+static gboolean
+_vte_ring_seek_row_record (VteRing *ring, VteRowRecordReader *reader, gulong position)
+{
+	char buf[VTE_RING_ROW_INDEX_INTERVAL * VTE_ROW_RECORD_MAX_SIZE];
+	const char *p = buf;
+	gulong skip;
+	gsize len;
 
-			if (ring->last_attr.i != attr.i) {
-				ring->last_attr_text_start_offset = record.text_start_offset + buffer->len;
-				memset(&attr_change, 0, sizeof (attr_change));
-				attr_change.text_end_offset = ring->last_attr_text_start_offset;
-				attr_change.attr = ring->last_attr;
-				_vte_stream_append (ring->attr_stream, (const char *) &attr_change, sizeof (attr_change));
-				if (!buffer->len)
-					/* This row doesn't use last_attr, adjust */
-					record.attr_start_offset += sizeof (attr_change);
-				ring->last_attr = attr;
-			}
+	if (G_UNLIKELY (position < ring->row_index_origin))
+		return FALSE;
 
-			num_chars = _vte_unistr_strlen (cell->c);
-			if (num_chars > 1) {
-				attr.s.columns = 0;
-				ring->last_attr_text_start_offset = record.text_start_offset + buffer->len
-								  + g_unichar_to_utf8 (_vte_unistr_get_base (cell->c), NULL);
-				memset(&attr_change, 0, sizeof (attr_change));
-				attr_change.text_end_offset = ring->last_attr_text_start_offset;
-				attr_change.attr = ring->last_attr;
-				_vte_stream_append (ring->attr_stream, (const char *) &attr_change, sizeof (attr_change));
-				ring->last_attr = attr;
-			}
+	skip = (position - ring->row_index_origin) % VTE_RING_ROW_INDEX_INTERVAL;
+	if (ring->row_reader.position <= position && position - ring->row_reader.position <= skip) {
+		*reader = ring->row_reader;
+		skip = position - reader->position;
+	} else {
+		VteRowIndexEntry entry;
 
-			if (cell->c < 32 || cell->c > 126) record.is_ascii = 0;
-			_vte_unistr_append_to_string (cell->c, buffer);
+		if (!_vte_stream_read (ring->row_index_stream, _vte_ring_row_index_offset (ring, position),
+				       (char *) &entry, sizeof (entry)))
+			return FALSE;
+		reader->position = position - skip;
+		reader->row_offset = entry.row_offset;
+		reader->record = entry.prev;
+	}
+
+	if (skip > 0) {
+		len = MIN (skip * VTE_ROW_RECORD_MAX_SIZE, _vte_stream_head (ring->row_stream) - reader->row_offset);
+		if (!_vte_stream_read (ring->row_stream, reader->row_offset, buf, len))
+			return FALSE;
+		for (; skip > 0; skip--) {
+			if (!_vte_ring_decode_row_record (&p, buf + len, &reader->record))
+				return FALSE;
 		}
+		reader->row_offset += p - buf;
+		reader->position = position;
 	}
-	if (!row->attr.soft_wrapped)
-		g_string_append_c (buffer, '\n');
-	record.soft_wrapped = row->attr.soft_wrapped;
 
-	_vte_stream_append (ring->text_stream, buffer->str, buffer->len);
-	_vte_ring_append_row_record (ring, &record, position);
+	ring->row_reader = *reader;
+	return TRUE;
+}
+
+static gboolean
+_vte_ring_read_row_record (VteRing *ring, VteRowRecord *record, gulong position)
+{
+	VteRowRecordReader reader;
+
+	return _vte_ring_seek_row_record (ring, &reader, position) &&
+	       _vte_ring_next_row_record (ring, &reader, record);
+}
+
+/* Read the records of the row at @position and of the next one. If it's the last
+ * frozen row, the next one's text offset is the text stream's head. @reader is
+ * left pointing to the row's record, for truncating. */
+static gboolean
+_vte_ring_read_row_records (VteRing *ring, gulong position, VteRowRecord *records, VteRowRecordReader *reader)
+{
+	VteRowRecordReader next;
+
+	if (!_vte_ring_seek_row_record (ring, reader, position))
+		return FALSE;
+	next = *reader;
+	if (!_vte_ring_next_row_record (ring, &next, &records[0]))
+		return FALSE;
+	if (next.row_offset < _vte_stream_head (ring->row_stream)) {
+		if (!_vte_ring_next_row_record (ring, &next, &records[1]))
+			return FALSE;
+	} else
+		records[1].text_start_offset = _vte_stream_head (ring->text_stream);
+	return TRUE;
+}
+
+/* Read the attr change at @offset, and its size */
+static gboolean
+_vte_ring_read_attr_change (VteRing *ring, gsize offset, VteCellAttrChange *attr_change, gsize *size)
+{
+	char buf[VTE_ATTR_CHANGE_MAX_SIZE];
+	const char *p = buf;
+	gsize len, head = _vte_stream_head (ring->attr_stream);
+	guint64 text_end_offset, attr;
+
+	if (G_UNLIKELY (offset < _vte_stream_tail (ring->attr_stream) || offset >= head))
+		return FALSE;
+
+	len = MIN (sizeof (buf), head - offset);
+	if (!_vte_stream_read (ring->attr_stream, offset, buf, len))
+		return FALSE;
+	if (!_vte_varint_get (&p, buf + len, &text_end_offset) ||
+	    !_vte_varint_get (&p, buf + len, &attr) ||
+	    p >= buf + len || (guchar) *p != p - buf + 1)
+		return FALSE;
+
+	attr_change->text_end_offset = text_end_offset;
+	attr_change->attr.i = attr ^ basic_cell.i.attr;
+	*size = p - buf + 1;
+	return TRUE;
+}
+
+/* Read the attr change that ends at @offset, and its size */
+static gboolean
+_vte_ring_read_attr_change_before (VteRing *ring, gsize offset, VteCellAttrChange *attr_change, gsize *size)
+{
+	guchar len;
+
+	if (G_UNLIKELY (offset <= _vte_stream_tail (ring->attr_stream) || offset > _vte_stream_head (ring->attr_stream)))
+		return FALSE;
+	if (!_vte_stream_read (ring->attr_stream, offset - 1, (char *) &len, 1))
+		return FALSE;
+	if (len == 0 || len > offset - _vte_stream_tail (ring->attr_stream))
+		return FALSE;
+	return _vte_ring_read_attr_change (ring, offset - len, attr_change, size) && *size == len;
 }
 
 static void
 _vte_ring_thaw_row (VteRing *ring, gulong position, VteRowData *row, gboolean do_truncate)
 {
 	VteRowRecord records[2], record;
+	VteRowRecordReader reader;
 	VteIntCellAttr attr;
 	VteCellAttrChange attr_change;
+	gsize attr_change_size;
 	VteCell cell;
 	const char *p, *q, *end;
 	GString *buffer = ring->utf8_buffer;
@@ -221,13 +530,8 @@ _vte_ring_thaw_row (VteRing *ring, gulong position, VteRowData *row, gboolean do
 
 	attr_change.text_end_offset = 0;
 
-	if (!_vte_ring_read_row_record (ring, &records[0], position))
+	if (!_vte_ring_read_row_records (ring, position, records, &reader))
 		return;
-	if ((position + 1) * sizeof (records[0]) < _vte_stream_head (ring->row_stream)) {
-		if (!_vte_ring_read_row_record (ring, &records[1], position + 1))
-			return;
-	} else
-		records[1].text_start_offset = _vte_stream_head (ring->text_stream);
 
 	g_string_set_size (buffer, records[1].text_start_offset - records[0].text_start_offset);
 	if (!_vte_stream_read (ring->text_stream, records[0].text_start_offset, buffer->str, buffer->len))
@@ -248,9 +552,9 @@ _vte_ring_thaw_row (VteRing *ring, gulong position, VteRowData *row, gboolean do
 			attr = ring->last_attr;
 		} else {
 			if (record.text_start_offset >= attr_change.text_end_offset) {
-				if (!_vte_stream_read (ring->attr_stream, record.attr_start_offset, (char *) &attr_change, sizeof (attr_change)))
+				if (!_vte_ring_read_attr_change (ring, record.attr_start_offset, &attr_change, &attr_change_size))
 					return;
-				record.attr_start_offset += sizeof (attr_change);
+				record.attr_start_offset += attr_change_size;
 			}
 			attr = attr_change.attr;
 		}
@@ -288,17 +592,17 @@ _vte_ring_thaw_row (VteRing *ring, gulong position, VteRowData *row, gboolean do
 		_vte_debug_print (VTE_DEBUG_RING, "Truncating\n");
 		if (records[0].text_start_offset <= ring->last_attr_text_start_offset) {
 			/* Check the previous attr record. If its text ends where truncating, this attr record also needs to be removed. */
-			if (_vte_stream_read (ring->attr_stream, attr_stream_truncate_at - sizeof (attr_change), (char *) &attr_change, sizeof (attr_change))) {
+			if (_vte_ring_read_attr_change_before (ring, attr_stream_truncate_at, &attr_change, &attr_change_size)) {
 				if (records[0].text_start_offset == attr_change.text_end_offset) {
 					_vte_debug_print (VTE_DEBUG_RING, "... at attribute change\n");
-					attr_stream_truncate_at -= sizeof (attr_change);
+					attr_stream_truncate_at -= attr_change_size;
 				}
 			}
 			/* Reconstruct last_attr from the first record of attr_stream that we cut off,
 			   last_attr_text_start_offset from the last record that we keep. */
-			if (_vte_stream_read (ring->attr_stream, attr_stream_truncate_at, (char *) &attr_change, sizeof (attr_change))) {
+			if (_vte_ring_read_attr_change (ring, attr_stream_truncate_at, &attr_change, &attr_change_size)) {
 				ring->last_attr = attr_change.attr;
-				if (_vte_stream_read (ring->attr_stream, attr_stream_truncate_at - sizeof (attr_change), (char *) &attr_change, sizeof (attr_change))) {
+				if (_vte_ring_read_attr_change_before (ring, attr_stream_truncate_at, &attr_change, &attr_change_size)) {
 					ring->last_attr_text_start_offset = attr_change.text_end_offset;
 				} else {
 					ring->last_attr_text_start_offset = 0;
@@ -308,127 +612,607 @@ _vte_ring_thaw_row (VteRing *ring, gulong position, VteRowData *row, gboolean do
 				ring->last_attr.i = basic_cell.i.attr;
 			}
 		}
-		_vte_stream_truncate (ring->row_stream, position * sizeof (record));
+		/* Keep the index entries of the groups starting before this row */
+		_vte_stream_truncate (ring->row_index_stream,
+				      _vte_ring_row_index_offset (ring, position + VTE_RING_ROW_INDEX_INTERVAL - 1));
+		_vte_stream_truncate (ring->row_stream, reader.row_offset);
 		_vte_stream_truncate (ring->attr_stream, attr_stream_truncate_at);
 		_vte_stream_truncate (ring->text_stream, records[0].text_start_offset);
+		ring->last_row_record = reader.record;
+		ring->row_reader.position = (gulong) -1;
 	}
 }
 
-static void
-_vte_ring_reset_streams (VteRing *ring, gulong position)
-{
-	_vte_debug_print (VTE_DEBUG_RING, "Reseting streams to %lu.\n", position);
-
-	if (ring->has_streams) {
-		_vte_stream_reset (ring->row_stream, position * sizeof (VteRowRecord));
-                _vte_stream_reset (ring->text_stream, _vte_stream_head (ring->text_stream));
-                _vte_stream_reset (ring->attr_stream, _vte_stream_head (ring->attr_stream));
-	}
+/*
+ * The text index
+ *
+ * Each block of text_stream has a bitmap of the trigrams of the searched text,
+ * see _vte_ring_read_search_text(), that end in it. The text is folded to
+ * lowercase and a row's trigrams include the last characters of the previous
+ * one. Searching can then skip the paragraphs whose blocks lack any trigram a
+ * match would contain. Bits are only ever added, so rows changed after being
+ * indexed are still covered, by the bits of their new text.
+ */
 
-	ring->last_attr_text_start_offset = 0;
-	ring->last_attr.i = basic_cell.i.attr;
+static inline guint
+_vte_ring_text_index_hash (guchar a, guchar b, guchar c)
+{
+	return ((((guint32) a << 16) | ((guint32) b << 8) | c) * 2654435761u) >> (32 - VTE_RING_TEXT_INDEX_BITS);
 }
 
-long
-_vte_ring_reset (VteRing *ring)
+static void
+_vte_ring_text_index_grow (VteRing *ring)
 {
-        _vte_debug_print (VTE_DEBUG_RING, "Reseting the ring at %lu.\n", ring->end);
-
-        _vte_ring_reset_streams (ring, ring->end);
-        ring->start = ring->writable = ring->end;
-        ring->cached_row_num = (gulong) -1;
-
-        return ring->end;
+	guint8 *old_index = ring->text_index;
+	gsize old_mask = ring->text_index_mask, block;
+
+	ring->text_index_mask = (old_mask << 1) + 1;
+	ring->text_index = (guint8 *) g_malloc (VTE_RING_TEXT_INDEX_BITMAP_SIZE * (ring->text_index_mask + 1));
+	for (block = ring->text_index_start; block < ring->text_index_end; block++)
+		memcpy (ring->text_index + (block & ring->text_index_mask) * VTE_RING_TEXT_INDEX_BITMAP_SIZE,
+			old_index + (block & old_mask) * VTE_RING_TEXT_INDEX_BITMAP_SIZE,
+			VTE_RING_TEXT_INDEX_BITMAP_SIZE);
+	g_free (old_index);
 }
 
-static inline VteRowData *
-_vte_ring_writable_index (VteRing *ring, gulong position)
+/* The bitmap of the block at @offset in text_stream, which gets one if it's
+ * new. Returns %NULL if the block was dropped to stay within the limit. */
+static guint8 *
+_vte_ring_text_index_bitmap (VteRing *ring, gsize offset)
 {
-	return &ring->array[position & ring->mask];
+	gsize block = offset / VTE_RING_TEXT_INDEX_BLOCK_SIZE;
+
+	if (G_UNLIKELY (block >= ring->text_index_end)) {
+		if (block - ring->text_index_end > ring->text_index_mask)
+			ring->text_index_start = ring->text_index_end = block;
+		while (ring->text_index_end <= block) {
+			if (ring->text_index_end - ring->text_index_start > ring->text_index_mask) {
+				if (ring->text_index_mask + 1 < VTE_RING_TEXT_INDEX_MAX_BLOCKS)
+					_vte_ring_text_index_grow (ring);
+				else
+					ring->text_index_start++;
+			}
+			memset (ring->text_index + (ring->text_index_end & ring->text_index_mask) * VTE_RING_TEXT_INDEX_BITMAP_SIZE,
+				0, VTE_RING_TEXT_INDEX_BITMAP_SIZE);
+			ring->text_index_end++;
+		}
+	}
+
+	if (block < ring->text_index_start)
+		return NULL;
+	return ring->text_index + (block & ring->text_index_mask) * VTE_RING_TEXT_INDEX_BITMAP_SIZE;
 }
 
-const VteRowData *
-_vte_ring_index (VteRing *ring, gulong position)
+/* Set all the bits of the blocks of text_stream in [@offset, @end) */
+static void
+_vte_ring_text_index_fill (VteRing *ring, gsize offset, gsize end)
 {
-	if (G_LIKELY (position >= ring->writable))
-		return _vte_ring_writable_index (ring, position);
+	guint8 *bitmap;
 
-	if (ring->cached_row_num != position) {
-		_vte_debug_print(VTE_DEBUG_RING, "Caching row %lu.\n", position);
-		_vte_ring_thaw_row (ring, position, &ring->cached_row, FALSE);
-		ring->cached_row_num = position;
+	offset -= offset % VTE_RING_TEXT_INDEX_BLOCK_SIZE;
+	for (; offset < end; offset += VTE_RING_TEXT_INDEX_BLOCK_SIZE) {
+		bitmap = _vte_ring_text_index_bitmap (ring, offset);
+		if (bitmap != NULL)
+			memset (bitmap, 0xff, VTE_RING_TEXT_INDEX_BITMAP_SIZE);
 	}
-
-	return &ring->cached_row;
 }
 
-static void _vte_ring_ensure_writable (VteRing *ring, gulong position);
-static void _vte_ring_ensure_writable_room (VteRing *ring);
-
-VteRowData *
-_vte_ring_index_writable (VteRing *ring, gulong position)
+/* Index the text of a frozen row, @len bytes at @offset in text_stream */
+static void
+_vte_ring_text_index_row (VteRing *ring, const char *text, gsize len, gsize offset)
 {
-	_vte_ring_ensure_writable (ring, position);
-	return _vte_ring_writable_index (ring, position);
+	guchar a = ring->text_index_tail[0], b = ring->text_index_tail[1], c;
+	int n = MAX (ring->text_index_tail_len, 0);
+	guint8 *bitmap = NULL;
+	gsize i, end, bitmap_end = 0;
+	gboolean hard, has_nul = FALSE;
+	guint h;
+
+	hard = len > 0 && text[len - 1] == '\n';
+	end = hard ? len - 1 : len;
+	while (end > 0 && text[end - 1] == '\0')
+		end--;
+
+	for (i = 0; i < len; i++) {
+		if (i == end) {
+			if (!hard)
+				break;
+			i = len - 1;
+			c = '\n';
+		} else if (text[i] == '\0') {
+			c = ' ';
+			has_nul = TRUE;
+		} else
+			c = g_ascii_tolower (text[i]);
+
+		if (n == 2) {
+			if (offset + i >= bitmap_end) {
+				bitmap = _vte_ring_text_index_bitmap (ring, offset + i);
+				bitmap_end = offset + i - (offset + i) % VTE_RING_TEXT_INDEX_BLOCK_SIZE + VTE_RING_TEXT_INDEX_BLOCK_SIZE;
+			}
+			if (bitmap != NULL) {
+				h = _vte_ring_text_index_hash (a, b, c);
+				bitmap[h / 8] |= 1 << (h % 8);
+			}
+		} else
+			n++;
+		a = b;
+		b = c;
+	}
+
+	ring->text_index_tail[0] = a;
+	ring->text_index_tail[1] = b;
+	ring->text_index_tail_len = n;
+
+	/* Empty cells become spaces, except at the end of rows, so rewrapping
+	 * can change the text around them. Don't skip these blocks then, the
+	 * next row's first trigrams included. */
+	if (has_nul || (end < len && !hard))
+		_vte_ring_text_index_fill (ring, offset, offset + len + 2);
 }
 
+/* Index the text of the row before @position again, to get the last
+ * characters for indexing the next one */
 static void
-_vte_ring_freeze_one_row (VteRing *ring)
+_vte_ring_text_index_reload_tail (VteRing *ring, gulong position)
 {
-	VteRowData *row;
-
-	if (G_UNLIKELY (ring->writable == ring->start))
-		_vte_ring_reset_streams (ring, ring->writable);
+	VteRowRecord record;
+	gsize end;
+	char *text;
 
-	row = _vte_ring_writable_index (ring, ring->writable);
-	_vte_ring_freeze_row (ring, ring->writable, row);
+	ring->text_index_tail_len = 0;
+	if (position <= ring->start || !_vte_ring_read_row_record (ring, &record, position - 1))
+		return;
 
-	ring->writable++;
+	end = _vte_stream_head (ring->text_stream);
+	text = (char *) g_malloc (end - record.text_start_offset);
+	if (_vte_stream_read (ring->text_stream, record.text_start_offset, text, end - record.text_start_offset))
+		_vte_ring_text_index_row (ring, text, end - record.text_start_offset, record.text_start_offset);
+	g_free (text);
 }
 
+/* Index all the frozen rows, the ones that can't be read are left unindexed */
 static void
-_vte_ring_thaw_one_row (VteRing *ring)
+_vte_ring_text_index_rebuild (VteRing *ring)
 {
-	VteRowData *row;
+	VteRowRecordReader reader;
+	VteRowRecord record;
+	GString *text;
+	gulong position;
+	gsize offset, end;
 
-	g_assert (ring->start < ring->writable);
+	ring->text_index_start = ring->text_index_end = 0;
+	ring->text_index_tail_len = 0;
+	if (ring->text_stream == NULL)
+		return;
 
-	_vte_ring_ensure_writable_room (ring);
+	offset = _vte_stream_tail (ring->text_stream);
+	ring->text_index_start = ring->text_index_end = offset / VTE_RING_TEXT_INDEX_BLOCK_SIZE;
+	if (ring->start == ring->writable)
+		return;
 
-	ring->writable--;
+	if (!_vte_ring_seek_row_record (ring, &reader, ring->start) ||
+	    !_vte_ring_next_row_record (ring, &reader, &record))
+		goto err;
 
-	if (ring->writable == ring->cached_row_num)
-		ring->cached_row_num = (gulong) -1; /* Invalidate cached row */
+	text = g_string_new (NULL);
+	for (position = ring->start; position < ring->writable; position++) {
+		offset = record.text_start_offset;
+		if (position + 1 == ring->writable)
+			end = _vte_stream_head (ring->text_stream);
+		else if (_vte_ring_next_row_record (ring, &reader, &record))
+			end = record.text_start_offset;
+		else
+			break;
 
-	row = _vte_ring_writable_index (ring, ring->writable);
+		g_string_set_size (text, end - offset);
+		if (!_vte_stream_read (ring->text_stream, offset, text->str, text->len))
+			break;
+		_vte_ring_text_index_row (ring, text->str, text->len, offset);
+	}
+	g_string_free (text, TRUE);
+	if (position == ring->writable)
+		return;
 
-	_vte_ring_thaw_row (ring, ring->writable, row, TRUE);
+err:
+	ring->text_index_start = ring->text_index_end =
+		_vte_stream_head (ring->text_stream) / VTE_RING_TEXT_INDEX_BLOCK_SIZE + 1;
+	ring->text_index_tail_len = -1;
+}
+
+/* Forget the blocks no longer in text_stream */
+static void
+_vte_ring_text_index_trim (VteRing *ring)
+{
+	gsize block = _vte_stream_tail (ring->text_stream) / VTE_RING_TEXT_INDEX_BLOCK_SIZE;
+
+	if (block > ring->text_index_start) {
+		ring->text_index_start = block;
+		ring->text_index_end = MAX (ring->text_index_end, block);
+	}
+}
+
+static void
+_vte_ring_reset_streams (VteRing *ring, gulong position)
+{
+	_vte_debug_print (VTE_DEBUG_RING, "Reseting streams to %lu.\n", position);
+
+	_vte_ring_cancel_rewrap (ring);
+	ring->generation = _vte_ring_next_generation ();
+
+	if (ring->attr_stream != NULL) {
+		_vte_stream_reset (ring->row_stream, _vte_stream_head (ring->row_stream));
+		_vte_stream_reset (ring->row_index_stream, _vte_stream_head (ring->row_index_stream));
+                _vte_stream_reset (ring->text_stream, _vte_stream_head (ring->text_stream));
+                _vte_stream_reset (ring->attr_stream, _vte_stream_head (ring->attr_stream));
+
+		ring->row_index_origin_offset = _vte_stream_head (ring->row_index_stream);
+		memset (&ring->last_row_record, 0, sizeof (ring->last_row_record));
+		ring->last_row_record.text_start_offset = _vte_stream_head (ring->text_stream);
+		ring->last_row_record.attr_start_offset = _vte_stream_head (ring->attr_stream);
+
+		if (ring->text_index != NULL)
+			_vte_ring_text_index_trim (ring);
+	}
+	ring->text_index_tail_len = 0;
+	ring->row_index_origin = position;
+	ring->row_reader.position = (gulong) -1;
+
+	ring->last_attr_text_start_offset = 0;
+	ring->last_attr.i = basic_cell.i.attr;
+}
+
+long
+_vte_ring_reset (VteRing *ring)
+{
+        _vte_debug_print (VTE_DEBUG_RING, "Reseting the ring at %lu.\n", ring->end);
+
+        _vte_ring_reset_streams (ring, ring->end);
+        ring->start = ring->writable = ring->end;
+        _vte_ring_invalidate_cached_rows (ring);
+
+        return ring->end;
+}
+
+static inline VteRowData *
+_vte_ring_writable_index (VteRing *ring, gulong position)
+{
+	return &ring->array[position & ring->mask];
+}
+
+/* Append the change to ring->last_attr ending at @text_end_offset, return its size */
+static gsize
+_vte_ring_append_attr_change (VteRing *ring, gsize text_end_offset)
+{
+	GString *buffer = ring->attr_buffer;
+	gsize len = buffer->len;
+	char *start, *p;
+
+	g_string_set_size (buffer, len + VTE_ATTR_CHANGE_MAX_SIZE);
+	start = p = buffer->str + len;
+	p = _vte_varint_put (p, text_end_offset);
+	p = _vte_varint_put (p, ring->last_attr.i ^ basic_cell.i.attr);
+	*p = (char) (p - start + 1);
+	p++;
+	g_string_truncate (buffer, p - buffer->str);
+
+	return p - start;
+}
+
+/* Convert a row into the pending text, attr and row record buffers.
+ * The buffers are appended to the streams by _vte_ring_freeze_rows(). */
+static void
+_vte_ring_freeze_row (VteRing *ring, gulong position, const VteRowData *row)
+{
+	VteRowRecord record;
+	const VteCell *cell, *end;
+	GString *buffer = ring->utf8_buffer;
+	gsize text_offset, row_len;
+
+	_vte_debug_print (VTE_DEBUG_RING, "Freezing row %lu.\n", position);
+
+	/* Offset of the text buffer's start in text_stream */
+	text_offset = _vte_stream_head (ring->text_stream);
+
+	memset(&record, 0, sizeof (record));
+	record.text_start_offset = text_offset + buffer->len;
+	record.attr_start_offset = _vte_stream_head (ring->attr_stream) + ring->attr_buffer->len;
+	record.is_ascii = 1;
+	row_len = buffer->len;
+
+	cell = row->cells;
+	end = cell + row->len;
+	while (cell < end) {
+		VteIntCellAttr attr;
+		int num_chars;
+
+		/* Fast path: a run of printable ASCII in the current attr
+		 * needs neither attr records nor UTF-8 encoding. */
+		attr.s = cell->attr;
+		if (G_LIKELY (cell->c >= 32 && cell->c <= 126 && attr.i == ring->last_attr.i)) {
+			char *p;
+
+			/* One byte per cell at most, make room for the rest of the row. */
+			if (G_UNLIKELY (buffer->len + (end - cell) >= buffer->allocated_len)) {
+				gsize len = buffer->len;
+				g_string_set_size (buffer, len + (end - cell));
+				buffer->len = len;
+			}
+
+			p = buffer->str + buffer->len;
+			do {
+				*p++ = cell->c;
+				cell++;
+				if (cell == end)
+					break;
+				attr.s = cell->attr;
+			} while (cell->c >= 32 && cell->c <= 126 && attr.i == ring->last_attr.i);
+			*p = '\0';
+			buffer->len = p - buffer->str;
+			continue;
+		}
+
+		/* Attr storage:
+		 *
+		 * 1. We don't store attrs for fragments.  They can be
+		 * reconstructed using the columns of their start cell.
+		 *
+		 * 2. We store one attr per vteunistr character starting
+		 * from the second character, with columns=0.
+		 *
+		 * That's enough to reconstruct the attrs, and to store
+		 * the text in real UTF-8.
+		 */
+		if (G_LIKELY (!attr.s.fragment)) {
+			if (ring->last_attr.i != attr.i) {
+				gsize size;
+
+				ring->last_attr_text_start_offset = text_offset + buffer->len;
+				size = _vte_ring_append_attr_change (ring, ring->last_attr_text_start_offset);
+				if (buffer->len == row_len)
+					/* This row doesn't use last_attr, adjust */
+					record.attr_start_offset += size;
+				ring->last_attr = attr;
+			}
+
+			num_chars = _vte_unistr_strlen (cell->c);
+			if (num_chars > 1) {
+				attr.s.columns = 0;
+				ring->last_attr_text_start_offset = text_offset + buffer->len
+								  + g_unichar_to_utf8 (_vte_unistr_get_base (cell->c), NULL);
+				_vte_ring_append_attr_change (ring, ring->last_attr_text_start_offset);
+				ring->last_attr = attr;
+			}
+
+			if (cell->c < 32 || cell->c > 126) record.is_ascii = 0;
+			_vte_unistr_append_to_string (cell->c, buffer);
+		}
+		cell++;
+	}
+	if (!row->attr.soft_wrapped)
+		g_string_append_c (buffer, '\n');
+	record.soft_wrapped = row->attr.soft_wrapped;
+
+	if (ring->text_index != NULL) {
+		if (G_UNLIKELY (ring->text_index_tail_len < 0))
+			_vte_ring_text_index_reload_tail (ring, position);
+		_vte_ring_text_index_row (ring, buffer->str + row_len, buffer->len - row_len, text_offset + row_len);
+	}
+
+	_vte_ring_encode_row_record (ring, ring->row_stream, &ring->last_row_record,
+				     (position - ring->row_index_origin) % VTE_RING_ROW_INDEX_INTERVAL == 0, &record);
+}
+
+static void _vte_ring_discard_one_row (VteRing *ring);
+
+/* Bytes taken by the rows in memory */
+static gsize
+_vte_ring_get_rows_usage (VteRing *ring)
+{
+	gsize size;
+	gulong i;
+
+	size = sizeof (ring->array[0]) * (ring->mask + 1);
+	for (i = 0; i <= ring->mask; i++)
+		size += _vte_row_data_get_allocated_size (&ring->array[i]);
+
+	size += (sizeof (ring->cached_rows[0]) + sizeof (ring->cached_row_nums[0])) * (ring->cached_rows_mask + 1);
+	for (i = 0; i <= ring->cached_rows_mask; i++)
+		size += _vte_row_data_get_allocated_size (&ring->cached_rows[i]);
+
+	return size;
+}
+
+/* Add the bytes taken by the frozen rows in memory and on disk */
+static void
+_vte_ring_get_streams_usage (VteRing *ring, gsize *buffers, gsize *disk)
+{
+	*buffers += ring->utf8_buffer->allocated_len + ring->attr_buffer->allocated_len +
+		    ring->row_buffer->allocated_len + ring->row_index_buffer->allocated_len;
+
+	if (ring->attr_stream == NULL)
+		return;
+
+	_vte_stream_get_usage (ring->attr_stream, buffers, disk);
+	_vte_stream_get_usage (ring->text_stream, buffers, disk);
+	_vte_stream_get_usage (ring->row_stream, buffers, disk);
+	_vte_stream_get_usage (ring->row_index_stream, buffers, disk);
+	if (ring->text_index != NULL)
+		*buffers += VTE_RING_TEXT_INDEX_BITMAP_SIZE * (ring->text_index_mask + 1);
+	if (ring->rewrap_row_stream != NULL) {
+		_vte_stream_get_usage (ring->rewrap_row_stream, buffers, disk);
+		_vte_stream_get_usage (ring->rewrap_row_index_stream, buffers, disk);
+	}
+}
+
+/* Discard the oldest frozen rows while over ring->max_bytes, but keep a
+ * screenful. The streams only shrink a block at a time, so this might drop
+ * a few rows more than strictly necessary. */
+static void
+_vte_ring_enforce_max_bytes (VteRing *ring)
+{
+	gsize rows, buffers, disk;
+	gulong n;
+
+	rows = _vte_ring_get_rows_usage (ring);
+	while (ring->start < ring->writable && ring->end - ring->start > ring->visible_rows) {
+		buffers = disk = 0;
+		_vte_ring_get_streams_usage (ring, &buffers, &disk);
+		if (rows + buffers + disk <= ring->max_bytes)
+			break;
+
+		/* The streams only shrink a block at a time, so rather than checking
+		 * after each row, discard as many as the excess takes going by the
+		 * average frozen row */
+		n = (rows + buffers + disk - ring->max_bytes) / MAX ((buffers + disk) / (ring->writable - ring->start), 1) + 1;
+		n = MIN (n, MIN (ring->writable - ring->start, ring->end - ring->start - ring->visible_rows));
+		_vte_debug_print(VTE_DEBUG_RING, "Over %" G_GSIZE_FORMAT " bytes, discarding rows %lu..%lu.\n",
+				 ring->max_bytes, ring->start, ring->start + n - 1);
+		while (n--)
+			_vte_ring_discard_one_row (ring);
+	}
+}
+
+/* Freeze @count rows starting at ring->writable, with a single append
+ * per stream. */
+static void
+_vte_ring_freeze_rows (VteRing *ring, gulong count)
+{
+	gulong i;
+
+        g_assert(ring->has_streams);
+	g_assert (ring->writable + count <= ring->end);
+
+	_vte_ring_rewrap_wait (ring);
+
+	if (G_UNLIKELY (ring->attr_stream == NULL)) {
+		ring->attr_stream = _vte_ring_new_stream (ring);
+		ring->text_stream = _vte_ring_new_stream (ring);
+		ring->row_stream = _vte_ring_new_stream (ring);
+		ring->row_index_stream = _vte_ring_new_stream (ring);
+	}
+
+	if (G_UNLIKELY (ring->writable == ring->start))
+		_vte_ring_reset_streams (ring, ring->writable);
+
+	g_string_set_size (ring->utf8_buffer, 0);
+	g_string_set_size (ring->attr_buffer, 0);
+	g_string_set_size (ring->row_buffer, 0);
+	g_string_set_size (ring->row_index_buffer, 0);
+
+	for (i = 0; i < count; i++, ring->writable++)
+		_vte_ring_freeze_row (ring, ring->writable, _vte_ring_writable_index (ring, ring->writable));
+
+	_vte_stream_append (ring->text_stream, ring->utf8_buffer->str, ring->utf8_buffer->len);
+	if (ring->attr_buffer->len)
+		_vte_stream_append (ring->attr_stream, ring->attr_buffer->str, ring->attr_buffer->len);
+	_vte_ring_flush_row_records (ring, ring->row_stream, ring->row_index_stream);
+}
+
+const VteRowData *
+_vte_ring_index (VteRing *ring, gulong position)
+{
+	gulong slot;
+
+	if (G_LIKELY (position >= ring->writable))
+		return _vte_ring_writable_index (ring, position);
+
+	slot = position & ring->cached_rows_mask;
+	if (ring->cached_row_nums[slot] != position) {
+		_vte_debug_print(VTE_DEBUG_RING, "Caching row %lu.\n", position);
+		_vte_ring_thaw_row (ring, position, &ring->cached_rows[slot], FALSE);
+		ring->cached_row_nums[slot] = position;
+	}
+
+	return &ring->cached_rows[slot];
+}
+
+static void _vte_ring_ensure_writable (VteRing *ring, gulong position);
+static void _vte_ring_ensure_writable_room (VteRing *ring);
+
+VteRowData *
+_vte_ring_index_writable (VteRing *ring, gulong position)
+{
+	_vte_ring_ensure_writable (ring, position);
+	return _vte_ring_touch_row (_vte_ring_writable_index (ring, position));
+}
+
+static void
+_vte_ring_thaw_one_row (VteRing *ring)
+{
+	VteRowData *row;
+
+	g_assert (ring->start < ring->writable);
+
+	_vte_ring_ensure_writable_room (ring);
+
+	/* The history can't be rewrapped once the rows after it change */
+	if (G_UNLIKELY (ring->writable <= ring->rewrap_end))
+		_vte_ring_cancel_rewrap (ring);
+	_vte_ring_rewrap_wait (ring);
+
+	ring->writable--;
+	ring->generation = _vte_ring_next_generation ();
+	ring->text_index_tail_len = -1;  /* the row's text is going away */
+
+	if (ring->writable == ring->cached_row_nums[ring->writable & ring->cached_rows_mask])
+		ring->cached_row_nums[ring->writable & ring->cached_rows_mask] = (gulong) -1; /* Invalidate cached row */
+
+	row = _vte_ring_writable_index (ring, ring->writable);
+
+	_vte_ring_thaw_row (ring, ring->writable, row, TRUE);
+	_vte_ring_touch_row (row);
 }
 
 static void
 _vte_ring_discard_one_row (VteRing *ring)
 {
+	_vte_ring_rewrap_wait (ring);
+
 	ring->start++;
 	if (G_UNLIKELY (ring->start == ring->writable)) {
 		_vte_ring_reset_streams (ring, ring->writable);
 	} else if (ring->start < ring->writable) {
 		VteRowRecord record;
-		_vte_stream_advance_tail (ring->row_stream, ring->start * sizeof (record));
+		/* Row records can only be dropped a whole indexed group at a time */
+		if ((ring->start - ring->row_index_origin) % VTE_RING_ROW_INDEX_INTERVAL == 0) {
+			VteRowIndexEntry entry;
+			gsize index_offset = _vte_ring_row_index_offset (ring, ring->start);
+			if (G_LIKELY (_vte_stream_read (ring->row_index_stream, index_offset, (char *) &entry, sizeof (entry)))) {
+				_vte_stream_advance_tail (ring->row_index_stream, index_offset);
+				_vte_stream_advance_tail (ring->row_stream, entry.row_offset);
+			}
+		}
 		if (G_LIKELY (_vte_ring_read_row_record (ring, &record, ring->start))) {
 			_vte_stream_advance_tail (ring->text_stream, record.text_start_offset);
 			_vte_stream_advance_tail (ring->attr_stream, record.attr_start_offset);
+			if (ring->text_index != NULL)
+				_vte_ring_text_index_trim (ring);
 		}
 	} else {
 		ring->writable = ring->start;
 	}
 }
 
+/* Make room in the writable array, freezing rows if it's full.
+ * Rows from @keep on are not frozen unless necessary, the caller
+ * is about to modify them. */
 static void
-_vte_ring_maybe_freeze_one_row (VteRing *ring)
+_vte_ring_maybe_freeze_rows (VteRing *ring, gulong keep)
 {
-        if (G_LIKELY (ring->mask >= ring->visible_rows && ring->writable + ring->mask + 1 == ring->end))
-		_vte_ring_freeze_one_row (ring);
-	else
+	gulong count;
+
+        if (G_LIKELY (ring->mask >= ring->visible_rows && ring->writable + ring->mask + 1 == ring->end)) {
+		/* Freeze the rows above the visible ones in one go, but keep
+		 * at least half of the array writable. */
+		count = MIN (ring->mask + 1 - ring->visible_rows, (ring->mask + 1) / 2);
+		if (keep > ring->writable)
+			count = MIN (count, keep - ring->writable);
+		_vte_ring_freeze_rows (ring, MAX (count, 1));
+
+		if (ring->max_bytes)
+			_vte_ring_enforce_max_bytes (ring);
+	} else
 		_vte_ring_ensure_writable_room (ring);
 }
 
@@ -562,9 +1346,10 @@ _vte_ring_insert (VteRing *ring, gulong position)
 
 	row = _vte_ring_writable_index (ring, position);
 	_vte_row_data_clear (row);
+	_vte_ring_touch_row (row);
 	ring->end++;
 
-	_vte_ring_maybe_freeze_one_row (ring);
+	_vte_ring_maybe_freeze_rows (ring, position);
 
 	_vte_ring_validate(ring);
 	return row;
@@ -638,6 +1423,38 @@ _vte_ring_drop_scrollback (VteRing * ring, gulong position)
 }
 
 
+/**
+ * _vte_ring_set_streams_in_memory:
+ * @ring: a #VteRing
+ * @in_memory: whether to keep the frozen rows in memory
+ *
+ * Choose between temporary files and memory for storing the frozen rows.
+ * The rows frozen so far are moved over.
+ */
+void
+_vte_ring_set_streams_in_memory (VteRing *ring, gboolean in_memory)
+{
+	in_memory = in_memory != FALSE;
+	if (in_memory == ring->streams_in_memory)
+		return;
+
+	ring->streams_in_memory = in_memory;
+	if (ring->attr_stream == NULL)
+		return;
+
+	_vte_debug_print(VTE_DEBUG_RING, "Moving streams to %s.\n", in_memory ? "memory" : "file");
+
+	_vte_ring_rewrap_wait (ring);
+	ring->attr_stream = _vte_ring_migrate_stream (ring, ring->attr_stream);
+	ring->text_stream = _vte_ring_migrate_stream (ring, ring->text_stream);
+	ring->row_stream = _vte_ring_migrate_stream (ring, ring->row_stream);
+	ring->row_index_stream = _vte_ring_migrate_stream (ring, ring->row_index_stream);
+	if (ring->rewrap_row_stream != NULL) {
+		ring->rewrap_row_stream = _vte_ring_migrate_stream (ring, ring->rewrap_row_stream);
+		ring->rewrap_row_index_stream = _vte_ring_migrate_stream (ring, ring->rewrap_row_index_stream);
+	}
+}
+
 /**
  * _vte_ring_set_visible_rows:
  * @ring: a #VteRing
@@ -649,7 +1466,151 @@ _vte_ring_drop_scrollback (VteRing * ring, gulong position)
 void
 _vte_ring_set_visible_rows (VteRing *ring, gulong rows)
 {
+        gulong n;
+
         ring->visible_rows = rows;
+
+        /* Keep a couple of screenfuls of thawed rows around */
+        if (ring->has_streams && 2 * rows > ring->cached_rows_mask + 1) {
+                for (n = ring->cached_rows_mask + 1; n < 2 * rows; n <<= 1)
+                        ;
+                _vte_ring_free_cached_rows (ring);
+                _vte_ring_alloc_cached_rows (ring, n);
+        }
+}
+
+/**
+ * _vte_ring_set_max_bytes:
+ * @ring: a #VteRing
+ * @max_bytes: the maximum number of bytes, or 0 for no limit
+ *
+ * Limits the memory and disk space taken by the ring, see _vte_ring_get_usage().
+ * The oldest frozen rows are discarded to stay within the limit, in addition
+ * to the limit on the number of rows.
+ */
+void
+_vte_ring_set_max_bytes (VteRing *ring, gsize max_bytes)
+{
+	ring->max_bytes = max_bytes;
+
+	if (max_bytes && ring->has_streams)
+		_vte_ring_enforce_max_bytes (ring);
+}
+
+/**
+ * _vte_ring_get_usage:
+ * @ring: a #VteRing
+ * @rows: (out): bytes taken by the rows kept in memory
+ * @buffers: (out): bytes of memory taken by the frozen rows
+ * @disk: (out): bytes of disk space taken by the frozen rows
+ */
+void
+_vte_ring_get_usage (VteRing *ring, gsize *rows, gsize *buffers, gsize *disk)
+{
+	*rows = _vte_ring_get_rows_usage (ring);
+	*buffers = *disk = 0;
+	_vte_ring_get_streams_usage (ring, buffers, disk);
+}
+
+/**
+ * _vte_ring_set_text_indexed:
+ * @ring: a #VteRing
+ * @indexed: whether to index the text of the frozen rows
+ *
+ * Keep an index of the trigrams of the frozen text, for _vte_ring_search()
+ * and _vte_ring_search_all() to skip the paragraphs that can't match. The
+ * rows frozen so far are indexed right away. The index takes 1/16th of the
+ * frozen text at most, up to 8MB, and is counted in the buffers by
+ * _vte_ring_get_usage().
+ */
+void
+_vte_ring_set_text_indexed (VteRing *ring, gboolean indexed)
+{
+	indexed = indexed != FALSE;
+	if (indexed == (ring->text_index != NULL))
+		return;
+
+	_vte_debug_print(VTE_DEBUG_RING, "%s the text.\n", indexed ? "Indexing" : "Not indexing");
+
+	if (!indexed) {
+		g_free (ring->text_index);
+		ring->text_index = NULL;
+		return;
+	}
+
+	ring->text_index_mask = 7;
+	ring->text_index = (guint8 *) g_malloc (VTE_RING_TEXT_INDEX_BITMAP_SIZE * (ring->text_index_mask + 1));
+	_vte_ring_text_index_rebuild (ring);
+}
+
+/* Replace @buffer by a small one if it has grown */
+static void
+_vte_ring_shrink_buffer (GString **buffer)
+{
+	if ((*buffer)->allocated_len > 128 + 1) {
+		g_string_free (*buffer, TRUE);
+		*buffer = g_string_sized_new (128);
+	}
+}
+
+/**
+ * _vte_ring_hibernate:
+ * @ring: a #VteRing
+ *
+ * Release as much memory as possible while the ring isn't in use. If it
+ * has streams, all the rows are frozen, to be thawed again on demand.
+ * The caches and buffers are freed, they are allocated again when needed.
+ */
+void
+_vte_ring_hibernate (VteRing *ring)
+{
+	gulong i;
+
+	_vte_debug_print(VTE_DEBUG_RING, "Hibernating ring %p.\n", ring);
+	_vte_ring_validate(ring);
+	_vte_ring_rewrap_wait (ring);
+
+	if (ring->has_streams && ring->writable < ring->end)
+		_vte_ring_freeze_rows (ring, ring->end - ring->writable);
+
+	if (ring->writable == ring->end) {
+		/* Go back to the initial array */
+		for (i = 0; i <= ring->mask; i++)
+			_vte_row_data_fini (&ring->array[i]);
+		g_free (ring->array);
+		ring->mask = 31;
+		ring->array = (VteRowData *) g_malloc0 (sizeof (ring->array[0]) * (ring->mask + 1));
+	} else {
+		/* Free the cells of the unused slots */
+		for (i = ring->end; i <= ring->writable + ring->mask; i++) {
+			_vte_row_data_fini (_vte_ring_writable_index (ring, i));
+			_vte_row_data_init (_vte_ring_writable_index (ring, i));
+		}
+	}
+
+	for (i = 0; i <= ring->cached_rows_mask; i++) {
+		_vte_row_data_fini (&ring->cached_rows[i]);
+		_vte_row_data_init (&ring->cached_rows[i]);
+	}
+	_vte_ring_invalidate_cached_rows (ring);
+
+	_vte_ring_shrink_buffer (&ring->utf8_buffer);
+	_vte_ring_shrink_buffer (&ring->attr_buffer);
+	_vte_ring_shrink_buffer (&ring->row_buffer);
+	_vte_ring_shrink_buffer (&ring->row_index_buffer);
+
+	if (ring->attr_stream != NULL) {
+		_vte_stream_trim (ring->attr_stream);
+		_vte_stream_trim (ring->text_stream);
+		_vte_stream_trim (ring->row_stream);
+		_vte_stream_trim (ring->row_index_stream);
+	}
+	if (ring->rewrap_row_stream != NULL) {
+		_vte_stream_trim (ring->rewrap_row_stream);
+		_vte_stream_trim (ring->rewrap_row_index_stream);
+	}
+
+	_vte_ring_validate(ring);
 }
 
 
@@ -663,6 +1624,7 @@ _vte_frozen_row_column_to_text_offset (VteRing *ring,
 				       VteCellTextOffset *offset)
 {
 	VteRowRecord records[2];
+	VteRowRecordReader reader;
 	VteCell *cell;
 	GString *buffer = ring->utf8_buffer;
 	const VteRowData *row;
@@ -684,13 +1646,8 @@ _vte_frozen_row_column_to_text_offset (VteRing *ring,
 	}
 
 	g_assert(position < ring->writable);
-	if (!_vte_ring_read_row_record (ring, &records[0], position))
+	if (!_vte_ring_read_row_records (ring, position, records, &reader))
 		return FALSE;
-	if ((position + 1) * sizeof (records[0]) < _vte_stream_head (ring->row_stream)) {
-		if (!_vte_ring_read_row_record (ring, &records[1], position + 1))
-			return FALSE;
-	} else
-		records[1].text_start_offset = _vte_stream_head (ring->text_stream);
 
 	g_string_set_size (buffer, records[1].text_start_offset - records[0].text_start_offset);
 	if (!_vte_stream_read (ring->text_stream, records[0].text_start_offset, buffer->str, buffer->len))
@@ -742,6 +1699,7 @@ _vte_frozen_row_text_offset_to_column (VteRing *ring,
 				       long *column)
 {
 	VteRowRecord records[2];
+	VteRowRecordReader reader;
 	VteCell *cell;
 	GString *buffer = ring->utf8_buffer;
 	const VteRowData *row;
@@ -760,13 +1718,8 @@ _vte_frozen_row_text_offset_to_column (VteRing *ring,
 	}
 
 	g_assert_cmpuint(position, <, ring->writable);
-	if (!_vte_ring_read_row_record (ring, &records[0], position))
+	if (!_vte_ring_read_row_records (ring, position, records, &reader))
 		return FALSE;
-	if ((position + 1) * sizeof (records[0]) < _vte_stream_head (ring->row_stream)) {
-		if (!_vte_ring_read_row_record (ring, &records[1], position + 1))
-			return FALSE;
-	} else
-		records[1].text_start_offset = _vte_stream_head (ring->text_stream);
 
 	g_assert(offset->text_offset >= records[0].text_start_offset && offset->text_offset < records[1].text_start_offset);
 
@@ -807,79 +1760,61 @@ _vte_frozen_row_text_offset_to_column (VteRing *ring,
 }
 
 
-/**
- * _vte_ring_rewrap:
- * @ring: a #VteRing
- * @columns: new number of columns
- * @markers: NULL-terminated array of #VteVisualPosition
- *
- * Reflow the @ring to match the new number of @columns.
- * For all @markers, find the cell at that position and update them to
- * reflect the cell's new position.
- */
-/* See ../doc/rewrap.txt for design and implementation details. */
-void
-_vte_ring_rewrap (VteRing *ring,
-		  glong columns,
-		  VteVisualPosition **markers)
+/* Rewrap the paragraphs starting at row *@position to @columns, up to row @end,
+ * or stop after the paragraph that reaches @count rows. The new records are
+ * appended to @row_stream and @row_index_stream relative to @prev, as rows
+ * from *@new_position on, indexed relative to @index_origin. @new_markers get
+ * the new row of the @marker_text_offsets found in them. Both positions are
+ * advanced. The text is only read for paragraphs that aren't all ASCII, with
+ * @concurrent from any thread, see _vte_stream_read_concurrent(). */
+static gboolean
+_vte_ring_rewrap_rows (VteRing *ring,
+		       gboolean concurrent,
+		       gulong *position,
+		       gulong end,
+		       gulong count,
+		       glong columns,
+		       VteStream *row_stream,
+		       VteStream *row_index_stream,
+		       VteRowRecord *prev,
+		       gulong index_origin,
+		       gulong *new_position,
+		       int num_markers,
+		       const VteCellTextOffset *marker_text_offsets,
+		       VteVisualPosition *new_markers)
 {
-	gulong old_row_index, new_row_index;
+	gulong old_row_index, new_row_index, stop;
 	int i;
-	int num_markers = 0;
-	VteCellTextOffset *marker_text_offsets;
-	VteVisualPosition *new_markers;
 	VteRowRecord old_record;
+	VteRowRecordReader old_reader;
 	VteCellAttrChange attr_change;
-	VteStream *new_row_stream;
+	gsize attr_change_size;
 	gsize paragraph_start_text_offset;
 	gsize paragraph_end_text_offset;
 	gsize paragraph_len;  /* excluding trailing '\n' */
 	gsize attr_offset;
-	gsize old_ring_end;
-
-	if (_vte_ring_length(ring) == 0)
-		return;
-	_vte_debug_print(VTE_DEBUG_RING, "Ring before rewrapping:\n");
-	_vte_ring_validate(ring);
-	new_row_stream = _vte_file_stream_new ();
+	GString *text = ring->utf8_buffer;  /* of the paragraph, unless it's ASCII */
 
-	/* Freeze everything, because rewrapping is really complicated and we don't want to
-	   duplicate the code for frozen and thawed rows. */
-	while (ring->writable < ring->end)
-		_vte_ring_freeze_one_row(ring);
-
-	/* For markers given as (row,col) pairs find their offsets in the text stream.
-	   This code requires that the rows are already frozen. */
-	while (markers[num_markers] != NULL)
-		num_markers++;
-	marker_text_offsets = (VteCellTextOffset *) g_malloc(num_markers * sizeof (marker_text_offsets[0]));
-	new_markers = (VteVisualPosition *) g_malloc(num_markers * sizeof (new_markers[0]));
-	for (i = 0; i < num_markers; i++) {
-		/* Convert visual column into byte offset */
-		if (!_vte_frozen_row_column_to_text_offset(ring, markers[i]->row, markers[i]->col, &marker_text_offsets[i]))
-			goto err;
-		new_markers[i].row = new_markers[i].col = -1;
-		_vte_debug_print(VTE_DEBUG_RING,
-				"Marker #%d old coords:  row %ld  col %ld  ->  text_offset %" G_GSIZE_FORMAT " fragment_cells %d  eol_cells %d\n",
-				i, markers[i]->row, markers[i]->col, marker_text_offsets[i].text_offset,
-				marker_text_offsets[i].fragment_cells, marker_text_offsets[i].eol_cells);
-	}
+	if (*position >= end)
+		return TRUE;
 
-	/* Prepare for rewrapping */
-	if (!_vte_ring_read_row_record(ring, &old_record, ring->start))
-		goto err;
+	if (!_vte_ring_seek_row_record(ring, &old_reader, *position) ||
+	    !_vte_ring_next_row_record(ring, &old_reader, &old_record))
+		return FALSE;
 	paragraph_start_text_offset = old_record.text_start_offset;
 	paragraph_end_text_offset = _vte_stream_head (ring->text_stream);  /* initialized to silence gcc */
-	new_row_index = 0;
+	new_row_index = *new_position;
+	stop = count < end - *position ? *position + count : end;
 
 	attr_offset = old_record.attr_start_offset;
-	if (!_vte_stream_read(ring->attr_stream, attr_offset, (char *) &attr_change, sizeof (attr_change))) {
+	if (!_vte_ring_read_attr_change(ring, attr_offset, &attr_change, &attr_change_size)) {
 		attr_change.attr = ring->last_attr;
 		attr_change.text_end_offset = _vte_stream_head (ring->text_stream);
+		attr_change_size = 0;
 	}
 
-	old_row_index = ring->start + 1;
-	while (paragraph_start_text_offset < _vte_stream_head (ring->text_stream)) {
+	old_row_index = *position + 1;
+	while (old_row_index - 1 < stop) {
 		/* Find the boundaries of the next paragraph */
 		gboolean prev_record_was_soft_wrapped = FALSE;
 		gboolean paragraph_is_ascii = TRUE;
@@ -891,12 +1826,12 @@ _vte_ring_rewrap (VteRing *ring,
 		_vte_debug_print(VTE_DEBUG_RING,
 				"  Old paragraph:  row %" G_GSIZE_FORMAT "  (text_offset %" G_GSIZE_FORMAT ")  up to (exclusive)  ",  /* no '\n' */
 				paragraph_start_row, paragraph_start_text_offset);
-		while (old_row_index <= ring->end) {
+		while (old_row_index <= end) {
 			prev_record_was_soft_wrapped = old_record.soft_wrapped;
 			paragraph_is_ascii = paragraph_is_ascii && old_record.is_ascii;
-			if (G_LIKELY (old_row_index < ring->end)) {
-				if (!_vte_ring_read_row_record(ring, &old_record, old_row_index))
-					goto err;
+			if (G_LIKELY (old_row_index < ring->writable)) {
+				if (!_vte_ring_next_row_record(ring, &old_reader, &old_record))
+					return FALSE;
 				paragraph_end_text_offset = old_record.text_start_offset;
 			} else {
 				paragraph_end_text_offset = _vte_stream_head (ring->text_stream);
@@ -915,13 +1850,23 @@ _vte_ring_rewrap (VteRing *ring,
 				prev_record_was_soft_wrapped ? "  soft_wrapped" : "",
 				paragraph_len, paragraph_is_ascii);
 
+		if (!paragraph_is_ascii) {
+			g_string_set_size (text, paragraph_len);
+			if (paragraph_len > 0 &&
+			    !(concurrent ?
+			      _vte_stream_read_concurrent (ring->text_stream, paragraph_start_text_offset, text->str, paragraph_len) :
+			      _vte_stream_read (ring->text_stream, paragraph_start_text_offset, text->str, paragraph_len)))
+				return FALSE;
+		}
+
 		/* Wrap the paragraph */
 		if (attr_change.text_end_offset <= text_offset) {
 			/* Attr change at paragraph boundary, advance to next attr. */
-			attr_offset += sizeof (attr_change);
-			if (!_vte_stream_read(ring->attr_stream, attr_offset, (char *) &attr_change, sizeof (attr_change))) {
+			attr_offset += attr_change_size;
+			if (!_vte_ring_read_attr_change(ring, attr_offset, &attr_change, &attr_change_size)) {
 				attr_change.attr = ring->last_attr;
 				attr_change.text_end_offset = _vte_stream_head (ring->text_stream);
+				attr_change_size = 0;
 			}
 		}
 		memset(&new_record, 0, sizeof (new_record));
@@ -934,10 +1879,11 @@ _vte_ring_rewrap (VteRing *ring,
 			gsize runlength;  /* number of bytes we process in one run: identical attributes, within paragraph */
 			if (attr_change.text_end_offset <= text_offset) {
 				/* Attr change at line boundary, advance to next attr. */
-				attr_offset += sizeof (attr_change);
-				if (!_vte_stream_read(ring->attr_stream, attr_offset, (char *) &attr_change, sizeof (attr_change))) {
+				attr_offset += attr_change_size;
+				if (!_vte_ring_read_attr_change(ring, attr_offset, &attr_change, &attr_change_size)) {
 					attr_change.attr = ring->last_attr;
 					attr_change.text_end_offset = _vte_stream_head (ring->text_stream);
+					attr_change_size = 0;
 				}
 			}
 			runlength = MIN(paragraph_len, attr_change.text_end_offset - text_offset);
@@ -951,7 +1897,8 @@ _vte_ring_rewrap (VteRing *ring,
 					if (col >= columns - attr_change.attr.s.columns + 1) {
 						/* Wrap now, write the soft wrapped row's record */
 						new_record.soft_wrapped = 1;
-						_vte_stream_append(new_row_stream, (const char *) &new_record, sizeof (new_record));
+						_vte_ring_encode_row_record(ring, row_stream, prev,
+									    (new_row_index - index_origin) % VTE_RING_ROW_INDEX_INTERVAL == 0, &new_record);
 						_vte_debug_print(VTE_DEBUG_RING,
 								"    New row %ld  text_offset %" G_GSIZE_FORMAT "  attr_offset %" G_GSIZE_FORMAT "  soft_wrapped\n",
 								new_row_index,
@@ -979,14 +1926,13 @@ _vte_ring_rewrap (VteRing *ring,
 						runlength -= len;
 					} else {
 						/* Process one character only. */
-						char textbuf[6];  /* fits at least one UTF-8 character */
+						const char *textbuf;
 						int textbuf_len;
 						col += attr_change.attr.s.columns;
 						/* Find beginning of next UTF-8 character */
 						text_offset++; paragraph_len--; runlength--;
-						textbuf_len = MIN(runlength, sizeof (textbuf));
-						if (!_vte_stream_read(ring->text_stream, text_offset, textbuf, textbuf_len))
-							goto err;
+						textbuf = text->str + (text_offset - paragraph_start_text_offset);
+						textbuf_len = MIN(runlength, 6);  /* at least one UTF-8 character */
 						for (i = 0; i < textbuf_len && (textbuf[i] & 0xC0) == 0x80; i++) {
 							text_offset++; paragraph_len--; runlength--;
 						}
@@ -998,7 +1944,8 @@ _vte_ring_rewrap (VteRing *ring,
 		/* Write the record of the paragraph's last row. */
 		/* Hard wrapped, except maybe at the end of the very last paragraph */
 		new_record.soft_wrapped = prev_record_was_soft_wrapped;
-		_vte_stream_append(new_row_stream, (const char *) &new_record, sizeof (new_record));
+		_vte_ring_encode_row_record(ring, row_stream, prev,
+					    (new_row_index - index_origin) % VTE_RING_ROW_INDEX_INTERVAL == 0, &new_record);
 		_vte_debug_print(VTE_DEBUG_RING,
 				"    New row %ld  text_offset %" G_GSIZE_FORMAT "  attr_offset %" G_GSIZE_FORMAT "\n",
 				new_row_index,
@@ -1013,23 +1960,204 @@ _vte_ring_rewrap (VteRing *ring,
 		}
 		new_row_index++;
 		paragraph_start_text_offset = paragraph_end_text_offset;
+		if (ring->row_buffer->len >= 65536)
+			_vte_ring_flush_row_records (ring, row_stream, row_index_stream);
+	}
+	_vte_ring_flush_row_records (ring, row_stream, row_index_stream);
+
+	*position = old_row_index - 1;
+	*new_position = new_row_index;
+	return TRUE;
+}
+
+/* Find the first row in [@lo, @hi) whose text starts at or after @text_offset,
+ * @hi if there's none. */
+static gboolean
+_vte_ring_find_row (VteRing *ring, gsize text_offset, gulong lo, gulong hi, gulong *position)
+{
+	VteRowRecord record;
+
+	while (lo < hi) {
+		gulong mid = lo + (hi - lo) / 2;
+		if (!_vte_ring_read_row_record (ring, &record, mid))
+			return FALSE;
+		if (record.text_start_offset < text_offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*position = lo;
+	return TRUE;
+}
+
+/**
+ * _vte_ring_rewrap:
+ * @ring: a #VteRing
+ * @columns: new number of columns
+ * @markers: NULL-terminated array of #VteVisualPosition
+ *
+ * Reflow the @ring to match the new number of @columns.
+ * For all @markers, find the cell at that position and update them to
+ * reflect the cell's new position.
+ *
+ * Only the paragraphs of the visible rows and of the @markers are rewrapped
+ * now, the history above them is left to _vte_ring_rewrap_step().
+ */
+/* See ../doc/rewrap.txt for design and implementation details. */
+void
+_vte_ring_rewrap (VteRing *ring,
+		  glong columns,
+		  VteVisualPosition **markers)
+{
+	gulong position, new_position, split;
+	int i;
+	int num_markers = 0;
+	VteCellTextOffset *marker_text_offsets;
+	VteVisualPosition *new_markers;
+	VteRowRecord record, prev_record;
+	VteRowRecordReader reader;
+	VteStream *new_row_stream = NULL, *new_row_index_stream = NULL;
+	gsize history_len;
+	gulong old_ring_start, old_ring_end;
+
+	if (_vte_ring_length(ring) == 0)
+		return;
+	_vte_debug_print(VTE_DEBUG_RING, "Ring before rewrapping:\n");
+	_vte_ring_validate(ring);
+	_vte_ring_rewrap_wait (ring);
+
+	/* Freeze everything, because rewrapping is really complicated and we don't want
+	   to duplicate the code for frozen and thawed rows. */
+	if (ring->writable < ring->end)
+		_vte_ring_freeze_rows(ring, ring->end - ring->writable);
+
+	/* For markers given as (row,col) pairs find their offsets in the text stream.
+	   This code requires that the rows are already frozen. */
+	while (markers[num_markers] != NULL)
+		num_markers++;
+	marker_text_offsets = (VteCellTextOffset *) g_malloc(num_markers * sizeof (marker_text_offsets[0]));
+	new_markers = (VteVisualPosition *) g_malloc(num_markers * sizeof (new_markers[0]));
+	for (i = 0; i < num_markers; i++) {
+		/* Convert visual column into byte offset */
+		if (!_vte_frozen_row_column_to_text_offset(ring, markers[i]->row, markers[i]->col, &marker_text_offsets[i]))
+			goto err;
+		new_markers[i].row = new_markers[i].col = -1;
+		_vte_debug_print(VTE_DEBUG_RING,
+				"Marker #%d old coords:  row %ld  col %ld  ->  text_offset %" G_GSIZE_FORMAT " fragment_cells %d  eol_cells %d\n",
+				i, markers[i]->row, markers[i]->col, marker_text_offsets[i].text_offset,
+				marker_text_offsets[i].fragment_cells, marker_text_offsets[i].eol_cells);
 	}
 
-	/* Update the ring. */
+	/* Rewrap from the paragraph of the first visible row, or of the first marker
+	   if that's above, until the end. Widening might leave less than a screenful,
+	   then go further back. The previous history stays as it is for now. */
+	old_ring_start = ring->start;
 	old_ring_end = ring->end;
-	g_object_unref(ring->row_stream);
-	ring->row_stream = new_row_stream;
-	ring->writable = ring->end = new_row_index;
-	ring->start = 0;
-	if (ring->end > ring->max)
-		ring->start = ring->end - ring->max;
-	ring->cached_row_num = (gulong) -1;
+	split = ring->end - MIN (ring->visible_rows, ring->end - ring->start);
+	for (i = 0; i < num_markers; i++) {
+		if ((gulong) markers[i]->row >= ring->start && (gulong) markers[i]->row < split)
+			split = markers[i]->row;
+	}
+	for (;;) {
+		while (split > ring->start) {
+			if (!_vte_ring_read_row_record (ring, &record, split - 1))
+				goto err;
+			if (!record.soft_wrapped)
+				break;
+			split--;
+		}
+
+		/* The new records go to temporary streams first, as the old ones are still needed */
+		if (!_vte_ring_seek_row_record (ring, &reader, split))
+			goto err;
+		new_row_stream = _vte_memory_stream_new (FALSE);
+		new_row_index_stream = _vte_memory_stream_new (FALSE);
+		_vte_stream_reset (new_row_stream, reader.row_offset);
+		_vte_stream_reset (new_row_index_stream,
+				   _vte_ring_row_index_offset (ring, split + VTE_RING_ROW_INDEX_INTERVAL - 1));
+		prev_record = reader.record;
+		position = new_position = split;
+		if (!_vte_ring_rewrap_rows (ring, FALSE, &position, ring->end, G_MAXULONG, columns,
+					    new_row_stream, new_row_index_stream, &prev_record,
+					    ring->row_index_origin, &new_position,
+					    num_markers, marker_text_offsets, new_markers))
+			goto err;
+
+		/* Update the ring. */
+		_vte_stream_truncate (ring->row_stream, _vte_stream_tail (new_row_stream));
+		_vte_stream_truncate (ring->row_index_stream, _vte_stream_tail (new_row_index_stream));
+		_vte_ring_append_stream (ring->row_stream, new_row_stream,
+					 _vte_stream_tail (new_row_stream), _vte_stream_head (new_row_stream));
+		_vte_ring_append_stream (ring->row_index_stream, new_row_index_stream,
+					 _vte_stream_tail (new_row_index_stream), _vte_stream_head (new_row_index_stream));
+		g_object_unref (new_row_stream);
+		g_object_unref (new_row_index_stream);
+		new_row_stream = new_row_index_stream = NULL;
+		ring->last_row_record = prev_record;
+		ring->row_reader.position = (gulong) -1;
+		ring->writable = ring->end = new_position;
+		ring->generation = _vte_ring_next_generation ();
+		_vte_ring_invalidate_cached_rows (ring);
+
+		if (split == ring->start || ring->end - split >= ring->visible_rows)
+			break;
+		split -= MIN (split - ring->start, ring->visible_rows - (ring->end - split));
+	}
+
+	/* Rewrapping the history can only start over */
+	_vte_ring_cancel_rewrap (ring);
+	if (split > ring->start) {
+		gulong shift = 0;
+		VteRowRecord start_record;
+
+		/* Each new row takes at least a byte of text, except for the last one of
+		   each paragraph (and rarely an empty one). Leave room for that many rows
+		   above the history, so that the rows from the split on can keep their
+		   numbers once it's rewrapped. */
+		if (!_vte_ring_read_row_record (ring, &start_record, ring->start) ||
+		    !_vte_ring_read_row_record (ring, &record, split))
+			goto err;
+		history_len = record.text_start_offset - start_record.text_start_offset + (split - ring->start);
+		if (history_len > split)
+			shift = history_len - split;
+		ring->start += shift;
+		ring->writable += shift;
+		ring->end += shift;
+		ring->row_index_origin += shift;
+		split += shift;
+		for (i = 0; i < num_markers; i++) {
+			if (new_markers[i].row != -1)
+				new_markers[i].row += shift;
+		}
+
+		ring->rewrap_columns = columns;
+		ring->rewrap_end = split;
+		ring->rewrap_position = ring->start;
+		ring->rewrap_rows = 0;
+		ring->rewrap_row_stream = _vte_ring_new_stream (ring);
+		ring->rewrap_row_index_stream = _vte_ring_new_stream (ring);
+		memset (&ring->rewrap_last_record, 0, sizeof (ring->rewrap_last_record));
+		_vte_debug_print(VTE_DEBUG_RING, "History up to row %lu left to rewrap.\n", split);
+	}
+
+	/* Narrowing might have added more rows than allowed */
+	while ((gulong) _vte_ring_length (ring) > ring->max)
+		_vte_ring_discard_one_row (ring);
+	if (ring->start >= ring->rewrap_end)
+		_vte_ring_cancel_rewrap (ring);
 
 	/* Find the markers. This requires that the ring is already updated. */
 	for (i = 0; i < num_markers; i++) {
-		/* Compute the row for markers beyond the ring */
-		if (new_markers[i].row == -1)
+		if (new_markers[i].row == -1) {
+			if ((gulong) markers[i]->row < old_ring_start) {
+				/* Scrolled off at the top, and the top is not rewrapped yet */
+				markers[i]->row = ring->start;
+				markers[i]->col = 0;
+				continue;
+			}
+			/* Compute the row for markers beyond the ring */
 			new_markers[i].row = markers[i]->row - old_ring_end + ring->end;
+		}
 		/* Convert byte offset into visual column */
 		if (!_vte_frozen_row_text_offset_to_column(ring, new_markers[i].row, &marker_text_offsets[i], &new_markers[i].col))
 			goto err;
@@ -1053,98 +2181,2602 @@ err:
 			"Error while rewrapping\n");
 	g_assert_not_reached();
 #endif
-	g_object_unref(new_row_stream);
+	if (new_row_stream != NULL) {
+		g_object_unref(new_row_stream);
+		g_object_unref(new_row_index_stream);
+	}
+	g_string_truncate (ring->row_buffer, 0);
+	g_string_truncate (ring->row_index_buffer, 0);
 	g_free(marker_text_offsets);
 	g_free(new_markers);
 }
 
-
+/* Put the rewrapped history in place, followed by the rest of the rows */
 static gboolean
-_vte_ring_write_row (VteRing *ring,
-		     GOutputStream *stream,
-		     VteRowData *row,
-		     VteWriteFlags flags,
-		     GCancellable *cancellable,
-		     GError **error)
+_vte_ring_finish_rewrap (VteRing *ring,
+			 VteVisualPosition **markers)
 {
-	VteCell *cell;
-	GString *buffer = ring->utf8_buffer;
+	gulong position, origin, history_end;
 	int i;
-	gsize bytes_written;
+	int num_markers = 0;
+	VteCellTextOffset *marker_text_offsets;
+	gboolean *in_history;
+	VteRowRecord record, start_record;
+	VteRowRecordReader reader;
+	gulong old_ring_start = ring->start;
 
-	/* Simple version of the loop in _vte_ring_freeze_row().
-	 * TODO Should unify one day */
-	g_string_set_size (buffer, 0);
-	for (i = 0, cell = row->cells; i < row->len; i++, cell++) {
-		if (G_LIKELY (!cell->attr.fragment))
-			_vte_unistr_append_to_string (cell->c, buffer);
+	/* Find the markers within the history in the text stream */
+	while (markers[num_markers] != NULL)
+		num_markers++;
+	marker_text_offsets = (VteCellTextOffset *) g_malloc(num_markers * sizeof (marker_text_offsets[0]));
+	in_history = (gboolean *) g_malloc(num_markers * sizeof (in_history[0]));
+	for (i = 0; i < num_markers; i++) {
+		in_history[i] = markers[i]->row < (glong) ring->rewrap_end;
+		if (in_history[i] && markers[i]->row >= (glong) ring->start &&
+		    !_vte_frozen_row_column_to_text_offset(ring, markers[i]->row, markers[i]->col, &marker_text_offsets[i]))
+			goto err;
 	}
-	if (!row->attr.soft_wrapped)
-		g_string_append_c (buffer, '\n');
+	if (!_vte_ring_read_row_record (ring, &start_record, ring->start))
+		goto err;
 
-	return g_output_stream_write_all (stream, buffer->str, buffer->len, &bytes_written, cancellable, error);
+	/* Append the records of the rows after the history */
+	position = ring->rewrap_rows;
+	if (ring->rewrap_end < ring->writable) {
+		if (!_vte_ring_seek_row_record (ring, &reader, ring->rewrap_end))
+			goto err;
+		while (reader.position < ring->writable) {
+			if (!_vte_ring_next_row_record (ring, &reader, &record))
+				goto err;
+			_vte_ring_encode_row_record (ring, ring->rewrap_row_stream, &ring->rewrap_last_record,
+						     position % VTE_RING_ROW_INDEX_INTERVAL == 0, &record);
+			position++;
+			if (ring->row_buffer->len >= 65536)
+				_vte_ring_flush_row_records (ring, ring->rewrap_row_stream, ring->rewrap_row_index_stream);
+		}
+	}
+	_vte_ring_flush_row_records (ring, ring->rewrap_row_stream, ring->rewrap_row_index_stream);
+
+	/* Switch over, the history ends right before the rows that keep their numbers */
+	origin = ring->rewrap_end - ring->rewrap_rows;
+	g_object_unref (ring->row_stream);
+	g_object_unref (ring->row_index_stream);
+	ring->row_stream = ring->rewrap_row_stream;
+	ring->row_index_stream = ring->rewrap_row_index_stream;
+	ring->rewrap_row_stream = ring->rewrap_row_index_stream = NULL;
+	ring->row_index_origin = origin;
+	ring->row_index_origin_offset = 0;
+	ring->last_row_record = ring->rewrap_last_record;
+	ring->row_reader.position = (gulong) -1;
+	ring->generation = _vte_ring_next_generation ();
+	_vte_ring_invalidate_cached_rows (ring);
+
+	/* Drop the new rows whose text has been discarded meanwhile */
+	if (!_vte_ring_find_row (ring, start_record.text_start_offset, origin, ring->rewrap_end, &ring->start))
+		goto err;
+	history_end = ring->rewrap_end;
+	_vte_ring_cancel_rewrap (ring);
+	while ((gulong) _vte_ring_length (ring) > ring->max)
+		_vte_ring_discard_one_row (ring);
+
+	/* Find the markers. The row is the last one starting at or before the text offset. */
+	for (i = 0; i < num_markers; i++) {
+		if (!in_history[i])
+			continue;
+		position = ring->start;
+		if (markers[i]->row >= (glong) old_ring_start &&
+		    !_vte_ring_find_row (ring, marker_text_offsets[i].text_offset + 1,
+					 ring->start, MAX (ring->start, history_end), &position))
+			goto err;
+		if (position == ring->start) {
+			/* Scrolled off at the top */
+			markers[i]->row = ring->start;
+			markers[i]->col = 0;
+			continue;
+		}
+		if (!_vte_frozen_row_text_offset_to_column (ring, position - 1, &marker_text_offsets[i], &markers[i]->col))
+			goto err;
+		markers[i]->row = position - 1;
+	}
+	g_free(marker_text_offsets);
+	g_free(in_history);
+
+	_vte_debug_print(VTE_DEBUG_RING, "Ring after rewrapping the history:\n");
+	_vte_ring_validate(ring);
+	return TRUE;
+
+err:
+	g_free(marker_text_offsets);
+	g_free(in_history);
+	return FALSE;
 }
 
-/**
- * _vte_ring_write_contents:
- * @ring: a #VteRing
- * @stream: a #GOutputStream to write to
- * @flags: a set of #VteWriteFlags
- * @cancellable: optional #GCancellable object, %NULL to ignore
- * @error: a #GError location to store the error occuring, or %NULL to ignore
- *
- * Write entire ring contents to @stream according to @flags.
- *
- * Return: %TRUE on success, %FALSE if there was an error
- */
-gboolean
-_vte_ring_write_contents (VteRing *ring,
-			  GOutputStream *stream,
-			  VteWriteFlags flags,
-			  GCancellable *cancellable,
-			  GError **error)
+/* The pending jobs pushed to a thread pool, waited for with _vte_ring_batch_wait() */
+typedef struct _VteRingBatch {
+	GMutex lock;
+	GCond cond;
+	guint pending;
+} VteRingBatch;
+
+static void
+_vte_ring_batch_init (VteRingBatch *batch, guint pending)
 {
-	gulong i;
+	g_mutex_init (&batch->lock);
+	g_cond_init (&batch->cond);
+	batch->pending = pending;
+}
 
-	_vte_debug_print(VTE_DEBUG_RING, "Writing contents to GOutputStream.\n");
+/* Called by the worker threads when a job is done */
+static void
+_vte_ring_batch_done (VteRingBatch *batch)
+{
+	g_mutex_lock (&batch->lock);
+	batch->pending--;
+	g_cond_signal (&batch->cond);
+	g_mutex_unlock (&batch->lock);
+}
 
-	if (ring->start < ring->writable)
-	{
-		VteRowRecord record;
+static guint
+_vte_ring_batch_pending (VteRingBatch *batch)
+{
+	guint pending;
 
-		if (_vte_ring_read_row_record (ring, &record, ring->start))
-		{
-			gsize start_offset = record.text_start_offset;
-			gsize end_offset = _vte_stream_head (ring->text_stream);
-			char buf[4096];
-			while (start_offset < end_offset)
-			{
-				gsize bytes_written, len;
+	g_mutex_lock (&batch->lock);
+	pending = batch->pending;
+	g_mutex_unlock (&batch->lock);
+	return pending;
+}
 
-				len = MIN (G_N_ELEMENTS (buf), end_offset - start_offset);
+static void
+_vte_ring_batch_wait (VteRingBatch *batch)
+{
+	g_mutex_lock (&batch->lock);
+	while (batch->pending > 0)
+		g_cond_wait (&batch->cond, &batch->lock);
+	g_mutex_unlock (&batch->lock);
+	g_mutex_clear (&batch->lock);
+	g_cond_clear (&batch->cond);
+}
 
-				if (!_vte_stream_read (ring->text_stream, start_offset,
-						       buf, len))
-					return FALSE;
+/* A range of whole paragraphs of the history, rewrapped on a worker thread.
+ * It has a copy of the ring, so that it can read its own copies of the range's
+ * row records and attr changes. The text is read from the ring's stream, only
+ * for the paragraphs that aren't all ASCII. The streams mustn't change until
+ * the jobs are done, see _vte_ring_rewrap_wait(). */
+
+typedef struct _VteRingRewrapRange {
+	VteRing ring;
+	gulong position, end;
+	glong columns;
+	VteStream *row_stream, *attr_stream;  /* the ring's, for the worker to copy from */
+	gsize row_offset, row_end, attr_offset, attr_end;
+	VteStream *new_row_stream, *new_row_index_stream;  /* the records relative to an empty one */
+	gulong new_rows;
+	gboolean ok;
+	VteRingBatch *batch;
+} VteRingRewrapRange;
+
+struct _VteRingRewrapJobs {
+	VteRingRewrapRange ranges[VTE_RING_REWRAP_MAX_THREADS];
+	guint n;
+	gulong end;  /* of the last range */
+	VteRingBatch batch;
+	gboolean done;  /* and waited for */
+};
+
+static GThreadPool *_vte_ring_rewrap_pool = NULL;
+
+/* Copy [@offset, @end) of @from into a new memory stream, on any thread */
+static VteStream *
+_vte_ring_copy_stream (VteStream *from, gsize offset, gsize end)
+{
+	VteStream *stream = _vte_memory_stream_new (FALSE);
+	gsize len = MIN (end - offset, 1024 * 1024);
+	char *buf = (char *) g_malloc (len);
+
+	_vte_stream_reset (stream, offset);
+	while (offset < end) {
+		len = MIN (len, end - offset);
+		if (!_vte_stream_read_concurrent (from, offset, buf, len))
+			memset (buf, 0, len);
+		_vte_stream_append (stream, buf, len);
+		offset += len;
+	}
+	g_free (buf);
+	return stream;
+}
 
-				if (!g_output_stream_write_all (stream, buf, len,
-								&bytes_written, cancellable,
-								error))
-					return FALSE;
+static gboolean
+_vte_ring_prepare_rewrap_range (VteRing *ring,
+				VteRingRewrapRange *range,
+				gulong position,
+				gulong end)
+{
+	VteRowRecordReader reader, end_reader;
+	VteRowRecord first, last;
 
-				start_offset += len;
-			}
-		}
-		else
+	if (!_vte_ring_seek_row_record (ring, &reader, position))
+		return FALSE;
+	end_reader = reader;
+	if (!_vte_ring_next_row_record (ring, &end_reader, &first))
+		return FALSE;
+
+	/* Up to the record of the next row, and the attr change it starts with */
+	range->row_offset = reader.row_offset;
+	range->row_end = _vte_stream_head (ring->row_stream);
+	range->attr_offset = first.attr_start_offset;
+	range->attr_end = _vte_stream_head (ring->attr_stream);
+	if (end < ring->writable) {
+		if (!_vte_ring_seek_row_record (ring, &end_reader, end) ||
+		    !_vte_ring_next_row_record (ring, &end_reader, &last))
 			return FALSE;
+		range->row_end = end_reader.row_offset;
+		range->attr_end = MIN (range->attr_end, last.attr_start_offset + VTE_ATTR_CHANGE_MAX_SIZE);
 	}
+	range->row_stream = ring->row_stream;
+	range->attr_stream = ring->attr_stream;
+
+	range->ring = *ring;
+	range->ring.row_stream = range->ring.attr_stream = NULL;  /* copied by the worker */
+	/* Seeking to @position needs no index then */
+	range->ring.row_index_stream = NULL;
+	range->ring.row_reader = reader;
+	range->ring.attr_buffer = NULL;
+	range->ring.text_index = NULL;
+	range->ring.rewrap_jobs = NULL;
+	range->ring.utf8_buffer = g_string_sized_new (128);
+	range->ring.row_buffer = g_string_sized_new (128);
+	range->ring.row_index_buffer = g_string_sized_new (128);
+
+	range->position = position;
+	range->end = end;
+	range->columns = ring->rewrap_columns;
+	range->new_row_stream = _vte_memory_stream_new (FALSE);
+	range->new_row_index_stream = _vte_memory_stream_new (FALSE);
+	range->new_rows = 0;
+	range->ok = FALSE;
+	range->batch = NULL;
+	return TRUE;
+}
 
-	for (i = ring->writable; i < ring->end; i++) {
-		if (!_vte_ring_write_row (ring, stream,
-					  _vte_ring_writable_index (ring, i),
-					  flags, cancellable, error))
-			return FALSE;
+static void
+_vte_ring_free_rewrap_range (VteRingRewrapRange *range)
+{
+	if (range->ring.row_stream != NULL) {
+		g_object_unref (range->ring.row_stream);
+		g_object_unref (range->ring.attr_stream);
 	}
+	g_string_free (range->ring.utf8_buffer, TRUE);
+	g_string_free (range->ring.row_buffer, TRUE);
+	g_string_free (range->ring.row_index_buffer, TRUE);
+	g_object_unref (range->new_row_stream);
+	g_object_unref (range->new_row_index_stream);
+}
 
-	return TRUE;
+static void
+_vte_ring_rewrap_range_worker (gpointer data, gpointer user_data)
+{
+	VteRingRewrapRange *range = (VteRingRewrapRange *) data;
+	VteRowRecord prev;
+
+	range->ring.row_stream = _vte_ring_copy_stream (range->row_stream, range->row_offset, range->row_end);
+	range->ring.attr_stream = _vte_ring_copy_stream (range->attr_stream, range->attr_offset, range->attr_end);
+
+	memset (&prev, 0, sizeof (prev));
+	range->ok = _vte_ring_rewrap_rows (&range->ring, TRUE, &range->position, range->end, G_MAXULONG, range->columns,
+					   range->new_row_stream, range->new_row_index_stream, &prev, 0,
+					   &range->new_rows, 0, NULL, NULL);
+
+	_vte_ring_batch_done (range->batch);
 }
+
+/* Append the records rewrapped in @range to the rewrapped history */
+static gboolean
+_vte_ring_append_rewrap_range (VteRing *ring, VteRingRewrapRange *range)
+{
+	VteRowRecord record;
+	gsize len = _vte_stream_head (range->new_row_stream);
+	char *data = (char *) g_malloc (len);
+	const char *p = data;
+	gboolean ok;
+
+	ok = _vte_stream_read (range->new_row_stream, 0, data, len);
+	memset (&record, 0, sizeof (record));
+	while (ok && p < data + len) {
+		ok = _vte_ring_decode_row_record (&p, data + len, &record);
+		if (!ok)
+			break;
+		_vte_ring_encode_row_record (ring, ring->rewrap_row_stream, &ring->rewrap_last_record,
+					     ring->rewrap_rows % VTE_RING_ROW_INDEX_INTERVAL == 0, &record);
+		ring->rewrap_rows++;
+		if (ring->row_buffer->len >= 65536)
+			_vte_ring_flush_row_records (ring, ring->rewrap_row_stream, ring->rewrap_row_index_stream);
+	}
+	_vte_ring_flush_row_records (ring, ring->rewrap_row_stream, ring->rewrap_row_index_stream);
+
+	g_free (data);
+	return ok;
+}
+
+/* The jobs read the ring's streams, wait for them before changing those */
+static void
+_vte_ring_rewrap_wait (VteRing *ring)
+{
+	VteRingRewrapJobs *jobs = ring->rewrap_jobs;
+
+	if (G_LIKELY (jobs == NULL) || jobs->done)
+		return;
+
+	_vte_debug_print(VTE_DEBUG_RING, "Waiting for rewrapping the history up to row %lu.\n", jobs->end);
+	_vte_ring_batch_wait (&jobs->batch);
+	jobs->done = TRUE;
+}
+
+static void
+_vte_ring_drop_rewrap_jobs (VteRing *ring)
+{
+	guint i;
+
+	if (ring->rewrap_jobs == NULL)
+		return;
+
+	_vte_ring_rewrap_wait (ring);
+	for (i = 0; i < ring->rewrap_jobs->n; i++)
+		_vte_ring_free_rewrap_range (&ring->rewrap_jobs->ranges[i]);
+	g_free (ring->rewrap_jobs);
+	ring->rewrap_jobs = NULL;
+}
+
+/**
+ * _vte_ring_rewrap_busy:
+ * @ring: a #VteRing
+ *
+ * Returns: %TRUE if the history is being rewrapped on other threads,
+ * _vte_ring_rewrap_step() can only collect the rows once they're done
+ */
+gboolean
+_vte_ring_rewrap_busy (VteRing *ring)
+{
+	VteRingRewrapJobs *jobs = ring->rewrap_jobs;
+
+	if (jobs == NULL || jobs->done)
+		return FALSE;
+	if (_vte_ring_batch_pending (&jobs->batch))
+		return TRUE;
+	_vte_ring_rewrap_wait (ring);
+	return FALSE;
+}
+
+/* Append the rows rewrapped by the finished jobs to the rewrapped history */
+static gboolean
+_vte_ring_collect_rewrap_jobs (VteRing *ring)
+{
+	VteRingRewrapJobs *jobs = ring->rewrap_jobs;
+	gboolean ok = TRUE;
+	guint i;
+
+	_vte_ring_rewrap_wait (ring);
+	for (i = 0; i < jobs->n; i++)
+		ok = ok && jobs->ranges[i].ok && _vte_ring_append_rewrap_range (ring, &jobs->ranges[i]);
+	if (ok)
+		ring->rewrap_position = jobs->end;
+	_vte_ring_drop_rewrap_jobs (ring);
+	return ok;
+}
+
+/* Rewrap about @count rows of the history. With more processors, start
+ * rewrapping that many on each of them instead, see _vte_ring_rewrap_busy(). */
+static gboolean
+_vte_ring_rewrap_history (VteRing *ring, gulong count)
+{
+	VteRingRewrapJobs *jobs;
+	VteRowRecord record;
+	gulong rows, position, end;
+	guint i, n;
+	gboolean ok = TRUE;
+
+	n = MIN ((guint) g_get_num_processors (), VTE_RING_REWRAP_MAX_THREADS);
+	rows = ring->rewrap_end - ring->rewrap_position;
+	if (count > 0 && rows / count < n)
+		n = rows / count;
+	if (n < 2)
+		return _vte_ring_rewrap_rows (ring, FALSE, &ring->rewrap_position, ring->rewrap_end, count, ring->rewrap_columns,
+					      ring->rewrap_row_stream, ring->rewrap_row_index_stream,
+					      &ring->rewrap_last_record, 0, &ring->rewrap_rows,
+					      0, NULL, NULL);
+
+	/* Split at paragraph boundaries */
+	jobs = g_new0 (VteRingRewrapJobs, 1);
+	position = ring->rewrap_position;
+	for (i = 0; i < n && position < ring->rewrap_end; i++) {
+		end = MIN (position + count, ring->rewrap_end);
+		while (end < ring->rewrap_end) {
+			if (!_vte_ring_read_row_record (ring, &record, end - 1))
+				break;
+			if (!record.soft_wrapped)
+				break;
+			end++;
+		}
+		if (!_vte_ring_prepare_rewrap_range (ring, &jobs->ranges[i], position, end)) {
+			ok = FALSE;
+			break;
+		}
+		jobs->n++;
+		position = end;
+	}
+	if (!ok) {
+		for (i = 0; i < jobs->n; i++)
+			_vte_ring_free_rewrap_range (&jobs->ranges[i]);
+		g_free (jobs);
+		return FALSE;
+	}
+	jobs->end = position;
+
+	_vte_debug_print(VTE_DEBUG_RING, "Rewrapping the history up to row %lu on %u threads.\n", position, jobs->n);
+
+	if (G_UNLIKELY (_vte_ring_rewrap_pool == NULL))
+		_vte_ring_rewrap_pool = g_thread_pool_new (_vte_ring_rewrap_range_worker, NULL,
+							   VTE_RING_REWRAP_MAX_THREADS, FALSE, NULL);
+
+	_vte_ring_batch_init (&jobs->batch, jobs->n);
+	ring->rewrap_jobs = jobs;
+	for (i = 0; i < jobs->n; i++) {
+		jobs->ranges[i].batch = &jobs->batch;
+		g_thread_pool_push (_vte_ring_rewrap_pool, &jobs->ranges[i], NULL);
+	}
+	return TRUE;
+}
+
+/**
+ * _vte_ring_rewrap_step:
+ * @ring: a #VteRing
+ * @count: the number of rows to rewrap, roughly
+ * @markers: NULL-terminated array of #VteVisualPosition
+ *
+ * Continue rewrapping the history that _vte_ring_rewrap() left behind.
+ * With more processors, @count rows are rewrapped on each of them, on other
+ * threads. Their rows are collected by a later step, once they're done,
+ * without waiting for them; see _vte_ring_rewrap_busy().
+ * Once it's done, the history's rows are renumbered and @markers within
+ * it are updated. The rows after the history are not affected.
+ *
+ * Returns: %TRUE if there's more to do
+ */
+gboolean
+_vte_ring_rewrap_step (VteRing *ring,
+		       gulong count,
+		       VteVisualPosition **markers)
+{
+	if (ring->rewrap_columns == 0)
+		return FALSE;
+
+	if (ring->rewrap_jobs != NULL) {
+		if (_vte_ring_rewrap_busy (ring))
+			return TRUE;
+		if (!_vte_ring_collect_rewrap_jobs (ring))
+			goto err;
+	}
+
+	/* The oldest rows might have been discarded meanwhile */
+	if (ring->start >= ring->rewrap_end) {
+		_vte_ring_cancel_rewrap (ring);
+		return FALSE;
+	}
+	if (ring->rewrap_position < ring->start)
+		ring->rewrap_position = ring->start;
+
+	if (ring->rewrap_position < ring->rewrap_end) {
+		_vte_debug_print(VTE_DEBUG_RING, "Rewrapping the history from row %lu.\n", ring->rewrap_position);
+		if (!_vte_ring_rewrap_history (ring, count))
+			goto err;
+	}
+	/* There's no room for the new rows above, see _vte_ring_rewrap() */
+	if (G_UNLIKELY (ring->rewrap_rows > ring->rewrap_end)) {
+		_vte_ring_cancel_rewrap (ring);
+		return FALSE;
+	}
+	if (ring->rewrap_jobs != NULL || ring->rewrap_position < ring->rewrap_end)
+		return TRUE;
+
+	if (!_vte_ring_finish_rewrap (ring, markers))
+		goto err;
+	return FALSE;
+
+err:
+#ifdef VTE_DEBUG
+	_vte_debug_print(VTE_DEBUG_RING,
+			"Error while rewrapping the history\n");
+	g_assert_not_reached();
+#endif
+	g_string_truncate (ring->row_buffer, 0);
+	g_string_truncate (ring->row_index_buffer, 0);
+	_vte_ring_cancel_rewrap (ring);
+	return FALSE;
+}
+
+/* Flags of the rows read by _vte_ring_read_search_text() */
+#define VTE_RING_SEARCH_ROW_HARD 1
+#define VTE_RING_SEARCH_ROW_SKIPPED 2
+
+/* Trigrams any match of a regex contains, see _vte_ring_text_query_init() */
+typedef struct _VteRingTextQuery {
+	guint n_hashes;
+	guint hashes[VTE_RING_TEXT_QUERY_MAX];
+} VteRingTextQuery;
+
+/* Add the trigrams of a literal of the regex */
+static void
+_vte_ring_text_query_add (VteRingTextQuery *query, const GString *literal, gboolean caseless)
+{
+	guchar a, b, c;
+	gsize i, j;
+	guint h;
+
+	for (i = 2; i < literal->len && query->n_hashes < VTE_RING_TEXT_QUERY_MAX; i++) {
+		a = literal->str[i - 2];
+		b = literal->str[i - 1];
+		c = literal->str[i];
+		/* Caseless, non-ASCII letters can match ASCII ones and the other way
+		 * around: U+212A KELVIN SIGN for k, U+017F LONG S for s */
+		if (caseless && ((a | b | c) >= 0x80 ||
+				 strchr ("kKsS", a) || strchr ("kKsS", b) || strchr ("kKsS", c)))
+			continue;
+		h = _vte_ring_text_index_hash (g_ascii_tolower (a), g_ascii_tolower (b), g_ascii_tolower (c));
+		for (j = 0; j < query->n_hashes && query->hashes[j] != h; j++)
+			;
+		if (j == query->n_hashes)
+			query->hashes[query->n_hashes++] = h;
+	}
+}
+
+/* Find the trigrams of the literal text any match of @regex contains: the
+ * runs of plain characters outside of groups and classes, without the ones
+ * quantifiers apply to. Anything unusual gives up, returning %FALSE. */
+static gboolean
+_vte_ring_text_query_init (VteRingTextQuery *query, GRegex *regex, GRegexMatchFlags flags)
+{
+	const char *p = g_regex_get_pattern (regex);
+	int compile_flags = g_regex_get_compile_flags (regex);
+	gboolean caseless = (compile_flags & G_REGEX_CASELESS) != 0;
+	GString *literal;
+	int depth = 0;
+
+	query->n_hashes = 0;
+	if ((compile_flags & G_REGEX_EXTENDED) ||
+	    (flags & (G_REGEX_MATCH_PARTIAL | G_REGEX_MATCH_PARTIAL_HARD)))
+		return FALSE;
+
+	literal = g_string_new (NULL);
+
+#define _VTE_RING_QUERY_END_LITERAL() G_STMT_START { \
+		_vte_ring_text_query_add (query, literal, caseless); \
+		g_string_truncate (literal, 0); \
+	} G_STMT_END
+#define _VTE_RING_QUERY_DROP_CHAR() G_STMT_START { \
+		while (literal->len > 0 && (literal->str[literal->len - 1] & 0xc0) == 0x80) \
+			literal->len--; \
+		if (literal->len > 0) \
+			literal->len--; \
+		_VTE_RING_QUERY_END_LITERAL (); \
+	} G_STMT_END
+
+	for (; *p; p++) {
+		switch (*p) {
+		case '\\':
+			p++;
+			if (*p == '\0' || *p == 'Q')
+				goto give_up;
+			/* Escapes taking arguments, like \x41 or \p{Lu}, and
+			 * backreferences; the others only end the literal */
+			if (g_ascii_isalnum (*p) && !strchr ("bBdDhHRsSvVwWXAzZGK", *p))
+				goto give_up;
+			if (depth == 0 && !g_ascii_isalnum (*p) && (guchar) *p >= 0x20 && (guchar) *p < 0x80)
+				g_string_append_c (literal, *p);
+			else
+				_VTE_RING_QUERY_END_LITERAL ();
+			break;
+		case '|':
+			if (depth == 0)
+				goto give_up;
+			break;
+		case '(':
+			/* Options could make the rest caseless or extended */
+			if (p[1] == '?' && p[2] != '\0' && strchr ("imsxXUJ-^", p[2]))
+				goto give_up;
+			_VTE_RING_QUERY_END_LITERAL ();
+			depth++;
+			break;
+		case ')':
+			_VTE_RING_QUERY_END_LITERAL ();
+			depth = MAX (depth - 1, 0);
+			break;
+		case '[':
+			_VTE_RING_QUERY_END_LITERAL ();
+			p++;
+			if (*p == '^')
+				p++;
+			if (*p == ']')
+				p++;
+			for (; *p != ']'; p++) {
+				if (*p == '\0')
+					goto give_up;
+				if (*p == '\\' && p[1] != '\0' && strchr ("xopPcN", p[1]))
+					goto give_up;
+				if (*p == '\\' && p[1] != '\0')
+					p++;
+				else if (*p == '[' && p[1] == ':' && (p = strstr (p + 2, ":]")) != NULL)
+					p++;
+				if (p == NULL)
+					goto give_up;
+			}
+			break;
+		case '?':
+		case '*':
+			_VTE_RING_QUERY_DROP_CHAR ();
+			break;
+		case '{':
+			if (g_ascii_isdigit (p[1])) {
+				_VTE_RING_QUERY_DROP_CHAR ();
+				while (*p != '}' && *p != '\0')
+					p++;
+				if (*p == '\0')
+					goto give_up;
+			} else
+				_VTE_RING_QUERY_END_LITERAL ();
+			break;
+		default:
+			if (depth == 0 && (guchar) *p >= 0x20 && !strchr (".^$+", *p))
+				g_string_append_c (literal, *p);
+			else
+				_VTE_RING_QUERY_END_LITERAL ();
+			break;
+		}
+	}
+	_VTE_RING_QUERY_END_LITERAL ();
+
+#undef _VTE_RING_QUERY_END_LITERAL
+#undef _VTE_RING_QUERY_DROP_CHAR
+
+	g_string_free (literal, TRUE);
+	return query->n_hashes > 0;
+
+give_up:
+	g_string_free (literal, TRUE);
+	query->n_hashes = 0;
+	return FALSE;
+}
+
+/* Whether the text in [@offset, @end) of text_stream could contain all the
+ * trigrams of @query, going by the index */
+static gboolean
+_vte_ring_text_may_match (VteRing *ring, const VteRingTextQuery *query, gsize offset, gsize end)
+{
+	gsize first = offset / VTE_RING_TEXT_INDEX_BLOCK_SIZE, last, block;
+	const guint8 *bitmap;
+	guint i, h;
+
+	if (end <= offset)
+		return FALSE;
+	last = (end - 1) / VTE_RING_TEXT_INDEX_BLOCK_SIZE;
+	if (first < ring->text_index_start || last >= ring->text_index_end)
+		return TRUE;
+
+	for (i = 0; i < query->n_hashes; i++) {
+		h = query->hashes[i];
+		for (block = first; block <= last; block++) {
+			bitmap = ring->text_index + (block & ring->text_index_mask) * VTE_RING_TEXT_INDEX_BITMAP_SIZE;
+			if (bitmap[h / 8] & (1 << (h % 8)))
+				break;
+		}
+		if (block > last)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* Locate the text of the frozen rows [@start, @end) in the text stream: the
+ * offset of each row is stored in @offsets, followed by where the last one
+ * ends, and their VTE_RING_SEARCH_ROW_* flags are added to @rows. With
+ * @query, the paragraphs the text index rules out are marked skipped. */
+static gboolean
+_vte_ring_locate_search_text (VteRing *ring, gulong start, gulong end, gsize *offsets, guint8 *rows,
+			      const VteRingTextQuery *query)
+{
+	VteRowRecordReader reader;
+	VteRowRecord record;
+	gulong position, i, j, para;
+	gboolean hard = FALSE;
+
+	if (!_vte_ring_seek_row_record (ring, &reader, start))
+		return FALSE;
+	para = 0;
+	for (position = start; position <= end; position++) {
+		i = position - start;
+		if (position == ring->writable)
+			offsets[i] = _vte_stream_head (ring->text_stream);
+		else if (_vte_ring_next_row_record (ring, &reader, &record))
+			offsets[i] = record.text_start_offset;
+		else
+			return FALSE;
+
+		/* The paragraph ending with the previous row */
+		if (query != NULL && i > 0 && hard) {
+			if (!_vte_ring_text_may_match (ring, query, offsets[para], offsets[i])) {
+				for (j = para; j < i; j++)
+					rows[j] |= VTE_RING_SEARCH_ROW_SKIPPED;
+			}
+			para = i;
+		}
+		hard = position < end && !record.soft_wrapped;
+		if (hard)
+			rows[i] |= VTE_RING_SEARCH_ROW_HARD;
+	}
+	return TRUE;
+}
+
+/* Read the @n rows _vte_ring_locate_search_text() found in @stream into @text,
+ * see _vte_ring_read_search_text(). Then @offsets holds where each row ends
+ * in @text. With @concurrent, any thread can do this, see
+ * _vte_stream_read_concurrent(). */
+static gboolean
+_vte_ring_fill_search_text (VteStream *stream, gboolean concurrent, gsize *offsets, const guint8 *rows, gulong n,
+			    GString *text)
+{
+	gsize in, in_end, out, raw, len;
+	gulong i, j;
+	guint skipped;
+	gboolean hard;
+
+	/* Read runs of rows that aren't skipped, a row's newline stands in
+	 * for skipped paragraphs. The text is never longer than in the stream,
+	 * so it can be converted in place. */
+	g_string_set_size (text, offsets[n] - offsets[0]);
+	out = 0;
+	for (i = 0; i < n; i = j) {
+		raw = offsets[i];
+		skipped = rows[i] & VTE_RING_SEARCH_ROW_SKIPPED;
+		for (j = i; j < n && (rows[j] & VTE_RING_SEARCH_ROW_SKIPPED) == skipped; j++) {
+			if (!skipped) {
+				offsets[j] = out + offsets[j] - raw;
+			} else {
+				offsets[j] = out;
+				if (rows[j] & VTE_RING_SEARCH_ROW_HARD)
+					text->str[out++] = '\n';
+			}
+		}
+		if (!skipped) {
+			len = offsets[j] - raw;
+			if (!(concurrent ?
+			      _vte_stream_read_concurrent (stream, raw, text->str + out, len) :
+			      _vte_stream_read (stream, raw, text->str + out, len)))
+				return FALSE;
+			out += len;
+		}
+	}
+	offsets[n] = out;
+
+	/* Convert it in place, a row at a time */
+	out = 0;
+	for (i = 0; i < n; i++) {
+		in = offsets[i];
+		in_end = offsets[i + 1];
+		hard = in_end > in && text->str[in_end - 1] == '\n';
+		if (hard)
+			in_end--;
+		while (in_end > in && text->str[in_end - 1] == '\0')
+			in_end--;
+		for (; in < in_end; in++)
+			text->str[out++] = text->str[in] ? text->str[in] : ' ';
+		if (hard)
+			text->str[out++] = '\n';
+		offsets[i] = out;
+	}
+	g_string_truncate (text, out);
+	return TRUE;
+}
+
+/* Read the text of the frozen rows [@start, @end) into @text the way
+ * vte_terminal_get_text_range() would return it: empty cells as spaces,
+ * except at the end of rows where they're dropped, and a newline after
+ * every row that's not soft wrapped. The offset in @text where each row
+ * ends is stored in @row_ends.
+ *
+ * With @query, the paragraphs the text index rules out aren't read, only
+ * their newline is there. */
+static gboolean
+_vte_ring_read_search_text (VteRing *ring, gulong start, gulong end, GString *text, GArray *row_ends,
+			    const VteRingTextQuery *query)
+{
+	gulong n = end - start;
+	guint8 *rows;  /* VTE_RING_SEARCH_ROW_* */
+	gboolean ok;
+
+	g_assert (start < end && end <= ring->writable);
+
+	g_array_set_size (row_ends, n + 1);
+	rows = (guint8 *) g_malloc0 (n);
+	ok = _vte_ring_locate_search_text (ring, start, end, &g_array_index (row_ends, gsize, 0), rows, query) &&
+	     _vte_ring_fill_search_text (ring->text_stream, FALSE, &g_array_index (row_ends, gsize, 0), rows, n, text);
+	g_free (rows);
+	g_array_set_size (row_ends, n);
+	return ok;
+}
+
+/* Called for each paragraph's text, between @from and @to in @text, by
+ * _vte_ring_search_paragraphs(). Returns %TRUE to stop there. */
+typedef gboolean (*VteRingParagraphFunc) (GString *text, gsize from, gsize to,
+					  gulong start_row, gulong end_row, gpointer data);
+
+/* Call @func for the text of each frozen paragraph, see _vte_ring_search().
+ * With @query, the ones the text index rules out are empty. */
+static gboolean
+_vte_ring_search_paragraphs (VteRing *ring,
+			     gulong limit,
+			     gulong *position,
+			     gboolean backward,
+			     const VteRingTextQuery *query,
+			     VteRingParagraphFunc func,
+			     gpointer data)
+{
+	GString *text;
+	GArray *row_ends;
+	gsize *ends, from, to;
+	gulong pos = *position, para, count = VTE_RING_SEARCH_BLOCK_ROWS;
+	gulong block_start, block_end, n;
+	glong i;
+	gboolean stopped = FALSE;
+
+	if (ring->text_stream == NULL || pos < ring->start)
+		return FALSE;
+
+	text = g_string_new (NULL);
+	row_ends = g_array_new (FALSE, FALSE, sizeof (gsize));
+
+#define _VTE_RING_ROW_IS_HARD(i) \
+	(ends[i] > ((i) ? ends[(i) - 1] : 0) && text->str[ends[i] - 1] == '\n')
+
+	if (!backward) {
+		while (pos < limit && pos < ring->writable) {
+			block_start = pos;
+			block_end = MIN (pos + count, ring->writable);
+			if (!_vte_ring_read_search_text (ring, block_start, block_end, text, row_ends, query))
+				break;
+			ends = &g_array_index (row_ends, gsize, 0);
+			n = block_end - block_start;
+
+			para = block_start;
+			from = 0;
+			for (i = 0; i < (glong) n && para < limit; i++) {
+				if (!_VTE_RING_ROW_IS_HARD (i))
+					continue;
+				if (func (text, from, ends[i], para, block_start + i + 1, data)) {
+					pos = block_start + i + 1;
+					stopped = TRUE;
+					goto done;
+				}
+				para = block_start + i + 1;
+				from = ends[i];
+			}
+
+			if (para == block_start) {
+				/* The paragraph continues beyond the writable rows,
+				 * or it's longer than the block */
+				if (block_end == ring->writable)
+					break;
+				count *= 2;
+			} else
+				count = VTE_RING_SEARCH_BLOCK_ROWS;
+			pos = para;
+		}
+	} else {
+		if (pos > ring->writable)
+			goto done;
+		while (pos > limit && pos > ring->start) {
+			block_end = pos;
+			block_start = pos - MIN (count, pos - ring->start);
+			if (!_vte_ring_read_search_text (ring, block_start, block_end, text, row_ends, query))
+				break;
+			ends = &g_array_index (row_ends, gsize, 0);
+			n = block_end - block_start;
+
+			para = block_end;
+			to = ends[n - 1];
+			for (i = n - 2; i >= -1 && para > limit; i--) {
+				if (i >= 0 && !_VTE_RING_ROW_IS_HARD (i))
+					continue;
+				/* The first row isn't known to start a paragraph */
+				if (i < 0 && block_start > ring->start)
+					break;
+				from = i >= 0 ? ends[i] : 0;
+				if (func (text, from, to, block_start + i + 1, para, data)) {
+					pos = block_start + i + 1;
+					stopped = TRUE;
+					goto done;
+				}
+				para = block_start + i + 1;
+				to = from;
+			}
+
+			if (para == block_end)
+				count *= 2;
+			else
+				count = VTE_RING_SEARCH_BLOCK_ROWS;
+			pos = para;
+		}
+	}
+
+#undef _VTE_RING_ROW_IS_HARD
+
+done:
+	*position = pos;
+	g_string_free (text, TRUE);
+	g_array_free (row_ends, TRUE);
+	return stopped;
+}
+
+/*
+ * Literal search
+ */
+
+struct _VteRingLiteral {
+	char *text;          /* folded to lowercase if caseless */
+	gsize len;
+	gsize anchor;        /* offset of the byte looked for first, a rare one */
+	gboolean caseless;   /* ASCII only */
+	gboolean ambiguous;  /* caseless with k or s, see _vte_ring_literal_applies() */
+};
+
+/* How rare @c is in terminal output, roughly */
+static int
+_vte_ring_literal_rarity (guchar c, gboolean caseless)
+{
+	static const char common[] = " etaoinsrhldcumfpgwybvkxjqz";
+	const char *p;
+
+	if (c >= 0x80)
+		return 30;
+	if (!g_ascii_isalpha (c) && c != ' ')
+		return 40;
+	p = strchr (common, g_ascii_tolower (c));
+	/* Caseless letters take two scans */
+	if (caseless)
+		return p - common;
+	return (p - common) + (g_ascii_isupper (c) ? 20 : 0);
+}
+
+/**
+ * _vte_ring_literal_new:
+ * @text: the text to search for, in UTF-8
+ * @caseless: whether to ignore case
+ *
+ * Prepares searching for @text with _vte_ring_match_text(), scanning for a
+ * rare byte of it with memchr(), which the C library vectorizes, and checking
+ * around it. Ignoring case is only done for ASCII text.
+ *
+ * Returns: a new #VteRingLiteral, or %NULL if @text is empty or can't be
+ *   searched for ignoring case that way
+ */
+VteRingLiteral *
+_vte_ring_literal_new (const char *text, gboolean caseless)
+{
+	VteRingLiteral *literal;
+	gsize i;
+	int rarity, best = -1;
+
+	if (*text == '\0')
+		return NULL;
+	for (i = 0; caseless && text[i]; i++) {
+		if ((guchar) text[i] >= 0x80)
+			return NULL;
+	}
+
+	literal = g_new0 (VteRingLiteral, 1);
+	literal->text = caseless ? g_ascii_strdown (text, -1) : g_strdup (text);
+	literal->len = strlen (text);
+	literal->caseless = caseless;
+	literal->ambiguous = caseless && strpbrk (literal->text, "ks") != NULL;
+	for (i = 0; i < literal->len; i++) {
+		rarity = _vte_ring_literal_rarity (literal->text[i], caseless);
+		if (rarity > best) {
+			best = rarity;
+			literal->anchor = i;
+		}
+	}
+	return literal;
+}
+
+VteRingLiteral *
+_vte_ring_literal_copy (const VteRingLiteral *literal)
+{
+	VteRingLiteral *copy;
+
+	if (literal == NULL)
+		return NULL;
+
+	copy = g_new (VteRingLiteral, 1);
+	*copy = *literal;
+	copy->text = g_strdup (literal->text);
+	return copy;
+}
+
+void
+_vte_ring_literal_free (VteRingLiteral *literal)
+{
+	if (literal == NULL)
+		return;
+
+	g_free (literal->text);
+	g_free (literal);
+}
+
+/* Whether finding @literal in @text gives the same matches as the regex.
+ * Caseless, k and s match U+212A KELVIN SIGN and U+017F LATIN SMALL LETTER
+ * LONG S too. */
+static gboolean
+_vte_ring_literal_applies (const VteRingLiteral *literal, const char *text, gsize len)
+{
+	const char *p, *end = text + len;
+
+	if (!literal->ambiguous)
+		return TRUE;
+
+	for (p = text; (p = (const char *) memchr (p, 0xe2, end - p)) != NULL; p++) {
+		if (end - p >= 3 && p[1] == '\x84' && p[2] == '\xaa')
+			return FALSE;
+	}
+	for (p = text; (p = (const char *) memchr (p, 0xc5, end - p)) != NULL; p++) {
+		if (end - p >= 2 && p[1] == '\xbf')
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* Find @literal in @text from @from on, returning its offset or -1 */
+static gssize
+_vte_ring_literal_find (const VteRingLiteral *literal, const char *text, gsize len, gsize from)
+{
+	const char *p, *q, *c, *end;
+	guchar a, b;
+
+	if (len < literal->len || from > len - literal->len)
+		return -1;
+
+	/* Where the anchor can be */
+	a = literal->text[literal->anchor];
+	b = literal->caseless ? g_ascii_toupper (a) : a;
+	c = text + from + literal->anchor;
+	end = text + len - literal->len + literal->anchor + 1;
+
+	p = (const char *) memchr (c, a, end - c);
+	q = b != a ? (const char *) memchr (c, b, end - c) : NULL;
+	while (p != NULL || q != NULL) {
+		c = p == NULL ? q : q == NULL ? p : MIN (p, q);
+		if (literal->caseless ?
+		    g_ascii_strncasecmp (c - literal->anchor, literal->text, literal->len) == 0 :
+		    memcmp (c - literal->anchor, literal->text, literal->len) == 0)
+			return c - literal->anchor - text;
+		if (c == p)
+			p = (const char *) memchr (p + 1, a, end - p - 1);
+		else
+			q = (const char *) memchr (q + 1, b, end - q - 1);
+	}
+	return -1;
+}
+
+/**
+ * _vte_ring_match_text:
+ * @regex: a #GRegex
+ * @flags: flags from #GRegexMatchFlags
+ * @literal: (allow-none): the text @regex matches, or %NULL
+ * @text: the text
+ * @len: its length
+ * @func: called for each match, in order, until it returns %TRUE
+ * @data: data for @func
+ *
+ * Matches @regex in @text, or finds @literal instead when it gives the same
+ * matches, which is much faster.
+ */
+void
+_vte_ring_match_text (GRegex *regex,
+		      GRegexMatchFlags flags,
+		      const VteRingLiteral *literal,
+		      const char *text,
+		      gsize len,
+		      VteRingTextMatchFunc func,
+		      gpointer data)
+{
+	GMatchInfo *match_info;
+	GError *error = NULL;
+	gssize offset;
+	gsize from;
+	int start, end;
+
+	if (literal != NULL && _vte_ring_literal_applies (literal, text, len)) {
+		for (from = 0; (offset = _vte_ring_literal_find (literal, text, len, from)) >= 0; from = offset + literal->len) {
+			if (func (offset, offset + literal->len, data))
+				break;
+		}
+		return;
+	}
+
+	g_regex_match_full (regex, text, len, 0, flags, &match_info, &error);
+	while (error == NULL && g_match_info_matches (match_info)) {
+		if (g_match_info_fetch_pos (match_info, 0, &start, &end) &&
+		    func (start, end, data))
+			break;
+		g_match_info_next (match_info, &error);
+	}
+	if (error) {
+		g_printerr ("Error while matching: %s\n", error->message);
+		g_error_free (error);
+	}
+	g_match_info_free (match_info);
+}
+
+typedef struct _VteRingSearch {
+	GRegex *regex;
+	GRegexMatchFlags flags;
+	const VteRingLiteral *literal;
+	VteRingTextQuery query;
+	VteRingMatch *match;
+	VteRingMatchFunc func;
+	gpointer data;
+} VteRingSearch;
+
+/* The query for looking up @search's regex in the text index, if any */
+static const VteRingTextQuery *
+_vte_ring_search_query (VteRing *ring, VteRingSearch *search)
+{
+	if (ring->text_index == NULL ||
+	    !_vte_ring_text_query_init (&search->query, search->regex, search->flags))
+		return NULL;
+	return &search->query;
+}
+
+static gboolean
+_vte_ring_search_first_match_found (int start, int end, gpointer data)
+{
+	VteRingMatch *match = (VteRingMatch *) data;
+
+	match->start_offset = start;
+	match->end_offset = end;
+	return TRUE;
+}
+
+/* Match the paragraph, and return the first match if any */
+static gboolean
+_vte_ring_search_first_match (GString *text, gsize from, gsize to,
+			      gulong start_row, gulong end_row, gpointer data)
+{
+	VteRingSearch *search = (VteRingSearch *) data;
+
+	search->match->start_offset = -1;
+	_vte_ring_match_text (search->regex, search->flags, search->literal,
+			      text->str + from, to - from,
+			      _vte_ring_search_first_match_found, search->match);
+	if (search->match->start_offset < 0)
+		return FALSE;
+
+	search->match->start_row = start_row;
+	search->match->end_row = end_row;
+	return TRUE;
+}
+
+typedef struct _VteRingSearchParagraph {
+	VteRingSearch *search;
+	VteRingMatch match;
+} VteRingSearchParagraph;
+
+static gboolean
+_vte_ring_search_all_matches_found (int start, int end, gpointer data)
+{
+	VteRingSearchParagraph *paragraph = (VteRingSearchParagraph *) data;
+
+	paragraph->match.start_offset = start;
+	paragraph->match.end_offset = end;
+	paragraph->search->func (&paragraph->match, paragraph->search->data);
+	return FALSE;
+}
+
+/* Match the paragraph, and pass all the matches to the callback */
+static gboolean
+_vte_ring_search_all_matches (GString *text, gsize from, gsize to,
+			      gulong start_row, gulong end_row, gpointer data)
+{
+	VteRingSearchParagraph paragraph;
+
+	paragraph.search = (VteRingSearch *) data;
+	paragraph.match.start_row = start_row;
+	paragraph.match.end_row = end_row;
+	_vte_ring_match_text (paragraph.search->regex, paragraph.search->flags, paragraph.search->literal,
+			      text->str + from, to - from,
+			      _vte_ring_search_all_matches_found, &paragraph);
+	return FALSE;
+}
+
+/* A range of whole paragraphs of the frozen rows, read and matched on a
+ * worker thread. Its matches are collected to be passed on in order. */
+typedef struct _VteRingSearchRange {
+	VteRingSearch search;  /* with its own match, and collecting matches */
+	VteRingParagraphFunc func;
+	VteStream *stream;
+	gulong start, end, limit;
+	gboolean backward;
+	GArray *row_ends;      /* the offsets of the rows in the stream, then in text */
+	const guint8 *rows;    /* VTE_RING_SEARCH_ROW_* */
+	GString *text;
+	VteRingMatch match;
+	GArray *matches;       /* of VteRingMatch */
+	gulong position;       /* where it left off, like _vte_ring_search_paragraphs() */
+	gboolean ok, stopped;
+	VteRingBatch *batch;
+} VteRingSearchRange;
+
+static GThreadPool *_vte_ring_search_pool = NULL;
+
+static void
+_vte_ring_search_collect_match (const VteRingMatch *match, gpointer data)
+{
+	g_array_append_vals ((GArray *) data, match, 1);
+}
+
+static void
+_vte_ring_search_range_worker (gpointer data, gpointer user_data)
+{
+	VteRingSearchRange *range = (VteRingSearchRange *) data;
+	gulong n = range->end - range->start, para;
+	gsize *ends, from, to;
+	glong i;
+
+	range->position = range->backward ? range->end : range->start;
+	range->ok = _vte_ring_fill_search_text (range->stream, TRUE, &g_array_index (range->row_ends, gsize, 0),
+						range->rows, n, range->text);
+	if (!range->ok)
+		goto done;
+	ends = &g_array_index (range->row_ends, gsize, 0);
+
+	if (!range->backward) {
+		para = range->start;
+		from = 0;
+		for (i = 0; i < (glong) n && para < range->limit; i++) {
+			if (!(range->rows[i] & VTE_RING_SEARCH_ROW_HARD))
+				continue;
+			if (range->func (range->text, from, ends[i], para, range->start + i + 1, &range->search)) {
+				para = range->start + i + 1;
+				range->stopped = TRUE;
+				break;
+			}
+			para = range->start + i + 1;
+			from = ends[i];
+		}
+	} else {
+		para = range->end;
+		to = ends[n - 1];
+		for (i = n - 2; i >= -1 && para > range->limit; i--) {
+			if (i >= 0 && !(range->rows[i] & VTE_RING_SEARCH_ROW_HARD))
+				continue;
+			from = i >= 0 ? ends[i] : 0;
+			if (range->func (range->text, from, to, range->start + i + 1, para, &range->search)) {
+				para = range->start + i + 1;
+				range->stopped = TRUE;
+				break;
+			}
+			para = range->start + i + 1;
+			to = from;
+		}
+	}
+	range->position = para;
+
+done:
+	if (range->batch != NULL)
+		_vte_ring_batch_done (range->batch);
+}
+
+static void
+_vte_ring_prepare_search_range (VteRing *ring,
+				VteRingSearchRange *range,
+				VteRingSearch *search,
+				VteRingParagraphFunc func,
+				gulong limit,
+				gboolean backward,
+				gulong span_start,
+				const gsize *offsets,
+				const guint8 *rows,
+				gulong from,
+				gulong to)
+{
+	range->search = *search;
+	range->search.match = &range->match;
+	range->matches = g_array_new (FALSE, FALSE, sizeof (VteRingMatch));
+	range->search.func = _vte_ring_search_collect_match;
+	range->search.data = range->matches;
+	range->func = func;
+	range->stream = ring->text_stream;
+	range->start = span_start + from;
+	range->end = span_start + to;
+	range->limit = limit;
+	range->backward = backward;
+	range->row_ends = g_array_sized_new (FALSE, FALSE, sizeof (gsize), to - from + 1);
+	g_array_append_vals (range->row_ends, offsets + from, to - from + 1);
+	range->rows = rows + from;
+	range->text = g_string_new (NULL);
+	range->ok = range->stopped = FALSE;
+	range->batch = NULL;
+}
+
+/* Search the paragraphs from @position on like _vte_ring_search_paragraphs()
+ * does, a span of them at a time split into ranges read and matched on as
+ * many threads, as they don't depend on each other. The matches are passed
+ * on afterwards, in order, up to the first one found in the direction of
+ * the search if @search is looking for that; it's in @stopped then.
+ *
+ * Returns: %FALSE if there aren't enough rows or processors to bother, or
+ *   on error, leaving the rest to _vte_ring_search_paragraphs() */
+static gboolean
+_vte_ring_search_parallel (VteRing *ring,
+			   gulong limit,
+			   gulong *position,
+			   gboolean backward,
+			   const VteRingTextQuery *query,
+			   VteRingSearch *search,
+			   VteRingParagraphFunc func,
+			   gboolean *stopped)
+{
+	VteRingSearchRange ranges[VTE_RING_SEARCH_MAX_THREADS], *range;
+	VteRingBatch batch;
+	gsize *offsets, total;
+	guint8 *rows;  /* VTE_RING_SEARCH_ROW_* */
+	gulong pos = *position, span_start, span_end, n_rows, lo, hi, i, cut, rows_left;
+	guint n, k, j;
+	gboolean ok = TRUE;
+
+	*stopped = FALSE;
+	n = MIN ((guint) g_get_num_processors (), VTE_RING_SEARCH_MAX_THREADS);
+	if (n < 2 || ring->text_stream == NULL || pos < ring->start)
+		return FALSE;
+
+	/* At least a block of rows for each thread */
+	if (!backward) {
+		if (pos >= MIN (limit, ring->writable))
+			return FALSE;
+		rows_left = MIN (limit, ring->writable) - pos;
+	} else {
+		if (pos > ring->writable || pos <= MAX (limit, ring->start))
+			return FALSE;
+		rows_left = pos - MAX (limit, ring->start);
+	}
+	n = MIN (n, rows_left / VTE_RING_SEARCH_BLOCK_ROWS);
+	if (n < 2)
+		return FALSE;
+	if (!backward) {
+		span_start = pos;
+		span_end = MIN (pos + n * VTE_RING_SEARCH_BLOCK_ROWS, ring->writable);
+	} else {
+		span_end = pos;
+		span_start = pos - MIN (n * VTE_RING_SEARCH_BLOCK_ROWS, pos - ring->start);
+	}
+
+	n_rows = span_end - span_start;
+	offsets = g_new (gsize, n_rows + 1);
+	rows = (guint8 *) g_malloc0 (n_rows);
+	if (!_vte_ring_locate_search_text (ring, span_start, span_end, offsets, rows, query)) {
+		g_free (offsets);
+		g_free (rows);
+		return FALSE;
+	}
+
+	/* Whole paragraphs: forward up to the end of the last one ending in the
+	 * span, backward from the start of the first one known to start in it */
+	lo = 0;
+	hi = n_rows;
+	if (!backward) {
+		while (hi > 0 && !(rows[hi - 1] & VTE_RING_SEARCH_ROW_HARD))
+			hi--;
+	} else if (span_start > ring->start) {
+		while (lo < n_rows && !(rows[lo] & VTE_RING_SEARCH_ROW_HARD))
+			lo++;
+		lo = MIN (lo + 1, n_rows);
+	}
+	if (hi <= lo) {
+		g_free (offsets);
+		g_free (rows);
+		return FALSE;
+	}
+
+	/* Split them into ranges of about the same amount of text */
+	total = offsets[hi] - offsets[lo];
+	k = 0;
+	cut = lo;
+	for (i = lo; i < hi && k < n - 1; i++) {
+		if (!(rows[i] & VTE_RING_SEARCH_ROW_HARD) ||
+		    (offsets[i + 1] - offsets[lo]) * n < total * (k + 1))
+			continue;
+		_vte_ring_prepare_search_range (ring, &ranges[k++], search, func, limit, backward,
+						span_start, offsets, rows, cut, i + 1);
+		cut = i + 1;
+	}
+	if (cut < hi)
+		_vte_ring_prepare_search_range (ring, &ranges[k++], search, func, limit, backward,
+						span_start, offsets, rows, cut, hi);
+	n = k;
+
+	_vte_debug_print(VTE_DEBUG_RING, "Searching rows %lu to %lu on %u threads.\n",
+			 span_start + lo, span_start + hi, n);
+
+	if (G_UNLIKELY (_vte_ring_search_pool == NULL))
+		_vte_ring_search_pool = g_thread_pool_new (_vte_ring_search_range_worker, NULL,
+							   VTE_RING_SEARCH_MAX_THREADS, FALSE, NULL);
+
+	/* The first range is done on this thread */
+	_vte_ring_batch_init (&batch, n - 1);
+	for (k = 1; k < n; k++) {
+		ranges[k].batch = &batch;
+		g_thread_pool_push (_vte_ring_search_pool, &ranges[k], NULL);
+	}
+	_vte_ring_search_range_worker (&ranges[0], NULL);
+	_vte_ring_batch_wait (&batch);
+
+	/* Pass on the matches in order, up to where one of them stopped */
+	pos = backward ? span_end : span_start + lo;
+	for (j = 0; j < n; j++) {
+		range = &ranges[backward ? n - 1 - j : j];
+		if (!range->ok) {
+			ok = FALSE;
+			break;
+		}
+		for (i = 0; i < range->matches->len; i++)
+			search->func (&g_array_index (range->matches, VteRingMatch, i), search->data);
+		pos = range->position;
+		if (range->stopped) {
+			*search->match = range->match;
+			*stopped = TRUE;
+			break;
+		}
+		/* Up to @limit */
+		if (pos != (backward ? range->start : range->end))
+			break;
+	}
+
+	for (k = 0; k < n; k++) {
+		g_array_free (ranges[k].row_ends, TRUE);
+		g_array_free (ranges[k].matches, TRUE);
+		g_string_free (ranges[k].text, TRUE);
+	}
+	g_free (offsets);
+	g_free (rows);
+
+	*position = pos;
+	return ok;
+}
+
+/**
+ * _vte_ring_search:
+ * @ring: a #VteRing
+ * @limit: the row to search up to
+ * @position: (inout): where to continue searching from
+ * @backward: the direction
+ * @regex: a #GRegex
+ * @flags: flags from #GRegexMatchFlags
+ * @literal: (allow-none): the text @regex matches, found faster, or %NULL
+ * @match: (out): the first match
+ *
+ * Search the frozen rows for @regex, a paragraph at a time, reading their text
+ * right from the text stream instead of thawing them. The text of a paragraph
+ * is the same as vte_terminal_get_text_range() would return for its rows.
+ *
+ * Forward, the paragraphs starting in [@position, @limit) are searched,
+ * backward the ones ending in (@limit, @position], the first of them ending
+ * right at @position. Paragraphs not ending before ring->writable are left
+ * alone. Then @position is updated to where the searching can go on: the next
+ * paragraph's start forward, the last one's start backward.
+ *
+ * With the text index, see _vte_ring_set_text_indexed(), the paragraphs
+ * lacking the literal text @regex requires aren't even read. With more
+ * processors, spans of paragraphs are read and matched on several threads.
+ *
+ * Returns: %TRUE if there's a match
+ */
+gboolean
+_vte_ring_search (VteRing *ring,
+		  gulong limit,
+		  gulong *position,
+		  gboolean backward,
+		  GRegex *regex,
+		  GRegexMatchFlags flags,
+		  const VteRingLiteral *literal,
+		  VteRingMatch *match)
+{
+	VteRingSearch search;
+	const VteRingTextQuery *query;
+	gboolean found;
+
+	search.regex = regex;
+	search.flags = flags;
+	search.literal = literal;
+	search.match = match;
+	search.func = NULL;
+	search.data = NULL;
+	query = _vte_ring_search_query (ring, &search);
+	while (_vte_ring_search_parallel (ring, limit, position, backward, query,
+					  &search, _vte_ring_search_first_match, &found)) {
+		if (found)
+			return TRUE;
+	}
+	return _vte_ring_search_paragraphs (ring, limit, position, backward, query,
+					    _vte_ring_search_first_match, &search);
+}
+
+/**
+ * _vte_ring_search_all:
+ * @ring: a #VteRing
+ * @limit: the row to search up to
+ * @position: (inout): where to continue searching from
+ * @regex: a #GRegex
+ * @flags: flags from #GRegexMatchFlags
+ * @literal: (allow-none): the text @regex matches, found faster, or %NULL
+ * @func: called for each match
+ * @data: data for @func
+ *
+ * Like searching forward with _vte_ring_search(), but every match of every
+ * paragraph is passed to @func, in order.
+ *
+ * ring->generation changes whenever frozen rows are changed or renumbered, so
+ * anything collected this way is stale then.
+ */
+void
+_vte_ring_search_all (VteRing *ring,
+		      gulong limit,
+		      gulong *position,
+		      GRegex *regex,
+		      GRegexMatchFlags flags,
+		      const VteRingLiteral *literal,
+		      VteRingMatchFunc func,
+		      gpointer data)
+{
+	VteRingSearch search;
+	const VteRingTextQuery *query;
+	gboolean stopped;
+
+	search.regex = regex;
+	search.flags = flags;
+	search.literal = literal;
+	search.match = NULL;
+	search.func = func;
+	search.data = data;
+	query = _vte_ring_search_query (ring, &search);
+	while (_vte_ring_search_parallel (ring, limit, position, FALSE, query,
+					  &search, _vte_ring_search_all_matches, &stopped))
+		;
+	_vte_ring_search_paragraphs (ring, limit, position, FALSE, query,
+				     _vte_ring_search_all_matches, &search);
+}
+
+static gboolean
+_vte_ring_write_row (VteRing *ring,
+		     GOutputStream *stream,
+		     VteRowData *row,
+		     VteWriteFlags flags,
+		     GCancellable *cancellable,
+		     GError **error)
+{
+	VteCell *cell;
+	GString *buffer = ring->utf8_buffer;
+	int i;
+	gsize bytes_written;
+
+	/* Simple version of the loop in _vte_ring_freeze_row().
+	 * TODO Should unify one day */
+	g_string_set_size (buffer, 0);
+	for (i = 0, cell = row->cells; i < row->len; i++, cell++) {
+		if (G_LIKELY (!cell->attr.fragment))
+			_vte_unistr_append_to_string (cell->c, buffer);
+	}
+	if (!row->attr.soft_wrapped)
+		g_string_append_c (buffer, '\n');
+
+	return g_output_stream_write_all (stream, buffer->str, buffer->len, &bytes_written, cancellable, error);
+}
+
+/**
+ * _vte_ring_write_contents:
+ * @ring: a #VteRing
+ * @stream: a #GOutputStream to write to
+ * @flags: a set of #VteWriteFlags
+ * @cancellable: optional #GCancellable object, %NULL to ignore
+ * @error: a #GError location to store the error occuring, or %NULL to ignore
+ *
+ * Write entire ring contents to @stream according to @flags.
+ *
+ * Return: %TRUE on success, %FALSE if there was an error
+ */
+gboolean
+_vte_ring_write_contents (VteRing *ring,
+			  GOutputStream *stream,
+			  VteWriteFlags flags,
+			  GCancellable *cancellable,
+			  GError **error)
+{
+	gulong i;
+
+	_vte_debug_print(VTE_DEBUG_RING, "Writing contents to GOutputStream.\n");
+
+	if (ring->start < ring->writable)
+	{
+		VteRowRecord record;
+
+		if (_vte_ring_read_row_record (ring, &record, ring->start))
+		{
+			gsize start_offset = record.text_start_offset;
+			gsize end_offset = _vte_stream_head (ring->text_stream);
+			char buf[4096];
+			while (start_offset < end_offset)
+			{
+				gsize bytes_written, len;
+
+				len = MIN (G_N_ELEMENTS (buf), end_offset - start_offset);
+
+				if (!_vte_stream_read (ring->text_stream, start_offset,
+						       buf, len))
+					return FALSE;
+
+				if (!g_output_stream_write_all (stream, buf, len,
+								&bytes_written, cancellable,
+								error))
+					return FALSE;
+
+				start_offset += len;
+			}
+		}
+		else
+			return FALSE;
+	}
+
+	for (i = ring->writable; i < ring->end; i++) {
+		if (!_vte_ring_write_row (ring, stream,
+					  _vte_ring_writable_index (ring, i),
+					  flags, cancellable, error))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+/*
+ * Snapshots: the state of the ring, written by _vte_ring_write_snapshot()
+ * and read back into another ring by _vte_ring_read_snapshot().
+ *
+ * The frozen rows are written as the contents of the streams, along with
+ * the fields needed to keep appending to them. The writable rows are
+ * written cell by cell, the characters in UTF-8 since vteunistr values
+ * are only valid within the process.
+ */
+
+#define VTE_RING_SNAPSHOT_MAX_WRITABLE (1 << 20)
+
+static gboolean
+_vte_ring_write_snapshot_stream (VteStream *stream,
+				 GDataOutputStream *out,
+				 GCancellable *cancellable,
+				 GError **error)
+{
+	gsize offset = _vte_stream_tail (stream);
+	gsize head = _vte_stream_head (stream);
+	char buf[4096];
+
+	if (!g_data_output_stream_put_uint64 (out, offset, cancellable, error) ||
+	    !g_data_output_stream_put_uint64 (out, head, cancellable, error))
+		return FALSE;
+
+	while (offset < head) {
+		gsize bytes_written, len = MIN (G_N_ELEMENTS (buf), head - offset);
+
+		if (!_vte_stream_read (stream, offset, buf, len)) {
+			g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+					     "Failed to read the scrollback buffer");
+			return FALSE;
+		}
+		if (!g_output_stream_write_all (G_OUTPUT_STREAM (out), buf, len, &bytes_written, cancellable, error))
+			return FALSE;
+		offset += len;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+_vte_ring_write_snapshot_row (VteRing *ring,
+			      const VteRowData *row,
+			      GDataOutputStream *out,
+			      GCancellable *cancellable,
+			      GError **error)
+{
+	GString *buffer = ring->utf8_buffer;
+	int i;
+
+	if (!g_data_output_stream_put_byte (out, row->attr.soft_wrapped, cancellable, error) ||
+	    !g_data_output_stream_put_uint16 (out, row->len, cancellable, error))
+		return FALSE;
+
+	for (i = 0; i < row->len; i++) {
+		const VteCell *cell = &row->cells[i];
+		VteIntCellAttr attr;
+
+		attr.s = cell->attr;
+		g_string_set_size (buffer, 0);
+		if (cell->c != 0)
+			_vte_unistr_append_to_string (cell->c, buffer);
+		if (G_UNLIKELY (buffer->len > G_MAXUINT8)) {
+			/* Too many combining characters, keep the base one */
+			g_string_set_size (buffer, 0);
+			g_string_append_unichar (buffer, _vte_unistr_get_base (cell->c));
+		}
+
+		if (!g_data_output_stream_put_uint64 (out, attr.i, cancellable, error) ||
+		    !g_data_output_stream_put_byte (out, buffer->len, cancellable, error) ||
+		    !g_output_stream_write_all (G_OUTPUT_STREAM (out), buffer->str, buffer->len, NULL, cancellable, error))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * _vte_ring_write_snapshot:
+ * @ring: a #VteRing
+ * @out: a #GDataOutputStream to write to
+ * @cancellable: optional #GCancellable object, %NULL to ignore
+ * @error: a #GError location to store the error occuring, or %NULL to ignore
+ *
+ * Write the state of the ring to @out, see _vte_ring_read_snapshot().
+ *
+ * Return: %TRUE on success, %FALSE if there was an error
+ */
+gboolean
+_vte_ring_write_snapshot (VteRing *ring,
+			  GDataOutputStream *out,
+			  GCancellable *cancellable,
+			  GError **error)
+{
+	gulong i;
+
+	_vte_debug_print(VTE_DEBUG_RING, "Writing snapshot of rows %lu..%lu..%lu.\n",
+			 ring->start, ring->writable, ring->end);
+
+	if (!g_data_output_stream_put_uint64 (out, ring->start, cancellable, error) ||
+	    !g_data_output_stream_put_uint64 (out, ring->writable, cancellable, error) ||
+	    !g_data_output_stream_put_uint64 (out, ring->end, cancellable, error))
+		return FALSE;
+
+	if (ring->start < ring->writable) {
+		if (!_vte_ring_write_snapshot_stream (ring->attr_stream, out, cancellable, error) ||
+		    !_vte_ring_write_snapshot_stream (ring->text_stream, out, cancellable, error) ||
+		    !_vte_ring_write_snapshot_stream (ring->row_stream, out, cancellable, error) ||
+		    !_vte_ring_write_snapshot_stream (ring->row_index_stream, out, cancellable, error))
+			return FALSE;
+
+		if (!g_data_output_stream_put_uint64 (out, ring->last_attr_text_start_offset, cancellable, error) ||
+		    !g_data_output_stream_put_uint64 (out, ring->last_attr.i, cancellable, error) ||
+		    !g_data_output_stream_put_uint64 (out, ring->last_row_record.text_start_offset, cancellable, error) ||
+		    !g_data_output_stream_put_uint64 (out, ring->last_row_record.attr_start_offset, cancellable, error) ||
+		    !g_data_output_stream_put_byte (out, (ring->last_row_record.soft_wrapped ? 1 : 0) |
+							 (ring->last_row_record.is_ascii ? 2 : 0), cancellable, error) ||
+		    !g_data_output_stream_put_uint64 (out, ring->row_index_origin, cancellable, error) ||
+		    !g_data_output_stream_put_uint64 (out, ring->row_index_origin_offset, cancellable, error))
+			return FALSE;
+	}
+
+	for (i = ring->writable; i < ring->end; i++) {
+		if (!_vte_ring_write_snapshot_row (ring, _vte_ring_writable_index (ring, i), out, cancellable, error))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+_vte_ring_read_snapshot_uint64 (GDataInputStream *in,
+				guint64 *value,
+				GCancellable *cancellable,
+				GError **error)
+{
+	GError *err = NULL;
+
+	*value = g_data_input_stream_read_uint64 (in, cancellable, &err);
+	if (G_UNLIKELY (err != NULL)) {
+		g_propagate_error (error, err);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static gboolean
+_vte_ring_read_snapshot_byte (GDataInputStream *in,
+			      guint8 *value,
+			      GCancellable *cancellable,
+			      GError **error)
+{
+	GError *err = NULL;
+
+	*value = g_data_input_stream_read_byte (in, cancellable, &err);
+	if (G_UNLIKELY (err != NULL)) {
+		g_propagate_error (error, err);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static gboolean
+_vte_ring_read_snapshot_data (GDataInputStream *in,
+			      char *data,
+			      gsize len,
+			      GCancellable *cancellable,
+			      GError **error)
+{
+	gsize bytes_read;
+
+	if (!g_input_stream_read_all (G_INPUT_STREAM (in), data, len, &bytes_read, cancellable, error))
+		return FALSE;
+	if (G_UNLIKELY (bytes_read != len)) {
+		g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+				     "Unexpected end of snapshot");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static gboolean
+_vte_ring_read_snapshot_stream (VteStream *stream,
+				GDataInputStream *in,
+				GCancellable *cancellable,
+				GError **error)
+{
+	guint64 offset, head;
+	char buf[4096];
+
+	if (!_vte_ring_read_snapshot_uint64 (in, &offset, cancellable, error) ||
+	    !_vte_ring_read_snapshot_uint64 (in, &head, cancellable, error))
+		return FALSE;
+	if (G_UNLIKELY (offset > head || head > G_MAXSIZE)) {
+		g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+				     "Invalid scrollback buffer in snapshot");
+		return FALSE;
+	}
+
+	_vte_stream_reset (stream, offset);
+	while (offset < head) {
+		gsize len = MIN (G_N_ELEMENTS (buf), head - offset);
+
+		if (!_vte_ring_read_snapshot_data (in, buf, len, cancellable, error))
+			return FALSE;
+		_vte_stream_append (stream, buf, len);
+		offset += len;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+_vte_ring_read_snapshot_row (VteRing *ring,
+			     VteRowData *row,
+			     GDataInputStream *in,
+			     GCancellable *cancellable,
+			     GError **error)
+{
+	GError *err = NULL;
+	guint8 soft_wrapped, len;
+	guint16 n;
+	guint64 attr;
+	char buf[256];
+	int i;
+
+	_vte_row_data_clear (row);
+
+	if (!_vte_ring_read_snapshot_byte (in, &soft_wrapped, cancellable, error))
+		return FALSE;
+	row->attr.soft_wrapped = soft_wrapped & 1;
+
+	n = g_data_input_stream_read_uint16 (in, cancellable, &err);
+	if (G_UNLIKELY (err != NULL)) {
+		g_propagate_error (error, err);
+		return FALSE;
+	}
+
+	for (i = 0; i < n; i++) {
+		VteCell cell;
+		VteIntCellAttr int_attr;
+		const char *p;
+
+		if (!_vte_ring_read_snapshot_uint64 (in, &attr, cancellable, error) ||
+		    !_vte_ring_read_snapshot_byte (in, &len, cancellable, error) ||
+		    !_vte_ring_read_snapshot_data (in, buf, len, cancellable, error))
+			return FALSE;
+		buf[len] = '\0';
+
+		if (G_UNLIKELY (!g_utf8_validate (buf, len, NULL))) {
+			g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+					     "Invalid character in snapshot");
+			return FALSE;
+		}
+
+		/* The base character, then the combining ones */
+		cell.c = 0;
+		for (p = buf; *p; p = g_utf8_next_char (p))
+			cell.c = cell.c == 0 ? g_utf8_get_char (p) : _vte_unistr_append_unichar (cell.c, g_utf8_get_char (p));
+		int_attr.i = attr;
+		cell.attr = int_attr.s;
+
+		_vte_row_data_append (row, &cell);
+	}
+
+	return TRUE;
+}
+
+/* Check the row records and index entries of the frozen rows [start, writable)
+ * read from a snapshot, so that thawing and searching them only ever read
+ * within the streams. The last record is taken as the one to append to. */
+static gboolean
+_vte_ring_check_snapshot_records (VteRing *ring,
+				  gulong start,
+				  gulong writable,
+				  GError **error)
+{
+	gsize text_tail = _vte_stream_tail (ring->text_stream), text_head = _vte_stream_head (ring->text_stream);
+	gsize attr_tail = _vte_stream_tail (ring->attr_stream), attr_head = _vte_stream_head (ring->attr_stream);
+	gsize row_tail = _vte_stream_tail (ring->row_stream), row_head = _vte_stream_head (ring->row_stream);
+	gsize index_tail = _vte_stream_tail (ring->row_index_stream), index_head = _vte_stream_head (ring->row_index_stream);
+	VteRowRecordReader reader;
+	VteRowRecord record;
+	VteRowIndexEntry entry;
+	gsize prev_text_offset = text_tail;
+	gulong first, position;
+
+	/* The index has an entry for each group of rows, and no more */
+	if (ring->row_index_origin_offset > index_head ||
+	    (writable - 1 - ring->row_index_origin) / VTE_RING_ROW_INDEX_INTERVAL >=
+	    (index_head - ring->row_index_origin_offset) / sizeof (entry) ||
+	    _vte_ring_row_index_offset (ring, start) < index_tail)
+		goto invalid;
+	_vte_stream_truncate (ring->row_index_stream,
+			      _vte_ring_row_index_offset (ring, writable - 1) + sizeof (entry));
+
+	/* Read the records from the first row of the group of @start */
+	first = start - (start - ring->row_index_origin) % VTE_RING_ROW_INDEX_INTERVAL;
+	reader.position = first;
+	for (position = first; position < writable; position++) {
+		/* Seeking to the group's rows must give what reading them in order does */
+		if ((position - ring->row_index_origin) % VTE_RING_ROW_INDEX_INTERVAL == 0) {
+			if (!_vte_stream_read (ring->row_index_stream, _vte_ring_row_index_offset (ring, position),
+					       (char *) &entry, sizeof (entry)))
+				goto invalid;
+			if (position == first) {
+				if (entry.row_offset < row_tail || entry.row_offset > row_head)
+					goto invalid;
+				reader.row_offset = entry.row_offset;
+				reader.record = entry.prev;
+			} else if (entry.row_offset != reader.row_offset ||
+				   entry.prev.text_start_offset != reader.record.text_start_offset ||
+				   entry.prev.attr_start_offset != reader.record.attr_start_offset)
+				goto invalid;
+		}
+
+		if (!_vte_ring_next_row_record (ring, &reader, &record))
+			goto invalid;
+		if (position < start)
+			continue;
+		if (record.text_start_offset < prev_text_offset || record.text_start_offset > text_head ||
+		    record.attr_start_offset < attr_tail || record.attr_start_offset > attr_head)
+			goto invalid;
+		prev_text_offset = record.text_start_offset;
+	}
+
+	/* Rows frozen next are appended right after */
+	_vte_stream_truncate (ring->row_stream, reader.row_offset);
+	ring->last_row_record = record;
+	return TRUE;
+
+invalid:
+	g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+			     "Invalid row records in snapshot");
+	return FALSE;
+}
+
+/* Empty the ring, keeping its settings */
+static void
+_vte_ring_clear (VteRing *ring)
+{
+	gulong max = ring->max;
+	gboolean has_streams = ring->has_streams;
+	gboolean streams_in_memory = ring->streams_in_memory;
+	gsize max_bytes = ring->max_bytes;
+	gulong visible_rows = ring->visible_rows;
+	gboolean text_indexed = ring->text_index != NULL;
+
+	_vte_ring_fini (ring);
+	_vte_ring_init (ring, max, has_streams);
+	ring->streams_in_memory = streams_in_memory;
+	ring->max_bytes = max_bytes;
+	_vte_ring_set_visible_rows (ring, visible_rows);
+	_vte_ring_set_text_indexed (ring, text_indexed);
+}
+
+/**
+ * _vte_ring_read_snapshot:
+ * @ring: a #VteRing
+ * @in: a #GDataInputStream to read from
+ * @cancellable: optional #GCancellable object, %NULL to ignore
+ * @error: a #GError location to store the error occuring, or %NULL to ignore
+ *
+ * Replace the contents of the ring with the ones written by _vte_ring_write_snapshot(),
+ * keeping the settings of @ring. The row numbers are kept too, but rows beyond
+ * the maximum are dropped.
+ *
+ * On error the ring is left empty.
+ *
+ * Return: %TRUE on success, %FALSE if there was an error
+ */
+gboolean
+_vte_ring_read_snapshot (VteRing *ring,
+			 GDataInputStream *in,
+			 GCancellable *cancellable,
+			 GError **error)
+{
+	gsize max_bytes = ring->max_bytes;
+	guint64 start, writable, end, value;
+	guint8 byte;
+
+	_vte_ring_clear (ring);
+
+	if (!_vte_ring_read_snapshot_uint64 (in, &start, cancellable, error) ||
+	    !_vte_ring_read_snapshot_uint64 (in, &writable, cancellable, error) ||
+	    !_vte_ring_read_snapshot_uint64 (in, &end, cancellable, error))
+		goto err;
+
+	_vte_debug_print(VTE_DEBUG_RING, "Reading snapshot of rows %" G_GUINT64_FORMAT "..%" G_GUINT64_FORMAT "..%" G_GUINT64_FORMAT ".\n",
+			 start, writable, end);
+
+	if (G_UNLIKELY (start > writable || writable > end || end > G_MAXLONG ||
+			end - writable > VTE_RING_SNAPSHOT_MAX_WRITABLE ||
+			(start < writable && !ring->has_streams))) {
+		g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+				     "Invalid rows in snapshot");
+		goto err;
+	}
+
+	if (start < writable) {
+		ring->attr_stream = _vte_ring_new_stream (ring);
+		ring->text_stream = _vte_ring_new_stream (ring);
+		ring->row_stream = _vte_ring_new_stream (ring);
+		ring->row_index_stream = _vte_ring_new_stream (ring);
+
+		if (!_vte_ring_read_snapshot_stream (ring->attr_stream, in, cancellable, error) ||
+		    !_vte_ring_read_snapshot_stream (ring->text_stream, in, cancellable, error) ||
+		    !_vte_ring_read_snapshot_stream (ring->row_stream, in, cancellable, error) ||
+		    !_vte_ring_read_snapshot_stream (ring->row_index_stream, in, cancellable, error))
+			goto err;
+
+		if (!_vte_ring_read_snapshot_uint64 (in, &value, cancellable, error))
+			goto err;
+		ring->last_attr_text_start_offset = value;
+		if (!_vte_ring_read_snapshot_uint64 (in, &value, cancellable, error))
+			goto err;
+		ring->last_attr.i = value;
+		if (!_vte_ring_read_snapshot_uint64 (in, &value, cancellable, error))
+			goto err;
+		ring->last_row_record.text_start_offset = value;
+		if (!_vte_ring_read_snapshot_uint64 (in, &value, cancellable, error))
+			goto err;
+		ring->last_row_record.attr_start_offset = value;
+		if (!_vte_ring_read_snapshot_byte (in, &byte, cancellable, error))
+			goto err;
+		ring->last_row_record.soft_wrapped = byte & 1;
+		ring->last_row_record.is_ascii = (byte >> 1) & 1;
+		if (!_vte_ring_read_snapshot_uint64 (in, &value, cancellable, error))
+			goto err;
+		ring->row_index_origin = value;
+		if (!_vte_ring_read_snapshot_uint64 (in, &value, cancellable, error))
+			goto err;
+		ring->row_index_origin_offset = value;
+
+		if (G_UNLIKELY (ring->row_index_origin > start)) {
+			g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+					     "Invalid row index in snapshot");
+			goto err;
+		}
+		if (!_vte_ring_check_snapshot_records (ring, start, writable, error))
+			goto err;
+	}
+
+	ring->start = start;
+	ring->writable = ring->end = writable;
+	while (ring->end < end) {
+		_vte_ring_ensure_writable_room (ring);
+		if (!_vte_ring_read_snapshot_row (ring, _vte_ring_writable_index (ring, ring->end), in, cancellable, error))
+			goto err;
+		ring->end++;
+	}
+
+	/* Obey the limits of this ring */
+	if ((gulong) _vte_ring_length (ring) > ring->max)
+		_vte_ring_resize (ring, ring->max);
+	_vte_ring_set_max_bytes (ring, max_bytes);
+
+	if (ring->text_index != NULL)
+		_vte_ring_text_index_rebuild (ring);
+
+	_vte_ring_validate (ring);
+	return TRUE;
+
+err:
+	_vte_ring_clear (ring);
+	return FALSE;
+}
+
+#ifdef RING_MAIN
+
+/* Check the trigrams of the query for @pattern are those of the literals
+ * following it, none if the query is to give up */
+static void
+assert_text_query (const char *pattern, ...)
+{
+	VteRingTextQuery query, expected;
+	GRegex *regex;
+	GString *literal;
+	const char *s;
+	va_list ap;
+
+	regex = g_regex_new (pattern, (GRegexCompileFlags) 0, (GRegexMatchFlags) 0, NULL);
+	g_assert (regex != NULL);
+
+	expected.n_hashes = 0;
+	va_start (ap, pattern);
+	while ((s = va_arg (ap, const char *)) != NULL) {
+		literal = g_string_new (s);
+		_vte_ring_text_query_add (&expected, literal, FALSE);
+		g_string_free (literal, TRUE);
+	}
+	va_end (ap);
+
+	g_assert_cmpint (_vte_ring_text_query_init (&query, regex, (GRegexMatchFlags) 0), ==, expected.n_hashes > 0);
+	g_assert_cmpuint (query.n_hashes, ==, expected.n_hashes);
+	g_assert (memcmp (query.hashes, expected.hashes, expected.n_hashes * sizeof (guint)) == 0);
+
+	g_regex_unref (regex);
+}
+
+/* Check every trigram of the query for @pattern is in @text, which matches */
+static void
+assert_text_query_finds (const char *pattern, const char *text)
+{
+	VteRingTextQuery query;
+	GRegex *regex;
+	gsize len = strlen (text), j;
+	guint i;
+
+	regex = g_regex_new (pattern, (GRegexCompileFlags) 0, (GRegexMatchFlags) 0, NULL);
+	g_assert (regex != NULL);
+	g_assert (g_regex_match (regex, text, (GRegexMatchFlags) 0, NULL));
+
+	_vte_ring_text_query_init (&query, regex, (GRegexMatchFlags) 0);
+	for (i = 0; i < query.n_hashes; i++) {
+		for (j = 2; j < len; j++) {
+			if (_vte_ring_text_index_hash (g_ascii_tolower (text[j - 2]),
+						       g_ascii_tolower (text[j - 1]),
+						       g_ascii_tolower (text[j])) == query.hashes[i])
+				break;
+		}
+		g_assert_cmpuint (j, <, len);
+	}
+
+	g_regex_unref (regex);
+}
+
+static void
+test_text_query (void)
+{
+	assert_text_query ("foobar", "foobar", NULL);
+	assert_text_query ("foo\\dbar", "foo", "bar", NULL);
+	assert_text_query ("foo\\.bar", "foo.bar", NULL);
+	assert_text_query ("foo(bar)+baz", "foo", "baz", NULL);
+	assert_text_query ("fooo?bar", "foo", "bar", NULL);
+	assert_text_query ("foo|bar", NULL);
+
+	/* Escapes with arguments, and backreferences */
+	assert_text_query ("\\x41bcd", NULL);
+	assert_text_query ("\\x{263a}bcd", NULL);
+	assert_text_query ("\\p{Lu}bcd", NULL);
+	assert_text_query ("\\cAbcd", NULL);
+	assert_text_query ("\\o{101}bcd", NULL);
+	assert_text_query ("\\N{U+41}bcd", NULL);
+	assert_text_query ("(?<n>a)\\k<n>bcd", NULL);
+	assert_text_query ("(a)\\g{1}bcd", NULL);
+	assert_text_query ("(a)\\12bcd", NULL);
+	assert_text_query ("[\\x5d]bcd", NULL);
+
+	assert_text_query_finds ("\\x41bc", "Abc");
+	assert_text_query_finds ("x\\x{263a}yz", "x\xe2\x98\xbayz");
+	assert_text_query_finds ("issue #\\d+ fixed", "issue #42 fixed");
+}
+
+/* Append paragraph @n of the test text wrapped at @columns. Every third one
+ * is non-ASCII, with characters found nowhere else. */
+static void
+ring_append_paragraph (VteRing *ring, guint n, glong columns)
+{
+	VteRowData *row = _vte_ring_append (ring);
+	VteCell cell = basic_cell.cell;
+	guint i, len = n * 37 % 100;
+
+	for (i = 0; i < len; i++) {
+		if (row->len == columns) {
+			row->attr.soft_wrapped = 1;
+			row = _vte_ring_append (ring);
+		}
+		cell.c = n % 3 == 0 ? 0x100 + n / 3 * 100 + i : 'a' + (n + i) % 26;
+		_vte_row_data_append (row, &cell);
+	}
+}
+
+static void
+ring_init_paragraphs (VteRing *ring, gulong max_rows, guint paragraphs, glong columns)
+{
+	guint n;
+
+	_vte_ring_init (ring, max_rows, TRUE);
+	_vte_ring_set_streams_in_memory (ring, TRUE);
+	_vte_ring_set_visible_rows (ring, 10);
+	for (n = 0; n < paragraphs; n++)
+		ring_append_paragraph (ring, n, columns);
+}
+
+/* The text of the rows from @start on, with a newline after each paragraph */
+static GString *
+ring_text (VteRing *ring, gulong start)
+{
+	GString *text = g_string_new (NULL);
+	const VteRowData *row;
+	gulong position;
+	int i;
+
+	for (position = start; position < ring->end; position++) {
+		row = _vte_ring_index (ring, position);
+		for (i = 0; i < row->len; i++)
+			g_string_append_unichar (text, row->cells[i].c);
+		if (!row->attr.soft_wrapped)
+			g_string_append_c (text, '\n');
+	}
+	return text;
+}
+
+/* Check the ring holds @text, or its end if @suffix, wrapped at @columns */
+static void
+assert_ring_rewrapped (VteRing *ring, const GString *text, gboolean suffix, glong columns)
+{
+	GString *rewrapped = ring_text (ring, ring->start);
+	const VteRowData *row;
+	gulong position;
+
+	if (suffix) {
+		g_assert_cmpuint (rewrapped->len, <=, text->len);
+		g_assert_cmpstr (rewrapped->str, ==, text->str + text->len - rewrapped->len);
+	} else
+		g_assert_cmpstr (rewrapped->str, ==, text->str);
+	g_string_free (rewrapped, TRUE);
+
+	for (position = ring->start; position < ring->end; position++) {
+		row = _vte_ring_index (ring, position);
+		if (row->attr.soft_wrapped)
+			g_assert_cmpint (row->len, ==, columns);
+		else
+			g_assert_cmpint (row->len, <=, columns);
+	}
+	g_assert_cmpuint (_vte_ring_length (ring), <=, ring->max);
+}
+
+/* Point @marker at the last non-ASCII cell before row @before */
+static gunichar
+ring_find_marker (VteRing *ring, gulong before, VteVisualPosition *marker)
+{
+	const VteRowData *row;
+	gulong position;
+	int i;
+
+	for (position = before; position > ring->start; position--) {
+		row = _vte_ring_index (ring, position - 1);
+		for (i = row->len; i > 0; i--) {
+			if (row->cells[i - 1].c >= 0x100) {
+				marker->row = position - 1;
+				marker->col = i - 1;
+				return row->cells[i - 1].c;
+			}
+		}
+	}
+	g_assert_not_reached ();
+	return 0;
+}
+
+static gunichar
+ring_marker_char (VteRing *ring, const VteVisualPosition *marker)
+{
+	const VteRowData *row;
+
+	g_assert (_vte_ring_contains (ring, marker->row));
+	row = _vte_ring_index (ring, marker->row);
+	g_assert_cmpint (marker->col, <, row->len);
+	return row->cells[marker->col].c;
+}
+
+static void
+ring_finish_rewrap (VteRing *ring, VteVisualPosition **markers)
+{
+	while (_vte_ring_rewrap_step (ring, 10, markers))
+		;
+	g_assert (!_vte_ring_rewrap_pending (ring));
+}
+
+static void
+test_rewrap (void)
+{
+	VteRing ring;
+	VteVisualPosition *markers[] = { NULL };
+	GString *text;
+
+	ring_init_paragraphs (&ring, 10000, 300, 20);
+	text = ring_text (&ring, ring.start);
+
+	/* Widening */
+	_vte_ring_rewrap (&ring, 30, markers);
+	g_assert (_vte_ring_rewrap_pending (&ring));
+	ring_finish_rewrap (&ring, markers);
+	assert_ring_rewrapped (&ring, text, FALSE, 30);
+
+	/* Narrowing */
+	_vte_ring_rewrap (&ring, 7, markers);
+	g_assert (_vte_ring_rewrap_pending (&ring));
+	ring_finish_rewrap (&ring, markers);
+	assert_ring_rewrapped (&ring, text, FALSE, 7);
+
+	/* Resized again while the history is pending */
+	_vte_ring_rewrap (&ring, 20, markers);
+	g_assert (_vte_ring_rewrap_step (&ring, 10, markers));
+	_vte_ring_rewrap (&ring, 13, markers);
+	g_assert (_vte_ring_rewrap_pending (&ring));
+	ring_finish_rewrap (&ring, markers);
+	assert_ring_rewrapped (&ring, text, FALSE, 13);
+
+	g_string_free (text, TRUE);
+	_vte_ring_fini (&ring);
+}
+
+static void
+test_rewrap_markers (void)
+{
+	VteRing ring;
+	VteVisualPosition cursor, selection, history, below;
+	VteVisualPosition *markers[] = { &cursor, &selection, NULL, NULL };
+	VteVisualPosition saved_below;
+	gunichar cursor_c, selection_c, history_c, below_c;
+	GString *text;
+
+	ring_init_paragraphs (&ring, 10000, 300, 20);
+	text = ring_text (&ring, ring.start);
+
+	/* The visible rows and the paragraphs of the markers are rewrapped at once */
+	cursor_c = ring_find_marker (&ring, ring.end, &cursor);
+	selection_c = ring_find_marker (&ring, ring.start + 200, &selection);
+	_vte_ring_rewrap (&ring, 30, markers);
+	g_assert (_vte_ring_rewrap_pending (&ring));
+	g_assert_cmpuint (selection.row, >=, ring.rewrap_end);
+	g_assert_cmpuint (ring_marker_char (&ring, &cursor), ==, cursor_c);
+	g_assert_cmpuint (ring_marker_char (&ring, &selection), ==, selection_c);
+
+	/* The steps move the markers within the history, not the ones after it */
+	history_c = ring_find_marker (&ring, ring.rewrap_end - 50, &history);
+	below_c = ring_find_marker (&ring, ring.end, &below);
+	g_assert_cmpuint (below.row, >=, ring.rewrap_end);
+	saved_below = below;
+	markers[0] = &history;
+	markers[1] = &below;
+	ring_finish_rewrap (&ring, markers);
+	assert_ring_rewrapped (&ring, text, FALSE, 30);
+	g_assert_cmpuint (ring_marker_char (&ring, &history), ==, history_c);
+	g_assert_cmpint (below.row, ==, saved_below.row);
+	g_assert_cmpint (below.col, ==, saved_below.col);
+	g_assert_cmpuint (ring_marker_char (&ring, &below), ==, below_c);
+
+	g_string_free (text, TRUE);
+	_vte_ring_fini (&ring);
+}
+
+static void
+test_rewrap_trimmed (void)
+{
+	VteRing ring;
+	VteVisualPosition *markers[] = { NULL };
+	GString *text, *more;
+	gulong end, rewrap_end;
+	guint n = 300;
+
+	ring_init_paragraphs (&ring, 1000, n, 20);
+	text = ring_text (&ring, ring.start);
+
+	/* Some of the pending history is discarded */
+	_vte_ring_rewrap (&ring, 13, markers);
+	g_assert (_vte_ring_rewrap_step (&ring, 10, markers));
+	end = ring.end;
+	while (ring.start < ring.rewrap_position + 100)
+		ring_append_paragraph (&ring, n++, 13);
+	g_assert_cmpuint (ring.start, <, ring.rewrap_end);
+	more = ring_text (&ring, end);
+	g_string_append (text, more->str);
+	g_string_free (more, TRUE);
+	ring_finish_rewrap (&ring, markers);
+	assert_ring_rewrapped (&ring, text, TRUE, 13);
+
+	/* All of it is */
+	_vte_ring_rewrap (&ring, 20, markers);
+	g_assert (_vte_ring_rewrap_pending (&ring));
+	end = ring.end;
+	rewrap_end = ring.rewrap_end;
+	while (ring.start < rewrap_end)
+		ring_append_paragraph (&ring, n++, 20);
+	more = ring_text (&ring, end);
+	g_string_append (text, more->str);
+	g_string_free (more, TRUE);
+	ring_finish_rewrap (&ring, markers);
+	assert_ring_rewrapped (&ring, text, TRUE, 20);
+
+	g_string_free (text, TRUE);
+	_vte_ring_fini (&ring);
+}
+
+static void
+test_varint (void)
+{
+	static const struct {
+		guint64 value;
+		gsize size;
+	} values[] = {
+		{ 0, 1 },
+		{ 127, 1 },
+		{ 128, 2 },
+		{ 16383, 2 },
+		{ 16384, 3 },
+		{ G_MAXUINT32, 5 },
+		{ G_MAXUINT64 >> 1, 9 },
+		{ (G_MAXUINT64 >> 1) + 1, 10 },
+		{ G_MAXUINT64 - 1, 10 },
+		{ G_MAXUINT64, 10 },
+	};
+	char buf[VTE_VARINT_MAX_SIZE + 1];
+	const char *p;
+	guint64 v;
+	gsize i, len;
+
+	for (i = 0; i < G_N_ELEMENTS (values); i++) {
+		len = _vte_varint_put (buf, values[i].value) - buf;
+		g_assert_cmpuint (len, ==, values[i].size);
+		p = buf;
+		g_assert (_vte_varint_get (&p, buf + len, &v));
+		g_assert_cmpuint (v, ==, values[i].value);
+		g_assert (p == buf + len);
+
+		/* Truncated input leaves everything as it is */
+		for (; len > 0; len--) {
+			p = buf;
+			v = 42;
+			g_assert (!_vte_varint_get (&p, buf + len - 1, &v));
+			g_assert (p == buf);
+			g_assert_cmpuint (v, ==, 42);
+		}
+	}
+
+	/* Longer than any value */
+	memset (buf, 0x80, sizeof (buf));
+	p = buf;
+	g_assert (!_vte_varint_get (&p, buf + sizeof (buf), &v));
+}
+
+/* Rows whose contents depend on their position */
+static void
+ring_append_numbered_rows (VteRing *ring, gulong count)
+{
+	VteRowData *row;
+	VteCell cell = basic_cell.cell;
+	gulong position;
+	guint i;
+
+	for (position = ring->end; count > 0; position++, count--) {
+		row = _vte_ring_append (ring);
+		for (i = 0; i < position % 37; i++) {
+			cell.c = position % 5 == 0 ? 0xe9 : 'a' + (position + i) % 26;
+			_vte_row_data_append (row, &cell);
+		}
+		row->attr.soft_wrapped = position % 3 == 0;
+	}
+}
+
+static void
+assert_ring_numbered_row (VteRing *ring, gulong position)
+{
+	const VteRowData *row = _vte_ring_index (ring, position);
+	guint i;
+
+	g_assert_cmpint (row->len, ==, position % 37);
+	for (i = 0; i < position % 37; i++)
+		g_assert_cmpuint (row->cells[i].c, ==, position % 5 == 0 ? 0xe9 : 'a' + (position + i) % 26);
+	g_assert_cmpint (row->attr.soft_wrapped, ==, position % 3 == 0);
+}
+
+/* Check the records of the frozen rows around every 64th one, looked up from
+ * the row index and from where the previous lookup ended, match reading them
+ * all in a row */
+static void
+assert_ring_row_index (VteRing *ring)
+{
+	static const gulong offsets[] = { 0, 1, 63, 64, 65, 127, 128, 129, 64, 63, 1, 0, 128, 127 };
+	VteRowRecord *records, record;
+	VteRowRecordReader reader;
+	gulong base, position, count = ring->writable - ring->start;
+	guint i;
+
+	records = g_new (VteRowRecord, count);
+	g_assert (_vte_ring_seek_row_record (ring, &reader, ring->start));
+	for (position = 0; position < count; position++)
+		g_assert (_vte_ring_next_row_record (ring, &reader, &records[position]));
+	g_assert (!_vte_ring_next_row_record (ring, &reader, &record));
+
+	for (base = ring->row_index_origin; base + 129 < ring->writable; base += VTE_RING_ROW_INDEX_INTERVAL) {
+		for (i = 0; i < G_N_ELEMENTS (offsets); i++) {
+			position = base + offsets[i];
+			if (position < ring->start)
+				continue;
+			g_assert (_vte_ring_read_row_record (ring, &record, position));
+			g_assert_cmpuint (record.text_start_offset, ==, records[position - ring->start].text_start_offset);
+			g_assert_cmpuint (record.attr_start_offset, ==, records[position - ring->start].attr_start_offset);
+			g_assert_cmpint (record.soft_wrapped, ==, records[position - ring->start].soft_wrapped);
+			g_assert_cmpint (record.is_ascii, ==, records[position - ring->start].is_ascii);
+			assert_ring_numbered_row (ring, position);
+		}
+	}
+	g_free (records);
+}
+
+static void
+test_row_index (void)
+{
+	VteRing ring;
+
+	_vte_ring_init (&ring, 10000, TRUE);
+	_vte_ring_set_streams_in_memory (&ring, TRUE);
+	_vte_ring_set_visible_rows (&ring, 10);
+	ring_append_numbered_rows (&ring, 300);
+	g_assert_cmpuint (ring.writable, >, 2 * VTE_RING_ROW_INDEX_INTERVAL + 1);
+	assert_ring_row_index (&ring);
+	_vte_ring_fini (&ring);
+
+	/* The first rows are discarded, the index still counts from the first one */
+	_vte_ring_init (&ring, 200, TRUE);
+	_vte_ring_set_streams_in_memory (&ring, TRUE);
+	_vte_ring_set_visible_rows (&ring, 10);
+	ring_append_numbered_rows (&ring, 500);
+	g_assert_cmpuint (ring.start, ==, 300);
+	assert_ring_row_index (&ring);
+	_vte_ring_fini (&ring);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+	g_test_init (&argc, &argv, NULL);
+
+	g_test_add_func ("/vte/ring/text-query", test_text_query);
+	g_test_add_func ("/vte/ring/rewrap", test_rewrap);
+	g_test_add_func ("/vte/ring/rewrap-markers", test_rewrap_markers);
+	g_test_add_func ("/vte/ring/rewrap-trimmed", test_rewrap_trimmed);
+	g_test_add_func ("/vte/ring/varint", test_varint);
+	g_test_add_func ("/vte/ring/row-index", test_row_index);
+
+	return g_test_run ();
+}
+#endif
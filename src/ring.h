@@ -41,6 +41,38 @@ typedef struct _VteCellAttrChange {
 	VteIntCellAttr attr;
 } VteCellAttrChange;
 
+typedef struct _VteRowRecord {
+	gsize text_start_offset;  /* offset where text of this row begins */
+	gsize attr_start_offset;  /* offset of the first character's attributes */
+	int soft_wrapped: 1;      /* end of line is not '\n' */
+	int is_ascii: 1;          /* for rewrapping speedup: guarantees that line contains 32..126 bytes only. Can be 0 even when ascii only. */
+} VteRowRecord;
+
+/* Position within the row records, see _vte_ring_seek_row_record() */
+typedef struct _VteRowRecordReader {
+	gulong position;      /* of the next record */
+	gsize row_offset;     /* of the next record in row_stream */
+	VteRowRecord record;  /* the previous one, the next record is relative to it */
+} VteRowRecordReader;
+
+
+/* A match found by _vte_ring_search() */
+typedef struct _VteRingMatch {
+	gulong start_row, end_row;     /* the paragraph */
+	int start_offset, end_offset;  /* of the match in the paragraph's text */
+} VteRingMatch;
+
+typedef void (*VteRingMatchFunc) (const VteRingMatch *match, gpointer data);
+
+/* Called by _vte_ring_match_text() for each match, returns %TRUE to stop there */
+typedef gboolean (*VteRingTextMatchFunc) (int start, int end, gpointer data);
+
+/* A literal text to search for, see _vte_ring_literal_new() */
+typedef struct _VteRingLiteral VteRingLiteral;
+
+/* Ranges of the history being rewrapped on other threads, see _vte_ring_rewrap_step() */
+typedef struct _VteRingRewrapJobs VteRingRewrapJobs;
+
 
 /*
  * VteRing: A scrollback buffer ring
@@ -49,6 +81,7 @@ typedef struct _VteCellAttrChange {
 typedef struct _VteRing VteRing;
 struct _VteRing {
 	gulong max;
+	gsize max_bytes;  /* limit on the memory and disk usage too, 0 if none */
 
 	gulong start, end;
 
@@ -57,15 +90,43 @@ struct _VteRing {
 	VteRowData *array;
 
 	/* Storage */
-	VteStream *attr_stream, *text_stream, *row_stream;
+	VteStream *attr_stream, *text_stream, *row_stream, *row_index_stream;
 	gsize last_attr_text_start_offset;
 	VteIntCellAttr last_attr;
 	GString *utf8_buffer;
-
-	VteRowData cached_row;
-	gulong cached_row_num;
+	GString *attr_buffer, *row_buffer, *row_index_buffer;  /* pending data of rows being frozen */
+
+	/* Row records */
+	VteRowRecord last_row_record;  /* the next one is stored relative to it */
+	gulong row_index_origin;       /* first row since the streams were reset, it's indexed */
+	gsize row_index_origin_offset; /* offset of its entry in row_index_stream */
+	VteRowRecordReader row_reader; /* where the last lookup ended up, for sequential access */
+	gulong generation;             /* changes when frozen rows change or get renumbered, never reused */
+
+	/* History still wrapped at an older width, see _vte_ring_rewrap_step() */
+	glong rewrap_columns;          /* 0 if there's none */
+	gulong rewrap_end;             /* rows from here on are rewrapped */
+	gulong rewrap_position;        /* the next row to rewrap */
+	gulong rewrap_rows;            /* the number of new rows so far */
+	VteStream *rewrap_row_stream, *rewrap_row_index_stream;
+	VteRowRecord rewrap_last_record;
+	VteRingRewrapJobs *rewrap_jobs;  /* NULL if none, they read the streams meanwhile */
+
+	/* Trigrams of the frozen text, a bitmap per block of text_stream, see
+	 * _vte_ring_set_text_indexed(). Block b is at (b & text_index_mask). */
+	guint8 *text_index;            /* NULL if not indexing */
+	gsize text_index_mask;
+	gsize text_index_start, text_index_end;  /* the blocks indexed */
+	guchar text_index_tail[2];     /* the last characters indexed, for the next row */
+	int text_index_tail_len;       /* -1 if they have to be read again */
+
+	/* Recently thawed rows, indexed by position & cached_rows_mask */
+	VteRowData *cached_rows;
+	gulong *cached_row_nums;
+	gulong cached_rows_mask;
 
 	gboolean has_streams;
+	gboolean streams_in_memory;
         gulong visible_rows;  /* to keep at least a screenful of lines in memory, bug 646098 comment 12 */
 };
 
@@ -75,6 +136,8 @@ struct _VteRing {
 #define _vte_ring_delta(__ring) ((glong) (__ring)->start)
 #define _vte_ring_length(__ring) ((glong) ((__ring)->end - (__ring)->start))
 #define _vte_ring_next(__ring) ((glong) (__ring)->end)
+#define _vte_ring_writable(__ring) ((glong) (__ring)->writable)
+#define _vte_ring_rewrap_pending(__ring) ((__ring)->rewrap_columns != 0)
 
 const VteRowData *_vte_ring_index (VteRing *ring, gulong position);
 VteRowData *_vte_ring_index_writable (VteRing *ring, gulong position);
@@ -88,13 +151,39 @@ VteRowData *_vte_ring_insert (VteRing *ring, gulong position);
 VteRowData *_vte_ring_append (VteRing *ring);
 void _vte_ring_remove (VteRing *ring, gulong position);
 void _vte_ring_drop_scrollback (VteRing *ring, gulong position);
+void _vte_ring_set_streams_in_memory (VteRing *ring, gboolean in_memory);
 void _vte_ring_set_visible_rows (VteRing *ring, gulong rows);
+void _vte_ring_set_max_bytes (VteRing *ring, gsize max_bytes);
+void _vte_ring_get_usage (VteRing *ring, gsize *rows, gsize *buffers, gsize *disk);
+void _vte_ring_set_text_indexed (VteRing *ring, gboolean indexed);
+void _vte_ring_hibernate (VteRing *ring);
 void _vte_ring_rewrap (VteRing *ring, glong columns, VteVisualPosition **markers);
+gboolean _vte_ring_rewrap_step (VteRing *ring, gulong count, VteVisualPosition **markers);
+gboolean _vte_ring_rewrap_busy (VteRing *ring);
+VteRingLiteral *_vte_ring_literal_new (const char *text, gboolean caseless);
+VteRingLiteral *_vte_ring_literal_copy (const VteRingLiteral *literal);
+void _vte_ring_literal_free (VteRingLiteral *literal);
+void _vte_ring_match_text (GRegex *regex, GRegexMatchFlags flags, const VteRingLiteral *literal,
+			   const char *text, gsize len, VteRingTextMatchFunc func, gpointer data);
+gboolean _vte_ring_search (VteRing *ring, gulong limit, gulong *position, gboolean backward,
+			   GRegex *regex, GRegexMatchFlags flags, const VteRingLiteral *literal,
+			   VteRingMatch *match);
+void _vte_ring_search_all (VteRing *ring, gulong limit, gulong *position,
+			   GRegex *regex, GRegexMatchFlags flags, const VteRingLiteral *literal,
+			   VteRingMatchFunc func, gpointer data);
 gboolean _vte_ring_write_contents (VteRing *ring,
 				   GOutputStream *stream,
 				   VteWriteFlags flags,
 				   GCancellable *cancellable,
 				   GError **error);
+gboolean _vte_ring_write_snapshot (VteRing *ring,
+				   GDataOutputStream *out,
+				   GCancellable *cancellable,
+				   GError **error);
+gboolean _vte_ring_read_snapshot (VteRing *ring,
+				  GDataInputStream *in,
+				  GCancellable *cancellable,
+				  GError **error);
 
 G_END_DECLS
 
@@ -104,6 +104,8 @@ static void vte_terminal_match_hilite_hide(VteTerminal *terminal);
 static void vte_terminal_match_hilite_show(VteTerminal *terminal, long x, long y);
 static void vte_terminal_match_hilite_update(VteTerminal *terminal, long x, long y);
 static void vte_terminal_match_contents_clear(VteTerminal *terminal);
+static guint64 vte_terminal_paragraph_key(VteTerminal *terminal,
+					  long start_row, long end_row);
 static void vte_terminal_background_update(VteTerminal *data);
 static void vte_terminal_process_incoming(VteTerminal *terminal);
 static void vte_terminal_emit_pending_signals(VteTerminal *terminal);
@@ -117,6 +119,7 @@ static char *vte_terminal_get_text_range_maybe_wrapped(VteTerminal *terminal,
 						       glong end_row,
 						       glong end_col,
 						       gboolean wrap,
+						       gboolean block,
 						       VteSelectionFunc is_selected,
 						       gpointer data,
 						       GArray *attributes,
@@ -135,6 +138,10 @@ static inline void vte_terminal_start_processing (VteTerminal *terminal);
 static void vte_terminal_add_process_timeout (VteTerminal *terminal);
 static void add_update_timeout (VteTerminal *terminal);
 static void remove_update_timeout (VteTerminal *terminal);
+static void vte_terminal_queue_hibernate (VteTerminal *terminal);
+static void vte_terminal_remove_hibernate_timeout (VteTerminal *terminal);
+static void vte_terminal_remove_resize_timeout (VteTerminal *terminal);
+static void vte_terminal_search_clear_highlights (VteTerminal *terminal);
 static void reset_update_regions (VteTerminal *terminal);
 static void vte_terminal_update_cursor_blinks_internal(VteTerminal *terminal);
 static void _vte_check_cursor_blink(VteTerminal *terminal);
@@ -153,6 +160,7 @@ static void vte_terminal_determine_colors_internal(VteTerminal *terminal,
 enum {
     COPY_CLIPBOARD,
     PASTE_CLIPBOARD,
+    SEARCH_PROGRESS,
     LAST_SIGNAL
 };
 static guint signals[LAST_SIGNAL];
@@ -175,11 +183,15 @@ enum {
         PROP_ENCODING,
         PROP_FONT_DESC,
         PROP_FONT_SCALE,
+        PROP_HIBERNATE_ON_UNMAP,
         PROP_ICON_TITLE,
         PROP_INPUT_ENABLED,
         PROP_MOUSE_POINTER_AUTOHIDE,
         PROP_PTY,
         PROP_REWRAP_ON_RESIZE,
+        PROP_SCROLLBACK_BYTES,
+        PROP_SCROLLBACK_IN_MEMORY,
+        PROP_SCROLLBACK_INDEXED,
         PROP_SCROLLBACK_LINES,
         PROP_SCROLL_ON_KEYSTROKE,
         PROP_SCROLL_ON_OUTPUT,
@@ -366,6 +378,125 @@ _vte_terminal_set_default_attributes(VteTerminal *terminal)
         terminal->pvt->fill_defaults = terminal->pvt->defaults;
 }
 
+/* Convert a range of visible cells to the window area to repaint.
+ * Always include the extra pixel border and overlap pixel. */
+static void
+vte_terminal_cells_to_rect (VteTerminal *terminal,
+			    glong column_start, glong column_count,
+			    glong row_start, glong row_count,
+			    cairo_rectangle_int_t *rect)
+{
+	rect->x = column_start * terminal->pvt->char_width - 1;
+	if (column_start != 0) {
+		rect->x += terminal->pvt->padding.left;
+	}
+	rect->width = (column_start + column_count) * terminal->pvt->char_width + 3 + terminal->pvt->padding.left;
+	if (column_start + column_count == terminal->pvt->column_count) {
+		rect->width += terminal->pvt->padding.right;
+	}
+	rect->width -= rect->x;
+
+	rect->y = row_start * terminal->pvt->char_height - 1;
+	if (row_start != 0) {
+		rect->y += terminal->pvt->padding.top;
+	}
+	rect->height = (row_start + row_count) * terminal->pvt->char_height + 2 + terminal->pvt->padding.top;
+	if (row_start + row_count == terminal->pvt->row_count) {
+		rect->height += terminal->pvt->padding.bottom;
+	}
+	rect->height -= rect->y;
+}
+
+/* Make sure there's a damage span for each visible row. */
+static void
+vte_terminal_ensure_damage (VteTerminal *terminal)
+{
+	VteTerminalPrivate *pvt = terminal->pvt;
+	glong i;
+
+	if (G_LIKELY (pvt->damage_rows == pvt->row_count))
+		return;
+
+	pvt->damage = g_renew (struct vte_damage_span, pvt->damage, pvt->row_count);
+	for (i = pvt->damage_rows; i < pvt->row_count; i++) {
+		pvt->damage[i].start = pvt->damage[i].end = 0;
+	}
+	pvt->damage_rows = pvt->row_count;
+}
+
+/* Record the visible cells to be repainted at the next update.
+ * This is the hot path, so only do integer operations here; the
+ * spans are turned into rectangles once per frame by update_regions(). */
+static void
+vte_terminal_damage_cells (VteTerminal *terminal,
+			   glong column_start, glong column_end,
+			   glong row_start, glong row_end)
+{
+	struct vte_damage_span *span;
+	glong i;
+
+	vte_terminal_ensure_damage (terminal);
+
+	for (i = row_start, span = &terminal->pvt->damage[row_start]; i < row_end; i++, span++) {
+		if (span->start >= span->end) {
+			span->start = column_start;
+			span->end = column_end;
+		} else {
+			span->start = MIN (span->start, column_start);
+			span->end = MAX (span->end, column_end);
+		}
+	}
+	terminal->pvt->damage_pending = TRUE;
+}
+
+/* Turn the recorded damage into a region with as few rectangles as
+ * possible, and reset it. */
+static cairo_region_t *
+vte_terminal_take_damage (VteTerminal *terminal)
+{
+	VteTerminalPrivate *pvt = terminal->pvt;
+	cairo_region_t *region;
+	cairo_rectangle_int_t rect;
+	glong row, next, rows;
+
+	region = cairo_region_create ();
+
+	if (pvt->damage_all) {
+		GtkAllocation allocation;
+
+		gtk_widget_get_allocation (&terminal->widget, &allocation);
+		rect.x = rect.y = 0;
+		rect.width = allocation.width;
+		rect.height = allocation.height;
+		cairo_region_union_rectangle (region, &rect);
+	} else {
+		rows = MIN (pvt->damage_rows, pvt->row_count);
+		for (row = 0; row < rows; row = next) {
+			struct vte_damage_span span = pvt->damage[row];
+
+			next = row + 1;
+			if (span.start >= span.end)
+				continue;
+
+			/* Subsequent rows with the same span go to the same rectangle. */
+			while (next < rows &&
+			       pvt->damage[next].start == span.start &&
+			       pvt->damage[next].end == span.end)
+				next++;
+
+			vte_terminal_cells_to_rect (terminal,
+						    span.start, span.end - span.start,
+						    row, next - row,
+						    &rect);
+			cairo_region_union_rectangle (region, &rect);
+		}
+	}
+
+	reset_update_regions (terminal);
+
+	return region;
+}
+
 /* Cause certain cells to be repainted. */
 void
 _vte_invalidate_cells(VteTerminal *terminal,
@@ -422,42 +553,25 @@ _vte_invalidate_cells(VteTerminal *terminal,
 		return;
 	}
 
-	/* Convert the column and row start and end to pixel values
-	 * by multiplying by the size of a character cell.
-	 * Always include the extra pixel border and overlap pixel.
-	 */
-	rect.x = column_start * terminal->pvt->char_width - 1;
-	if (column_start != 0) {
-		rect.x += terminal->pvt->padding.left;
-	}
-	rect.width = (column_start + column_count) * terminal->pvt->char_width + 3 + terminal->pvt->padding.left;
-	if (column_start + column_count == terminal->pvt->column_count) {
-		rect.width += terminal->pvt->padding.right;
-	}
-	rect.width -= rect.x;
-
-	rect.y = row_start * terminal->pvt->char_height - 1;
-	if (row_start != 0) {
-		rect.y += terminal->pvt->padding.top;
-	}
-	rect.height = (row_start + row_count) * terminal->pvt->char_height + 2 + terminal->pvt->padding.top;
-	if (row_start + row_count == terminal->pvt->row_count) {
-		rect.height += terminal->pvt->padding.bottom;
-	}
-	rect.height -= rect.y;
-
-	_vte_debug_print (VTE_DEBUG_UPDATES,
-			"Invalidating pixels at (%d,%d)x(%d,%d).\n",
-			rect.x, rect.y, rect.width, rect.height);
-
 	if (terminal->pvt->active != NULL) {
-		terminal->pvt->update_regions = g_slist_prepend (
-				terminal->pvt->update_regions,
-				cairo_region_create_rectangle (&rect));
+		vte_terminal_damage_cells (terminal,
+					   column_start, column_start + column_count,
+					   row_start, MIN (row_start + row_count, terminal->pvt->row_count));
 		/* Wait a bit before doing any invalidation, just in
 		 * case updates are coming in really soon. */
 		add_update_timeout (terminal);
 	} else {
+		/* Convert the column and row start and end to pixel values
+		 * by multiplying by the size of a character cell. */
+		vte_terminal_cells_to_rect (terminal,
+					    column_start, column_count,
+					    row_start, row_count,
+					    &rect);
+
+		_vte_debug_print (VTE_DEBUG_UPDATES,
+				"Invalidating pixels at (%d,%d)x(%d,%d).\n",
+				rect.x, rect.y, rect.width, rect.height);
+
 		gdk_window_invalidate_rect (gtk_widget_get_window (&terminal->widget), &rect, FALSE);
 	}
 
@@ -508,47 +622,168 @@ _vte_invalidate_all(VteTerminal *terminal)
 	_vte_debug_print (VTE_DEBUG_WORK, "*");
 	_vte_debug_print (VTE_DEBUG_UPDATES, "Invalidating all.\n");
 
-	gtk_widget_get_allocation (&terminal->widget, &allocation);
-
 	/* replace invalid regions with one covering the whole terminal */
 	reset_update_regions (terminal);
-	rect.x = rect.y = 0;
-	rect.width = allocation.width;
-	rect.height = allocation.height;
 	terminal->pvt->invalidated_all = TRUE;
 
 	if (terminal->pvt->active != NULL) {
-		terminal->pvt->update_regions = g_slist_prepend (NULL,
-				cairo_region_create_rectangle (&rect));
+		terminal->pvt->damage_all = TRUE;
+		terminal->pvt->damage_pending = TRUE;
 		/* Wait a bit before doing any invalidation, just in
 		 * case updates are coming in really soon. */
 		add_update_timeout (terminal);
 	} else {
+		gtk_widget_get_allocation (&terminal->widget, &allocation);
+		rect.x = rect.y = 0;
+		rect.width = allocation.width;
+		rect.height = allocation.height;
 		gdk_window_invalidate_rect (gtk_widget_get_window (&terminal->widget), &rect, FALSE);
 	}
 }
 
+/* Copy the pixels of the pending scroll operation, if any. GDK invalidates
+ * the area uncovered by the move. */
+static void
+vte_terminal_flush_scroll (VteTerminal *terminal)
+{
+	VteTerminalPrivate *pvt = terminal->pvt;
+	cairo_rectangle_int_t rect;
+	cairo_region_t *region;
+	GtkAllocation allocation;
+
+	if (!pvt->scroll_pending)
+		return;
+
+	gtk_widget_get_allocation (&terminal->widget, &allocation);
+	rect.x = 0;
+	rect.width = allocation.width;
+	rect.y = pvt->scroll_row_start * pvt->char_height + pvt->padding.top;
+	rect.height = (pvt->scroll_row_end - pvt->scroll_row_start) * pvt->char_height;
+
+	_vte_debug_print (VTE_DEBUG_UPDATES,
+			"Moving pixels at (%d,%d)x(%d,%d) by %ld rows.\n",
+			rect.x, rect.y, rect.width, rect.height,
+			pvt->scroll_rows);
+
+	region = cairo_region_create_rectangle (&rect);
+	gdk_window_move_region (gtk_widget_get_window (&terminal->widget),
+				region, 0, pvt->scroll_rows * pvt->char_height);
+	cairo_region_destroy (region);
+
+	pvt->scroll_pending = FALSE;
+	pvt->scroll_rows = 0;
+}
+
+/* Record that the visible rows from @row_start to @row_end (exclusive) are
+ * to be moved by @delta rows. Consecutive scrolls of the same area in the
+ * same direction are merged into a single copy which is performed in
+ * update_regions(). */
+static void
+vte_terminal_queue_scroll (VteTerminal *terminal,
+			   glong row_start, glong row_end, glong delta)
+{
+	VteTerminalPrivate *pvt = terminal->pvt;
+	glong i;
+
+	if (pvt->scroll_pending &&
+	    (pvt->scroll_row_start != row_start || pvt->scroll_row_end != row_end ||
+	     (pvt->scroll_rows < 0) != (delta < 0))) {
+		/* Can't be merged, perform the previous one first. */
+		vte_terminal_flush_scroll (terminal);
+	}
+
+	/* Damage recorded so far refers to the pixels before the move. Mark
+	 * their new location too; the old one might have been recorded after
+	 * the scroll offset already changed, so keep that as well.
+	 * Walk against the direction of the move so that each row is only
+	 * merged into its destination once. */
+	if (pvt->damage_pending && !pvt->damage_all) {
+		vte_terminal_ensure_damage (terminal);
+		if (delta > 0) {
+			for (i = row_end - 1 - delta; i >= row_start; i--) {
+				if (pvt->damage[i].start < pvt->damage[i].end)
+					vte_terminal_damage_cells (terminal,
+								   pvt->damage[i].start, pvt->damage[i].end,
+								   i + delta, i + delta + 1);
+			}
+		} else {
+			for (i = row_start - delta; i < row_end; i++) {
+				if (pvt->damage[i].start < pvt->damage[i].end)
+					vte_terminal_damage_cells (terminal,
+								   pvt->damage[i].start, pvt->damage[i].end,
+								   i + delta, i + delta + 1);
+			}
+		}
+	}
+
+	pvt->scroll_row_start = row_start;
+	pvt->scroll_row_end = row_end;
+	pvt->scroll_rows += delta;
+	pvt->scroll_pending = TRUE;
+
+	if (ABS (pvt->scroll_rows) >= row_end - row_start) {
+		/* Everything has been scrolled out, nothing to copy. */
+		pvt->scroll_pending = FALSE;
+		pvt->scroll_rows = 0;
+		vte_terminal_damage_cells (terminal, 0, pvt->column_count, row_start, row_end);
+	}
+
+	if (pvt->active != NULL) {
+		/* Wait a bit, more scrolling of the same area is likely. */
+		add_update_timeout (terminal);
+	} else {
+		vte_terminal_flush_scroll (terminal);
+	}
+}
+
 /* Scroll a rectangular region up or down by a fixed number of lines,
  * negative = up, positive = down. */
 void
 _vte_terminal_scroll_region (VteTerminal *terminal,
 			     long row, glong count, glong delta)
 {
+	long row_start, row_end;
+
 	if ((delta == 0) || (count == 0)) {
 		/* Shenanigans! */
 		return;
 	}
 
-	if (count >= terminal->pvt->row_count) {
-		/* We have to repaint the entire window. */
-		_vte_invalidate_all(terminal);
-	} else {
-		/* We have to repaint the area which is to be
-		 * scrolled. */
-		_vte_invalidate_cells(terminal,
-				     0, terminal->pvt->column_count,
-				     row, count);
+	if (G_UNLIKELY (!gtk_widget_get_realized(&terminal->widget)))
+		return;
+
+	if (terminal->pvt->invalidated_all) {
+		return;
+	}
+
+	/* Clamp the region to the visible rows. */
+	row_start = MAX (row - terminal->pvt->screen->scroll_delta, 0);
+	row_end = MIN (row - terminal->pvt->screen->scroll_delta + count,
+		       terminal->pvt->row_count);
+	if (row_end <= row_start) {
+		return;
+	}
+
+	/* The window still shows the contents for the old scroll offset
+	 * while a change of it is pending, so we can't move its pixels
+	 * relative to the new offset. Also, there's nothing to copy if
+	 * everything is scrolled out. */
+	if (terminal->pvt->adjustment_value_changed_pending ||
+	    ABS (delta) >= row_end - row_start) {
+		if (count >= terminal->pvt->row_count) {
+			/* We have to repaint the entire window. */
+			_vte_invalidate_all(terminal);
+		} else {
+			/* We have to repaint the area which is to be
+			 * scrolled. */
+			_vte_invalidate_cells(terminal,
+					     0, terminal->pvt->column_count,
+					     row, count);
+		}
+		return;
 	}
+
+	vte_terminal_queue_scroll (terminal, row_start, row_end, delta);
 }
 
 /* Find the row in the given position in the backscroll buffer. */
@@ -860,8 +1095,9 @@ static void
 vte_terminal_emit_contents_changed(VteTerminal *terminal)
 {
 	if (terminal->pvt->contents_changed_pending) {
-		/* Update dingus match set. */
-		vte_terminal_match_contents_clear(terminal);
+		/* Update dingus match set, the matches of changed
+		 * paragraphs are found again as the pointer needs them. */
+		vte_terminal_match_hilite_clear(terminal);
 		if (terminal->pvt->mouse_cursor_visible) {
 			vte_terminal_match_hilite_update(terminal,
 					terminal->pvt->mouse_last_x,
@@ -1090,40 +1326,301 @@ vte_terminal_set_default_tabstops(VteTerminal *terminal)
 	}
 }
 
+/* Free the matches of the paragraphs we keep. */
+static void
+vte_terminal_match_paragraphs_free(VteTerminal *terminal)
+{
+	VteTerminalPrivate *pvt = terminal->pvt;
+	struct vte_match_paragraph *paragraph;
+	guint i;
+
+	if (pvt->match_paragraphs == NULL)
+		return;
+
+	for (i = 0; i < VTE_MATCH_PARAGRAPHS; i++) {
+		paragraph = &pvt->match_paragraphs[i];
+		g_free (paragraph->text);
+		if (paragraph->attrs != NULL)
+			g_array_free (paragraph->attrs, TRUE);
+		if (paragraph->matches != NULL)
+			g_array_free (paragraph->matches, TRUE);
+	}
+	g_free (pvt->match_paragraphs);
+	pvt->match_paragraphs = NULL;
+}
+
 /* Clear the cache of the screen contents we keep. */
 static void
 vte_terminal_match_contents_clear(VteTerminal *terminal)
 {
 	g_assert(VTE_IS_TERMINAL(terminal));
-	if (terminal->pvt->match_contents != NULL) {
-		g_free(terminal->pvt->match_contents);
-		terminal->pvt->match_contents = NULL;
-	}
-	if (terminal->pvt->match_attributes != NULL) {
-		g_array_free(terminal->pvt->match_attributes, TRUE);
-		terminal->pvt->match_attributes = NULL;
-	}
+	vte_terminal_match_paragraphs_free(terminal);
 	vte_terminal_match_hilite_clear(terminal);
 }
 
-/* Refresh the cache of the screen contents we keep. */
 static gboolean
 always_selected(VteTerminal *terminal, glong column, glong row, gpointer data)
 {
 	return TRUE;
 }
 
+/* Free the alternations of the match regexes. */
 static void
-vte_terminal_match_contents_refresh(VteTerminal *terminal)
+vte_terminal_match_combined_free(VteTerminal *terminal)
 {
-	GArray *array;
-	vte_terminal_match_contents_clear(terminal);
-	array = g_array_new(FALSE, TRUE, sizeof(struct _VteCharAttributes));
-	terminal->pvt->match_contents = vte_terminal_get_text(terminal,
-							      always_selected,
-							      NULL,
-							      array);
-	terminal->pvt->match_attributes = array;
+	VteTerminalPrivate *pvt = terminal->pvt;
+	struct vte_match_combined *combined;
+	guint i;
+
+	if (pvt->match_combined == NULL)
+		return;
+
+	for (i = 0; i < pvt->match_combined->len; i++) {
+		combined = &g_array_index(pvt->match_combined,
+					  struct vte_match_combined,
+					  i);
+		if (combined->regex != NULL)
+			g_regex_unref (combined->regex);
+	}
+	g_array_free (pvt->match_combined, TRUE);
+	pvt->match_combined = NULL;
+}
+
+/* Whether a regex means the same within an alternation of others: it mustn't
+ * refer to groups by number, recurse, leave a quote open, have matching flags
+ * of its own, or have verbs like (*SKIP) or (*UCP) affecting the others. */
+static gboolean
+vte_regex_is_combinable(GRegex *regex)
+{
+	const char *pattern = g_regex_get_pattern (regex);
+	const char *p;
+
+	if (g_regex_get_match_flags (regex) != 0 ||
+	    g_regex_get_max_backref (regex) > 0 ||
+	    strstr (pattern, "\\g") != NULL ||
+	    strstr (pattern, "\\Q") != NULL ||
+	    strstr (pattern, "(?P>") != NULL ||
+	    strstr (pattern, "(*") != NULL) {
+		return FALSE;
+	}
+	for (p = strstr (pattern, "(?"); p != NULL; p = strstr (p + 2, "(?")) {
+		if (strchr ("R&(+-0123456789", p[2]) != NULL)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* Combine the match regexes with the same flags into alternations, so that
+ * paragraphs without any match take one scan per set of flags instead of one
+ * per regex. */
+static void
+vte_terminal_match_combine(VteTerminal *terminal)
+{
+	VteTerminalPrivate *pvt = terminal->pvt;
+	struct vte_match_combined *combined, new_combined;
+	struct vte_match_regex *regex;
+	GRegexCompileFlags compile_flags;
+	GError *error = NULL;
+	gboolean combinable;
+	guint i, j;
+
+	pvt->match_combined = g_array_new (FALSE, FALSE, sizeof (struct vte_match_combined));
+	for (i = 0; i < pvt->match_regexes->len; i++) {
+		regex = &g_array_index(pvt->match_regexes,
+				       struct vte_match_regex,
+				       i);
+		/* Skip holes. */
+		if (regex->tag < 0) {
+			continue;
+		}
+
+		compile_flags = g_regex_get_compile_flags (regex->regex);
+		combinable = vte_regex_is_combinable (regex->regex);
+		for (j = 0; combinable && j < pvt->match_combined->len; j++) {
+			combined = &g_array_index(pvt->match_combined,
+						  struct vte_match_combined,
+						  j);
+			if (combined->pattern != NULL &&
+			    combined->compile_flags == compile_flags &&
+			    combined->match_flags == regex->match_flags) {
+				break;
+			}
+		}
+		if (!combinable || j == pvt->match_combined->len) {
+			new_combined.regex = NULL;
+			new_combined.compile_flags = compile_flags;
+			new_combined.match_flags = regex->match_flags;
+			new_combined.pattern = combinable ? g_string_new (NULL) : NULL;
+			new_combined.n_regexes = 0;
+			new_combined.matched = FALSE;
+			j = pvt->match_combined->len;
+			g_array_append_val (pvt->match_combined, new_combined);
+		}
+
+		combined = &g_array_index(pvt->match_combined,
+					  struct vte_match_combined,
+					  j);
+		if (combined->pattern != NULL) {
+			if (combined->pattern->len > 0)
+				g_string_append_c (combined->pattern, '|');
+			g_string_append (combined->pattern, "(?:");
+			g_string_append (combined->pattern, g_regex_get_pattern (regex->regex));
+			/* End any comment. */
+			if (compile_flags & G_REGEX_EXTENDED)
+				g_string_append_c (combined->pattern, '\n');
+			g_string_append_c (combined->pattern, ')');
+		}
+		combined->n_regexes++;
+		regex->combined = j;
+	}
+
+	for (i = 0; i < pvt->match_combined->len; i++) {
+		combined = &g_array_index(pvt->match_combined,
+					  struct vte_match_combined,
+					  i);
+		if (combined->pattern == NULL) {
+			continue;
+		}
+		/* A lone regex is as quick run directly. */
+		if (combined->n_regexes > 1) {
+			combined->regex = g_regex_new (combined->pattern->str,
+						       (GRegexCompileFlags)(combined->compile_flags | G_REGEX_OPTIMIZE),
+						       (GRegexMatchFlags) 0,
+						       &error);
+			if (combined->regex == NULL) {
+				_vte_debug_print(VTE_DEBUG_EVENTS,
+						"Not combining %u match regexes: %s\n",
+						combined->n_regexes, error->message);
+				g_clear_error (&error);
+			}
+		}
+		g_string_free (combined->pattern, TRUE);
+		combined->pattern = NULL;
+	}
+}
+
+/* Get the visible paragraph around a row with the matches of all the match
+ * regexes in it, from the cache unless its rows have changed since.  Frozen
+ * rows are keyed by their position, so that thawing them again for drawing
+ * doesn't make them look changed.  Returns NULL if the row isn't visible. */
+static struct vte_match_paragraph *
+vte_terminal_match_paragraph(VteTerminal *terminal, glong row)
+{
+	VteTerminalPrivate *pvt = terminal->pvt;
+	struct vte_match_paragraph *paragraph;
+	struct vte_match_combined *combined;
+	struct vte_match_regex *regex;
+	struct vte_match_span span;
+	const VteRowData *row_data;
+	GMatchInfo *match_info;
+	glong top, bottom, start_row, end_row;
+	guint64 key;
+	guint i;
+
+	top = pvt->screen->scroll_delta;
+	bottom = top + pvt->row_count;
+	if (row < top || row >= bottom) {
+		return NULL;
+	}
+
+	/* Rows end lines unless they're soft wrapped, like in
+	 * vte_terminal_get_text_range(). */
+	start_row = end_row = row;
+	if (!pvt->selection_block_mode) {
+		while (start_row > top &&
+		       (row_data = _vte_terminal_find_row_data (terminal, start_row - 1)) != NULL &&
+		       row_data->attr.soft_wrapped)
+			start_row--;
+		while (end_row + 1 < bottom &&
+		       (row_data = _vte_terminal_find_row_data (terminal, end_row)) != NULL &&
+		       row_data->attr.soft_wrapped)
+			end_row++;
+	}
+	end_row++;
+
+	if (pvt->match_paragraphs == NULL) {
+		pvt->match_paragraphs = g_new0 (struct vte_match_paragraph, VTE_MATCH_PARAGRAPHS);
+		for (i = 0; i < VTE_MATCH_PARAGRAPHS; i++)
+			pvt->match_paragraphs[i].start_row = -1;
+	}
+
+	/* The same key as the search highlights', the last row's text is
+	 * cut at the width too. */
+	key = vte_terminal_paragraph_key (terminal, start_row, end_row) * 1000003 + pvt->column_count;
+	paragraph = &pvt->match_paragraphs[start_row & (VTE_MATCH_PARAGRAPHS - 1)];
+	if (paragraph->start_row == start_row &&
+	    paragraph->end_row == end_row &&
+	    paragraph->key == key) {
+		return paragraph;
+	}
+
+	_vte_debug_print(VTE_DEBUG_EVENTS,
+			"Matching rows %ld to %ld.\n", start_row, end_row - 1);
+
+	if (paragraph->attrs == NULL) {
+		paragraph->attrs = g_array_new (FALSE, TRUE, sizeof (struct _VteCharAttributes));
+		paragraph->matches = g_array_new (FALSE, FALSE, sizeof (struct vte_match_span));
+	}
+	paragraph->start_row = start_row;
+	paragraph->end_row = end_row;
+	paragraph->key = key;
+	g_free (paragraph->text);
+	paragraph->text = vte_terminal_get_text_range_maybe_wrapped (terminal,
+								     start_row, 0,
+								     end_row - 1, pvt->column_count - 1,
+								     TRUE, pvt->selection_block_mode,
+								     always_selected, NULL,
+								     paragraph->attrs, FALSE);
+	g_array_set_size (paragraph->matches, 0);
+
+	/* Snip off the final newline. */
+	paragraph->len = strlen (paragraph->text);
+	if (paragraph->len > 0 && paragraph->text[paragraph->len - 1] == '\n')
+		paragraph->len--;
+
+	/* Only run the regexes whose alternation matches. */
+	if (pvt->match_combined == NULL) {
+		vte_terminal_match_combine(terminal);
+	}
+	for (i = 0; i < pvt->match_combined->len; i++) {
+		combined = &g_array_index(pvt->match_combined,
+					  struct vte_match_combined,
+					  i);
+		combined->matched = combined->regex == NULL ||
+			g_regex_match_full (combined->regex,
+					    paragraph->text, paragraph->len, 0,
+					    combined->match_flags,
+					    NULL,
+					    NULL);
+	}
+
+	for (i = 0; i < pvt->match_regexes->len; i++) {
+		regex = &g_array_index(pvt->match_regexes,
+				       struct vte_match_regex,
+				       i);
+		/* Skip holes, and regexes which can't match. */
+		if (regex->tag < 0 ||
+		    !g_array_index(pvt->match_combined,
+				   struct vte_match_combined,
+				   regex->combined).matched) {
+			continue;
+		}
+		g_regex_match_full (regex->regex,
+				    paragraph->text, paragraph->len, 0,
+				    regex->match_flags,
+				    &match_info,
+				    NULL);
+		while (g_match_info_matches (match_info)) {
+			if (g_match_info_fetch_pos (match_info, 0, &span.start, &span.end)) {
+				span.regex = i;
+				g_array_append_val (paragraph->matches, span);
+			}
+			g_match_info_next (match_info, NULL);
+		}
+		g_match_info_free (match_info);
+	}
+
+	return paragraph;
 }
 
 static void
@@ -1214,7 +1711,8 @@ vte_terminal_match_remove_all(VteTerminal *terminal)
 		}
 	}
 	g_array_set_size(terminal->pvt->match_regexes, 0);
-	vte_terminal_match_hilite_clear(terminal);
+	vte_terminal_match_combined_free(terminal);
+	vte_terminal_match_contents_clear(terminal);
 }
 
 /**
@@ -1243,7 +1741,8 @@ vte_terminal_match_remove(VteTerminal *terminal, int tag)
 		/* Remove this item and leave a hole in its place. */
                 regex_match_clear (regex);
 	}
-	vte_terminal_match_hilite_clear(terminal);
+	vte_terminal_match_combined_free(terminal);
+	vte_terminal_match_contents_clear(terminal);
 }
 
 static GdkCursor *
@@ -1307,6 +1806,9 @@ vte_terminal_match_add_gregex(VteTerminal *terminal, GRegex *regex, GRegexMatchF
 		/* Append. */
 		g_array_append_val(pvt->match_regexes, new_regex_match);
 	}
+	/* The cached matches don't have this regex's. */
+	vte_terminal_match_combined_free(terminal);
+	vte_terminal_match_contents_clear(terminal);
 
 	return new_regex_match.tag;
 }
@@ -1391,20 +1893,23 @@ vte_terminal_match_set_cursor_name(VteTerminal *terminal,
 
 /* Check if a given cell on the screen contains part of a matched string.  If
  * it does, return the string, and store the match tag in the optional tag
- * argument. */
+ * argument.  The match, or else the stretch around the cell without any, is
+ * stored in the optional start and end arguments. */
 static char *
 vte_terminal_match_check_internal_gregex(VteTerminal *terminal,
                                          long column, glong row,
-                                         int *tag, int *start, int *end)
+                                         int *tag,
+                                         VteVisualPosition *start,
+                                         VteVisualPosition *end)
 {
+	struct vte_match_paragraph *paragraph;
+	struct vte_match_regex *regex;
+	struct vte_match_span *span;
+	struct _VteCharAttributes *attr;
 	gint start_blank, end_blank;
-        guint i;
-	int offset;
-	struct vte_match_regex *regex = NULL;
-	struct _VteCharAttributes *attr = NULL;
-	gssize sattr, eattr;
-	gchar *line, eol;
-        GMatchInfo *match_info;
+	gssize offset;
+	gchar *result = NULL;
+	guint i;
 
 	_vte_debug_print(VTE_DEBUG_EVENTS,
 			"Checking for gregex match at (%ld,%ld).\n", row, column);
@@ -1412,23 +1917,27 @@ vte_terminal_match_check_internal_gregex(VteTerminal *terminal,
 		*tag = -1;
 	}
 	if (start != NULL) {
-		*start = 0;
+		start->row = -1;
+		start->col = -1;
 	}
 	if (end != NULL) {
-		*end = 0;
+		end->row = -2;
+		end->col = -2;
+	}
+
+	paragraph = vte_terminal_match_paragraph(terminal, row);
+	if (paragraph == NULL) {
+		return NULL;
 	}
+
 	/* Map the pointer position to a portion of the string. */
-	eattr = terminal->pvt->match_attributes->len;
-	for (offset = eattr; offset--; ) {
-		attr = &g_array_index(terminal->pvt->match_attributes,
+	for (offset = paragraph->len; offset--; ) {
+		attr = &g_array_index(paragraph->attrs,
 				      struct _VteCharAttributes,
 				      offset);
-		if (row < attr->row) {
-			eattr = offset;
-		}
 		if (row == attr->row &&
 		    column == attr->column &&
-		    terminal->pvt->match_contents[offset] != ' ') {
+		    paragraph->text[offset] != ' ') {
 			break;
 		}
 	}
@@ -1437,9 +1946,9 @@ vte_terminal_match_check_internal_gregex(VteTerminal *terminal,
 		if (offset < 0)
 			g_printerr("Cursor is not on a character.\n");
 		else
-			g_printerr("Cursor is on character '%c' at %d.\n",
-					g_utf8_get_char (terminal->pvt->match_contents + offset),
-					offset);
+			g_printerr("Cursor is on character '%c' at %ld.\n",
+					g_utf8_get_char (paragraph->text + offset),
+					(long) offset);
 	}
 
 	/* If the pointer isn't on a matchable character, bug out. */
@@ -1447,182 +1956,69 @@ vte_terminal_match_check_internal_gregex(VteTerminal *terminal,
 		return NULL;
 	}
 
-	/* If the pointer is on a newline, bug out. */
-	if ((g_ascii_isspace(terminal->pvt->match_contents[offset])) ||
-	    (terminal->pvt->match_contents[offset] == '\0')) {
+	/* If the pointer is on whitespace, bug out. */
+	if (g_ascii_isspace(paragraph->text[offset])) {
 		_vte_debug_print(VTE_DEBUG_EVENTS,
 				"Cursor is on whitespace.\n");
 		return NULL;
 	}
 
-	/* Snip off any final newlines. */
-	while (terminal->pvt->match_contents[eattr] == '\n' ||
-			terminal->pvt->match_contents[eattr] == '\0') {
-		eattr--;
-	}
-	/* and scan forwards to find the end of this line */
-	while (!(terminal->pvt->match_contents[eattr] == '\n' ||
-			terminal->pvt->match_contents[eattr] == '\0')) {
-		eattr++;
-	}
-
-	/* find the start of row */
-	if (row == 0) {
-		sattr = 0;
-	} else {
-		for (sattr = offset; sattr > 0; sattr--) {
-			attr = &g_array_index(terminal->pvt->match_attributes,
-					      struct _VteCharAttributes,
-					      sattr);
-			if (row > attr->row) {
-				break;
+	start_blank = 0;
+	end_blank = paragraph->len;
+
+	/* The first match in regex order that the pointer is in wins. */
+	for (i = 0; i < paragraph->matches->len; i++) {
+		span = &g_array_index(paragraph->matches,
+				      struct vte_match_span,
+				      i);
+		if (offset >= span->start && offset < span->end) {
+			regex = &g_array_index(terminal->pvt->match_regexes,
+					       struct vte_match_regex,
+					       span->regex);
+			if (tag != NULL) {
+				*tag = regex->tag;
 			}
+			start_blank = span->start;
+			end_blank = span->end;
+			vte_terminal_set_cursor_from_regex_match(terminal, regex);
+			result = g_strndup(paragraph->text + span->start,
+					   span->end - span->start);
+			break;
+		}
+		if (offset >= span->end && span->end > start_blank) {
+			start_blank = span->end;
+		}
+		if (offset < span->start && span->start < end_blank) {
+			end_blank = span->start;
 		}
 	}
-	/* Scan backwards to find the start of this line */
-	while (sattr > 0 &&
-		! (terminal->pvt->match_contents[sattr] == '\n' ||
-		    terminal->pvt->match_contents[sattr] == '\0')) {
-		sattr--;
-	}
-	/* and skip any initial newlines. */
-	while (terminal->pvt->match_contents[sattr] == '\n' ||
-		terminal->pvt->match_contents[sattr] == '\0') {
-		sattr++;
-	}
-	if (eattr <= sattr) { /* blank line */
-		return NULL;
+
+	if (start != NULL) {
+		attr = &g_array_index(paragraph->attrs,
+				      struct _VteCharAttributes,
+				      start_blank);
+		start->row = attr->row;
+		start->col = attr->column;
 	}
-	if (eattr <= offset || sattr > offset) {
-		/* nothing to match on this line */
-		return NULL;
+	if (end != NULL) {
+		attr = &g_array_index(paragraph->attrs,
+				      struct _VteCharAttributes,
+				      end_blank - 1);
+		end->row = attr->row;
+		end->col = attr->column;
 	}
-	offset -= sattr;
-	eattr -= sattr;
-
-	/* temporarily shorten the contents to this row */
-	line = terminal->pvt->match_contents + sattr;
-	eol = line[eattr];
-	line[eattr] = '\0';
+	return result;
+}
 
-	start_blank = 0;
-	end_blank = eattr;
-
-	/* Now iterate over each regex we need to match against. */
-	for (i = 0; i < terminal->pvt->match_regexes->len; i++) {
-		regex = &g_array_index(terminal->pvt->match_regexes,
-				       struct vte_match_regex,
-				       i);
-		/* Skip holes. */
-		if (regex->tag < 0) {
-			continue;
-		}
-		/* We'll only match the first item in the buffer which
-		 * matches, so we'll have to skip each match until we
-		 * stop getting matches. */
-                if (!g_regex_match_full(regex->regex,
-                                        line, -1, 0,
-                                        regex->match_flags,
-                                        &match_info,
-                                        NULL)) {
-                        g_match_info_free(match_info);
-                        continue;
-                }
-
-                while (g_match_info_matches(match_info)) {
-			gint ko = offset;
-			gint sblank=G_MININT, eblank=G_MAXINT;
-                        gint rm_so, rm_eo;
-
-                        if (g_match_info_fetch_pos (match_info, 0, &rm_so, &rm_eo)) {
-				/* The offsets should be "sane". */
-				g_assert(rm_so < eattr);
-				g_assert(rm_eo <= eattr);
-				_VTE_DEBUG_IF(VTE_DEBUG_MISC) {
-					gchar *match;
-					struct _VteCharAttributes *_sattr, *_eattr;
-					match = g_strndup(line + rm_so, rm_eo - rm_so);
-					_sattr = &g_array_index(terminal->pvt->match_attributes,
-							struct _VteCharAttributes,
-							rm_so);
-					_eattr = &g_array_index(terminal->pvt->match_attributes,
-							struct _VteCharAttributes,
-							rm_eo - 1);
-					g_printerr("Match `%s' from %d(%ld,%ld) to %d(%ld,%ld) (%d).\n",
-							match,
-							rm_so,
-							_sattr->column,
-							_sattr->row,
-							rm_eo - 1,
-							_eattr->column,
-							_eattr->row,
-							offset);
-					g_free(match);
-
-				}
-				/* If the pointer is in this substring,
-				 * then we're done. */
-				if (ko >= rm_so &&
-				    ko < rm_eo) {
-					gchar *result;
-					if (tag != NULL) {
-						*tag = regex->tag;
-					}
-					if (start != NULL) {
-						*start = sattr + rm_so;
-					}
-					if (end != NULL) {
-						*end = sattr + rm_eo - 1;
-					}
-                                        vte_terminal_set_cursor_from_regex_match(terminal, regex);
-                                        result = g_match_info_fetch(match_info, 0);
-					line[eattr] = eol;
-
-                                        g_match_info_free(match_info);
-					return result;
-				}
-				if (ko > rm_eo - 1 &&
-						rm_eo > sblank) {
-					sblank = rm_eo;
-				}
-				if (ko < rm_so &&
-						rm_so < eblank) {
-					eblank = rm_so;
-				}
-			}
-			if (sblank > start_blank) {
-				start_blank = sblank;
-			}
-			if (eblank < end_blank) {
-				end_blank = eblank;
-			}
-
-                        g_match_info_next(match_info, NULL);
-		}
-
-                g_match_info_free(match_info);
-	}
-	line[eattr] = eol;
-	if (start != NULL) {
-		*start = sattr + start_blank;
-	}
-	if (end != NULL) {
-		*end = sattr + end_blank - 1;
-	}
-	return NULL;
-}
-
-static char *
-vte_terminal_match_check_internal(VteTerminal *terminal,
-                                  long column, glong row,
-                                  int *tag, int *start, int *end)
-{
-	if (terminal->pvt->match_contents == NULL) {
-		vte_terminal_match_contents_refresh(terminal);
-	}
-
-        return vte_terminal_match_check_internal_gregex(terminal, column, row, tag, start, end);
-}
+static char *
+vte_terminal_match_check_internal(VteTerminal *terminal,
+                                  long column, glong row,
+                                  int *tag,
+                                  VteVisualPosition *start,
+                                  VteVisualPosition *end)
+{
+        return vte_terminal_match_check_internal_gregex(terminal, column, row, tag, start, end);
+}
 
 static gboolean
 rowcol_inside_match (VteTerminal *terminal, glong row, glong col)
@@ -4064,6 +4460,8 @@ next_match:
 	if (modified || (screen != terminal->pvt->screen)) {
 		/* Signal that the visible contents changed. */
 		_vte_terminal_queue_contents_changed(terminal);
+		/* The rows written to have been thawed again */
+		vte_terminal_queue_hibernate(terminal);
 	}
 
 	vte_terminal_emit_pending_signals (terminal);
@@ -5860,9 +6258,9 @@ vte_terminal_match_hilite_hide(VteTerminal *terminal)
 static void
 vte_terminal_match_hilite_update(VteTerminal *terminal, long x, long y)
 {
-	int start, end, width, height;
+	VteVisualPosition start, end;
+	int width, height;
 	char *match;
-	struct _VteCharAttributes *attr;
 	VteScreen *screen;
 	long delta;
 
@@ -5896,30 +6294,8 @@ vte_terminal_match_hilite_update(VteTerminal *terminal, long x, long y)
 	}
 
 	/* Read the new locations. */
-	attr = NULL;
-	if ((guint) start < terminal->pvt->match_attributes->len) {
-		attr = &g_array_index(terminal->pvt->match_attributes,
-				struct _VteCharAttributes,
-				start);
-		terminal->pvt->match_start.row = attr->row;
-		terminal->pvt->match_start.col = attr->column;
-
-		attr = NULL;
-		if ((guint) end < terminal->pvt->match_attributes->len) {
-			attr = &g_array_index(terminal->pvt->match_attributes,
-					struct _VteCharAttributes,
-					end);
-			terminal->pvt->match_end.row = attr->row;
-			terminal->pvt->match_end.col = attr->column;
-		}
-	}
-	if (attr == NULL) { /* i.e. if either endpoint is not found */
-		terminal->pvt->match_start.row = -1;
-		terminal->pvt->match_start.col = -1;
-		terminal->pvt->match_end.row = -2;
-		terminal->pvt->match_end.col = -2;
-		g_assert (match == NULL);
-	}
+	terminal->pvt->match_start = start;
+	terminal->pvt->match_end = end;
 
 	g_free (terminal->pvt->match);
 	terminal->pvt->match = match;
@@ -6127,6 +6503,7 @@ vte_terminal_get_text_range(VteTerminal *terminal,
 							 start_row, start_col,
 							 end_row, end_col,
 							 TRUE,
+							 terminal->pvt->selection_block_mode,
 							 is_selected,
 							 user_data,
 							 attributes,
@@ -6138,6 +6515,7 @@ vte_terminal_get_text_range_maybe_wrapped(VteTerminal *terminal,
 					  glong start_row, glong start_col,
 					  glong end_row, glong end_col,
 					  gboolean wrap,
+					  gboolean block,
 					  VteSelectionFunc is_selected,
 					  gpointer data,
 					  GArray *attributes,
@@ -6246,7 +6624,7 @@ vte_terminal_get_text_range_maybe_wrapped(VteTerminal *terminal,
 		attr.column = MAX(terminal->pvt->column_count, attr.column + 1);
 
 		/* Add a newline in block mode. */
-		if (terminal->pvt->selection_block_mode) {
+		if (block) {
 			string = g_string_append_c(string, '\n');
 		}
 		/* Else, if the last visible column on this line was selected and
@@ -6286,6 +6664,7 @@ vte_terminal_get_text_maybe_wrapped(VteTerminal *terminal,
 							 start_row, start_col,
 							 end_row, end_col,
 							 wrap,
+							 terminal->pvt->selection_block_mode,
 							 is_selected,
 							 data,
 							 attributes,
@@ -8240,6 +8619,75 @@ vte_terminal_screen_set_size(VteTerminal *terminal, VteScreen *screen, glong old
 		screen->scroll_delta = new_scroll_delta;
 }
 
+/* Rewrap the rest of the normal screen's history, a batch of rows at a time */
+static gboolean
+vte_terminal_rewrap_idle(gpointer data)
+{
+	VteTerminal *terminal = VTE_TERMINAL(data);
+	VteScreen *screen = &terminal->pvt->normal_screen;
+	VteVisualPosition top_of_viewport;
+	VteVisualPosition *markers[4];
+	gboolean more;
+
+	top_of_viewport.row = screen->scroll_delta;
+	top_of_viewport.col = 0;
+	memset(&markers, 0, sizeof(markers));
+	markers[0] = &top_of_viewport;
+	if (screen == terminal->pvt->screen && terminal->pvt->has_selection) {
+		/* selection_end is inclusive, make it non-inclusive, see bug 722635. */
+		terminal->pvt->selection_end.col++;
+		markers[1] = &terminal->pvt->selection_start;
+		markers[2] = &terminal->pvt->selection_end;
+	}
+
+	more = _vte_ring_rewrap_step(screen->row_data, VTE_REWRAP_BATCH_ROWS, markers);
+
+	if (markers[1] != NULL)
+		terminal->pvt->selection_end.col--;
+	if (more) {
+		/* While the worker threads are busy, check back a bit later
+		 * rather than spinning or waiting for them here. */
+		if (_vte_ring_rewrap_busy(screen->row_data))
+			terminal->pvt->rewrap_tag = g_timeout_add_full(VTE_REWRAP_PRIORITY,
+								       VTE_REWRAP_POLL_TIMEOUT,
+								       vte_terminal_rewrap_idle,
+								       terminal,
+								       NULL);
+		else
+			terminal->pvt->rewrap_tag = g_idle_add_full(VTE_REWRAP_PRIORITY,
+								    vte_terminal_rewrap_idle,
+								    terminal,
+								    NULL);
+		return FALSE;
+	}
+
+	/* The history got renumbered */
+	terminal->pvt->rewrap_tag = 0;
+	if (top_of_viewport.row != screen->scroll_delta) {
+		if (screen == terminal->pvt->screen)
+			vte_terminal_queue_adjustment_value_changed(terminal, top_of_viewport.row);
+		else
+			screen->scroll_delta = top_of_viewport.row;
+	}
+	_vte_terminal_adjust_adjustments(terminal);
+	_vte_invalidate_all(terminal);
+
+	return FALSE;
+}
+
+static void
+vte_terminal_queue_rewrap(VteTerminal *terminal)
+{
+	if (terminal->pvt->rewrap_tag != 0 ||
+	    !_vte_ring_rewrap_pending(terminal->pvt->normal_screen.row_data))
+		return;
+
+	terminal->pvt->rewrap_tag = g_idle_add_full(VTE_REWRAP_PRIORITY,
+						    vte_terminal_rewrap_idle,
+						    terminal,
+						    NULL);
+}
+
 /**
  * vte_terminal_set_size:
  * @terminal: a #VteTerminal
@@ -8260,6 +8708,9 @@ vte_terminal_set_size(VteTerminal *terminal, glong columns, glong rows)
 			"Setting PTY size to %ldx%ld.\n",
 			columns, rows);
 
+	/* An explicit size overrides a queued allocation. */
+	vte_terminal_remove_resize_timeout(terminal);
+
 	old_rows = terminal->pvt->row_count;
 	old_columns = terminal->pvt->column_count;
 
@@ -8286,6 +8737,7 @@ vte_terminal_set_size(VteTerminal *terminal, glong columns, glong rows)
 
 		/* Resize the normal screen and (if rewrapping is enabled) rewrap it even if the alternate screen is visible: bug 415277 */
 		vte_terminal_screen_set_size(terminal, &terminal->pvt->normal_screen, old_columns, old_rows, terminal->pvt->rewrap_on_resize);
+		vte_terminal_queue_rewrap(terminal);
 		/* Resize the alternate screen if it's the current one, but never rewrap it: bug 336238 comment 60 */
 		if (terminal->pvt->screen == &terminal->pvt->alternate_screen)
 			vte_terminal_screen_set_size(terminal, &terminal->pvt->alternate_screen, old_columns, old_rows, FALSE);
@@ -8306,6 +8758,78 @@ vte_terminal_set_size(VteTerminal *terminal, glong columns, glong rows)
 	}
 }
 
+static void
+vte_terminal_remove_resize_timeout(VteTerminal *terminal)
+{
+	if (terminal->pvt->resize_tag == 0)
+		return;
+
+	g_source_remove(terminal->pvt->resize_tag);
+	terminal->pvt->resize_tag = 0;
+}
+
+static void
+vte_terminal_apply_queued_size(VteTerminal *terminal)
+{
+	/* Only the latest size reaches the rings and the pty. */
+	vte_terminal_set_size(terminal,
+			      terminal->pvt->resize_columns,
+			      terminal->pvt->resize_rows);
+
+	/* Notify viewers that the contents have changed. */
+	_vte_terminal_queue_contents_changed(terminal);
+}
+
+static gboolean
+vte_terminal_resize_timeout(gpointer data)
+{
+	VteTerminal *terminal = VTE_TERMINAL(data);
+
+	terminal->pvt->resize_tag = 0;
+	vte_terminal_apply_queued_size(terminal);
+
+	return FALSE;
+}
+
+/* While the window is being dragged, allocations arrive for every
+ * intermediate size.  Rewrapping and signalling the child for each of them
+ * is wasted work, so only apply the last one after a short pause, or at
+ * least every VTE_RESIZE_MAX_DELAY ms if the drag goes on. */
+static void
+vte_terminal_queue_set_size(VteTerminal *terminal, glong columns, glong rows)
+{
+	VteTerminalPrivate *pvt = terminal->pvt;
+	gint64 now;
+
+	pvt->resize_columns = columns;
+	pvt->resize_rows = rows;
+
+	/* Nobody is watching, e.g. the initial allocation. */
+	if (!gtk_widget_get_mapped(&terminal->widget)) {
+		vte_terminal_apply_queued_size(terminal);
+		return;
+	}
+
+	now = g_get_monotonic_time();
+	if (pvt->resize_tag != 0) {
+		if (now - pvt->resize_since >= VTE_RESIZE_MAX_DELAY * 1000)
+			return;
+		g_source_remove(pvt->resize_tag);
+	} else {
+		pvt->resize_since = now;
+	}
+
+	_vte_debug_print(VTE_DEBUG_RESIZE,
+			"Queueing PTY size %ldx%ld.\n",
+			columns, rows);
+
+	pvt->resize_tag = g_timeout_add_full(GDK_PRIORITY_RESIZE,
+					     VTE_RESIZE_TIMEOUT,
+					     vte_terminal_resize_timeout,
+					     terminal,
+					     NULL);
+}
+
 /* Redraw the widget. */
 static void
 vte_terminal_handle_scroll(VteTerminal *terminal)
@@ -8675,11 +9199,11 @@ vte_terminal_size_allocate(GtkWidget *widget, GtkAllocation *allocation)
 			|| height != terminal->pvt->row_count
 			|| update_scrollback)
 	{
-		/* Set the size of the pseudo-terminal. */
-		vte_terminal_set_size(terminal, width, height);
-
-		/* Notify viewers that the contents have changed. */
-		_vte_terminal_queue_contents_changed(terminal);
+		/* Set the size of the pseudo-terminal, once things settle. */
+		vte_terminal_queue_set_size(terminal, width, height);
+	} else {
+		/* Dragged back to the size we already have. */
+		vte_terminal_remove_resize_timeout(terminal);
 	}
 
 	/* Resize the GDK window. */
@@ -8697,6 +9221,27 @@ vte_terminal_size_allocate(GtkWidget *widget, GtkAllocation *allocation)
 	}
 }
 
+static void
+vte_terminal_map(GtkWidget *widget)
+{
+	_vte_debug_print(VTE_DEBUG_LIFECYCLE, "vte_terminal_map()\n");
+
+	/* Anything hibernated is thawed as it's drawn */
+	vte_terminal_remove_hibernate_timeout (VTE_TERMINAL (widget));
+
+	GTK_WIDGET_CLASS (vte_terminal_parent_class)->map (widget);
+}
+
+static void
+vte_terminal_unmap(GtkWidget *widget)
+{
+	_vte_debug_print(VTE_DEBUG_LIFECYCLE, "vte_terminal_unmap()\n");
+
+	GTK_WIDGET_CLASS (vte_terminal_parent_class)->unmap (widget);
+
+	vte_terminal_queue_hibernate (VTE_TERMINAL (widget));
+}
+
 /* The window is being destroyed. */
 static void
 vte_terminal_unrealize(GtkWidget *widget)
@@ -8873,11 +9418,11 @@ vte_terminal_finalize(GObject *object)
 		pango_font_description_free(terminal->pvt->fontdesc);
 	}
 
+	g_free(terminal->pvt->damage);
+
 	/* Free matching data. */
-	if (terminal->pvt->match_attributes != NULL) {
-		g_array_free(terminal->pvt->match_attributes, TRUE);
-	}
-	g_free(terminal->pvt->match_contents);
+	vte_terminal_match_paragraphs_free(terminal);
+	vte_terminal_match_combined_free(terminal);
 	if (terminal->pvt->match_regexes != NULL) {
 		for (i = 0; i < terminal->pvt->match_regexes->len; i++) {
 			regex = &g_array_index(terminal->pvt->match_regexes,
@@ -8894,8 +9439,10 @@ vte_terminal_finalize(GObject *object)
 
 	if (terminal->pvt->search_regex)
 		g_regex_unref (terminal->pvt->search_regex);
+	_vte_ring_literal_free (terminal->pvt->search_literal);
 	if (terminal->pvt->search_attrs)
 		g_array_free (terminal->pvt->search_attrs, TRUE);
+	vte_terminal_search_clear_highlights (terminal);
 
 	/* Disconnect from autoscroll requests. */
 	vte_terminal_stop_autoscroll(terminal);
@@ -8986,6 +9533,10 @@ vte_terminal_finalize(GObject *object)
 	}
 
 	remove_update_timeout (terminal);
+	vte_terminal_remove_hibernate_timeout (terminal);
+	vte_terminal_remove_resize_timeout (terminal);
+	if (terminal->pvt->rewrap_tag != 0)
+		g_source_remove (terminal->pvt->rewrap_tag);
 
 	/* discard title updates */
         g_free(terminal->pvt->window_title);
@@ -9611,6 +10162,248 @@ vte_terminal_draw_cells_with_attributes(VteTerminal *terminal,
 }
 
 
+/*
+ * Highlighting all the matches of the search regex
+ *
+ * The matches are kept per row, in a small cache indexed by the row number
+ * like the ring's thawed rows. An entry is valid as long as the key of its
+ * paragraph's rows stays the same, so only the paragraphs that changed
+ * or that weren't visible before are matched again.
+ */
+
+/* Forget all the highlighted matches */
+static void
+vte_terminal_search_clear_highlights (VteTerminal *terminal)
+{
+        VteTerminalPrivate *pvt = terminal->pvt;
+	guint i;
+
+	if (pvt->search_highlights == NULL)
+		return;
+
+	for (i = 0; i < VTE_SEARCH_HIGHLIGHT_ROWS; i++) {
+		if (pvt->search_highlights[i].spans != NULL)
+			g_array_free (pvt->search_highlights[i].spans, TRUE);
+	}
+	g_free (pvt->search_highlights);
+	pvt->search_highlights = NULL;
+}
+
+/* What the matches in the rows [start_row, end_row) of a paragraph depend on.
+ * Frozen rows only change along with the ring's generation, their copies in
+ * the ring's cache don't keep theirs when thawed again. */
+static guint64
+vte_terminal_paragraph_key (VteTerminal *terminal,
+			    long start_row,
+			    long end_row)
+{
+	VteRing *ring = terminal->pvt->screen->row_data;
+	const VteRowData *row_data;
+	guint64 key = start_row;
+	long row;
+
+	for (row = start_row; row < end_row; row++) {
+		if (row < _vte_ring_writable (ring)) {
+			key = key * 1000003 + (_vte_ring_contains (ring, row) ? ring->generation : 0);
+			continue;
+		}
+		row_data = _vte_terminal_find_row_data (terminal, row);
+		key = key * 1000003 + (row_data ? row_data->generation : 0);
+	}
+	return key;
+}
+
+/* The text of the paragraph in the rows [start_row, end_row) as the ring has
+ * it for searching, with newlines only where lines end, even in block mode:
+ * the offsets of _vte_ring_search() matches index its attributes. */
+static char *
+vte_terminal_get_search_text (VteTerminal *terminal,
+			      long start_row,
+			      long end_row,
+			      GArray *attrs)
+{
+	return vte_terminal_get_text_range_maybe_wrapped (terminal,
+							  start_row, 0, end_row - 1, G_MAXLONG,
+							  TRUE, FALSE, NULL, NULL,
+							  attrs, FALSE);
+}
+
+typedef struct _VteSearchHighlightParagraph {
+	VteTerminal *terminal;
+	GArray *attrs;
+	long from_row, to_row;
+} VteSearchHighlightParagraph;
+
+/* Store a match of the paragraph in the cache */
+static gboolean
+vte_terminal_search_highlight_match (int start,
+				     int end,
+				     gpointer data)
+{
+	VteSearchHighlightParagraph *paragraph = (VteSearchHighlightParagraph *) data;
+        VteTerminalPrivate *pvt = paragraph->terminal->pvt;
+	struct vte_search_highlight *highlight;
+	struct vte_search_span span, *last;
+	const VteCharAttributes *ca;
+	const VteRowData *row_data;
+	const VteCell *cell;
+	long row, start_col, end_col, first_row, last_row;
+
+	ca = &g_array_index (paragraph->attrs, VteCharAttributes, start);
+	first_row = ca->row;
+	start_col = ca->column;
+	ca = &g_array_index (paragraph->attrs, VteCharAttributes, end - 1);
+	last_row = ca->row;
+	end_col = ca->column + 1;
+	row_data = _vte_terminal_find_row_data (paragraph->terminal, last_row);
+	if (row_data && (cell = _vte_row_data_get (row_data, ca->column)) != NULL)
+		end_col = ca->column + MAX (cell->attr.columns, 1);
+
+	for (row = MAX (first_row, paragraph->from_row); row <= MIN (last_row, paragraph->to_row - 1); row++) {
+		highlight = &pvt->search_highlights[row & (VTE_SEARCH_HIGHLIGHT_ROWS - 1)];
+		span.start = row == first_row ? start_col : 0;
+		span.end = row == last_row ? end_col : G_MAXLONG;
+		if (highlight->spans->len > 0 &&
+		    (last = &g_array_index (highlight->spans, struct vte_search_span, highlight->spans->len - 1))->end >= span.start)
+			last->end = MAX (last->end, span.end);
+		else
+			g_array_append_val (highlight->spans, span);
+	}
+	return FALSE;
+}
+
+/* Match the paragraph of the rows [start_row, end_row), and store the
+ * matches of the rows [from_row, to_row) in the cache */
+static void
+vte_terminal_search_highlight_paragraph (VteTerminal *terminal,
+					 long start_row,
+					 long end_row,
+					 long from_row,
+					 long to_row,
+					 guint64 key)
+{
+        VteTerminalPrivate *pvt = terminal->pvt;
+	struct vte_search_highlight *highlight;
+	VteSearchHighlightParagraph paragraph;
+	char *text;
+	long row;
+
+	for (row = from_row; row < to_row; row++) {
+		highlight = &pvt->search_highlights[row & (VTE_SEARCH_HIGHLIGHT_ROWS - 1)];
+		highlight->row = row;
+		highlight->key = key;
+		if (highlight->spans == NULL)
+			highlight->spans = g_array_new (FALSE, FALSE, sizeof (struct vte_search_span));
+		g_array_set_size (highlight->spans, 0);
+	}
+
+	if (!pvt->search_attrs)
+		pvt->search_attrs = g_array_new (FALSE, TRUE, sizeof (VteCharAttributes));
+	text = vte_terminal_get_search_text (terminal, start_row, end_row, pvt->search_attrs);
+
+	paragraph.terminal = terminal;
+	paragraph.attrs = pvt->search_attrs;
+	paragraph.from_row = from_row;
+	paragraph.to_row = to_row;
+	_vte_ring_match_text (pvt->search_regex,
+			      (GRegexMatchFlags)(pvt->search_match_flags | G_REGEX_MATCH_NOTEMPTY),
+			      pvt->search_literal, text, strlen (text),
+			      vte_terminal_search_highlight_match, &paragraph);
+	g_free (text);
+}
+
+/* Make sure the cache has the matches of the rows [start_row, end_row) */
+static void
+vte_terminal_search_highlight_rows (VteTerminal *terminal,
+				    long start_row,
+				    long end_row)
+{
+        VteTerminalPrivate *pvt = terminal->pvt;
+	VteRing *ring = pvt->screen->row_data;
+	struct vte_search_highlight *highlight;
+	const VteRowData *row_data;
+	long row, para_start, para_end, to_row, i;
+	guint64 key;
+
+	if (pvt->search_highlights == NULL) {
+		pvt->search_highlights = g_new0 (struct vte_search_highlight, VTE_SEARCH_HIGHLIGHT_ROWS);
+		for (i = 0; i < VTE_SEARCH_HIGHLIGHT_ROWS; i++)
+			pvt->search_highlights[i].row = -1;
+	}
+
+	start_row = MAX (start_row, _vte_ring_delta (ring));
+	end_row = MIN (end_row, _vte_ring_next (ring));
+
+	for (row = start_row; row < end_row; row = to_row) {
+		/* The paragraph, but don't go too far for the longest ones */
+		para_start = row;
+		while (para_start > _vte_ring_delta (ring) &&
+		       row - para_start < VTE_SEARCH_HIGHLIGHT_CONTEXT &&
+		       (row_data = _vte_terminal_find_row_data (terminal, para_start - 1)) != NULL &&
+		       row_data->attr.soft_wrapped)
+			para_start--;
+		para_end = row;
+		while (para_end + 1 < _vte_ring_next (ring) &&
+		       para_end - row < VTE_SEARCH_HIGHLIGHT_CONTEXT + (end_row - start_row) &&
+		       (row_data = _vte_terminal_find_row_data (terminal, para_end)) != NULL &&
+		       row_data->attr.soft_wrapped)
+			para_end++;
+		para_end++;
+		to_row = MIN (para_end, end_row);
+
+		key = vte_terminal_paragraph_key (terminal, para_start, para_end);
+		for (i = row; i < to_row; i++) {
+			highlight = &pvt->search_highlights[i & (VTE_SEARCH_HIGHLIGHT_ROWS - 1)];
+			if (highlight->row != i || highlight->key != key)
+				break;
+		}
+		if (i < to_row)
+			vte_terminal_search_highlight_paragraph (terminal, para_start, para_end, row, to_row, key);
+	}
+}
+
+/* Paint the highlighted matches over the background of the given rows */
+static void
+vte_terminal_draw_search_highlights (VteTerminal *terminal,
+				     gint start_row, gint row_count,
+				     gint start_column, gint end_column,
+				     gint x, gint y,
+				     gint column_width, gint row_height)
+{
+        VteTerminalPrivate *pvt = terminal->pvt;
+	struct vte_search_highlight *highlight;
+	struct vte_search_span *span;
+	const PangoColor *color;
+	long row, start, end;
+	guint i;
+
+	if (!pvt->search_highlight_all || pvt->search_regex == NULL)
+		return;
+
+	vte_terminal_search_highlight_rows (terminal, start_row, start_row + row_count);
+
+	color = _vte_terminal_get_color (terminal, VTE_HIGHLIGHT_BG);
+	if (color == NULL)
+		color = _vte_terminal_get_color (terminal, VTE_DEFAULT_FG);
+
+	for (row = start_row; row < start_row + row_count; row++, y += row_height) {
+		highlight = &pvt->search_highlights[row & (VTE_SEARCH_HIGHLIGHT_ROWS - 1)];
+		if (highlight->row != row)
+			continue;
+		for (i = 0; i < highlight->spans->len; i++) {
+			span = &g_array_index (highlight->spans, struct vte_search_span, i);
+			start = MAX (span->start, start_column);
+			end = MIN (span->end, end_column);
+			if (start >= end)
+				continue;
+			_vte_draw_fill_rectangle (pvt->draw,
+						  x + start * column_width, y,
+						  (end - start) * column_width, row_height,
+						  color, VTE_SEARCH_HIGHLIGHT_ALPHA);
+		}
+	}
+}
+
 /* Paint the contents of a given row at the given location.  Take advantage
  * of multiple-draw APIs by finding runs of characters with identical
  * attributes and bundling them together. */
@@ -9730,6 +10523,12 @@ vte_terminal_draw_rows(VteTerminal *terminal,
 		y += row_height;
 	} while (--rows);
 
+	vte_terminal_draw_search_highlights (terminal, start_row, row_count,
+					     start_column, end_column,
+					     start_x + terminal->pvt->padding.left,
+					     start_y + terminal->pvt->padding.top,
+					     column_width, row_height);
+
 
 	/* render the text */
 	y = start_y;
@@ -10517,6 +11316,9 @@ vte_terminal_get_property (GObject *object,
                 case PROP_FONT_SCALE:
                         g_value_set_double (value, vte_terminal_get_font_scale (terminal));
                         break;
+                case PROP_HIBERNATE_ON_UNMAP:
+                        g_value_set_boolean (value, vte_terminal_get_hibernate_on_unmap (terminal));
+                        break;
                 case PROP_ICON_TITLE:
                         g_value_set_string (value, vte_terminal_get_icon_title (terminal));
                         break;
@@ -10532,6 +11334,15 @@ vte_terminal_get_property (GObject *object,
                 case PROP_REWRAP_ON_RESIZE:
                         g_value_set_boolean (value, vte_terminal_get_rewrap_on_resize (terminal));
                         break;
+                case PROP_SCROLLBACK_BYTES:
+                        g_value_set_uint64 (value, vte_terminal_get_scrollback_bytes (terminal));
+                        break;
+                case PROP_SCROLLBACK_IN_MEMORY:
+                        g_value_set_boolean (value, vte_terminal_get_scrollback_in_memory (terminal));
+                        break;
+                case PROP_SCROLLBACK_INDEXED:
+                        g_value_set_boolean (value, vte_terminal_get_scrollback_indexed (terminal));
+                        break;
                 case PROP_SCROLLBACK_LINES:
                         g_value_set_uint (value, pvt->scrollback_lines);
                         break;
@@ -10609,6 +11420,9 @@ vte_terminal_set_property (GObject *object,
                 case PROP_FONT_SCALE:
                         vte_terminal_set_font_scale (terminal, g_value_get_double (value));
                         break;
+                case PROP_HIBERNATE_ON_UNMAP:
+                        vte_terminal_set_hibernate_on_unmap (terminal, g_value_get_boolean (value));
+                        break;
                 case PROP_INPUT_ENABLED:
                         vte_terminal_set_input_enabled (terminal, g_value_get_boolean (value));
                         break;
@@ -10621,6 +11435,15 @@ vte_terminal_set_property (GObject *object,
                 case PROP_REWRAP_ON_RESIZE:
                         vte_terminal_set_rewrap_on_resize (terminal, g_value_get_boolean (value));
                         break;
+                case PROP_SCROLLBACK_BYTES:
+                        vte_terminal_set_scrollback_bytes (terminal, g_value_get_uint64 (value));
+                        break;
+                case PROP_SCROLLBACK_IN_MEMORY:
+                        vte_terminal_set_scrollback_in_memory (terminal, g_value_get_boolean (value));
+                        break;
+                case PROP_SCROLLBACK_INDEXED:
+                        vte_terminal_set_scrollback_indexed (terminal, g_value_get_boolean (value));
+                        break;
                 case PROP_SCROLLBACK_LINES:
                         vte_terminal_set_scrollback_lines (terminal, g_value_get_uint (value));
                         break;
@@ -10695,6 +11518,8 @@ vte_terminal_class_init(VteTerminalClass *klass)
         gobject_class->get_property = vte_terminal_get_property;
         gobject_class->set_property = vte_terminal_set_property;
 	widget_class->realize = vte_terminal_realize;
+	widget_class->map = vte_terminal_map;
+	widget_class->unmap = vte_terminal_unmap;
 	widget_class->scroll_event = vte_terminal_scroll;
         widget_class->draw = vte_terminal_draw;
 	widget_class->key_press_event = vte_terminal_key_press;
@@ -11223,6 +12048,28 @@ vte_terminal_class_init(VteTerminalClass *klass)
                              g_cclosure_marshal_VOID__VOID,
 			     G_TYPE_NONE, 0);
 
+        /**
+         * VteTerminal::search-progress:
+         * @vteterminal: the object which received the signal
+         * @n_rows_searched: the number of rows searched so far
+         * @n_rows: the number of rows in the buffer
+         * @n_matches: the number of matches found so far
+         *
+         * Emitted from time to time while vte_terminal_search_find_async()
+         * is running, and once more after it has completed successfully.
+         *
+         * Since: 0.44
+         */
+	signals[SEARCH_PROGRESS] =
+                g_signal_new(I_("search-progress"),
+			     G_OBJECT_CLASS_TYPE(klass),
+			     G_SIGNAL_RUN_LAST,
+			     G_STRUCT_OFFSET(VteTerminalClass, search_progress),
+			     NULL,
+			     NULL,
+			     _vte_marshal_VOID__LONG_LONG_LONG,
+			     G_TYPE_NONE, 3, G_TYPE_LONG, G_TYPE_LONG, G_TYPE_LONG);
+
         /**
          * VteTerminal::bell:
          * @vteterminal: the object which received the signal
@@ -11448,6 +12295,67 @@ vte_terminal_class_init(VteTerminalClass *klass)
                                        TRUE,
                                        (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_EXPLICIT_NOTIFY)));
 
+        /**
+         * VteTerminal:hibernate-on-unmap:
+         *
+         * Controls whether the terminal releases as much memory as possible
+         * after it has been unmapped for a while, see vte_terminal_hibernate().
+         *
+         * Since: 0.44
+         */
+        g_object_class_install_property
+                (gobject_class,
+                 PROP_HIBERNATE_ON_UNMAP,
+                 g_param_spec_boolean ("hibernate-on-unmap", NULL, NULL,
+                                       FALSE,
+                                       (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_EXPLICIT_NOTIFY)));
+
+        /**
+         * VteTerminal:scrollback-bytes:
+         *
+         * The maximum number of bytes of memory and disk space the scrollback
+         * buffer may take, in addition to the limit set by
+         * #VteTerminal:scrollback-lines, or 0 for no such limit.
+         *
+         * Since: 0.44
+         */
+        g_object_class_install_property
+                (gobject_class,
+                 PROP_SCROLLBACK_BYTES,
+                 g_param_spec_uint64 ("scrollback-bytes", NULL, NULL,
+                                      0, G_MAXUINT64, 0,
+                                      (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_EXPLICIT_NOTIFY)));
+
+        /**
+         * VteTerminal:scrollback-in-memory:
+         *
+         * Controls whether the scrollback buffer is kept in memory instead of
+         * compressed and encrypted temporary files.
+         *
+         * Since: 0.44
+         */
+        g_object_class_install_property
+                (gobject_class,
+                 PROP_SCROLLBACK_IN_MEMORY,
+                 g_param_spec_boolean ("scrollback-in-memory", NULL, NULL,
+                                       FALSE,
+                                       (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_EXPLICIT_NOTIFY)));
+
+        /**
+         * VteTerminal:scrollback-indexed:
+         *
+         * Controls whether the text of the scrollback buffer is indexed, to
+         * speed up searching it.
+         *
+         * Since: 0.44
+         */
+        g_object_class_install_property
+                (gobject_class,
+                 PROP_SCROLLBACK_INDEXED,
+                 g_param_spec_boolean ("scrollback-indexed", NULL, NULL,
+                                       FALSE,
+                                       (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_EXPLICIT_NOTIFY)));
+
         /**
          * VteTerminal:scrollback-lines:
          *
@@ -12139,21 +13047,333 @@ vte_terminal_set_scrollback_lines(VteTerminal *terminal, glong lines)
 }
 
 /**
- * vte_terminal_set_backspace_binding:
+ * vte_terminal_set_scrollback_in_memory:
  * @terminal: a #VteTerminal
- * @binding: a #VteEraseBinding for the backspace key
+ * @in_memory: whether to keep the scrollback buffer in memory
  *
- * Modifies the terminal's backspace key binding, which controls what
- * string or control sequence the terminal sends to its child when the user
- * presses the backspace key.
+ * Controls whether the scrollback buffer is kept in memory, or in
+ * temporary files which are compressed and, if supported, encrypted.
+ * Keeping it in memory is faster, but only suitable if the scrollback
+ * buffer is of a limited size. The current contents are kept.
+ *
+ * Since: 0.44
  */
 void
-vte_terminal_set_backspace_binding(VteTerminal *terminal,
-				   VteEraseBinding binding)
+vte_terminal_set_scrollback_in_memory(VteTerminal *terminal, gboolean in_memory)
 {
         VteTerminalPrivate *pvt;
 
-	g_return_if_fail(VTE_IS_TERMINAL(terminal));
+        g_return_if_fail(VTE_IS_TERMINAL(terminal));
+
+        pvt = terminal->pvt;
+        in_memory = in_memory != FALSE;
+
+        if (in_memory == pvt->scrollback_in_memory)
+                return;
+
+        pvt->scrollback_in_memory = in_memory;
+        _vte_ring_set_streams_in_memory (pvt->normal_screen.row_data, in_memory);
+
+        g_object_notify (G_OBJECT (terminal), "scrollback-in-memory");
+}
+
+/**
+ * vte_terminal_get_scrollback_in_memory:
+ * @terminal: a #VteTerminal
+ *
+ * Returns: %TRUE if the scrollback buffer is kept in memory
+ *
+ * Since: 0.44
+ */
+gboolean
+vte_terminal_get_scrollback_in_memory(VteTerminal *terminal)
+{
+	g_return_val_if_fail(VTE_IS_TERMINAL(terminal), FALSE);
+	return terminal->pvt->scrollback_in_memory;
+}
+
+/**
+ * vte_terminal_set_scrollback_indexed:
+ * @terminal: a #VteTerminal
+ * @indexed: whether to index the text of the scrollback buffer
+ *
+ * Controls whether an index of the text of the scrollback buffer is kept,
+ * so searching it can skip the parts that can't match. It helps searching
+ * a long scrollback buffer for literal text, or regexes with some, over
+ * and over. The current contents are indexed right away, which takes about
+ * as long as searching them once.
+ *
+ * The index takes up to a sixteenth of the memory or disk space of the
+ * text, but no more than 8MB, and is reported by
+ * vte_terminal_get_memory_usage(). Beyond that, the oldest text is searched
+ * without it.
+ *
+ * Since: 0.44
+ */
+void
+vte_terminal_set_scrollback_indexed(VteTerminal *terminal, gboolean indexed)
+{
+        VteTerminalPrivate *pvt;
+
+        g_return_if_fail(VTE_IS_TERMINAL(terminal));
+
+        pvt = terminal->pvt;
+        indexed = indexed != FALSE;
+
+        if (indexed == pvt->scrollback_indexed)
+                return;
+
+        pvt->scrollback_indexed = indexed;
+        _vte_ring_set_text_indexed (pvt->normal_screen.row_data, indexed);
+
+        g_object_notify (G_OBJECT (terminal), "scrollback-indexed");
+}
+
+/**
+ * vte_terminal_get_scrollback_indexed:
+ * @terminal: a #VteTerminal
+ *
+ * Returns: %TRUE if the text of the scrollback buffer is indexed
+ *
+ * Since: 0.44
+ */
+gboolean
+vte_terminal_get_scrollback_indexed(VteTerminal *terminal)
+{
+	g_return_val_if_fail(VTE_IS_TERMINAL(terminal), FALSE);
+	return terminal->pvt->scrollback_indexed;
+}
+
+/**
+ * vte_terminal_set_scrollback_bytes:
+ * @terminal: a #VteTerminal
+ * @bytes: the maximum size of the scrollback buffer in bytes, or 0 for no limit
+ *
+ * Limits the memory and disk space taken by the scrollback buffer, as
+ * reported by vte_terminal_get_memory_usage(), in addition to the limit
+ * on the number of lines. The oldest lines are discarded to stay within it.
+ * This is useful for long lines, or lots of color changes, which take up
+ * a lot more space than the number of lines would suggest.
+ *
+ * Since: 0.44
+ */
+void
+vte_terminal_set_scrollback_bytes(VteTerminal *terminal, guint64 bytes)
+{
+        VteTerminalPrivate *pvt;
+
+        g_return_if_fail(VTE_IS_TERMINAL(terminal));
+
+        pvt = terminal->pvt;
+        if (bytes == pvt->scrollback_bytes)
+                return;
+
+        pvt->scrollback_bytes = bytes;
+        _vte_ring_set_max_bytes (pvt->normal_screen.row_data, (gsize) MIN (bytes, G_MAXSIZE));
+        _vte_terminal_adjust_adjustments_full (terminal);
+
+        g_object_notify (G_OBJECT (terminal), "scrollback-bytes");
+}
+
+/**
+ * vte_terminal_get_scrollback_bytes:
+ * @terminal: a #VteTerminal
+ *
+ * Returns: the maximum size of the scrollback buffer in bytes, or 0 for no limit
+ *
+ * Since: 0.44
+ */
+guint64
+vte_terminal_get_scrollback_bytes(VteTerminal *terminal)
+{
+	g_return_val_if_fail(VTE_IS_TERMINAL(terminal), 0);
+	return terminal->pvt->scrollback_bytes;
+}
+
+/**
+ * vte_terminal_get_memory_usage:
+ * @terminal: a #VteTerminal
+ * @rows: (out) (allow-none): location to store the bytes of memory taken by
+ *   the lines kept in their editable form, or %NULL
+ * @buffers: (out) (allow-none): location to store the bytes of memory taken
+ *   by the rest of the scrollback buffer, or %NULL
+ * @disk: (out) (allow-none): location to store the bytes of disk space taken
+ *   by the scrollback buffer, or %NULL
+ *
+ * Reports the memory and disk usage of the contents of both the normal and
+ * the alternate screens. Data that's queued for writing to disk is counted
+ * as memory.
+ *
+ * Since: 0.44
+ */
+void
+vte_terminal_get_memory_usage(VteTerminal *terminal,
+                              gsize *rows,
+                              gsize *buffers,
+                              gsize *disk)
+{
+        VteTerminalPrivate *pvt;
+        gsize screen_rows[2], screen_buffers[2], screen_disk[2];
+
+        g_return_if_fail(VTE_IS_TERMINAL(terminal));
+
+        pvt = terminal->pvt;
+        _vte_ring_get_usage (pvt->normal_screen.row_data, &screen_rows[0], &screen_buffers[0], &screen_disk[0]);
+        _vte_ring_get_usage (pvt->alternate_screen.row_data, &screen_rows[1], &screen_buffers[1], &screen_disk[1]);
+
+        if (rows)
+                *rows = screen_rows[0] + screen_rows[1];
+        if (buffers)
+                *buffers = screen_buffers[0] + screen_buffers[1];
+        if (disk)
+                *disk = screen_disk[0] + screen_disk[1];
+}
+
+/**
+ * vte_terminal_hibernate:
+ * @terminal: a #VteTerminal
+ *
+ * Releases as much memory as possible, for when @terminal isn't going to be
+ * looked at for a while, like in a background tab. All the lines are moved
+ * to the scrollback buffer, and the caches are freed. They are brought back
+ * on demand, as @terminal is drawn or its contents change.
+ *
+ * See also #VteTerminal:hibernate-on-unmap.
+ *
+ * Since: 0.44
+ */
+void
+vte_terminal_hibernate(VteTerminal *terminal)
+{
+        VteTerminalPrivate *pvt;
+
+        g_return_if_fail(VTE_IS_TERMINAL(terminal));
+
+        pvt = terminal->pvt;
+        vte_terminal_remove_hibernate_timeout (terminal);
+
+        _vte_ring_hibernate (pvt->normal_screen.row_data);
+        _vte_ring_hibernate (pvt->alternate_screen.row_data);
+
+        vte_terminal_match_contents_clear (terminal);
+        if (pvt->search_attrs != NULL) {
+                g_array_free (pvt->search_attrs, TRUE);
+                pvt->search_attrs = NULL;
+        }
+        vte_terminal_search_clear_highlights (terminal);
+
+        /* Start over with a small array if there's nothing pending */
+        if (pvt->pending->len == 0) {
+                g_array_free (pvt->pending, TRUE);
+                pvt->pending = g_array_new (FALSE, TRUE, sizeof (gunichar));
+        }
+
+        /* The spare input chunks, shared by all terminals */
+        prune_chunks (0);
+}
+
+static gboolean
+vte_terminal_hibernate_timeout (gpointer data)
+{
+        VteTerminal *terminal = VTE_TERMINAL (data);
+
+        terminal->pvt->hibernate_tag = 0;
+        vte_terminal_hibernate (terminal);
+
+        return FALSE;
+}
+
+/* Hibernate after a while if unmapped, and asked to */
+static void
+vte_terminal_queue_hibernate (VteTerminal *terminal)
+{
+        VteTerminalPrivate *pvt = terminal->pvt;
+
+        if (!pvt->hibernate_on_unmap || pvt->hibernate_tag != 0 ||
+            gtk_widget_get_mapped (&terminal->widget))
+                return;
+
+        pvt->hibernate_tag = g_timeout_add_full (G_PRIORITY_LOW,
+                                                 VTE_HIBERNATE_TIMEOUT,
+                                                 vte_terminal_hibernate_timeout,
+                                                 terminal,
+                                                 NULL);
+}
+
+static void
+vte_terminal_remove_hibernate_timeout (VteTerminal *terminal)
+{
+        if (terminal->pvt->hibernate_tag == 0)
+                return;
+
+        g_source_remove (terminal->pvt->hibernate_tag);
+        terminal->pvt->hibernate_tag = 0;
+}
+
+/**
+ * vte_terminal_set_hibernate_on_unmap:
+ * @terminal: a #VteTerminal
+ * @hibernate: whether to hibernate after being unmapped for a while
+ *
+ * Controls whether @terminal calls vte_terminal_hibernate() by itself once
+ * it has been unmapped for a while, and again after output arrives while
+ * it's still unmapped.
+ *
+ * Since: 0.44
+ */
+void
+vte_terminal_set_hibernate_on_unmap(VteTerminal *terminal, gboolean hibernate)
+{
+        VteTerminalPrivate *pvt;
+
+        g_return_if_fail(VTE_IS_TERMINAL(terminal));
+
+        pvt = terminal->pvt;
+        hibernate = hibernate != FALSE;
+
+        if (hibernate == pvt->hibernate_on_unmap)
+                return;
+
+        pvt->hibernate_on_unmap = hibernate;
+        if (hibernate)
+                vte_terminal_queue_hibernate (terminal);
+        else
+                vte_terminal_remove_hibernate_timeout (terminal);
+
+        g_object_notify (G_OBJECT (terminal), "hibernate-on-unmap");
+}
+
+/**
+ * vte_terminal_get_hibernate_on_unmap:
+ * @terminal: a #VteTerminal
+ *
+ * Returns: whether @terminal hibernates after being unmapped for a while
+ *
+ * Since: 0.44
+ */
+gboolean
+vte_terminal_get_hibernate_on_unmap(VteTerminal *terminal)
+{
+	g_return_val_if_fail(VTE_IS_TERMINAL(terminal), FALSE);
+	return terminal->pvt->hibernate_on_unmap;
+}
+
+/**
+ * vte_terminal_set_backspace_binding:
+ * @terminal: a #VteTerminal
+ * @binding: a #VteEraseBinding for the backspace key
+ *
+ * Modifies the terminal's backspace key binding, which controls what
+ * string or control sequence the terminal sends to its child when the user
+ * presses the backspace key.
+ */
+void
+vte_terminal_set_backspace_binding(VteTerminal *terminal,
+				   VteEraseBinding binding)
+{
+        VteTerminalPrivate *pvt;
+
+	g_return_if_fail(VTE_IS_TERMINAL(terminal));
 
         pvt = terminal->pvt;
 
@@ -12722,12 +13942,18 @@ add_update_timeout (VteTerminal *terminal)
 static void
 reset_update_regions (VteTerminal *terminal)
 {
-	if (terminal->pvt->update_regions != NULL) {
-		g_slist_foreach (terminal->pvt->update_regions,
-				(GFunc)cairo_region_destroy, NULL);
-		g_slist_free (terminal->pvt->update_regions);
-		terminal->pvt->update_regions = NULL;
+	VteTerminalPrivate *pvt = terminal->pvt;
+	glong i;
+
+	if (pvt->damage_pending && !pvt->damage_all) {
+		for (i = 0; i < pvt->damage_rows; i++) {
+			pvt->damage[i].start = pvt->damage[i].end = 0;
+		}
 	}
+	pvt->damage_pending = FALSE;
+	pvt->damage_all = FALSE;
+	pvt->scroll_pending = FALSE;
+	pvt->scroll_rows = 0;
 	/* the invalidated_all flag also marks whether to skip processing
 	 * due to the widget being invisible */
 	terminal->pvt->invalidated_all =
@@ -12738,7 +13964,8 @@ static void
 remove_from_active_list (VteTerminal *terminal)
 {
 	if (terminal->pvt->active != NULL
-			&& terminal->pvt->update_regions == NULL) {
+			&& !terminal->pvt->damage_pending
+			&& !terminal->pvt->scroll_pending) {
 		_vte_debug_print(VTE_DEBUG_TIMEOUT,
 			"Removing terminal from active list\n");
 		active_terminals = g_list_delete_link (active_terminals,
@@ -12967,7 +14194,8 @@ process_timeout (gpointer data)
 			terminal->pvt->input_bytes = 0;
 		} else
 			vte_terminal_emit_pending_signals (terminal);
-		if (!active && terminal->pvt->update_regions == NULL) {
+		if (!active && !terminal->pvt->damage_pending &&
+				!terminal->pvt->scroll_pending) {
 			if (terminal->pvt->active != NULL) {
 				_vte_debug_print(VTE_DEBUG_TIMEOUT,
 						"Removing terminal from active list [process]\n");
@@ -13013,7 +14241,6 @@ process_timeout (gpointer data)
 static gboolean
 update_regions (VteTerminal *terminal)
 {
-	GSList *l;
 	cairo_region_t *region;
 	GdkWindow *window;
 
@@ -13024,31 +14251,23 @@ update_regions (VteTerminal *terminal)
 		return FALSE;
 	}
 
-	if (G_UNLIKELY (!terminal->pvt->update_regions))
+	if (G_UNLIKELY (!terminal->pvt->damage_pending && !terminal->pvt->scroll_pending))
 		return FALSE;
 
+	window = gtk_widget_get_window (&terminal->widget);
+
+	/* Copy the scrolled pixels first, the recorded damage refers to
+	 * the window's contents after the move. */
+	vte_terminal_flush_scroll (terminal);
 
-	l = terminal->pvt->update_regions;
-	if (g_slist_next (l) != NULL) {
-		/* amalgamate into one super-region */
-		region = cairo_region_create ();
-		do {
-                        cairo_region_t *r = (cairo_region_t *)l->data;
-			cairo_region_union (region, r);
-			cairo_region_destroy (r);
-		} while ((l = g_slist_next (l)) != NULL);
-	} else {
-		region = (cairo_region_t *)l->data;
+	if (terminal->pvt->damage_pending) {
+		region = vte_terminal_take_damage (terminal);
+		gdk_window_invalidate_region (window, region, FALSE);
+		cairo_region_destroy (region);
 	}
-	g_slist_free (terminal->pvt->update_regions);
-	terminal->pvt->update_regions = NULL;
 	terminal->pvt->invalidated_all = FALSE;
 
-	/* and perform the merge with the window visible area */
-	window = gtk_widget_get_window (&terminal->widget);
-	gdk_window_invalidate_region (window, region, FALSE);
 	gdk_window_process_updates (window, FALSE);
-	cairo_region_destroy (region);
 
 	_vte_debug_print (VTE_DEBUG_WORK, "-");
 
@@ -13276,75 +14495,454 @@ vte_terminal_write_contents_sync (VteTerminal *terminal,
 					 cancellable, error);
 }
 
-
 /*
- * Buffer search
+ * Snapshots
  */
 
-/* TODO Add properties & signals */
+#define VTE_SNAPSHOT_MAGIC   0x56544553  /* "VTES" */
+#define VTE_SNAPSHOT_VERSION 1
 
-/**
- * vte_terminal_search_set_gregex:
- * @terminal: a #VteTerminal
- * @regex: (allow-none): a #GRegex, or %NULL
- * @flags: flags from #GRegexMatchFlags
- *
- * Sets the #GRegex regex to search for. Unsets the search regex when passed %NULL.
- */
-void
-vte_terminal_search_set_gregex (VteTerminal *terminal,
-				GRegex      *regex,
-                                GRegexMatchFlags flags)
+static gboolean
+vte_terminal_read_snapshot_int (GDataInputStream *in,
+                                gint64 *value,
+                                GCancellable *cancellable,
+                                GError **error)
 {
-        g_return_if_fail(VTE_IS_TERMINAL(terminal));
+        GError *err = NULL;
 
-	if (terminal->pvt->search_regex == regex)
-		return;
+        *value = g_data_input_stream_read_int64 (in, cancellable, &err);
+        if (err != NULL) {
+                g_propagate_error (error, err);
+                return FALSE;
+        }
+        return TRUE;
+}
 
-	if (terminal->pvt->search_regex) {
-		g_regex_unref (terminal->pvt->search_regex);
-		terminal->pvt->search_regex = NULL;
-	}
+/* The state saved along with the cursor. The active character replacement
+ * is stored as an index, it points into the terminal's own array. */
+static gboolean
+vte_terminal_write_snapshot_saved (VteTerminal *terminal,
+                                   VteScreen *screen,
+                                   GDataOutputStream *out,
+                                   GCancellable *cancellable,
+                                   GError **error)
+{
+        const VteCell *cells[3] = { &screen->saved.defaults, &screen->saved.color_defaults, &screen->saved.fill_defaults };
+        VteIntCellAttr attr;
+        guint i;
 
-	if (regex)
-		terminal->pvt->search_regex = g_regex_ref (regex);
-        terminal->pvt->search_match_flags = flags;
+        if (!g_data_output_stream_put_int64 (out, screen->saved.cursor.row, cancellable, error) ||
+            !g_data_output_stream_put_int64 (out, screen->saved.cursor.col, cancellable, error) ||
+            !g_data_output_stream_put_int64 (out, (screen->saved.reverse_mode ? 1 : 0) |
+                                                  (screen->saved.origin_mode ? 2 : 0) |
+                                                  (screen->saved.sendrecv_mode ? 4 : 0) |
+                                                  (screen->saved.insert_mode ? 8 : 0) |
+                                                  (screen->saved.linefeed_mode ? 16 : 0), cancellable, error))
+                return FALSE;
 
-	_vte_invalidate_all (terminal);
+        for (i = 0; i < G_N_ELEMENTS (cells); i++) {
+                attr.s = cells[i]->attr;
+                if (!g_data_output_stream_put_int64 (out, _vte_unistr_get_base (cells[i]->c), cancellable, error) ||
+                    !g_data_output_stream_put_uint64 (out, attr.i, cancellable, error))
+                        return FALSE;
+        }
+
+        return g_data_output_stream_put_int64 (out, screen->saved.character_replacements[0], cancellable, error) &&
+               g_data_output_stream_put_int64 (out, screen->saved.character_replacements[1], cancellable, error) &&
+               g_data_output_stream_put_int64 (out, screen->saved.character_replacement == &terminal->pvt->character_replacements[1] ? 1 : 0,
+                                               cancellable, error);
 }
 
-/**
- * vte_terminal_search_get_gregex:
- * @terminal: a #VteTerminal
- *
- * Returns: (transfer none): the search #GRegex regex set in @terminal, or %NULL
- */
-GRegex *
-vte_terminal_search_get_gregex (VteTerminal *terminal)
+static gboolean
+vte_terminal_read_snapshot_saved (VteTerminal *terminal,
+                                  VteScreen *screen,
+                                  GDataInputStream *in,
+                                  GCancellable *cancellable,
+                                  GError **error)
 {
-	g_return_val_if_fail(VTE_IS_TERMINAL(terminal), NULL);
+        VteCell *cells[3] = { &screen->saved.defaults, &screen->saved.color_defaults, &screen->saved.fill_defaults };
+        gint64 row, col, modes, c, a, replacements[3];
+        VteIntCellAttr attr;
+        guint i;
 
-	return terminal->pvt->search_regex;
+        if (!vte_terminal_read_snapshot_int (in, &row, cancellable, error) ||
+            !vte_terminal_read_snapshot_int (in, &col, cancellable, error) ||
+            !vte_terminal_read_snapshot_int (in, &modes, cancellable, error))
+                return FALSE;
+
+        screen->saved.cursor.row = row;
+        screen->saved.cursor.col = col;
+        screen->saved.reverse_mode = (modes & 1) != 0;
+        screen->saved.origin_mode = (modes & 2) != 0;
+        screen->saved.sendrecv_mode = (modes & 4) != 0;
+        screen->saved.insert_mode = (modes & 8) != 0;
+        screen->saved.linefeed_mode = (modes & 16) != 0;
+
+        for (i = 0; i < G_N_ELEMENTS (cells); i++) {
+                if (!vte_terminal_read_snapshot_int (in, &c, cancellable, error) ||
+                    !vte_terminal_read_snapshot_int (in, &a, cancellable, error))
+                        return FALSE;
+                if (c < 0 || c > G_MAXUINT32 || !g_unichar_validate ((gunichar) c))
+                        c = 0;
+                attr.i = a;
+                cells[i]->c = c;
+                cells[i]->attr = attr.s;
+        }
+
+        for (i = 0; i < G_N_ELEMENTS (replacements); i++) {
+                if (!vte_terminal_read_snapshot_int (in, &replacements[i], cancellable, error))
+                        return FALSE;
+        }
+        if (replacements[0] < VTE_CHARACTER_REPLACEMENT_NONE || replacements[0] > VTE_CHARACTER_REPLACEMENT_BRITISH ||
+            replacements[1] < VTE_CHARACTER_REPLACEMENT_NONE || replacements[1] > VTE_CHARACTER_REPLACEMENT_BRITISH ||
+            (replacements[2] != 0 && replacements[2] != 1)) {
+                g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                                     "Invalid character set in snapshot");
+                return FALSE;
+        }
+        screen->saved.character_replacements[0] = (VteCharacterReplacement) replacements[0];
+        screen->saved.character_replacements[1] = (VteCharacterReplacement) replacements[1];
+        screen->saved.character_replacement = &terminal->pvt->character_replacements[replacements[2]];
+
+        return TRUE;
 }
 
-/**
- * vte_terminal_search_set_wrap_around:
- * @terminal: a #VteTerminal
- * @wrap_around: whether search should wrap
- *
- * Sets whether search should wrap around to the beginning of the
- * terminal content when reaching its end.
- */
-void
-vte_terminal_search_set_wrap_around (VteTerminal *terminal,
-				     gboolean     wrap_around)
+static gboolean
+vte_terminal_write_snapshot_screen (VteTerminal *terminal,
+                                    VteScreen *screen,
+                                    GDataOutputStream *out,
+                                    GCancellable *cancellable,
+                                    GError **error)
 {
-	g_return_if_fail(VTE_IS_TERMINAL(terminal));
-
-	terminal->pvt->search_wrap_around = !!wrap_around;
+        return g_data_output_stream_put_int64 (out, screen->insert_delta, cancellable, error) &&
+               g_data_output_stream_put_int64 (out, screen->scroll_delta, cancellable, error) &&
+               vte_terminal_write_snapshot_saved (terminal, screen, out, cancellable, error) &&
+               _vte_ring_write_snapshot (screen->row_data, out, cancellable, error);
 }
 
-/**
+static gboolean
+vte_terminal_read_snapshot_screen (VteTerminal *terminal,
+                                   VteScreen *screen,
+                                   GDataInputStream *in,
+                                   GCancellable *cancellable,
+                                   GError **error)
+{
+        gint64 insert_delta, scroll_delta;
+
+        if (!vte_terminal_read_snapshot_int (in, &insert_delta, cancellable, error) ||
+            !vte_terminal_read_snapshot_int (in, &scroll_delta, cancellable, error) ||
+            !vte_terminal_read_snapshot_saved (terminal, screen, in, cancellable, error) ||
+            !_vte_ring_read_snapshot (screen->row_data, in, cancellable, error))
+                return FALSE;
+
+        /* Clamped to the restored rows, the resize that follows fixes them up */
+        screen->insert_delta = CLAMP (insert_delta, _vte_ring_delta (screen->row_data), _vte_ring_next (screen->row_data));
+        screen->scroll_delta = CLAMP (scroll_delta, _vte_ring_delta (screen->row_data), screen->insert_delta);
+
+        return TRUE;
+}
+
+/**
+ * vte_terminal_write_snapshot_sync:
+ * @terminal: a #VteTerminal
+ * @stream: a #GOutputStream to write to
+ * @cancellable: (allow-none): a #GCancellable object, or %NULL
+ * @error: (allow-none): a #GError location to store the error occuring, or %NULL
+ *
+ * Writes a compressed snapshot of the state of @terminal to @stream: the
+ * contents of the normal and alternate screens including the scrollback,
+ * the cursor and the state saved along with it. The snapshot can be loaded
+ * into another terminal with vte_terminal_read_snapshot_sync(), without
+ * having to process the output that produced it again.
+ *
+ * Snapshots are meant for resuming a session on the same system, their
+ * format may change between versions of VTE.
+ *
+ * The snapshot holds everything the terminal shows or has scrolled off in the
+ * clear, unlike the scrollback VTE keeps on disk, which is encrypted. Write it
+ * somewhere only the user can read, or encrypt @stream.
+ *
+ * @stream is not closed.
+ *
+ * This is a synchronous operation, see vte_terminal_write_contents_sync().
+ *
+ * Returns: %TRUE on success, %FALSE if there was an error
+ *
+ * Since: 0.44
+ */
+gboolean
+vte_terminal_write_snapshot_sync (VteTerminal *terminal,
+                                  GOutputStream *stream,
+                                  GCancellable *cancellable,
+                                  GError **error)
+{
+        VteTerminalPrivate *pvt;
+        GZlibCompressor *compressor;
+        GOutputStream *converter;
+        GDataOutputStream *out;
+        VteScreen current;
+        gboolean ret;
+
+        g_return_val_if_fail(VTE_IS_TERMINAL(terminal), FALSE);
+        g_return_val_if_fail(G_IS_OUTPUT_STREAM(stream), FALSE);
+
+        pvt = terminal->pvt;
+
+        compressor = g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1);
+        converter = g_converter_output_stream_new (stream, G_CONVERTER (compressor));
+        g_filter_output_stream_set_close_base_stream (G_FILTER_OUTPUT_STREAM (converter), FALSE);
+        out = g_data_output_stream_new (converter);
+
+        /* The current cursor state, stored like a saved one */
+        current.insert_delta = pvt->screen->insert_delta;
+        _vte_terminal_save_cursor (terminal, &current);
+
+        ret = g_data_output_stream_put_uint32 (out, VTE_SNAPSHOT_MAGIC, cancellable, error) &&
+              g_data_output_stream_put_uint32 (out, VTE_SNAPSHOT_VERSION, cancellable, error) &&
+              g_data_output_stream_put_int64 (out, pvt->column_count, cancellable, error) &&
+              g_data_output_stream_put_int64 (out, pvt->row_count, cancellable, error) &&
+              g_data_output_stream_put_int64 (out, pvt->screen == &pvt->alternate_screen, cancellable, error) &&
+              g_data_output_stream_put_int64 (out, pvt->cursor.row, cancellable, error) &&
+              vte_terminal_write_snapshot_saved (terminal, &current, out, cancellable, error) &&
+              vte_terminal_write_snapshot_screen (terminal, &pvt->normal_screen, out, cancellable, error) &&
+              vte_terminal_write_snapshot_screen (terminal, &pvt->alternate_screen, out, cancellable, error) &&
+              g_output_stream_close (G_OUTPUT_STREAM (out), cancellable, error);
+
+        g_object_unref (out);
+        g_object_unref (converter);
+        g_object_unref (compressor);
+
+        return ret;
+}
+
+/**
+ * vte_terminal_read_snapshot_sync:
+ * @terminal: a #VteTerminal
+ * @stream: a #GInputStream to read from
+ * @cancellable: (allow-none): a #GCancellable object, or %NULL
+ * @error: (allow-none): a #GError location to store the error occuring, or %NULL
+ *
+ * Replaces the contents and the cursor state of @terminal with the ones
+ * in a snapshot written by vte_terminal_write_snapshot_sync(). If the
+ * snapshot was taken at a different size, its contents are resized
+ * like on vte_terminal_set_size(). The scrollback is cut to the limits
+ * of @terminal.
+ *
+ * Loading a truncated or corrupt snapshot fails with an error. If the
+ * snapshot turns out to be invalid after its contents started to be loaded,
+ * @terminal is reset, see vte_terminal_reset().
+ *
+ * @stream is not closed.
+ *
+ * This is a synchronous operation, see vte_terminal_write_contents_sync().
+ *
+ * Returns: %TRUE on success, %FALSE if there was an error
+ *
+ * Since: 0.44
+ */
+gboolean
+vte_terminal_read_snapshot_sync (VteTerminal *terminal,
+                                 GInputStream *stream,
+                                 GCancellable *cancellable,
+                                 GError **error)
+{
+        VteTerminalPrivate *pvt;
+        GZlibDecompressor *decompressor;
+        GInputStream *converter;
+        GDataInputStream *in;
+        VteScreen current;
+        GError *err = NULL;
+        guint32 magic, version = 0;
+        gint64 columns = 0, rows = 0, alternate = 0, cursor_row = 0;
+        gboolean ret = FALSE;
+
+        g_return_val_if_fail(VTE_IS_TERMINAL(terminal), FALSE);
+        g_return_val_if_fail(G_IS_INPUT_STREAM(stream), FALSE);
+
+        pvt = terminal->pvt;
+
+        decompressor = g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP);
+        converter = g_converter_input_stream_new (stream, G_CONVERTER (decompressor));
+        g_filter_input_stream_set_close_base_stream (G_FILTER_INPUT_STREAM (converter), FALSE);
+        in = g_data_input_stream_new (converter);
+
+        magic = g_data_input_stream_read_uint32 (in, cancellable, &err);
+        if (err == NULL)
+                version = g_data_input_stream_read_uint32 (in, cancellable, &err);
+        if (err != NULL) {
+                g_propagate_error (error, err);
+                goto out;
+        }
+        if (magic != VTE_SNAPSHOT_MAGIC || version != VTE_SNAPSHOT_VERSION) {
+                g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                                     "Unsupported snapshot format");
+                goto out;
+        }
+
+        if (!vte_terminal_read_snapshot_int (in, &columns, cancellable, error) ||
+            !vte_terminal_read_snapshot_int (in, &rows, cancellable, error) ||
+            !vte_terminal_read_snapshot_int (in, &alternate, cancellable, error) ||
+            !vte_terminal_read_snapshot_int (in, &cursor_row, cancellable, error))
+                goto out;
+        if (columns < 1 || rows < 1 || columns > G_MAXINT || rows > G_MAXINT) {
+                g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                                     "Invalid size in snapshot");
+                goto out;
+        }
+
+        vte_terminal_deselect_all (terminal);
+
+        if (!vte_terminal_read_snapshot_saved (terminal, &current, in, cancellable, error) ||
+            !vte_terminal_read_snapshot_screen (terminal, &pvt->normal_screen, in, cancellable, error) ||
+            !vte_terminal_read_snapshot_screen (terminal, &pvt->alternate_screen, in, cancellable, error)) {
+                vte_terminal_reset (terminal, FALSE, TRUE);
+                goto out;
+        }
+
+        pvt->screen = alternate ? &pvt->alternate_screen : &pvt->normal_screen;
+        current.insert_delta = pvt->screen->insert_delta;
+        _vte_terminal_restore_cursor (terminal, &current);
+        pvt->cursor.row = cursor_row;
+
+        /* Fit the contents to the current size, like vte_terminal_set_size() does */
+        pvt->scrolling_restricted = FALSE;
+        vte_terminal_screen_set_size (terminal, &pvt->normal_screen, columns, rows, pvt->rewrap_on_resize);
+        if (pvt->screen == &pvt->alternate_screen)
+                vte_terminal_screen_set_size (terminal, &pvt->alternate_screen, columns, rows, FALSE);
+        vte_terminal_set_scrollback_lines (terminal, pvt->scrollback_lines);
+        pvt->cursor.row = CLAMP (pvt->cursor.row,
+                                 _vte_ring_delta (pvt->screen->row_data),
+                                 MAX (_vte_ring_delta (pvt->screen->row_data),
+                                      _vte_ring_next (pvt->screen->row_data) - 1));
+
+        _vte_terminal_adjust_adjustments_full (terminal);
+        _vte_invalidate_all (terminal);
+        _vte_terminal_queue_contents_changed (terminal);
+        vte_terminal_emit_text_modified (terminal);
+
+        ret = TRUE;
+
+out:
+        g_object_unref (in);
+        g_object_unref (converter);
+        g_object_unref (decompressor);
+
+        return ret;
+}
+
+
+/*
+ * Buffer search
+ */
+
+/* TODO Add properties & signals */
+
+/**
+ * vte_terminal_search_set_gregex:
+ * @terminal: a #VteTerminal
+ * @regex: (allow-none): a #GRegex, or %NULL
+ * @flags: flags from #GRegexMatchFlags
+ *
+ * Sets the #GRegex regex to search for. Unsets the search regex when passed %NULL.
+ */
+void
+vte_terminal_search_set_gregex (VteTerminal *terminal,
+				GRegex      *regex,
+                                GRegexMatchFlags flags)
+{
+        g_return_if_fail(VTE_IS_TERMINAL(terminal));
+
+	if (terminal->pvt->search_regex == regex)
+		return;
+
+	if (terminal->pvt->search_regex) {
+		g_regex_unref (terminal->pvt->search_regex);
+		terminal->pvt->search_regex = NULL;
+	}
+	_vte_ring_literal_free (terminal->pvt->search_literal);
+	terminal->pvt->search_literal = NULL;
+
+	if (regex)
+		terminal->pvt->search_regex = g_regex_ref (regex);
+        terminal->pvt->search_match_flags = flags;
+
+	vte_terminal_search_clear_highlights (terminal);
+	_vte_invalidate_all (terminal);
+}
+
+/**
+ * vte_terminal_search_get_gregex:
+ * @terminal: a #VteTerminal
+ *
+ * Returns: (transfer none): the search #GRegex regex set in @terminal, or %NULL
+ */
+GRegex *
+vte_terminal_search_get_gregex (VteTerminal *terminal)
+{
+	g_return_val_if_fail(VTE_IS_TERMINAL(terminal), NULL);
+
+	return terminal->pvt->search_regex;
+}
+
+/**
+ * vte_terminal_search_set_text:
+ * @terminal: a #VteTerminal
+ * @text: (allow-none): the text to search for, or %NULL
+ * @case_sensitive: whether the case of letters has to match
+ *
+ * Sets plain text to search for. It's the same as setting a regex matching
+ * just @text with vte_terminal_search_set_gregex(), and that regex is what
+ * vte_terminal_search_get_gregex() returns then, but searching is much
+ * faster. Ignoring case is only faster for ASCII text. Unsets the search
+ * regex when passed %NULL or an empty string.
+ *
+ * Since: 0.44
+ */
+void
+vte_terminal_search_set_text (VteTerminal *terminal,
+			      const char  *text,
+			      gboolean     case_sensitive)
+{
+	GRegex *regex = NULL;
+	char *pattern;
+
+	g_return_if_fail(VTE_IS_TERMINAL(terminal));
+	g_return_if_fail(text == NULL || g_utf8_validate (text, -1, NULL));
+
+	if (text != NULL && text[0] != '\0') {
+		pattern = g_regex_escape_string (text, -1);
+		regex = g_regex_new (pattern,
+				     (GRegexCompileFlags)(G_REGEX_OPTIMIZE | (case_sensitive ? 0 : G_REGEX_CASELESS)),
+				     (GRegexMatchFlags) 0, NULL);
+		g_free (pattern);
+		g_return_if_fail(regex != NULL);
+	}
+
+	vte_terminal_search_set_gregex (terminal, regex, (GRegexMatchFlags) 0);
+	if (regex != NULL) {
+		terminal->pvt->search_literal = _vte_ring_literal_new (text, !case_sensitive);
+		g_regex_unref (regex);
+	}
+}
+
+/**
+ * vte_terminal_search_set_wrap_around:
+ * @terminal: a #VteTerminal
+ * @wrap_around: whether search should wrap
+ *
+ * Sets whether search should wrap around to the beginning of the
+ * terminal content when reaching its end.
+ */
+void
+vte_terminal_search_set_wrap_around (VteTerminal *terminal,
+				     gboolean     wrap_around)
+{
+	g_return_if_fail(VTE_IS_TERMINAL(terminal));
+
+	terminal->pvt->search_wrap_around = !!wrap_around;
+}
+
+/**
  * vte_terminal_search_get_wrap_around:
  * @terminal: a #VteTerminal
  *
@@ -13358,55 +14956,71 @@ vte_terminal_search_get_wrap_around (VteTerminal *terminal)
 	return terminal->pvt->search_wrap_around;
 }
 
-static gboolean
-vte_terminal_search_rows (VteTerminal *terminal,
-			  long start_row,
-			  long end_row,
-			  gboolean backward)
+/**
+ * vte_terminal_search_set_highlight_all:
+ * @terminal: a #VteTerminal
+ * @highlight_all: whether to highlight all the matches
+ *
+ * Sets whether all the matches of the search regex set with
+ * vte_terminal_search_set_gregex() are highlighted, as they become visible.
+ *
+ * Since: 0.44
+ */
+void
+vte_terminal_search_set_highlight_all (VteTerminal *terminal,
+				       gboolean     highlight_all)
+{
+	g_return_if_fail(VTE_IS_TERMINAL(terminal));
+
+	highlight_all = highlight_all != FALSE;
+	if (highlight_all == terminal->pvt->search_highlight_all)
+		return;
+
+	terminal->pvt->search_highlight_all = highlight_all;
+	vte_terminal_search_clear_highlights (terminal);
+	_vte_invalidate_all (terminal);
+}
+
+/**
+ * vte_terminal_search_get_highlight_all:
+ * @terminal: a #VteTerminal
+ *
+ * Returns: whether all the matches are highlighted
+ *
+ * Since: 0.44
+ */
+gboolean
+vte_terminal_search_get_highlight_all (VteTerminal *terminal)
+{
+	g_return_val_if_fail(VTE_IS_TERMINAL(terminal), FALSE);
+
+	return terminal->pvt->search_highlight_all;
+}
+
+/* Select the match at the given byte offsets in the text of the rows
+ * [start_row, end_row), and scroll to it. */
+static void
+vte_terminal_search_select_match (VteTerminal *terminal,
+				  long start_row,
+				  long end_row,
+				  int start,
+				  int end,
+				  gboolean backward)
 {
         VteTerminalPrivate *pvt;
-	char *row_text;
-	GMatchInfo *match_info;
-	GError *error = NULL;
-	int start, end;
 	long start_col, end_col;
-	gchar *word;
+	char *row_text;
 	VteCharAttributes *ca;
 	GArray *attrs;
 	gdouble value, page_size;
 
 	pvt = terminal->pvt;
 
-	row_text = vte_terminal_get_text_range (terminal, start_row, 0, end_row, -1, NULL, NULL, NULL);
-
-	g_regex_match_full (pvt->search_regex, row_text, -1, 0,
-                            (GRegexMatchFlags)(pvt->search_match_flags | G_REGEX_MATCH_NOTEMPTY),
-                            &match_info, &error);
-	if (error) {
-		g_printerr ("Error while matching: %s\n", error->message);
-		g_error_free (error);
-		g_match_info_free (match_info);
-		g_free (row_text);
-		return TRUE;
-	}
-
-	if (!g_match_info_matches (match_info)) {
-		g_match_info_free (match_info);
-		g_free (row_text);
-		return FALSE;
-	}
-
-	word = g_match_info_fetch (match_info, 0);
-
-	/* Fetch text again, with attributes */
-	g_free (row_text);
+	/* Fetch the text with attributes, only for this paragraph */
 	if (!pvt->search_attrs)
 		pvt->search_attrs = g_array_new (FALSE, TRUE, sizeof (VteCharAttributes));
 	attrs = pvt->search_attrs;
-	row_text = vte_terminal_get_text_range (terminal, start_row, 0, end_row, -1, NULL, NULL, attrs);
-
-	/* This gives us the offset in the buffer */
-	g_match_info_fetch_pos (match_info, 0, &start, &end);
+	row_text = vte_terminal_get_search_text (terminal, start_row, end_row, attrs);
 
 	ca = &g_array_index (attrs, VteCharAttributes, start);
 	start_row = ca->row;
@@ -13415,9 +15029,7 @@ vte_terminal_search_rows (VteTerminal *terminal,
 	end_row = ca->row;
 	end_col = ca->column;
 
-	g_free (word);
 	g_free (row_text);
-	g_match_info_free (match_info);
 
 	_vte_terminal_select_text (terminal, start_col, start_row, end_col, end_row, 0, 0);
 	/* Quite possibly the math here should not access adjustment directly... */
@@ -13430,27 +15042,87 @@ vte_terminal_search_rows (VteTerminal *terminal,
 		if (start_row < value || start_row >= value + page_size)
 			vte_terminal_queue_adjustment_value_changed_clamped (terminal, start_row);
 	}
+}
+
+static gboolean
+vte_terminal_search_rows_found (int start,
+				int end,
+				gpointer data)
+{
+	VteRingMatch *match = (VteRingMatch *) data;
+
+	match->start_offset = start;
+	match->end_offset = end;
+	return TRUE;
+}
+
+static gboolean
+vte_terminal_search_rows (VteTerminal *terminal,
+			  long start_row,
+			  long end_row,
+			  gboolean backward)
+{
+        VteTerminalPrivate *pvt;
+	VteRingMatch match;
+	char *row_text;
+
+	pvt = terminal->pvt;
+
+	row_text = vte_terminal_get_search_text (terminal, start_row, end_row, NULL);
+
+	match.start_offset = -1;
+	_vte_ring_match_text (pvt->search_regex,
+			      (GRegexMatchFlags)(pvt->search_match_flags | G_REGEX_MATCH_NOTEMPTY),
+			      pvt->search_literal, row_text, strlen (row_text),
+			      vte_terminal_search_rows_found, &match);
+	g_free (row_text);
+
+	if (match.start_offset < 0)
+		return FALSE;
+
+	vte_terminal_search_select_match (terminal, start_row, end_row, match.start_offset, match.end_offset, backward);
 
 	return TRUE;
 }
 
+/* Search the paragraphs starting in [start_row, end_row) forward, or the
+ * ones ending in (start_row, end_row] backward. The frozen ones are searched
+ * by the ring, right in its text stream, the rest a paragraph at a time. */
 static gboolean
 vte_terminal_search_rows_iter (VteTerminal *terminal,
 			       long start_row,
 			       long end_row,
 			       gboolean backward)
 {
+	VteRing *ring = terminal->pvt->screen->row_data;
+	VteRingMatch match;
 	const VteRowData *row;
+	gulong position;
 	long iter_start_row, iter_end_row;
+	GRegexMatchFlags flags;
+
+	flags = (GRegexMatchFlags)(terminal->pvt->search_match_flags | G_REGEX_MATCH_NOTEMPTY);
 
 	if (backward) {
 		iter_start_row = end_row;
 		while (iter_start_row > start_row) {
-			iter_end_row = iter_start_row;
+			position = iter_start_row;
+			if (_vte_ring_search (ring, start_row, &position, TRUE,
+					      terminal->pvt->search_regex, flags,
+					      terminal->pvt->search_literal, &match)) {
+				vte_terminal_search_select_match (terminal, match.start_row, match.end_row,
+								  match.start_offset, match.end_offset, backward);
+				return TRUE;
+			}
+			if ((long) position != iter_start_row) {
+				iter_start_row = position;
+				continue;
+			}
 
+			iter_end_row = iter_start_row;
 			do {
 				iter_start_row--;
-				row = _vte_terminal_find_row_data (terminal, iter_start_row);
+				row = _vte_terminal_find_row_data (terminal, iter_start_row - 1);
 			} while (row && row->attr.soft_wrapped);
 
 			if (vte_terminal_search_rows (terminal, iter_start_row, iter_end_row, backward))
@@ -13459,8 +15131,20 @@ vte_terminal_search_rows_iter (VteTerminal *terminal,
 	} else {
 		iter_end_row = start_row;
 		while (iter_end_row < end_row) {
-			iter_start_row = iter_end_row;
+			position = iter_end_row;
+			if (_vte_ring_search (ring, end_row, &position, FALSE,
+					      terminal->pvt->search_regex, flags,
+					      terminal->pvt->search_literal, &match)) {
+				vte_terminal_search_select_match (terminal, match.start_row, match.end_row,
+								  match.start_offset, match.end_offset, backward);
+				return TRUE;
+			}
+			if ((long) position != iter_end_row) {
+				iter_end_row = position;
+				continue;
+			}
 
+			iter_start_row = iter_end_row;
 			do {
 				row = _vte_terminal_find_row_data (terminal, iter_end_row);
 				iter_end_row++;
@@ -13575,6 +15259,435 @@ vte_terminal_search_find_next (VteTerminal *terminal)
 	return vte_terminal_search_find (terminal, FALSE);
 }
 
+/*
+ * Asynchronous search
+ *
+ * The whole buffer is searched from the top, a slice at a time from an idle
+ * callback, counting all the matches. The one to select is the first one
+ * after the search origin (the selection's start, or the viewport), or the
+ * last one before it when searching backward. Matches are ordered by their
+ * paragraph's first row and their byte offset in its text.
+ */
+
+typedef struct _VteTerminalSearch {
+	GRegex *regex;
+	GRegexMatchFlags flags;
+	VteRingLiteral *literal;
+	gboolean backward;
+	gboolean wrap_around;
+	guint tag;
+
+	VteRing *ring;       /* the rows counted so far are from this one */
+	gulong generation;   /* ...and this generation of its frozen rows */
+	gulong position;     /* the next paragraph to search */
+	guint n_restarts;    /* since the search started */
+
+	long origin_row;     /* the first row of the origin's paragraph */
+	long origin_offset;  /* and the origin's offset in its text */
+
+	glong n_matches;
+	gboolean has_first, has_target;
+	VteRingMatch first, last, target;
+	glong first_index, last_index, target_index;
+} VteTerminalSearch;
+
+static void
+vte_terminal_search_free (gpointer data)
+{
+	VteTerminalSearch *search = (VteTerminalSearch *) data;
+
+	g_regex_unref (search->regex);
+	_vte_ring_literal_free (search->literal);
+	g_free (search);
+}
+
+/* Find where to search from, see above */
+static void
+vte_terminal_search_set_origin (VteTerminal *terminal,
+				VteTerminalSearch *search)
+{
+        VteTerminalPrivate *pvt = terminal->pvt;
+	VteRing *ring = pvt->screen->row_data;
+	const VteRowData *row;
+	VteCharAttributes *ca;
+	GArray *attrs;
+	long start_row, end_row, sel_row, sel_col;
+	char *text;
+	guint i;
+
+	if (!pvt->has_selection) {
+		if (search->backward) {
+			search->origin_row = pvt->screen->scroll_delta + pvt->row_count;
+			search->origin_offset = 0;
+		} else {
+			search->origin_row = pvt->screen->scroll_delta;
+			search->origin_offset = -1;
+		}
+		return;
+	}
+
+	sel_row = CLAMP (pvt->selection_start.row, _vte_ring_delta (ring), _vte_ring_next (ring));
+	sel_col = pvt->selection_start.col;
+
+	start_row = sel_row;
+	while (start_row > _vte_ring_delta (ring) &&
+	       (row = _vte_terminal_find_row_data (terminal, start_row - 1)) != NULL &&
+	       row->attr.soft_wrapped)
+		start_row--;
+	end_row = sel_row;
+	while ((row = _vte_terminal_find_row_data (terminal, end_row)) != NULL &&
+	       row->attr.soft_wrapped)
+		end_row++;
+
+	search->origin_row = start_row;
+
+	/* The first byte at or after the selection's start */
+	if (!pvt->search_attrs)
+		pvt->search_attrs = g_array_new (FALSE, TRUE, sizeof (VteCharAttributes));
+	attrs = pvt->search_attrs;
+	text = vte_terminal_get_search_text (terminal, start_row, end_row + 1, attrs);
+	g_free (text);
+	for (i = 0; i < attrs->len; i++) {
+		ca = &g_array_index (attrs, VteCharAttributes, i);
+		if (ca->row > sel_row || (ca->row == sel_row && ca->column >= sel_col))
+			break;
+	}
+	search->origin_offset = i;
+}
+
+/* Start over, e.g. because the frozen rows changed */
+static void
+vte_terminal_search_restart (VteTerminal *terminal,
+			     VteTerminalSearch *search)
+{
+	search->ring = terminal->pvt->screen->row_data;
+	search->generation = search->ring->generation;
+	search->position = search->ring->start;
+	search->n_matches = 0;
+	search->has_first = search->has_target = FALSE;
+	vte_terminal_search_set_origin (terminal, search);
+}
+
+static void
+vte_terminal_search_add_match (const VteRingMatch *match,
+			       gpointer data)
+{
+	VteTerminalSearch *search = (VteTerminalSearch *) data;
+	int cmp;
+
+	search->n_matches++;
+
+	if ((long) match->start_row != search->origin_row)
+		cmp = (long) match->start_row < search->origin_row ? -1 : 1;
+	else if (match->start_offset != search->origin_offset)
+		cmp = match->start_offset < search->origin_offset ? -1 : 1;
+	else
+		cmp = 0;
+
+	if (!search->has_first) {
+		search->first = *match;
+		search->first_index = search->n_matches;
+		search->has_first = TRUE;
+	}
+	search->last = *match;
+	search->last_index = search->n_matches;
+
+	if (search->backward) {
+		if (cmp < 0) {
+			search->target = *match;
+			search->target_index = search->n_matches;
+			search->has_target = TRUE;
+		}
+	} else if (cmp > 0 && !search->has_target) {
+		search->target = *match;
+		search->target_index = search->n_matches;
+		search->has_target = TRUE;
+	}
+}
+
+typedef struct _VteSearchRowsAll {
+	VteRingMatch match;
+	VteRingMatchFunc func;
+	gpointer data;
+} VteSearchRowsAll;
+
+static gboolean
+vte_terminal_search_rows_all_found (int start,
+				    int end,
+				    gpointer data)
+{
+	VteSearchRowsAll *all = (VteSearchRowsAll *) data;
+
+	all->match.start_offset = start;
+	all->match.end_offset = end;
+	all->func (&all->match, all->data);
+	return FALSE;
+}
+
+/* Pass all the matches in the paragraphs starting in [start_row, end_row) to
+ * @func, fetching the rows one by one */
+static void
+vte_terminal_search_rows_all (VteTerminal *terminal,
+			      GRegex *regex,
+			      GRegexMatchFlags flags,
+			      const VteRingLiteral *literal,
+			      long start_row,
+			      long end_row,
+			      VteRingMatchFunc func,
+			      gpointer data)
+{
+	const VteRowData *row;
+	long iter_start_row, iter_end_row;
+	VteSearchRowsAll all;
+	char *row_text;
+
+	all.func = func;
+	all.data = data;
+
+	iter_end_row = start_row;
+	while (iter_end_row < end_row) {
+		iter_start_row = iter_end_row;
+		do {
+			row = _vte_terminal_find_row_data (terminal, iter_end_row);
+			iter_end_row++;
+		} while (row && row->attr.soft_wrapped);
+		iter_end_row = MIN (iter_end_row, _vte_ring_next (terminal->pvt->screen->row_data));
+
+		row_text = vte_terminal_get_search_text (terminal, iter_start_row, iter_end_row, NULL);
+		all.match.start_row = iter_start_row;
+		all.match.end_row = iter_end_row;
+
+		_vte_ring_match_text (regex, flags, literal, row_text, strlen (row_text),
+				      vte_terminal_search_rows_all_found, &all);
+		g_free (row_text);
+	}
+}
+
+/* Select the match found, or do what vte_terminal_search_find() does if
+ * there's none */
+static gboolean
+vte_terminal_search_select_result (VteTerminal *terminal,
+				   VteTerminalSearch *search)
+{
+        VteTerminalPrivate *pvt = terminal->pvt;
+	VteRing *ring = pvt->screen->row_data;
+
+	if (!search->has_target && search->wrap_around && search->has_first) {
+		if (search->backward) {
+			search->target = search->last;
+			search->target_index = search->last_index;
+		} else {
+			search->target = search->first;
+			search->target_index = search->first_index;
+		}
+		search->has_target = TRUE;
+	}
+
+	if (search->has_target) {
+		vte_terminal_search_select_match (terminal,
+						  search->target.start_row, search->target.end_row,
+						  search->target.start_offset, search->target.end_offset,
+						  search->backward);
+		return TRUE;
+	}
+
+	if (pvt->has_selection) {
+		if (search->wrap_around)
+			_vte_terminal_select_empty_at (terminal,
+						       search->backward ? pvt->selection_start.col : pvt->selection_end.col + 1,
+						       search->backward ? pvt->selection_start.row : pvt->selection_end.row);
+		else
+			_vte_terminal_select_empty_at (terminal,
+						       -1,
+						       search->backward ? _vte_ring_delta (ring) - 1 : _vte_ring_next (ring));
+	}
+	return FALSE;
+}
+
+static gboolean
+vte_terminal_search_idle (gpointer data)
+{
+	GTask *task = G_TASK (data);
+	VteTerminal *terminal = VTE_TERMINAL (g_task_get_source_object (task));
+	VteTerminalSearch *search = (VteTerminalSearch *) g_task_get_task_data (task);
+	VteRing *ring = terminal->pvt->screen->row_data;
+	gulong position;
+	gint64 deadline;
+
+	if (g_task_return_error_if_cancelled (task)) {
+		search->tag = 0;
+		terminal->pvt->search_task = NULL;
+		return FALSE;
+	}
+
+	/* The rows counted so far might not be there any more */
+	if (ring != search->ring || ring->generation != search->generation) {
+		if (search->n_restarts++ == VTE_SEARCH_MAX_RESTARTS)
+			goto busy;
+		vte_terminal_search_restart (terminal, search);
+	}
+	if (search->position < ring->start)
+		search->position = ring->start;
+
+	/* The frozen rows, in the ring's text stream */
+	deadline = g_get_monotonic_time () + VTE_SEARCH_TIMESLICE * 1000;
+	while (search->position < ring->writable) {
+		position = search->position;
+		_vte_ring_search_all (ring, position + VTE_SEARCH_BATCH_ROWS, &position,
+				      search->regex, search->flags, search->literal,
+				      vte_terminal_search_add_match, search);
+		if (position == search->position)
+			break;
+		search->position = position;
+
+		if (g_get_monotonic_time () >= deadline) {
+			g_signal_emit (terminal, signals[SEARCH_PROGRESS], 0,
+				       (glong) (search->position - ring->start),
+				       _vte_ring_length (ring),
+				       search->n_matches);
+			return TRUE;
+		}
+	}
+
+	/* The rest, which can change any time, at once */
+	vte_terminal_search_rows_all (terminal, search->regex, search->flags, search->literal,
+				      search->position, _vte_ring_next (ring),
+				      vte_terminal_search_add_match, search);
+	search->position = _vte_ring_next (ring);
+
+	/* The match to select has been dropped from the scrollback meanwhile */
+	if (search->has_target && search->target.start_row < ring->start) {
+		if (search->n_restarts++ == VTE_SEARCH_MAX_RESTARTS)
+			goto busy;
+		vte_terminal_search_restart (terminal, search);
+		return TRUE;
+	}
+
+	/* Done with the task before the handlers can start another one */
+	search->tag = 0;
+	terminal->pvt->search_task = NULL;
+	g_task_return_boolean (task, vte_terminal_search_select_result (terminal, search));
+
+	g_signal_emit (terminal, signals[SEARCH_PROGRESS], 0,
+		       _vte_ring_length (ring), _vte_ring_length (ring), search->n_matches);
+	return FALSE;
+
+busy:
+	search->tag = 0;
+	terminal->pvt->search_task = NULL;
+	g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_BUSY,
+				 "Scrollback changing too fast to search");
+	return FALSE;
+}
+
+/**
+ * vte_terminal_search_find_async:
+ * @terminal: a #VteTerminal
+ * @backward: whether to search backward
+ * @cancellable: (allow-none): a #GCancellable, or %NULL
+ * @callback: (scope async): a #GAsyncReadyCallback, or %NULL
+ * @user_data: (closure callback): user data for @callback
+ *
+ * Like vte_terminal_search_find_next() or vte_terminal_search_find_previous(),
+ * but the buffer is searched in the background, a slice at a time, and all
+ * the matches are counted. #VteTerminal::search-progress is emitted as it goes.
+ * When done, the match is selected and @callback is called; use
+ * vte_terminal_search_find_finish() to get the result.
+ *
+ * Starting another search cancels this one. If the scrollback keeps changing
+ * too much to finish, the search fails with %G_IO_ERROR_BUSY.
+ *
+ * Since: 0.44
+ */
+void
+vte_terminal_search_find_async (VteTerminal *terminal,
+				gboolean backward,
+				GCancellable *cancellable,
+				GAsyncReadyCallback callback,
+				gpointer user_data)
+{
+        VteTerminalPrivate *pvt;
+	VteTerminalSearch *search;
+	GTask *task;
+
+	g_return_if_fail(VTE_IS_TERMINAL(terminal));
+	g_return_if_fail(cancellable == NULL || G_IS_CANCELLABLE (cancellable));
+
+	pvt = terminal->pvt;
+
+	task = g_task_new (terminal, cancellable, callback, user_data);
+	g_task_set_source_tag (task, (gpointer) vte_terminal_search_find_async);
+
+	if (pvt->search_task != NULL) {
+		GTask *old_task = pvt->search_task;
+		VteTerminalSearch *old_search = (VteTerminalSearch *) g_task_get_task_data (old_task);
+
+		pvt->search_task = NULL;
+		g_task_return_new_error (old_task, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+					 "Search superseded");
+		g_source_remove (old_search->tag);
+	}
+
+	if (!pvt->search_regex) {
+		g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+					 "No search regex set");
+		g_object_unref (task);
+		return;
+	}
+
+	search = g_new0 (VteTerminalSearch, 1);
+	search->regex = g_regex_ref (pvt->search_regex);
+	search->flags = (GRegexMatchFlags)(pvt->search_match_flags | G_REGEX_MATCH_NOTEMPTY);
+	search->literal = _vte_ring_literal_copy (pvt->search_literal);
+	search->backward = backward;
+	search->wrap_around = pvt->search_wrap_around;
+	vte_terminal_search_restart (terminal, search);
+	g_task_set_task_data (task, search, vte_terminal_search_free);
+
+	pvt->search_task = task;
+	search->tag = g_idle_add_full (VTE_SEARCH_PRIORITY,
+				       vte_terminal_search_idle,
+				       task,
+				       g_object_unref);
+}
+
+/**
+ * vte_terminal_search_find_finish:
+ * @terminal: a #VteTerminal
+ * @result: a #GAsyncResult
+ * @match_index: (out) (allow-none): the number of the match found, counting from 1
+ * @n_matches: (out) (allow-none): the number of matches in the whole buffer
+ * @error: (allow-none): return location for a #GError, or %NULL
+ *
+ * Finishes a search started with vte_terminal_search_find_async().
+ *
+ * Returns: %TRUE if a match was found and selected
+ *
+ * Since: 0.44
+ */
+gboolean
+vte_terminal_search_find_finish (VteTerminal *terminal,
+				 GAsyncResult *result,
+				 glong *match_index,
+				 glong *n_matches,
+				 GError **error)
+{
+	VteTerminalSearch *search;
+	gboolean found;
+
+	g_return_val_if_fail(VTE_IS_TERMINAL(terminal), FALSE);
+	g_return_val_if_fail(g_task_is_valid (result, terminal), FALSE);
+
+	search = (VteTerminalSearch *) g_task_get_task_data (G_TASK (result));
+	found = g_task_propagate_boolean (G_TASK (result), error);
+
+	if (match_index)
+		*match_index = found ? search->target_index : 0;
+	if (n_matches)
+		*n_matches = search != NULL ? search->n_matches : 0;
+	return found;
+}
+
 /* Just some arbitrary minimum values */
 #define MIN_COLUMNS (16)
 #define MIN_ROWS    (2)
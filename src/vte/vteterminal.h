@@ -110,8 +110,10 @@ struct _VteTerminalClass {
 
 	void (*bell)(VteTerminal* terminal);
 
+	void (*search_progress)(VteTerminal* terminal, glong n_rows_searched, glong n_rows, glong n_matches);
+
         /* Padding for future expansion. */
-        gpointer padding[16];
+        gpointer padding[15];
 
         VteTerminalClassPrivate *priv;
 };
@@ -247,6 +249,23 @@ VteCursorShape vte_terminal_get_cursor_shape(VteTerminal *terminal) _VTE_GNUC_NO
 /* Set the number of scrollback lines, above or at an internal minimum. */
 void vte_terminal_set_scrollback_lines(VteTerminal *terminal,
                                        glong lines) _VTE_GNUC_NONNULL(1);
+void vte_terminal_set_scrollback_in_memory(VteTerminal *terminal,
+                                           gboolean in_memory) _VTE_GNUC_NONNULL(1);
+gboolean vte_terminal_get_scrollback_in_memory(VteTerminal *terminal) _VTE_GNUC_NONNULL(1);
+void vte_terminal_set_scrollback_indexed(VteTerminal *terminal,
+                                         gboolean indexed) _VTE_GNUC_NONNULL(1);
+gboolean vte_terminal_get_scrollback_indexed(VteTerminal *terminal) _VTE_GNUC_NONNULL(1);
+void vte_terminal_set_scrollback_bytes(VteTerminal *terminal,
+                                       guint64 bytes) _VTE_GNUC_NONNULL(1);
+guint64 vte_terminal_get_scrollback_bytes(VteTerminal *terminal) _VTE_GNUC_NONNULL(1);
+void vte_terminal_get_memory_usage(VteTerminal *terminal,
+                                   gsize *rows,
+                                   gsize *buffers,
+                                   gsize *disk) _VTE_GNUC_NONNULL(1);
+void vte_terminal_hibernate(VteTerminal *terminal) _VTE_GNUC_NONNULL(1);
+void vte_terminal_set_hibernate_on_unmap(VteTerminal *terminal,
+                                         gboolean hibernate) _VTE_GNUC_NONNULL(1);
+gboolean vte_terminal_get_hibernate_on_unmap(VteTerminal *terminal) _VTE_GNUC_NONNULL(1);
 
 /* Set or retrieve the current font. */
 void vte_terminal_set_font(VteTerminal *terminal,
@@ -331,11 +350,27 @@ void      vte_terminal_search_set_gregex      (VteTerminal *terminal,
 					       GRegex      *regex,
                                                GRegexMatchFlags flags) _VTE_GNUC_NONNULL(1);
 GRegex   *vte_terminal_search_get_gregex      (VteTerminal *terminal) _VTE_GNUC_NONNULL(1);
+void      vte_terminal_search_set_text        (VteTerminal *terminal,
+                                               const char  *text,
+                                               gboolean     case_sensitive) _VTE_GNUC_NONNULL(1);
 void      vte_terminal_search_set_wrap_around (VteTerminal *terminal,
 					       gboolean     wrap_around) _VTE_GNUC_NONNULL(1);
 gboolean  vte_terminal_search_get_wrap_around (VteTerminal *terminal) _VTE_GNUC_NONNULL(1);
+void      vte_terminal_search_set_highlight_all (VteTerminal *terminal,
+                                                 gboolean     highlight_all) _VTE_GNUC_NONNULL(1);
+gboolean  vte_terminal_search_get_highlight_all (VteTerminal *terminal) _VTE_GNUC_NONNULL(1);
 gboolean  vte_terminal_search_find_previous   (VteTerminal *terminal) _VTE_GNUC_NONNULL(1);
 gboolean  vte_terminal_search_find_next       (VteTerminal *terminal) _VTE_GNUC_NONNULL(1);
+void      vte_terminal_search_find_async      (VteTerminal *terminal,
+                                               gboolean backward,
+                                               GCancellable *cancellable,
+                                               GAsyncReadyCallback callback,
+                                               gpointer user_data) _VTE_GNUC_NONNULL(1);
+gboolean  vte_terminal_search_find_finish     (VteTerminal *terminal,
+                                               GAsyncResult *result,
+                                               glong *match_index,
+                                               glong *n_matches,
+                                               GError **error) _VTE_GNUC_NONNULL(1) _VTE_GNUC_NONNULL(2);
 
 
 /* Set the character encoding.  Most of the time you won't need this. */
@@ -383,6 +418,16 @@ gboolean vte_terminal_write_contents_sync (VteTerminal *terminal,
                                            GCancellable *cancellable,
                                            GError **error) _VTE_GNUC_NONNULL(1) _VTE_GNUC_NONNULL(2);
 
+/* Snapshots of the state */
+gboolean vte_terminal_write_snapshot_sync (VteTerminal *terminal,
+                                           GOutputStream *stream,
+                                           GCancellable *cancellable,
+                                           GError **error) _VTE_GNUC_NONNULL(1) _VTE_GNUC_NONNULL(2);
+gboolean vte_terminal_read_snapshot_sync (VteTerminal *terminal,
+                                          GInputStream *stream,
+                                          GCancellable *cancellable,
+                                          GError **error) _VTE_GNUC_NONNULL(1) _VTE_GNUC_NONNULL(2);
+
 G_END_DECLS
 
 #endif /* __VTE_VTE_TERMINAL_H__ */
@@ -74,6 +74,20 @@
 #define VTE_UPDATE_TIMEOUT		15
 #define VTE_UPDATE_REPEAT_TIMEOUT	30
 #define VTE_MAX_PROCESS_TIME		100
+#define VTE_HIBERNATE_TIMEOUT		30000
+#define VTE_REWRAP_PRIORITY		G_PRIORITY_LOW
+#define VTE_REWRAP_BATCH_ROWS		1000
+#define VTE_REWRAP_POLL_TIMEOUT		5
+#define VTE_RESIZE_TIMEOUT		40
+#define VTE_RESIZE_MAX_DELAY		200
+#define VTE_SEARCH_PRIORITY		G_PRIORITY_DEFAULT_IDLE
+#define VTE_SEARCH_TIMESLICE		10
+#define VTE_SEARCH_BATCH_ROWS		4096
+#define VTE_SEARCH_MAX_RESTARTS		16
+#define VTE_SEARCH_HIGHLIGHT_ROWS	512
+#define VTE_SEARCH_HIGHLIGHT_CONTEXT	256
+#define VTE_SEARCH_HIGHLIGHT_ALPHA	0x60
+#define VTE_MATCH_PARAGRAPHS		64
 #define VTE_CELL_BBOX_SLACK		1
 #define VTE_DEFAULT_UTF8_AMBIGUOUS_WIDTH 1
 
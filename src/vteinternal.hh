@@ -41,6 +41,7 @@ struct vte_match_regex {
 	gint tag;
         GRegex *regex;
         GRegexMatchFlags match_flags;
+        guint combined;         /* index into match_combined */
         VteRegexCursorMode cursor_mode;
         union {
 	       GdkCursor *cursor;
@@ -158,6 +159,51 @@ struct vte_scrolling_region {
         int start, end;
 };
 
+/* Columns of a visible row to be repainted, empty if start >= end. */
+struct vte_damage_span {
+        glong start, end;
+};
+
+/* Columns of a row covered by matches of the search regex. */
+struct vte_search_span {
+        glong start, end;
+};
+
+/* The search regex's matches in a row, see vte_terminal_search_highlight_rows(). */
+struct vte_search_highlight {
+        glong row;      /* -1 if unused */
+        guint64 key;    /* of the paragraph's rows, see vte_terminal_paragraph_key() */
+        GArray *spans;  /* of struct vte_search_span, in order */
+};
+
+/* Match regexes with the same flags as one alternation, which tells with one
+ * scan whether any of them matches, see vte_terminal_match_combine(). */
+struct vte_match_combined {
+        GRegex *regex;  /* NULL if not combined, the regexes are then always run */
+        GRegexCompileFlags compile_flags;
+        GRegexMatchFlags match_flags;
+        GString *pattern;       /* while combining, NULL if not combinable */
+        guint n_regexes;
+        gboolean matched;       /* in the paragraph being matched */
+};
+
+/* A match of a match regex, as byte offsets into its paragraph's text. */
+struct vte_match_span {
+        guint regex;    /* index into match_regexes */
+        gint start, end;
+};
+
+/* The matches of all the match regexes in a visible paragraph, see
+ * vte_terminal_match_paragraph(). */
+struct vte_match_paragraph {
+        glong start_row, end_row;       /* [start_row, end_row), start_row is -1 if unused */
+        guint64 key;    /* of the rows, see vte_terminal_paragraph_key(), and the width */
+        char *text;
+        gsize len;      /* of the text without its final newline */
+        GArray *attrs;  /* of struct _VteCharAttributes, one per byte of text */
+        GArray *matches;        /* of struct vte_match_span, by regex then offset */
+};
+
 /* Terminal private data. */
 class VteTerminalPrivate {
 public:
@@ -167,6 +213,11 @@ public:
         /* Metric and sizing data: dimensions of the window */
         glong row_count;
         glong column_count;
+        /* Size from the last allocation, not yet applied while resizing */
+        guint resize_tag;
+        gint64 resize_since;
+        glong resize_columns;
+        glong resize_rows;
 
 	/* Emulation setup data. */
 	struct _vte_matcher *matcher;	/* control sequence matcher */
@@ -190,8 +241,14 @@ public:
 	struct _vte_iso2022_state *iso2022;
 	_vte_incoming_chunk_t *incoming;/* pending bytestream */
 	GArray *pending;		/* pending characters */
-	GSList *update_regions;
+	struct vte_damage_span *damage; /* per visible row */
+        glong damage_rows;
+        gboolean damage_pending;
+        gboolean damage_all;
 	gboolean invalidated_all;	/* pending refresh of entire terminal */
+        gboolean scroll_pending;        /* pending pixel copy of visible rows */
+        glong scroll_row_start, scroll_row_end;
+        glong scroll_rows;              /* negative = up */
 	GList *active;                  /* is the terminal processing data */
 	glong input_bytes;
 	glong max_input_bytes;
@@ -264,6 +321,7 @@ public:
 	gboolean text_inserted_flag;
 	gboolean text_deleted_flag;
 	gboolean rewrap_on_resize;
+	guint rewrap_tag;  /* rewrapping the rest of the history */
 	gboolean bracketed_paste_mode;
 
 	/* Scrolling options. */
@@ -272,6 +330,13 @@ public:
 	gboolean scroll_on_keystroke;
 	gboolean alternate_screen_scroll;
 	long scrollback_lines;
+        gboolean scrollback_in_memory;
+        gboolean scrollback_indexed;
+        guint64 scrollback_bytes;
+
+        /* Releasing memory while unmapped */
+        gboolean hibernate_on_unmap;
+        guint hibernate_tag;
 
         /* Restricted scrolling */
         struct vte_scrolling_region scrolling_region;     /* the region we scroll in */
@@ -314,9 +379,9 @@ public:
         gboolean focus_tracking_mode;
 
 	/* State variables for handling match checks. */
-	char *match_contents;
-	GArray *match_attributes;
+	struct vte_match_paragraph *match_paragraphs; /* VTE_MATCH_PARAGRAPHS of them */
 	GArray *match_regexes;
+	GArray *match_combined; /* of struct vte_match_combined, NULL until needed */
 	char *match;
 	int match_tag;
 	VteVisualPosition match_start, match_end;
@@ -325,8 +390,12 @@ public:
 	/* Search data. */
 	GRegex *search_regex;
         GRegexMatchFlags search_match_flags;
+	VteRingLiteral *search_literal; /* the text search_regex matches, if set by vte_terminal_search_set_text() */
 	gboolean search_wrap_around;
 	GArray *search_attrs; /* Cache attrs */
+	GTask *search_task; /* the running vte_terminal_search_find_async() */
+	gboolean search_highlight_all;
+	struct vte_search_highlight *search_highlights; /* VTE_SEARCH_HIGHLIGHT_ROWS of them */
 
 	/* Data used when rendering the text which does not require server
 	 * resources and which can be kept after unrealizing. */
@@ -79,8 +79,10 @@ void
 _vte_row_data_clear (VteRowData *row)
 {
 	VteCell *cells = row->cells;
+	guint32 generation = row->generation;
 	_vte_row_data_init (row);
 	row->cells = cells;
+	row->generation = generation;
 }
 
 void
@@ -91,6 +93,17 @@ _vte_row_data_fini (VteRowData *row)
 	row->cells = NULL;
 }
 
+/* Bytes allocated for the cells of the row */
+gsize
+_vte_row_data_get_allocated_size (const VteRowData *row)
+{
+	VteCells *cells = _vte_cells_for_cell_array (row->cells);
+	if (!cells)
+		return 0;
+
+	return G_STRUCT_OFFSET (VteCells, cells) + cells->alloc_len * sizeof (cells->cells[0]);
+}
+
 static inline gboolean
 _vte_row_data_ensure (VteRowData *row, gulong len)
 {
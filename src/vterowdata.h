@@ -136,6 +136,7 @@ typedef struct _VteRowData {
 	VteCell *cells;
 	guint16 len;
 	VteRowAttr attr;
+	guint32 generation;  /* changes whenever the writable row might change, set by the ring */
 } VteRowData;
 
 
@@ -167,6 +168,7 @@ void _vte_row_data_append (VteRowData *row, const VteCell *cell);
 void _vte_row_data_remove (VteRowData *row, gulong col);
 void _vte_row_data_fill (VteRowData *row, const VteCell *cell, gulong len);
 void _vte_row_data_shrink (VteRowData *row, gulong max_len);
+gsize _vte_row_data_get_allocated_size (const VteRowData *row);
 
 
 G_END_DECLS
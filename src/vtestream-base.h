@@ -36,11 +36,14 @@ typedef struct _VteStreamClass {
 
 	void (*reset) (VteStream *stream, gsize offset);
 	gboolean (*read) (VteStream *stream, gsize offset, char *data, gsize len);
+	gboolean (*read_concurrent) (VteStream *stream, gsize offset, char *data, gsize len);
 	void (*append) (VteStream *stream, const char *data, gsize len);
 	void (*truncate) (VteStream *stream, gsize offset);
 	void (*advance_tail) (VteStream *stream, gsize offset);
 	gsize (*tail) (VteStream *stream);
 	gsize (*head) (VteStream *stream);
+	void (*get_usage) (VteStream *stream, gsize *memory, gsize *disk);
+	void (*trim) (VteStream *stream);
 } VteStreamClass;
 
 static GType _vte_stream_get_type (void);
@@ -71,6 +74,14 @@ _vte_stream_read (VteStream *stream, gsize offset, char *data, gsize len)
 	return VTE_STREAM_GET_CLASS (stream)->read (stream, offset, data, len);
 }
 
+/* Like _vte_stream_read(), but bypassing the read cache, so that several
+ * threads can read at once, as long as the stream isn't changed meanwhile */
+gboolean
+_vte_stream_read_concurrent (VteStream *stream, gsize offset, char *data, gsize len)
+{
+	return VTE_STREAM_GET_CLASS (stream)->read_concurrent (stream, offset, data, len);
+}
+
 void
 _vte_stream_append (VteStream *stream, const char *data, gsize len)
 {
@@ -101,5 +112,18 @@ _vte_stream_head (VteStream *stream)
 	return VTE_STREAM_GET_CLASS (stream)->head (stream);
 }
 
+/* Bytes of memory and disk space taken by the stream, both are added to */
+void
+_vte_stream_get_usage (VteStream *stream, gsize *memory, gsize *disk)
+{
+	VTE_STREAM_GET_CLASS (stream)->get_usage (stream, memory, disk);
+}
+
+void
+_vte_stream_trim (VteStream *stream)
+{
+	VTE_STREAM_GET_CLASS (stream)->trim (stream);
+}
+
 G_END_DECLS
 
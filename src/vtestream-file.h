@@ -89,6 +89,12 @@
 # include <gnutls/crypto.h>
 #endif
 
+/* Without encryption, the file can be mapped and blocks accessed in place */
+#if defined HAVE_SYS_MMAN_H && defined HAVE_MMAP && (defined VTESTREAM_MAIN || !defined WITH_GNUTLS)
+# define VTE_SNAKE_MMAP 1
+# include <sys/mman.h>
+#endif
+
 #include "vteutils.h"
 
 G_BEGIN_DECLS
@@ -117,10 +123,38 @@ typedef guint8 _vte_overwrite_counter_t;
 # define VTE_CIPHER_TAG_SIZE     1
 #endif
 
+#ifdef VTE_SNAKE_MMAP
+/* Size of the file windows mapped at once, and how many of them are kept */
+# ifndef VTESTREAM_MAIN
+#  define VTE_SNAKE_MMAP_WINDOW  (16 * 1024 * 1024)
+# else
+#  define VTE_SNAKE_MMAP_WINDOW  0  /* As small as possible */
+# endif
+# define VTE_SNAKE_MMAP_WINDOWS  2
+#endif
+
 #define VTE_BLOCK_DATALENGTH_SIZE  sizeof(_vte_block_datalength_t)
+/* The top 4 bits of the data length field denote the codec */
+#define VTE_BLOCK_CODEC_SHIFT      (8 * VTE_BLOCK_DATALENGTH_SIZE - 4)
+#define VTE_BLOCK_DATALENGTH_MASK  ((1U << VTE_BLOCK_CODEC_SHIFT) - 1)
 #define VTE_OVERWRITE_COUNTER_SIZE sizeof(_vte_overwrite_counter_t)
 #define VTE_BOA_BLOCKSIZE (VTE_SNAKE_BLOCKSIZE - VTE_BLOCK_DATALENGTH_SIZE - VTE_OVERWRITE_COUNTER_SIZE - VTE_CIPHER_TAG_SIZE)
 
+enum {
+        VTE_BOA_CODEC_ZLIB,
+        VTE_BOA_CODEC_LZ,
+        VTE_BOA_CODEC_COUNT
+};
+
+/* The codec for writing new blocks; zlib compresses better, LZ is a lot faster */
+#ifndef VTE_BOA_CODEC
+# ifndef VTESTREAM_MAIN
+#  define VTE_BOA_CODEC VTE_BOA_CODEC_LZ
+# else
+#  define VTE_BOA_CODEC VTE_BOA_CODEC_ZLIB
+# endif
+#endif
+
 #define OFFSET_BOA_TO_SNAKE(x) ((x) / VTE_BOA_BLOCKSIZE * VTE_SNAKE_BLOCKSIZE)
 #define ALIGN_BOA(x) ((x) / VTE_BOA_BLOCKSIZE * VTE_BOA_BLOCKSIZE)
 #define MOD_BOA(x)   ((x) % VTE_BOA_BLOCKSIZE)
@@ -343,6 +377,15 @@ typedef struct _VteSnake {
                 gsize fd_head;  /* FD's physical head offset. One of these four is redundant, nevermind. */
         } segment[3];           /* At most 3 segments, [0] at the tail. */
         gsize tail, head;       /* These are redundant too, for convenience. */
+#ifdef VTE_SNAKE_MMAP
+        gboolean use_mmap;
+        gsize fd_size;          /* The mapping is only accessed below this, past EOF would raise SIGBUS. */
+        gsize map_size;
+        struct {
+                char *data;
+                gsize start;
+        } map[VTE_SNAKE_MMAP_WINDOWS];  /* Most recently used first. */
+#endif
 } VteSnake;
 #define VTE_SNAKE_SEGMENTS(s) ((s)->state == 4 ? 2 : (s)->state)
 
@@ -366,14 +409,39 @@ G_DEFINE_TYPE (VteSnake, _vte_snake, G_TYPE_OBJECT)
 static void
 _vte_snake_init (VteSnake *snake)
 {
+#ifdef VTE_SNAKE_MMAP
+        gsize page_size = sysconf (_SC_PAGESIZE);
+        gsize half;
+#endif
+
         snake->fd = -1;
         snake->state = 1;
+
+#ifdef VTE_SNAKE_MMAP
+        /* A window consists of two page aligned halves, each large enough to hold a block.
+         * Windows are placed so that a block starts in the first half, hence fits entirely. */
+        half = MAX (VTE_SNAKE_MMAP_WINDOW / 2, VTE_SNAKE_BLOCKSIZE);
+        half = (half + page_size - 1) / page_size * page_size;
+        snake->map_size = 2 * half;
+# ifndef VTESTREAM_MAIN
+        /* Don't eat up the address space of 32 bit systems */
+        snake->use_mmap = GLIB_SIZEOF_VOID_P >= 8;
+# endif
+#endif
 }
 
 static void
 _vte_snake_finalize (GObject *object)
 {
         VteSnake *snake = (VteSnake *) object;
+#ifdef VTE_SNAKE_MMAP
+        int i;
+
+        for (i = 0; i < VTE_SNAKE_MMAP_WINDOWS; i++) {
+                if (snake->map[i].data != NULL)
+                        munmap (snake->map[i].data, snake->map_size);
+        }
+#endif
 
         _file_close (snake->fd);
 
@@ -389,6 +457,87 @@ _vte_snake_ensure_file (VteSnake *snake)
         snake->fd = _vte_mkstemp ();
 }
 
+static void
+_vte_snake_truncate (VteSnake *snake, gsize offset)
+{
+#ifdef VTE_SNAKE_MMAP
+        if (_file_try_truncate (snake->fd, offset) || offset < snake->fd_size)
+                snake->fd_size = offset;
+#else
+        _file_try_truncate (snake->fd, offset);
+#endif
+}
+
+#ifdef VTE_SNAKE_MMAP
+/*
+ * Return the address of the block at the physical offset fd_offset in the
+ * mapping, mapping a new window if necessary; or NULL if the file can't
+ * be accessed this way. The address is valid until the next call.
+ */
+static char *
+_vte_snake_map (VteSnake *snake, gsize fd_offset)
+{
+        gsize half = snake->map_size / 2;
+        gsize start;
+        char *data;
+        int i;
+
+        if (!snake->use_mmap || snake->fd == -1 || fd_offset + VTE_SNAKE_BLOCKSIZE > snake->fd_size)
+                return NULL;
+
+        for (i = 0; i < VTE_SNAKE_MMAP_WINDOWS; i++) {
+                if (snake->map[i].data != NULL &&
+                    fd_offset >= snake->map[i].start &&
+                    fd_offset + VTE_SNAKE_BLOCKSIZE <= snake->map[i].start + snake->map_size) {
+                        if (i > 0) {
+                                data = snake->map[i].data;
+                                start = snake->map[i].start;
+                                memmove (&snake->map[1], &snake->map[0], i * sizeof (snake->map[0]));
+                                snake->map[0].data = data;
+                                snake->map[0].start = start;
+                        }
+                        return snake->map[0].data + (fd_offset - snake->map[0].start);
+                }
+        }
+
+        /* The window can extend past EOF, as long as we don't touch that part */
+        start = fd_offset / half * half;
+        data = (char *) mmap (NULL, snake->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, snake->fd, start);
+        if (G_UNLIKELY (data == MAP_FAILED)) {
+                /* Fall back to reading and writing the file for good */
+                snake->use_mmap = FALSE;
+                return NULL;
+        }
+
+        if (snake->map[VTE_SNAKE_MMAP_WINDOWS - 1].data != NULL)
+                munmap (snake->map[VTE_SNAKE_MMAP_WINDOWS - 1].data, snake->map_size);
+        memmove (&snake->map[1], &snake->map[0], (VTE_SNAKE_MMAP_WINDOWS - 1) * sizeof (snake->map[0]));
+        snake->map[0].data = data;
+        snake->map[0].start = start;
+        return data + (fd_offset - start);
+}
+
+/*
+ * Storing to a mapped hole raises SIGBUS if the disk is full, rather than
+ * failing gracefully like pwrite() does. So allocate the disk space first.
+ */
+static gboolean
+_vte_snake_reserve (VteSnake *snake, gsize fd_offset, gsize len)
+{
+# ifdef FALLOC_FL_KEEP_SIZE
+        int ret;
+
+        do {
+                ret = fallocate (snake->fd, FALLOC_FL_KEEP_SIZE, fd_offset, len);
+        } while (ret == -1 && errno == EINTR);
+
+        return !ret;
+# else
+        return FALSE;
+# endif
+}
+#endif
+
 static void _vte_snake_advance_tail (VteSnake *snake, gsize offset);
 static void
 _vte_snake_reset (VteSnake *snake, gsize offset)
@@ -400,6 +549,9 @@ _vte_snake_reset (VteSnake *snake, gsize offset)
 
         if (G_LIKELY (offset >= snake->head)) {
                 _file_reset (snake->fd);
+#ifdef VTE_SNAKE_MMAP
+                snake->fd_size = 0;
+#endif
                 snake->segment[0].st_tail = snake->segment[0].st_head = snake->tail = snake->head = offset;
                 snake->segment[0].fd_tail = snake->segment[0].fd_head = 0;
                 snake->state = 1;
@@ -433,6 +585,9 @@ static gboolean
 _vte_snake_read (VteSnake *snake, gsize offset, char *data)
 {
         gsize fd_offset;
+#ifdef VTE_SNAKE_MMAP
+        const char *mapped;
+#endif
 
         g_assert_cmpuint (offset % VTE_SNAKE_BLOCKSIZE, ==, 0);
 
@@ -441,9 +596,31 @@ _vte_snake_read (VteSnake *snake, gsize offset, char *data)
 
         fd_offset = _vte_snake_offset_map(snake, offset);
 
+#ifdef VTE_SNAKE_MMAP
+        if (G_LIKELY ((mapped = _vte_snake_map (snake, fd_offset)) != NULL)) {
+                memcpy (data, mapped, VTE_SNAKE_BLOCKSIZE);
+                return TRUE;
+        }
+#endif
+
         return (_file_read (snake->fd, data, VTE_SNAKE_BLOCKSIZE, fd_offset) == VTE_SNAKE_BLOCKSIZE);
 }
 
+#if defined VTE_SNAKE_MMAP && !defined VTESTREAM_MAIN
+/* Like _vte_snake_read(), but return the block in place without copying it, valid until
+ * the next operation on the snake; or NULL if this is not possible. */
+static const char *
+_vte_snake_peek (VteSnake *snake, gsize offset)
+{
+        g_assert_cmpuint (offset % VTE_SNAKE_BLOCKSIZE, ==, 0);
+
+        if (G_UNLIKELY (offset < snake->tail || offset >= snake->head))
+                return NULL;
+
+        return _vte_snake_map (snake, _vte_snake_offset_map(snake, offset));
+}
+#endif
+
 /*
  * offset is either within the stream (overwrite data), or at its head (append data).
  * data is at most VTE_SNAKE_BLOCKSIZE bytes large; if shorter then the remaining amount is skipped.
@@ -457,6 +634,9 @@ static void
 _vte_snake_write (VteSnake *snake, gsize offset, const char *data, gsize len)
 {
         gsize fd_offset;
+#ifdef VTE_SNAKE_MMAP
+        char *mapped;
+#endif
 
         g_assert_cmpuint (offset, >=, snake->tail);
         g_assert_cmpuint (offset, <=, snake->head);
@@ -490,7 +670,7 @@ _vte_snake_write (VteSnake *snake, gsize offset, const char *data, gsize len)
                 if (snake->state != 2) {
                         /* Grow the file with sparse blocks to make sure that later pread() can
                          * read back a whole block, even if we are about to write a shorter one. */
-                        _file_try_truncate (snake->fd, fd_offset + VTE_SNAKE_BLOCKSIZE);
+                        _vte_snake_truncate (snake, fd_offset + VTE_SNAKE_BLOCKSIZE);
 #ifdef VTESTREAM_MAIN
                         /* For convenient unit testing only: fill with dots. */
                         _file_try_punch_hole (snake->fd, fd_offset, VTE_SNAKE_BLOCKSIZE);
@@ -503,6 +683,14 @@ _vte_snake_write (VteSnake *snake, gsize offset, const char *data, gsize len)
                 fd_offset = _vte_snake_offset_map(snake, offset);
                 _file_try_punch_hole (snake->fd, fd_offset, VTE_SNAKE_BLOCKSIZE);
         }
+
+#ifdef VTE_SNAKE_MMAP
+        if (G_LIKELY (len > 0 && _vte_snake_reserve (snake, fd_offset, len) &&
+                      (mapped = _vte_snake_map (snake, fd_offset)) != NULL)) {
+                memcpy (mapped, data, len);
+                return;
+        }
+#endif
         _file_write (snake->fd, data, len, fd_offset);
 }
 
@@ -538,7 +726,7 @@ _vte_snake_advance_tail (VteSnake *snake, gsize offset)
                                 break;
                         case 2:
                                 snake->segment[0] = snake->segment[1];
-                                _file_try_truncate (snake->fd, snake->segment[0].fd_head);
+                                _vte_snake_truncate (snake, snake->segment[0].fd_head);
                                 snake->state = 1;
                                 break;
                         case 3:
@@ -619,6 +807,7 @@ _vte_snake_class_init (VteSnakeClass *klass)
  *
  * Structure of the block that we give to the snake:
  * - 0..4 (0..1): The length of the compressed and encrypted Data, that is D-8 (D-2) [VTE_BLOCK_DATALENGTH_SIZE bytes]
+ *   Its top 4 bits denote the compression codec, see VTE_BOA_CODEC_*
  * - 4..8 (1..2): Overwrite counter [VTE_OVERWRITE_COUNTER_SIZE bytes]
  * - 8..D (2..D): The compressed and encrypted Data [<= VTE_BOA_BLOCKSIZE bytes]
  * - D..T: Encryption verification Tag [VTE_CIPHER_TAG_SIZE bytes]
@@ -626,26 +815,43 @@ _vte_snake_class_init (VteSnakeClass *klass)
  */
 
 #if !defined VTESTREAM_MAIN && defined WITH_GNUTLS
-        /* The IV (nonce) consists of the offset within the stream, and an overwrite counter so that
+        /* The IV (nonce) consists of the block's index within the stream, and an overwrite counter so that
          * we don't reuse the same IVs when a block at a certain logical offset is overwritten.
+         * The streams share the key, so the top bits of the index hold the id of the stream.
          * The padding is there to make sure the structure is at least VTE_CIPHER_IV_SIZE bytes large.
          * Assertion is made later that the real data fits in its first VTE_CIPHER_IV_SIZE bytes.
          */
         typedef struct _VteIv {
-                gsize offset;
+                guint64 index;
                 guint32 overwrite_counter;
                 unsigned char padding[VTE_CIPHER_IV_SIZE];
         } VteIv;
+
+# define VTE_CIPHER_STREAM_ID_BITS 24
+
+        /* A key shared by the streams, each of them getting a distinct stream id. Once they run out,
+         * a new key is generated for the next streams. */
+        typedef struct _VteCipherKey {
+                int ref_count;
+                guint32 next_stream_id;
+                unsigned char data[VTE_CIPHER_KEY_SIZE];
+        } VteCipherKey;
 #endif
 
+typedef struct _VteBoaCodec VteBoaCodec;
+
 typedef struct _VteBoa {
         VteSnake parent;
         gsize tail, head;
 
 #if !defined VTESTREAM_MAIN && defined WITH_GNUTLS
-        gnutls_cipher_hd_t cipher_hd;
+        VteCipherKey *key;
+        guint32 stream_id;
+        gnutls_cipher_hd_t cipher_hd;  /* set up on first use */
         VteIv iv;
 #endif
+        const VteBoaCodec *codec;
+        int codec_id;
         int compressBound;
 } VteBoa;
 
@@ -653,7 +859,7 @@ typedef struct _VteBoaClass {
         GObjectClass parent_class;
 
         void (*reset) (VteBoa *boa, gsize offset);
-        void (*write) (VteBoa *boa, gsize offset, const char *data);
+        gsize (*write) (VteBoa *boa, gsize offset, const char *data);
         gboolean (*read) (VteBoa *boa, gsize offset, char *data);
         void (*advance_tail) (VteBoa *boa, gsize offset);
         gsize (*tail) (VteBoa *boa);
@@ -668,6 +874,75 @@ G_DEFINE_TYPE (VteBoa, _vte_boa, VTE_TYPE_SNAKE)
 
 /*----------------------------------------------------------------------------------------*/
 
+#if !defined VTESTREAM_MAIN && defined WITH_GNUTLS
+/* The key new streams get. Like the worker pool, only used from the main thread. */
+static VteCipherKey *_vte_cipher_key = NULL;
+
+static void
+_vte_cipher_key_unref (VteCipherKey *key)
+{
+        if (--key->ref_count > 0)
+                return;
+
+        memset(key->data, 0, VTE_CIPHER_KEY_SIZE);
+        g_free (key);
+        gnutls_global_deinit ();
+}
+
+/* Returns a reference to the current key, and a stream id that's unique for it */
+static VteCipherKey *
+_vte_cipher_key_get (guint32 *stream_id)
+{
+        VteCipherKey *key = _vte_cipher_key;
+
+        if (G_UNLIKELY (key == NULL || key->next_stream_id == (1U << VTE_CIPHER_STREAM_ID_BITS))) {
+                if (key != NULL)
+                        _vte_cipher_key_unref (key);
+
+                gnutls_global_init ();
+
+                /* Assert that VTE_CIPHER_* constants are defined correctly. Should happen compile-time, nevermind. */
+                g_assert_cmpuint (gnutls_cipher_get_iv_size(VTE_CIPHER_ALGORITHM), ==, VTE_CIPHER_IV_SIZE);
+                g_assert_cmpuint (gnutls_cipher_get_tag_size(VTE_CIPHER_ALGORITHM), ==, VTE_CIPHER_TAG_SIZE);
+
+                /* Assert that IV does indeed include all the data we want to use (index and overwrite_counter). */
+                g_assert_cmpuint (offsetof(struct _VteIv, padding), <=, VTE_CIPHER_IV_SIZE);
+
+                key = _vte_cipher_key = g_new0 (VteCipherKey, 1);
+                key->ref_count = 1;  /* for _vte_cipher_key */
+
+                /* Strong random for the key. */
+                gnutls_rnd(GNUTLS_RND_KEY, key->data, VTE_CIPHER_KEY_SIZE);
+        }
+
+        *stream_id = key->next_stream_id++;
+        key->ref_count++;
+        return key;
+}
+
+/* Set up the cipher of a boa on first use, streams that never write a block don't need one */
+static void
+_vte_boa_ensure_cipher (VteBoa *boa)
+{
+        gnutls_datum_t datum_key;
+
+        if (G_LIKELY (boa->cipher_hd != NULL))
+                return;
+
+        datum_key.data = boa->key->data;
+        datum_key.size = VTE_CIPHER_KEY_SIZE;
+        gnutls_cipher_init(&boa->cipher_hd, VTE_CIPHER_ALGORITHM, &datum_key, NULL);
+}
+
+/* The block's index in the stream with the stream id on top, the block index gets the other 40 bits
+ * which are enough for the lifetime of any stream */
+static inline guint64
+_vte_boa_iv_index (VteBoa *boa, gsize offset)
+{
+        return ((guint64) boa->stream_id << (64 - VTE_CIPHER_STREAM_ID_BITS)) | (offset / VTE_BOA_BLOCKSIZE);
+}
+#endif
+
 /* Thin wrapper layers above the compression and encryption routines, for unit testing. */
 
 /* Encrypt: len bytes are overwritten in place, followed by VTE_CIPHER_TAG_SIZE more bytes for the tag. */
@@ -676,7 +951,8 @@ _vte_boa_encrypt (VteBoa *boa, gsize offset, guint32 overwrite_counter, char *da
 {
 #ifndef VTESTREAM_MAIN
 # ifdef WITH_GNUTLS
-        boa->iv.offset = offset;
+        _vte_boa_ensure_cipher (boa);
+        boa->iv.index = _vte_boa_iv_index (boa, offset);
         boa->iv.overwrite_counter = overwrite_counter;
         gnutls_cipher_set_iv (boa->cipher_hd, &boa->iv, VTE_CIPHER_IV_SIZE);
         gnutls_cipher_encrypt (boa->cipher_hd, data, len);
@@ -707,7 +983,8 @@ _vte_boa_decrypt (VteBoa *boa, gsize offset, guint32 overwrite_counter, char *da
 
 #ifndef VTESTREAM_MAIN
 # ifdef WITH_GNUTLS
-        boa->iv.offset = offset;
+        _vte_boa_ensure_cipher (boa);
+        boa->iv.index = _vte_boa_iv_index (boa, offset);
         boa->iv.overwrite_counter = overwrite_counter;
         gnutls_cipher_set_iv (boa->cipher_hd, &boa->iv, VTE_CIPHER_IV_SIZE);
         gnutls_cipher_decrypt (boa->cipher_hd, data, len);
@@ -808,37 +1085,241 @@ _vte_boa_uncompress (char *dst, unsigned int dstlen, const char *src, unsigned i
 
 /*----------------------------------------------------------------------------------------*/
 
-static void
-_vte_boa_init (VteBoa *boa)
+/*
+ * A fast LZ77 codec in the spirit of LZ4, used for compressing the boa blocks by default.
+ * It trades compression ratio for speed, which is what scrollback needs: it's
+ * written once at output speed, and read back whenever scrolling.
+ *
+ * The compressed data is a series of sequences, each one consisting of
+ * - a token byte, the upper 4 bits are the number of literals, the lower 4 bits
+ *   are the length of the match minus VTE_LZ_MIN_MATCH,
+ * - if the number of literals is 15 or more, additional bytes of it, each of them
+ *   added to the length, until a byte other than 255,
+ * - the literals,
+ * - the offset of the match backwards, 2 bytes little endian,
+ * - if the match length is 15 or more, additional bytes of it, as above.
+ * The last sequence consists of the token and the literals only.
+ */
+
+#define VTE_LZ_MIN_MATCH     4
+#define VTE_LZ_MAX_OFFSET    65535
+#define VTE_LZ_HASH_BITS     12
+/* Leave the last bytes as literals so that the match finder never reads past the end */
+#define VTE_LZ_LAST_LITERALS 5
+
+static int
+_vte_lz_compressBound (unsigned int len)
 {
-#if !defined VTESTREAM_MAIN && defined WITH_GNUTLS
-        unsigned char key[VTE_CIPHER_KEY_SIZE];
-        gnutls_datum_t datum_key;
+        return len + len / 255 + 16;
+}
+
+static inline guint32
+_vte_lz_read32 (const unsigned char *p)
+{
+        guint32 v;
+        memcpy (&v, p, sizeof (v));
+        return v;
+}
+
+static inline unsigned int
+_vte_lz_hash (guint32 v)
+{
+        return (v * 2654435761U) >> (32 - VTE_LZ_HASH_BITS);
+}
+
+static inline unsigned char *
+_vte_lz_write_length (unsigned char *op, unsigned int len)
+{
+        while (len >= 255) {
+                *op++ = 255;
+                len -= 255;
+        }
+        *op++ = len;
+        return op;
+}
+
+/* Compress; returns the compressed size which might be bigger than the original.
+ * dstlen has to be at least _vte_lz_compressBound(srclen). */
+static unsigned int
+_vte_lz_compress (char *dst, unsigned int dstlen, const char *src, unsigned int srclen)
+{
+        const unsigned char *ip = (const unsigned char *) src;
+        const unsigned char *anchor = ip;
+        const unsigned char *base = ip;
+        const unsigned char *end = ip + srclen;
+        const unsigned char *limit = srclen > VTE_LZ_MIN_MATCH + VTE_LZ_LAST_LITERALS ? end - VTE_LZ_MIN_MATCH - VTE_LZ_LAST_LITERALS : base;
+        unsigned char *op = (unsigned char *) dst;
+        unsigned char *token;
+        unsigned int table[1 << VTE_LZ_HASH_BITS];
+        unsigned int litlen, matchlen, offset;
+
+        g_assert_cmpuint (dstlen, >=, (unsigned int) _vte_lz_compressBound (srclen));
+
+        memset (table, 0, sizeof (table));
+
+        while (ip < limit) {
+                guint32 seq = _vte_lz_read32 (ip);
+                unsigned int h = _vte_lz_hash (seq);
+                const unsigned char *ref = base + table[h];
+                const unsigned char *match;
+
+                table[h] = ip - base;
+                if (ref >= ip || ip - ref > VTE_LZ_MAX_OFFSET || _vte_lz_read32 (ref) != seq) {
+                        ip++;
+                        continue;
+                }
 
-        gnutls_global_init ();
+                /* Extend the match */
+                match = ip;
+                offset = ip - ref;
+                ip += VTE_LZ_MIN_MATCH;
+                ref += VTE_LZ_MIN_MATCH;
+                while (ip < end - VTE_LZ_LAST_LITERALS && *ip == *ref) {
+                        ip++;
+                        ref++;
+                }
 
-        /* Assert that VTE_CIPHER_* constants are defined correctly. Should happen compile-time, nevermind. */
-        g_assert_cmpuint (gnutls_cipher_get_iv_size(VTE_CIPHER_ALGORITHM), ==, VTE_CIPHER_IV_SIZE);
-        g_assert_cmpuint (gnutls_cipher_get_tag_size(VTE_CIPHER_ALGORITHM), ==, VTE_CIPHER_TAG_SIZE);
+                litlen = match - anchor;
+                matchlen = ip - match - VTE_LZ_MIN_MATCH;
+
+                token = op++;
+                *token = (MIN (litlen, 15) << 4) | MIN (matchlen, 15);
+                if (litlen >= 15)
+                        op = _vte_lz_write_length (op, litlen - 15);
+                memcpy (op, anchor, litlen);
+                op += litlen;
+                *op++ = offset & 0xff;
+                *op++ = offset >> 8;
+                if (matchlen >= 15)
+                        op = _vte_lz_write_length (op, matchlen - 15);
+
+                anchor = ip;
+        }
 
-        /* Assert that IV does indeed include all the data we want to use (offset and overwrite_counter). */
-        g_assert_cmpuint (offsetof(struct _VteIv, padding), <=, VTE_CIPHER_IV_SIZE);
+        /* Trailing literals */
+        litlen = end - anchor;
+        token = op++;
+        *token = MIN (litlen, 15) << 4;
+        if (litlen >= 15)
+                op = _vte_lz_write_length (op, litlen - 15);
+        memcpy (op, anchor, litlen);
+        op += litlen;
 
-        /* Strong random for the key. */
-        gnutls_rnd(GNUTLS_RND_KEY, key, VTE_CIPHER_KEY_SIZE);
+        return op - (unsigned char *) dst;
+}
 
-        datum_key.data = key;
-        datum_key.size = VTE_CIPHER_KEY_SIZE;
-        gnutls_cipher_init(&boa->cipher_hd, VTE_CIPHER_ALGORITHM, &datum_key, NULL);
-        /* FIXME: 738601#c52 the compiler might optimize this away, how to make sure it's erased?
-         * It's on the stack so maybe we can rest assured it'll be overwritten pretty soon. */
-        memset(key, 0, VTE_CIPHER_KEY_SIZE);
+static inline gboolean
+_vte_lz_read_length (const unsigned char **ip, const unsigned char *end, unsigned int *len)
+{
+        unsigned int c;
+
+        do {
+                if (G_UNLIKELY (*ip >= end))
+                        return FALSE;
+                c = *(*ip)++;
+                *len += c;
+        } while (c == 255);
+        return TRUE;
+}
+
+/* Uncompress; returns the uncompressed size, or 0 on malformed input. */
+static unsigned int
+_vte_lz_uncompress (char *dst, unsigned int dstlen, const char *src, unsigned int srclen)
+{
+        const unsigned char *ip = (const unsigned char *) src;
+        const unsigned char *end = ip + srclen;
+        unsigned char *op = (unsigned char *) dst;
+        unsigned char *oend = op + dstlen;
+        const unsigned char *ref;
+        unsigned int token, len, offset;
+
+        while (ip < end) {
+                token = *ip++;
+
+                /* Literals */
+                len = token >> 4;
+                if (len == 15 && G_UNLIKELY (!_vte_lz_read_length (&ip, end, &len)))
+                        return 0;
+                if (G_UNLIKELY (len > (unsigned int) (end - ip) || len > (unsigned int) (oend - op)))
+                        return 0;
+                memcpy (op, ip, len);
+                ip += len;
+                op += len;
+
+                if (ip == end)
+                        break;
+
+                /* Match */
+                if (G_UNLIKELY (end - ip < 2))
+                        return 0;
+                offset = ip[0] | (ip[1] << 8);
+                ip += 2;
+                if (G_UNLIKELY (offset == 0 || offset > (unsigned int) (op - (unsigned char *) dst)))
+                        return 0;
+                len = token & 15;
+                if (len == 15 && G_UNLIKELY (!_vte_lz_read_length (&ip, end, &len)))
+                        return 0;
+                len += VTE_LZ_MIN_MATCH;
+                if (G_UNLIKELY (len > (unsigned int) (oend - op)))
+                        return 0;
+
+                ref = op - offset;
+                if (offset >= len) {
+                        memcpy (op, ref, len);
+                        op += len;
+                } else {
+                        /* Overlapping, e.g. a run of the same character */
+                        while (len--)
+                                *op++ = *ref++;
+                }
+        }
+
+        return op - (unsigned char *) dst;
+}
+
+/*----------------------------------------------------------------------------------------*/
+
+/* The compression codecs. The one used for a block is stored in the top bits of its
+ * data length field, so blocks compressed with different codecs can be read back. */
+
+struct _VteBoaCodec {
+        int (*compressBound) (unsigned int len);
+        unsigned int (*compress) (char *dst, unsigned int dstlen, const char *src, unsigned int srclen);
+        unsigned int (*uncompress) (char *dst, unsigned int dstlen, const char *src, unsigned int srclen);
+};
+
+static const VteBoaCodec _vte_boa_codecs[VTE_BOA_CODEC_COUNT] = {
+        /* VTE_BOA_CODEC_ZLIB (fake one for unit testing) */
+        { _vte_boa_compressBound, _vte_boa_compress, _vte_boa_uncompress },
+        /* VTE_BOA_CODEC_LZ */
+        { _vte_lz_compressBound, _vte_lz_compress, _vte_lz_uncompress },
+};
+
+/* Select the codec for writing subsequent blocks */
+static void
+_vte_boa_set_codec (VteBoa *boa, int codec_id)
+{
+        g_assert_cmpint (codec_id, >=, 0);
+        g_assert_cmpint (codec_id, <, VTE_BOA_CODEC_COUNT);
+
+        boa->codec_id = codec_id;
+        boa->codec = &_vte_boa_codecs[codec_id];
+        boa->compressBound = boa->codec->compressBound(VTE_BOA_BLOCKSIZE);
+}
+
+/*----------------------------------------------------------------------------------------*/
+
+static void
+_vte_boa_init (VteBoa *boa)
+{
+#if !defined VTESTREAM_MAIN && defined WITH_GNUTLS
+        boa->key = _vte_cipher_key_get (&boa->stream_id);
 
         /* Empty IV. */
         memset(&boa->iv, 0, sizeof(boa->iv));
 #endif
 
-        boa->compressBound = _vte_boa_compressBound(VTE_BOA_BLOCKSIZE);
+        _vte_boa_set_codec (boa, VTE_BOA_CODEC);
 }
 
 static void
@@ -849,8 +1330,9 @@ _vte_boa_finalize (GObject *object)
 
         memset(&boa->iv, 0, sizeof(boa->iv));
 
-        gnutls_cipher_deinit (boa->cipher_hd);
-        gnutls_global_deinit ();
+        if (boa->cipher_hd != NULL)
+                gnutls_cipher_deinit (boa->cipher_hd);
+        _vte_cipher_key_unref (boa->key);
 #endif
 
         G_OBJECT_CLASS (_vte_boa_parent_class)->finalize(object);
@@ -878,44 +1360,65 @@ _vte_boa_reset (VteBoa *boa, gsize offset)
 }
 
 /* Place VTE_BOA_BLOCKSIZE bytes at data.
- * data can be NULL if we're only interested in integrity verification and the overwrite_counter. */
+ * data can be NULL if we're only interested in integrity verification and the overwrite_counter.
+ * If lock is not NULL, it's held on entry, and released before uncompressing so that other
+ * threads can go on reading meanwhile. */
 static gboolean
-_vte_boa_read_with_overwrite_counter (VteBoa *boa, gsize offset, char *data, _vte_overwrite_counter_t *overwrite_counter)
+_vte_boa_read_with_overwrite_counter (VteBoa *boa, gsize offset, char *data, _vte_overwrite_counter_t *overwrite_counter, GMutex *lock)
 {
         _vte_block_datalength_t compressed_len;
+        unsigned int codec_id;
         gboolean ret = FALSE;
-        char *buf = (char *)g_malloc(VTE_SNAKE_BLOCKSIZE);
+        const char *block = NULL;
+        char *buf = NULL;
 
         g_assert_cmpuint (offset % VTE_BOA_BLOCKSIZE, ==, 0);
 
-        /* Read */
-        if (G_UNLIKELY (!_vte_snake_read (&boa->parent, OFFSET_BOA_TO_SNAKE(offset), buf)))
-                goto out;
+        /* Read, in place from the mapped file if possible: there's no decryption to do then */
+#if defined VTE_SNAKE_MMAP && !defined VTESTREAM_MAIN
+        if (lock == NULL)
+                block = _vte_snake_peek (&boa->parent, OFFSET_BOA_TO_SNAKE(offset));
+#endif
+        if (block == NULL) {
+                buf = (char *)g_malloc(VTE_SNAKE_BLOCKSIZE);
+                if (G_UNLIKELY (!_vte_snake_read (&boa->parent, OFFSET_BOA_TO_SNAKE(offset), buf)))
+                        goto out;
+                block = buf;
+        }
 
-        compressed_len = *((_vte_block_datalength_t *) buf);
-        *overwrite_counter = *((_vte_overwrite_counter_t *) (buf + VTE_BLOCK_DATALENGTH_SIZE));
+        compressed_len = *((const _vte_block_datalength_t *) block) & VTE_BLOCK_DATALENGTH_MASK;
+        codec_id = *((const _vte_block_datalength_t *) block) >> VTE_BLOCK_CODEC_SHIFT;
+        *overwrite_counter = *((const _vte_overwrite_counter_t *) (block + VTE_BLOCK_DATALENGTH_SIZE));
 
         /* We could have read an empty block due to a previous disk full. Treat that as an error too. Perform other sanity checks. */
-        if (G_UNLIKELY (compressed_len <= 0 || compressed_len > VTE_BOA_BLOCKSIZE || *overwrite_counter <= 0))
+        if (G_UNLIKELY (compressed_len <= 0 || compressed_len > VTE_BOA_BLOCKSIZE || *overwrite_counter <= 0 || codec_id >= VTE_BOA_CODEC_COUNT))
                 goto out;
 
         /* Decrypt, bail out on tag mismatch */
-        if (G_UNLIKELY (!_vte_boa_decrypt (boa, offset, *overwrite_counter, buf + VTE_BLOCK_DATALENGTH_SIZE + VTE_OVERWRITE_COUNTER_SIZE, compressed_len)))
+        if (G_UNLIKELY (buf != NULL && !_vte_boa_decrypt (boa, offset, *overwrite_counter, buf + VTE_BLOCK_DATALENGTH_SIZE + VTE_OVERWRITE_COUNTER_SIZE, compressed_len)))
                 goto out;
 
+        if (lock != NULL) {
+                g_mutex_unlock (lock);
+                lock = NULL;
+        }
+
         /* Uncompress, or copy if wasn't compressable */
         if (G_LIKELY (data != NULL)) {
                 if (G_UNLIKELY (compressed_len >= VTE_BOA_BLOCKSIZE)) {
-                        memcpy (data, buf + VTE_BLOCK_DATALENGTH_SIZE + VTE_OVERWRITE_COUNTER_SIZE, VTE_BOA_BLOCKSIZE);
+                        memcpy (data, block + VTE_BLOCK_DATALENGTH_SIZE + VTE_OVERWRITE_COUNTER_SIZE, VTE_BOA_BLOCKSIZE);
                 } else {
                         unsigned int uncompressed_len;
-                        uncompressed_len = _vte_boa_uncompress(data, VTE_BOA_BLOCKSIZE, buf + VTE_BLOCK_DATALENGTH_SIZE + VTE_OVERWRITE_COUNTER_SIZE, compressed_len);
-                        g_assert_cmpuint (uncompressed_len, ==, VTE_BOA_BLOCKSIZE);
+                        uncompressed_len = _vte_boa_codecs[codec_id].uncompress(data, VTE_BOA_BLOCKSIZE, block + VTE_BLOCK_DATALENGTH_SIZE + VTE_OVERWRITE_COUNTER_SIZE, compressed_len);
+                        if (G_UNLIKELY (uncompressed_len != VTE_BOA_BLOCKSIZE))
+                                goto out;
                 }
         }
         ret = TRUE;
 
 out:
+        if (lock != NULL)
+                g_mutex_unlock (lock);
         g_free(buf);
         return ret;
 }
@@ -924,17 +1427,19 @@ static gboolean
 _vte_boa_read (VteBoa *boa, gsize offset, char *data)
 {
         _vte_overwrite_counter_t overwrite_counter;
-        return _vte_boa_read_with_overwrite_counter (boa, offset, data, &overwrite_counter);
+        return _vte_boa_read_with_overwrite_counter (boa, offset, data, &overwrite_counter, NULL);
 }
 
 /*
  * offset is either within the stream (overwrite data), or at its head (append data).
  * data is VTE_BOA_BLOCKSIZE bytes large.
  */
-static void
+/* Returns the number of bytes stored in the snake block */
+static gsize
 _vte_boa_write (VteBoa *boa, gsize offset, const char *data)
 {
         _vte_block_datalength_t compressed_len = boa->compressBound;
+        gsize len = 0;
 
         /* The overwrite counter is 1-based.  This is to make sure that the IV is never 0: 738601#c88,
            to make sure that an empty block (e.g. after a previous write failure) is always invalid,
@@ -951,14 +1456,20 @@ _vte_boa_write (VteBoa *boa, gsize offset, const char *data)
         g_assert_cmpuint (offset % VTE_BOA_BLOCKSIZE, ==, 0);
 
         if (G_UNLIKELY (offset < boa->head)) {
-                /* Overwriting an existing block. This only happens around a window resize.
+                /* Overwriting an existing block. This happens when truncating around a window resize,
+                 * and when a partial last block written out by a trim (hibernation) is written again
+                 * after new data was appended to it.
                  * We need to read back that block and verify its integrity to get the previous overwrite_counter,
                  * which will be incremented for the new block.
                  * Then the new block is encrypted with the new IV.
                  * This is to never reuse the same IV/nonce for encryption.
+                 * The stream doesn't rewrite an unchanged block on trim, so the counter only advances
+                 * with appends or truncations in that block; should it still reach its maximum,
+                 * treat it as a read failure rather than wrap around to a used IV.
                  * In case of read failure, do our best to destroy that block (overwrite with zeros, then punch a hole)
                  * and return, forcing this and all subsequent reads and writes to fail. */
-                if (G_UNLIKELY (!_vte_boa_read_with_overwrite_counter (boa, offset, NULL, &overwrite_counter))) {
+                if (G_UNLIKELY (!_vte_boa_read_with_overwrite_counter (boa, offset, NULL, &overwrite_counter, NULL)) ||
+                    G_UNLIKELY ((_vte_overwrite_counter_t) (overwrite_counter + 1) == 0)) {
                         /* Try to overwrite with explicit zeros */
                         memset (buf, 0, VTE_SNAKE_BLOCKSIZE);
                         _vte_snake_write (&boa->parent, OFFSET_BOA_TO_SNAKE(offset), buf, VTE_SNAKE_BLOCKSIZE);
@@ -970,21 +1481,22 @@ _vte_boa_write (VteBoa *boa, gsize offset, const char *data)
         }
 
         /* Compress, or copy if uncompressable */
-        compressed_len = _vte_boa_compress (buf + VTE_BLOCK_DATALENGTH_SIZE + VTE_OVERWRITE_COUNTER_SIZE, boa->compressBound,
-                                            data, VTE_BOA_BLOCKSIZE);
+        compressed_len = boa->codec->compress (buf + VTE_BLOCK_DATALENGTH_SIZE + VTE_OVERWRITE_COUNTER_SIZE, boa->compressBound,
+                                               data, VTE_BOA_BLOCKSIZE);
         if (G_UNLIKELY (compressed_len >= VTE_BOA_BLOCKSIZE)) {
                 memcpy (buf + VTE_BLOCK_DATALENGTH_SIZE + VTE_OVERWRITE_COUNTER_SIZE, data, VTE_BOA_BLOCKSIZE);
                 compressed_len = VTE_BOA_BLOCKSIZE;
         }
 
-        *((_vte_block_datalength_t *) buf) = (_vte_block_datalength_t) compressed_len;
+        *((_vte_block_datalength_t *) buf) = (_vte_block_datalength_t) (compressed_len | (boa->codec_id << VTE_BLOCK_CODEC_SHIFT));
         *((_vte_overwrite_counter_t *) (buf + VTE_BLOCK_DATALENGTH_SIZE)) = (_vte_overwrite_counter_t) overwrite_counter;
 
         /* Encrypt */
         _vte_boa_encrypt (boa, offset, overwrite_counter, buf + VTE_BLOCK_DATALENGTH_SIZE + VTE_OVERWRITE_COUNTER_SIZE, compressed_len);
 
         /* Write */
-        _vte_snake_write (&boa->parent, OFFSET_BOA_TO_SNAKE(offset), buf, VTE_BLOCK_DATALENGTH_SIZE + VTE_OVERWRITE_COUNTER_SIZE + compressed_len + VTE_CIPHER_TAG_SIZE);
+        len = VTE_BLOCK_DATALENGTH_SIZE + VTE_OVERWRITE_COUNTER_SIZE + compressed_len + VTE_CIPHER_TAG_SIZE;
+        _vte_snake_write (&boa->parent, OFFSET_BOA_TO_SNAKE(offset), buf, len);
 
         if (G_LIKELY (offset == boa->head)) {
                 boa->head += VTE_BOA_BLOCKSIZE;
@@ -992,6 +1504,7 @@ _vte_boa_write (VteBoa *boa, gsize offset, const char *data)
 
 out:
         g_free(buf);
+        return len;
 }
 
 static void
@@ -1037,21 +1550,65 @@ _vte_boa_class_init (VteBoaClass *klass)
 
 /*
  * VteFileStream: Implement buffering/caching on top of VteBoa.
+ *
+ * Full blocks are handed over to a worker thread that compresses, encrypts and
+ * writes them, so that processing the terminal's output doesn't stall on them.
+ * Advancing the tail is queued too, to keep the order of operations on the boa.
+ * Queued blocks are read back from memory until they're written.
  */
 
+/* Maximum number of operations queued per stream before append blocks */
+#define VTE_FILE_STREAM_MAX_PENDING 4
+/* Number of worker threads shared by all the streams */
+#define VTE_FILE_STREAM_WORKERS 2
+/* Disk space is accounted in file system blocks, the rest of a snake block is a hole */
+#ifndef VTESTREAM_MAIN
+# define VTE_FILE_STREAM_FS_BLOCKSIZE 4096
+#else
+# define VTE_FILE_STREAM_FS_BLOCKSIZE 1
+#endif
+
+typedef struct _VteFileStreamOp {
+        gsize offset;
+        char *data;  /* block to write, or NULL to advance the tail */
+} VteFileStreamOp;
+
+/* Number of decompressed blocks kept per stream for reading */
+#ifndef VTE_FILE_STREAM_RBUF_COUNT
+# define VTE_FILE_STREAM_RBUF_COUNT 4
+#endif
+
 typedef struct _VteFileStream {
         GObject parent;
 
         VteBoa *boa;
 
-        char *rbuf;
-        /* Offset of the cached record, always a multiple of block size.
+        /* Read cache, most recently used block first. Buffers are
+         * allocated on demand. */
+        char *rbuf[VTE_FILE_STREAM_RBUF_COUNT];
+        /* Offsets of the cached records, always a multiple of block size.
          * Use a value of 1 (or anything that's not a multiple of block size)
          * to denote if no record is cached. */
-        gsize rbuf_offset;
+        gsize rbuf_offset[VTE_FILE_STREAM_RBUF_COUNT];
+        gulong rbuf_hits, rbuf_misses;
+
+        /* Background writing. lock protects pending and worker_scheduled,
+         * boa_lock protects the boa. */
+        gboolean async;
+        GMutex lock, boa_lock;
+        GCond cond;
+        GQueue pending;  /* of VteFileStreamOp, oldest first */
+        gboolean worker_scheduled;
+
+        /* Disk space taken by the written blocks from first_block on,
+         * also protected by lock. */
+        GArray *block_sizes;  /* of guint32 */
+        gsize first_block;
+        gsize disk_size;
 
         char *wbuf;
         gsize wbuf_len;
+        gboolean wbuf_stored;  /* the boa has wbuf's block unchanged since the last trim */
 
         gsize head, tail;
 } VteFileStream;
@@ -1069,15 +1626,197 @@ _vte_file_stream_new (void)
 	return (VteStream *) g_object_new (VTE_TYPE_FILE_STREAM, NULL);
 }
 
+static GThreadPool *_vte_file_stream_pool = NULL;
+
+/* Returns the number of bytes written */
+static gsize
+_vte_file_stream_run_op (VteFileStream *stream, const VteFileStreamOp *op)
+{
+        gsize len = 0;
+
+        g_mutex_lock (&stream->boa_lock);
+        if (op->data != NULL)
+                len = _vte_boa_write (stream->boa, op->offset, op->data);
+        else
+                _vte_boa_advance_tail (stream->boa, op->offset);
+        g_mutex_unlock (&stream->boa_lock);
+
+        return len;
+}
+
+/* Account for the block at @offset_aligned taking @len bytes on disk now.
+ * Needs the lock if the stream is async. */
+static void
+_vte_file_stream_set_block_size (VteFileStream *stream, gsize offset_aligned, gsize len)
+{
+        gsize i = offset_aligned / VTE_BOA_BLOCKSIZE;
+        guint32 *size;
+
+        /* The tail has been advanced past it in the mean time */
+        if (i < stream->first_block)
+                return;
+
+        i -= stream->first_block;
+        if (i >= stream->block_sizes->len)
+                g_array_set_size (stream->block_sizes, i + 1);
+        size = &g_array_index (stream->block_sizes, guint32, i);
+
+        stream->disk_size -= *size;
+        *size = (len + VTE_FILE_STREAM_FS_BLOCKSIZE - 1) / VTE_FILE_STREAM_FS_BLOCKSIZE * VTE_FILE_STREAM_FS_BLOCKSIZE;
+        stream->disk_size += *size;
+}
+
+/* Forget the sizes of the blocks before @first_block and from @end_block on.
+ * Needs the lock if the stream is async. */
+static void
+_vte_file_stream_drop_block_sizes (VteFileStream *stream, gsize first_block, gsize end_block)
+{
+        guint i, n;
+
+        n = MIN (end_block - MIN (stream->first_block, end_block), stream->block_sizes->len);
+        for (i = n; i < stream->block_sizes->len; i++)
+                stream->disk_size -= g_array_index (stream->block_sizes, guint32, i);
+        g_array_set_size (stream->block_sizes, n);
+
+        n = MIN (first_block - MIN (stream->first_block, first_block), stream->block_sizes->len);
+        for (i = 0; i < n; i++)
+                stream->disk_size -= g_array_index (stream->block_sizes, guint32, i);
+        g_array_remove_range (stream->block_sizes, 0, n);
+        stream->first_block = MAX (stream->first_block, first_block);
+}
+
+/* Perform the queued operations of a stream in order. At most one of these
+ * runs at a time for each stream. */
+static void
+_vte_file_stream_worker (gpointer data, gpointer user_data)
+{
+        VteFileStream *stream = (VteFileStream *) data;
+        VteFileStreamOp *op;
+
+        gsize len;
+
+        g_mutex_lock (&stream->lock);
+        while ((op = (VteFileStreamOp *) g_queue_peek_head (&stream->pending)) != NULL) {
+                g_mutex_unlock (&stream->lock);
+                len = _vte_file_stream_run_op (stream, op);
+                g_mutex_lock (&stream->lock);
+
+                if (op->data != NULL)
+                        _vte_file_stream_set_block_size (stream, op->offset, len);
+
+                /* Only remove it now, it had to remain readable until written */
+                g_queue_pop_head (&stream->pending);
+                g_free (op->data);
+                g_slice_free (VteFileStreamOp, op);
+                g_cond_broadcast (&stream->cond);
+        }
+        stream->worker_scheduled = FALSE;
+        g_cond_broadcast (&stream->cond);
+        g_mutex_unlock (&stream->lock);
+}
+
+/* Queue writing a block (taking ownership of data), or advancing the tail if data is NULL */
+static void
+_vte_file_stream_queue_op (VteFileStream *stream, gsize offset, char *data)
+{
+        VteFileStreamOp *op;
+
+        if (!stream->async) {
+                VteFileStreamOp sync_op = { offset, data };
+                gsize len = _vte_file_stream_run_op (stream, &sync_op);
+                if (data != NULL)
+                        _vte_file_stream_set_block_size (stream, offset, len);
+                g_free (data);
+                return;
+        }
+
+        if (G_UNLIKELY (_vte_file_stream_pool == NULL))
+                _vte_file_stream_pool = g_thread_pool_new (_vte_file_stream_worker, NULL,
+                                                           VTE_FILE_STREAM_WORKERS, FALSE, NULL);
+
+        op = g_slice_new (VteFileStreamOp);
+        op->offset = offset;
+        op->data = data;
+
+        g_mutex_lock (&stream->lock);
+        /* Don't let the queue grow unbounded if the worker can't keep up */
+        while (g_queue_get_length (&stream->pending) >= VTE_FILE_STREAM_MAX_PENDING)
+                g_cond_wait (&stream->cond, &stream->lock);
+        g_queue_push_tail (&stream->pending, op);
+        if (!stream->worker_scheduled) {
+                stream->worker_scheduled = TRUE;
+                g_thread_pool_push (_vte_file_stream_pool, stream, NULL);
+        }
+        g_mutex_unlock (&stream->lock);
+}
+
+/* Wait until all the queued operations are performed */
+static void
+_vte_file_stream_sync (VteFileStream *stream)
+{
+        g_mutex_lock (&stream->lock);
+        while (stream->worker_scheduled)
+                g_cond_wait (&stream->cond, &stream->lock);
+        g_mutex_unlock (&stream->lock);
+}
+
+/* Read a block, either from the queue or from the boa. If concurrent, the
+ * block is uncompressed after releasing boa_lock, see _vte_stream_read_concurrent(). */
+static gboolean
+_vte_file_stream_read_block (VteFileStream *stream, gsize offset_aligned, char *data, gboolean concurrent)
+{
+        _vte_overwrite_counter_t overwrite_counter;
+        gboolean ret;
+        GList *l;
+
+        g_mutex_lock (&stream->lock);
+        /* The most recent one, in case it's been overwritten after a truncate */
+        for (l = stream->pending.tail; l != NULL; l = l->prev) {
+                VteFileStreamOp *op = (VteFileStreamOp *) l->data;
+                if (op->data != NULL && op->offset == offset_aligned) {
+                        memcpy (data, op->data, VTE_BOA_BLOCKSIZE);
+                        g_mutex_unlock (&stream->lock);
+                        return TRUE;
+                }
+        }
+        g_mutex_unlock (&stream->lock);
+
+        g_mutex_lock (&stream->boa_lock);
+        if (concurrent)
+                return _vte_boa_read_with_overwrite_counter (stream->boa, offset_aligned, data, &overwrite_counter,
+                                                             &stream->boa_lock);
+        ret = _vte_boa_read (stream->boa, offset_aligned, data);
+        g_mutex_unlock (&stream->boa_lock);
+        return ret;
+}
+
+/* Drop the cached blocks starting at or after @offset_aligned */
+static void
+_vte_file_stream_invalidate_rbufs (VteFileStream *stream, gsize offset_aligned)
+{
+        int i;
+
+        for (i = 0; i < VTE_FILE_STREAM_RBUF_COUNT; i++) {
+                if (stream->rbuf_offset[i] >= offset_aligned)
+                        stream->rbuf_offset[i] = 1;  /* Invalidate */
+        }
+}
+
 static void
 _vte_file_stream_init (VteFileStream *stream)
 {
         stream->boa = (VteBoa *)g_object_new (VTE_TYPE_BOA, NULL);
-        _vte_boa_init (stream->boa);
 
-        stream->rbuf = (char *)g_malloc(VTE_BOA_BLOCKSIZE);
-        stream->wbuf = (char *)g_malloc(VTE_BOA_BLOCKSIZE);
-        stream->rbuf_offset = 1;  /* Invalidate */
+        _vte_file_stream_invalidate_rbufs (stream, 0);
+
+        g_mutex_init (&stream->lock);
+        g_mutex_init (&stream->boa_lock);
+        g_cond_init (&stream->cond);
+        g_queue_init (&stream->pending);
+        stream->block_sizes = g_array_new (FALSE, TRUE, sizeof (guint32));
+#ifndef VTESTREAM_MAIN
+        stream->async = TRUE;
+#endif
 }
 
 static void
@@ -1085,13 +1824,41 @@ _vte_file_stream_finalize (GObject *object)
 {
         VteFileStream *stream = (VteFileStream *) object;
 
-        g_free(stream->rbuf);
+        int i;
+
+        _vte_file_stream_sync (stream);
+        g_mutex_clear (&stream->lock);
+        g_mutex_clear (&stream->boa_lock);
+        g_cond_clear (&stream->cond);
+
+        for (i = 0; i < VTE_FILE_STREAM_RBUF_COUNT; i++)
+                g_free(stream->rbuf[i]);
         g_free(stream->wbuf);
+        g_array_free (stream->block_sizes, TRUE);
         g_object_unref (stream->boa);
 
         G_OBJECT_CLASS (_vte_file_stream_parent_class)->finalize(object);
 }
 
+/* The write buffer is only allocated once there's something to write.
+ * If it was trimmed while partially filled, its block is read back.
+ * That can happen on reading, so it's only set once it's filled in,
+ * for _vte_file_stream_read_concurrent() on other threads. */
+static inline void
+_vte_file_stream_ensure_wbuf (VteFileStream *stream)
+{
+        char *wbuf;
+
+        if (G_LIKELY (stream->wbuf != NULL))
+                return;
+
+        wbuf = (char *)g_malloc(VTE_BOA_BLOCKSIZE);
+        if (G_UNLIKELY (stream->wbuf_len) &&
+            G_UNLIKELY (!_vte_file_stream_read_block (stream, ALIGN_BOA(stream->head), wbuf, FALSE)))
+                memset(wbuf, 0, VTE_BOA_BLOCKSIZE);
+        g_atomic_pointer_set (&stream->wbuf, wbuf);
+}
+
 static void
 _vte_file_stream_reset (VteStream *astream, gsize offset)
 {
@@ -1102,21 +1869,67 @@ _vte_file_stream_reset (VteStream *astream, gsize offset)
          * to catch if this expectation is broken within a block. */
         g_assert_cmpuint (offset, >=, stream->head);
 
+        _vte_file_stream_sync (stream);
         _vte_boa_reset (stream->boa, offset_aligned);
         stream->tail = stream->head = offset;
 
+        _vte_file_stream_drop_block_sizes (stream, 0, 0);
+        stream->first_block = offset_aligned / VTE_BOA_BLOCKSIZE;
+        stream->wbuf_len = 0;
+        stream->wbuf_stored = FALSE;
+
         /* When resetting at a non-aligned offset, initial bytes of the write buffer
          * will eventually be written to disk, although doesn't contain useful information.
          * Rather than leaving garbage there, fill it with zeros.
          * For unit testing, fill it with dashes for convenience. */
+        if (MOD_BOA(offset)) {
+                _vte_file_stream_ensure_wbuf (stream);
 #ifndef VTESTREAM_MAIN
-        memset(stream->wbuf, 0, MOD_BOA(offset));
+                memset(stream->wbuf, 0, MOD_BOA(offset));
 #else
-        memset(stream->wbuf, '-', MOD_BOA(offset));
+                memset(stream->wbuf, '-', MOD_BOA(offset));
 #endif
+        }
 
         stream->wbuf_len = MOD_BOA(offset);
-        stream->rbuf_offset = 1;  /* Invalidate */
+        _vte_file_stream_invalidate_rbufs (stream, 0);
+}
+
+/* Return the decompressed block at @offset_aligned, from the cache if possible */
+static const char *
+_vte_file_stream_get_rbuf (VteFileStream *stream, gsize offset_aligned)
+{
+        char *buf;
+        int i;
+
+        for (i = 0; i < VTE_FILE_STREAM_RBUF_COUNT; i++) {
+                if (stream->rbuf_offset[i] == offset_aligned)
+                        break;
+        }
+
+        if (G_LIKELY (i < VTE_FILE_STREAM_RBUF_COUNT)) {
+                stream->rbuf_hits++;
+        } else {
+                /* Replace the least recently used one */
+                stream->rbuf_misses++;
+                i = VTE_FILE_STREAM_RBUF_COUNT - 1;
+                if (stream->rbuf[i] == NULL)
+                        stream->rbuf[i] = (char *)g_malloc(VTE_BOA_BLOCKSIZE);
+                if (G_UNLIKELY (!_vte_file_stream_read_block (stream, offset_aligned, stream->rbuf[i], FALSE))) {
+                        stream->rbuf_offset[i] = 1;  /* Invalidate */
+                        return NULL;
+                }
+                stream->rbuf_offset[i] = offset_aligned;
+        }
+
+        /* Move it to the front */
+        buf = stream->rbuf[i];
+        memmove(&stream->rbuf[1], &stream->rbuf[0], i * sizeof (stream->rbuf[0]));
+        memmove(&stream->rbuf_offset[1], &stream->rbuf_offset[0], i * sizeof (stream->rbuf_offset[0]));
+        stream->rbuf[0] = buf;
+        stream->rbuf_offset[0] = offset_aligned;
+
+        return buf;
 }
 
 static gboolean
@@ -1141,33 +1954,70 @@ _vte_file_stream_read (VteStream *astream, gsize offset, char *data, gsize len)
 
         while (len && offset < ALIGN_BOA(stream->head)) {
                 gsize l = MIN(VTE_BOA_BLOCKSIZE - MOD_BOA(offset), len);
-                gsize offset_aligned = ALIGN_BOA(offset);
-                if (offset_aligned != stream->rbuf_offset) {
-                        if (G_UNLIKELY (!_vte_boa_read (stream->boa, offset_aligned, stream->rbuf)))
-                                return FALSE;
-                        stream->rbuf_offset = offset_aligned;
-                }
-                memcpy(data, stream->rbuf + MOD_BOA(offset), l);
+                const char *rbuf = _vte_file_stream_get_rbuf (stream, ALIGN_BOA(offset));
+                if (G_UNLIKELY (rbuf == NULL))
+                        return FALSE;
+                memcpy(data, rbuf + MOD_BOA(offset), l);
                 offset += l; data += l; len -= l;
         }
         if (len) {
                 g_assert_cmpuint (MOD_BOA(offset) + len, <=, stream->wbuf_len);
+                _vte_file_stream_ensure_wbuf (stream);
                 memcpy(data, stream->wbuf + MOD_BOA(offset), len);
         }
         return TRUE;
 }
 
+static gboolean
+_vte_file_stream_read_concurrent (VteStream *astream, gsize offset, char *data, gsize len)
+{
+	VteFileStream *stream = (VteFileStream *) astream;
+        const char *wbuf = (const char *) g_atomic_pointer_get (&stream->wbuf);
+        char *buf;
+        gsize l;
+
+        if (G_UNLIKELY (offset < stream->tail || offset + len > stream->head || offset + len < offset)) {
+                if (G_LIKELY (offset + len <= stream->tail || offset >= stream->head))
+                        return FALSE;
+                g_assert_not_reached();
+        }
+
+        /* Whole blocks right into data, the rest through a buffer of our own */
+        buf = NULL;
+        while (len) {
+                l = MIN(VTE_BOA_BLOCKSIZE - MOD_BOA(offset), len);
+                if (offset >= ALIGN_BOA(stream->head) && wbuf != NULL) {
+                        memcpy(data, wbuf + MOD_BOA(offset), l);
+                } else if (l == VTE_BOA_BLOCKSIZE) {
+                        if (G_UNLIKELY (!_vte_file_stream_read_block (stream, offset, data, TRUE)))
+                                break;
+                } else {
+                        if (buf == NULL)
+                                buf = (char *)g_malloc(VTE_BOA_BLOCKSIZE);
+                        if (G_UNLIKELY (!_vte_file_stream_read_block (stream, ALIGN_BOA(offset), buf, TRUE)))
+                                break;
+                        memcpy(data, buf + MOD_BOA(offset), l);
+                }
+                offset += l; data += l; len -= l;
+        }
+        g_free(buf);
+        return len == 0;
+}
+
 static void
 _vte_file_stream_append (VteStream *astream, const char *data, gsize len)
 {
 	VteFileStream *stream = (VteFileStream *) astream;
 
+        stream->wbuf_stored = FALSE;
         while (len) {
                 gsize l = MIN(VTE_BOA_BLOCKSIZE - stream->wbuf_len, len);
+                _vte_file_stream_ensure_wbuf (stream);
                 memcpy(stream->wbuf + stream->wbuf_len, data, l);
                 stream->wbuf_len += l; data += l; len -= l;
                 if (stream->wbuf_len == VTE_BOA_BLOCKSIZE) {
-                        _vte_boa_write (stream->boa, ALIGN_BOA(stream->head), stream->wbuf);
+                        _vte_file_stream_queue_op (stream, ALIGN_BOA(stream->head), stream->wbuf);
+                        stream->wbuf = NULL;
                         stream->wbuf_len = 0;
                 }
                 stream->head += l;
@@ -1190,16 +2040,22 @@ _vte_file_stream_truncate (VteStream *astream, gsize offset)
                  * intact, that is, read back the new partial last block to
                  * the write cache. */
                 gsize offset_aligned = ALIGN_BOA(offset);
-                if (G_UNLIKELY (!_vte_boa_read (stream->boa, offset_aligned, stream->wbuf))) {
+                stream->wbuf_len = 0;
+                _vte_file_stream_ensure_wbuf (stream);
+                if (G_UNLIKELY (!_vte_file_stream_read_block (stream, offset_aligned, stream->wbuf, FALSE))) {
                         /* what now? */
                         memset(stream->wbuf, 0, VTE_BOA_BLOCKSIZE);
                 }
 
-                if (stream->rbuf_offset >= offset_aligned) {
-                        stream->rbuf_offset = 1;  /* Invalidate */
-                }
+                _vte_file_stream_invalidate_rbufs (stream, offset_aligned);
+
+                /* The dropped blocks stay on disk until overwritten, but don't count them.
+                 * Let the queued writes finish first, so that they don't add them back. */
+                _vte_file_stream_sync (stream);
+                _vte_file_stream_drop_block_sizes (stream, 0, offset_aligned / VTE_BOA_BLOCKSIZE);
         }
         stream->wbuf_len = MOD_BOA(offset);
+        stream->wbuf_stored = FALSE;
 	stream->head = offset;
 }
 
@@ -1211,8 +2067,14 @@ _vte_file_stream_advance_tail (VteStream *astream, gsize offset)
         g_assert_cmpuint (offset, >=, stream->tail);
         g_assert_cmpuint (offset, <=, stream->head);
 
-        if (ALIGN_BOA(offset) > ALIGN_BOA(stream->tail))
-                _vte_boa_advance_tail (stream->boa, ALIGN_BOA(offset));
+        if (ALIGN_BOA(offset) > ALIGN_BOA(stream->tail)) {
+                _vte_file_stream_queue_op (stream, ALIGN_BOA(offset), NULL);
+
+                /* Don't count them from now on, even though they're only dropped later */
+                g_mutex_lock (&stream->lock);
+                _vte_file_stream_drop_block_sizes (stream, ALIGN_BOA(offset) / VTE_BOA_BLOCKSIZE, G_MAXSIZE);
+                g_mutex_unlock (&stream->lock);
+        }
 
         stream->tail = offset;
 }
@@ -1233,6 +2095,55 @@ _vte_file_stream_head (VteStream *astream)
 	return stream->head;
 }
 
+static void
+_vte_file_stream_get_usage (VteStream *astream, gsize *memory, gsize *disk)
+{
+	VteFileStream *stream = (VteFileStream *) astream;
+        GList *l;
+        int i;
+
+        if (stream->wbuf != NULL)
+                *memory += VTE_BOA_BLOCKSIZE;
+        for (i = 0; i < VTE_FILE_STREAM_RBUF_COUNT; i++) {
+                if (stream->rbuf[i] != NULL)
+                        *memory += VTE_BOA_BLOCKSIZE;
+        }
+
+        g_mutex_lock (&stream->lock);
+        for (l = stream->pending.head; l != NULL; l = l->next) {
+                if (((VteFileStreamOp *) l->data)->data != NULL)
+                        *memory += VTE_BOA_BLOCKSIZE;
+        }
+        *memory += stream->block_sizes->len * sizeof (guint32);
+        *disk += stream->disk_size;
+        g_mutex_unlock (&stream->lock);
+}
+
+static void
+_vte_file_stream_trim (VteStream *astream)
+{
+	VteFileStream *stream = (VteFileStream *) astream;
+        int i;
+
+        for (i = 0; i < VTE_FILE_STREAM_RBUF_COUNT; i++) {
+                g_free(stream->rbuf[i]);
+                stream->rbuf[i] = NULL;
+        }
+        _vte_file_stream_invalidate_rbufs (stream, 0);
+
+        /* Write out the partial last block, it's read back on the next access.
+         * Don't write it again if it was only read back since, as each
+         * rewrite advances the block's overwrite counter. */
+        if (stream->wbuf != NULL && stream->wbuf_len && !stream->wbuf_stored) {
+                memset(stream->wbuf + stream->wbuf_len, 0, VTE_BOA_BLOCKSIZE - stream->wbuf_len);
+                _vte_file_stream_queue_op (stream, ALIGN_BOA(stream->head), stream->wbuf);
+                stream->wbuf_stored = TRUE;
+        } else {
+                g_free(stream->wbuf);
+        }
+        stream->wbuf = NULL;
+}
+
 static void
 _vte_file_stream_class_init (VteFileStreamClass *klass)
 {
@@ -1242,11 +2153,14 @@ _vte_file_stream_class_init (VteFileStreamClass *klass)
 
 	klass->reset = _vte_file_stream_reset;
 	klass->read = _vte_file_stream_read;
+	klass->read_concurrent = _vte_file_stream_read_concurrent;
 	klass->append = _vte_file_stream_append;
 	klass->truncate = _vte_file_stream_truncate;
 	klass->advance_tail = _vte_file_stream_advance_tail;
 	klass->tail = _vte_file_stream_tail;
 	klass->head = _vte_file_stream_head;
+	klass->get_usage = _vte_file_stream_get_usage;
+	klass->trim = _vte_file_stream_trim;
 }
 
 G_END_DECLS
@@ -1300,6 +2214,9 @@ G_END_DECLS
         g_assert_cmpuint (strlen(__contents), ==, __head - __tail); \
         g_assert (_vte_stream_read (__astream, __tail, __buf, __head - __tail)); \
         g_assert (memcmp(__buf, __contents, __head - __tail) == 0); \
+        memset(__buf, 0, sizeof (__buf)); \
+        g_assert (_vte_stream_read_concurrent (__astream, __tail, __buf, __head - __tail)); \
+        g_assert (memcmp(__buf, __contents, __head - __tail) == 0); \
 } while (0)
 
 /* Test the fake encryption/decryption and compression/decompression routines.
@@ -1368,10 +2285,21 @@ test_fakes (void)
 
 #define snake_write(snake, offset, str) _vte_snake_write((snake), (offset), (str), strlen(str))
 
-static void
-test_snake (void)
+static VteSnake *
+snake_new (gboolean use_mmap)
 {
         VteSnake *snake = (VteSnake *)g_object_new (VTE_TYPE_SNAKE, NULL);
+#ifdef VTE_SNAKE_MMAP
+        snake->use_mmap = use_mmap;
+#endif
+        return snake;
+}
+
+/* Run with and without accessing the file through mmap(), the results must be the same */
+static void
+test_snake (gboolean use_mmap)
+{
+        VteSnake *snake = snake_new (use_mmap);
 
         /* Test overwriting data */
         snake_write (snake, 0, "Armadillo");
@@ -1399,7 +2327,7 @@ test_snake (void)
 
         /* Start over */
         g_object_unref (snake);
-        snake = (VteSnake *)g_object_new (VTE_TYPE_SNAKE, NULL);
+        snake = snake_new (use_mmap);
 
         /* State 1 */
         snake_write (snake, 0, "Armadillo");
@@ -1547,7 +2475,6 @@ test_stream (void)
 
         VteStream *astream = _vte_file_stream_new();
         VteFileStream *stream = (VteFileStream *) astream;
-        _vte_file_stream_init (stream);
         boa = stream->boa;
         snake = (VteSnake *) &boa->parent;
 
@@ -1597,12 +2524,12 @@ test_stream (void)
 
         /* Test that the read cache is invalidated on truncate */
         _vte_stream_read (astream, 12, buf, 2);
-        g_assert_cmpuint (stream->rbuf_offset, ==, 7);
+        g_assert_cmpuint (stream->rbuf_offset[0], ==, 7);
         _vte_stream_truncate (astream, 13);
-        g_assert_cmpuint (stream->rbuf_offset, ==, 1);
+        g_assert_cmpuint (stream->rbuf_offset[0], ==, 1);
         stream_append (astream, "z" "cat");
         _vte_stream_read (astream, 12, buf, 2);
-        g_assert_cmpuint (stream->rbuf_offset, ==, 7);
+        g_assert_cmpuint (stream->rbuf_offset[0], ==, 7);
         buf[2] = '\0';
         g_assert_cmpstr (buf, ==, "ez");
         assert_file (snake->fd, "\007\001AXOLOTL\001" "\006\0031B5E1Z\013.");
@@ -1761,14 +2688,372 @@ test_stream (void)
         g_object_unref (astream);
 }
 
+static void
+test_stream_cache (void)
+{
+        char buf[8];
+        int i;
+
+        VteStream *astream = _vte_file_stream_new();
+        VteFileStream *stream = (VteFileStream *) astream;
+
+        /* One more block than fits in the read cache, plus the write buffer */
+        for (i = 0; i <= VTE_FILE_STREAM_RBUF_COUNT; i++)
+                stream_append (astream, "abcdefg");
+        stream_append (astream, "xyz");
+
+        /* Read two blocks, then both of them again */
+        g_assert (_vte_stream_read (astream, 0, buf, 7));
+        g_assert (_vte_stream_read (astream, 7, buf, 7));
+        g_assert (_vte_stream_read (astream, 3, buf, 7));
+        buf[7] = '\0';
+        g_assert_cmpstr (buf, ==, "defgabc");
+        g_assert_cmpuint (stream->rbuf_hits, ==, 2);
+        g_assert_cmpuint (stream->rbuf_misses, ==, 2);
+        g_assert_cmpuint (stream->rbuf_offset[0], ==, 7);
+        g_assert_cmpuint (stream->rbuf_offset[1], ==, 0);
+
+        /* The write buffer doesn't go through the cache */
+        g_assert (_vte_stream_read (astream, (VTE_FILE_STREAM_RBUF_COUNT + 1) * 7, buf, 3));
+        g_assert_cmpuint (stream->rbuf_hits, ==, 2);
+        g_assert_cmpuint (stream->rbuf_misses, ==, 2);
+
+        /* Reading all the others evicts the least recently used block only */
+        for (i = 2; i <= VTE_FILE_STREAM_RBUF_COUNT; i++)
+                g_assert (_vte_stream_read (astream, i * 7, buf, 7));
+        g_assert_cmpuint (stream->rbuf_misses, ==, VTE_FILE_STREAM_RBUF_COUNT + 1);
+        g_assert (_vte_stream_read (astream, 7, buf, 7));
+        g_assert_cmpuint (stream->rbuf_hits, ==, 3);
+        g_assert (_vte_stream_read (astream, 0, buf, 7));
+        g_assert_cmpuint (stream->rbuf_misses, ==, VTE_FILE_STREAM_RBUF_COUNT + 2);
+        buf[7] = '\0';
+        g_assert_cmpstr (buf, ==, "abcdefg");
+
+        /* Truncating drops the blocks from the new head on */
+        _vte_stream_truncate (astream, 10);
+        for (i = 0; i < VTE_FILE_STREAM_RBUF_COUNT; i++)
+                g_assert (stream->rbuf_offset[i] == 0 || stream->rbuf_offset[i] == 1);
+
+        g_object_unref (astream);
+}
+
+static void
+test_stream_async (void)
+{
+        VteBoa *boa;
+        int i;
+
+        VteStream *astream = _vte_file_stream_new();
+        VteFileStream *stream = (VteFileStream *) astream;
+        boa = stream->boa;
+        stream->async = TRUE;
+
+        /* More blocks than the queue holds; all of them are readable at any time */
+        for (i = 0; i < 11; i++)
+                stream_append (astream, "abcdefg");
+        stream_append (astream, "hij");
+        assert_stream (astream, 0, 80, "abcdefg" "abcdefg" "abcdefg" "abcdefg" "abcdefg" "abcdefg"
+                                       "abcdefg" "abcdefg" "abcdefg" "abcdefg" "abcdefg" "hij");
+
+        /* Truncating back to a block that might still be queued, then overwriting it */
+        _vte_stream_truncate (astream, 74);
+        stream_append (astream, "xyz" "klmnopq");
+        _vte_stream_advance_tail (astream, 30);
+        assert_stream (astream, 30, 84, "cdefg" "abcdefg" "abcdefg" "abcdefg" "abcdefg" "abcdefg"
+                                        "abcdxyz" "klmnopq");
+
+        /* Everything gets written in order */
+        _vte_file_stream_sync (stream);
+        g_assert (g_queue_is_empty (&stream->pending));
+        assert_boa (boa, 28, 84, "abcdefg" "abcdefg" "abcdefg" "abcdefg" "abcdefg" "abcdefg"
+                                 "abcdxyz" "klmnopq");
+
+        g_object_unref (astream);
+}
+
+static void
+test_stream_usage (void)
+{
+        gsize memory = 0, disk = 0;
+
+        VteStream *astream = _vte_file_stream_new();
+        VteFileStream *stream = (VteFileStream *) astream;
+
+        /* Only the write buffer */
+        stream_append (astream, "axolot");
+        _vte_stream_get_usage (astream, &memory, &disk);
+        g_assert_cmpuint (memory, ==, 7);
+        g_assert_cmpuint (disk, ==, 0);
+
+        /* The written blocks with their overhead, a compressed one is shorter */
+        stream_append (astream, "l" "beeeees" "cat");
+        memory = disk = 0;
+        _vte_stream_get_usage (astream, &memory, &disk);
+        g_assert_cmpuint (memory, ==, 7 + 2 * sizeof (guint32));
+        g_assert_cmpuint (disk, ==, 10 + 9);
+
+        /* Dropped blocks are no longer counted */
+        _vte_stream_advance_tail (astream, 8);
+        memory = disk = 0;
+        _vte_stream_get_usage (astream, &memory, &disk);
+        g_assert_cmpuint (disk, ==, 9);
+        _vte_stream_truncate (astream, 10);
+        memory = disk = 0;
+        _vte_stream_get_usage (astream, &memory, &disk);
+        g_assert_cmpuint (disk, ==, 0);
+        stream_append (astream, "eeee" "zebra");
+        memory = disk = 0;
+        _vte_stream_get_usage (astream, &memory, &disk);
+        g_assert_cmpuint (disk, ==, 7);
+        g_assert_cmpuint (stream->first_block, ==, 1);
+
+        _vte_stream_reset (astream, 30);
+        memory = disk = 0;
+        _vte_stream_get_usage (astream, &memory, &disk);
+        g_assert_cmpuint (disk, ==, 0);
+        g_assert_cmpuint (stream->first_block, ==, 4);
+
+        g_object_unref (astream);
+}
+
+static void
+test_stream_trim (void)
+{
+        char buf[VTE_BOA_BLOCKSIZE];
+        VteBoa *boa;
+        int i;
+
+        VteStream *astream = _vte_file_stream_new();
+        VteFileStream *stream = (VteFileStream *) astream;
+        boa = stream->boa;
+
+        stream_append (astream, "axolotl" "bis");
+        assert_stream (astream, 0, 10, "axolotl" "bis");
+
+        /* The caches are freed, the partial block goes to the boa */
+        _vte_stream_trim (astream);
+        for (i = 0; i < VTE_FILE_STREAM_RBUF_COUNT; i++)
+                g_assert (stream->rbuf[i] == NULL);
+        g_assert (stream->wbuf == NULL);
+        g_assert_cmpuint (stream->wbuf_len, ==, 3);
+        g_assert (_vte_boa_read (boa, 7, buf));
+        g_assert (memcmp (buf, "bis\0\0\0\0", VTE_BOA_BLOCKSIZE) == 0);
+
+        /* And it's read back when needed */
+        assert_stream (astream, 0, 10, "axolotl" "bis");
+        _vte_stream_trim (astream);
+        stream_append (astream, "oncat");
+        assert_stream (astream, 0, 15, "axolotl" "bisonca" "t");
+        assert_boa (boa, 0, 14, "axolotl" "bisonca");
+
+        stream_append (astream, "dolphin");
+        _vte_stream_trim (astream);
+        g_assert (stream->wbuf == NULL);
+        g_assert_cmpuint (boa->head, ==, 28);
+        g_assert (_vte_boa_read (boa, 21, buf));
+        g_assert (memcmp (buf, "n\0\0\0\0\0\0", VTE_BOA_BLOCKSIZE) == 0);
+        assert_stream (astream, 0, 22, "axolotl" "bisonca" "tdolphi" "n");
+
+        /* Repeated trims without appending don't rewrite the block,
+         * so its overwrite counter doesn't advance */
+        for (i = 0; i < 300; i++) {
+                assert_stream (astream, 0, 22, "axolotl" "bisonca" "tdolphi" "n");
+                _vte_stream_trim (astream);
+        }
+        g_assert (_vte_boa_read (boa, 21, buf));
+        g_assert (memcmp (buf, "n\0\0\0\0\0\0", VTE_BOA_BLOCKSIZE) == 0);
+        stream_append (astream, "ewt");
+        _vte_stream_trim (astream);
+        assert_stream (astream, 0, 25, "axolotl" "bisonca" "tdolphi" "newt");
+
+        g_object_unref (astream);
+}
+
+static void
+test_lz_roundtrip (const char *data, unsigned int len, unsigned int expected_len)
+{
+        char *compressed = (char *) g_malloc (_vte_lz_compressBound (len));
+        char *uncompressed = (char *) g_malloc (len + 1);
+        unsigned int compressed_len;
+
+        compressed_len = _vte_lz_compress (compressed, _vte_lz_compressBound (len), data, len);
+        if (expected_len)
+                g_assert_cmpuint (compressed_len, ==, expected_len);
+        g_assert_cmpuint (_vte_lz_uncompress (uncompressed, len, compressed, compressed_len), ==, len);
+        g_assert (memcmp (uncompressed, data, len) == 0);
+
+        /* Truncated or overlong input is rejected */
+        if (compressed_len > 1)
+                g_assert_cmpuint (_vte_lz_uncompress (uncompressed, len, compressed, compressed_len - 1), !=, len);
+        if (len)
+                g_assert_cmpuint (_vte_lz_uncompress (uncompressed, len - 1, compressed, compressed_len), ==, 0);
+
+        g_free (compressed);
+        g_free (uncompressed);
+}
+
+static void
+test_lz (void)
+{
+        char buf[70000];
+        unsigned int i;
+        VteBoa *boa;
+        VteSnake *snake;
+
+        /* Literals only: a token, then the literals */
+        test_lz_roundtrip ("", 0, 1);
+        test_lz_roundtrip ("abcdef", 6, 7);
+
+        /* Run of the same character: overlapping match */
+        memset (buf, 'x', 100);
+        test_lz_roundtrip (buf, 100, 0);
+
+        /* Repetitive, long literal and match lengths */
+        for (i = 0; i < sizeof (buf); i++)
+                buf[i] = "the quick brown fox jumps over the lazy dog\n"[i % 44] ^ ((i / 1000) & 1);
+        test_lz_roundtrip (buf, sizeof (buf), 0);
+
+        /* Incompressible */
+        for (i = 0; i < sizeof (buf); i++)
+                buf[i] = g_random_int ();
+        test_lz_roundtrip (buf, sizeof (buf), 0);
+
+        /* The codec is recorded per block, blocks written by different codecs can be read back.
+         * These tiny blocks are stored uncompressed, only the codec bits differ. */
+        boa = (VteBoa *)g_object_new (VTE_TYPE_BOA, NULL);
+        snake = (VteSnake *) &boa->parent;
+        _vte_boa_init (boa);
+
+        _vte_boa_write (boa, 0, "axolotl");
+        _vte_boa_set_codec (boa, VTE_BOA_CODEC_LZ);
+        _vte_boa_write (boa, 7, "beeeeee");
+        assert_file (snake->fd, "\007\001AXOLOTL\001" "\027\001BEEEEEE\011");
+        assert_boa (boa, 0, 14, "axolotl" "beeeeee");
+
+        g_object_unref (boa);
+}
+
+/* Compare the compression ratio and speed of the codecs on the files given as arguments.
+ * The fake codec of unit testing is replaced by the real zlib one. */
+
+#define BENCH_BLOCKSIZE (65536 - 4 - 4 - 16)
+#define BENCH_BYTES (256 * 1024 * 1024)
+
+static int
+bench_zlib_compressBound (unsigned int len)
+{
+        return compressBound(len);
+}
+
+static unsigned int
+bench_zlib_compress (char *dst, unsigned int dstlen, const char *src, unsigned int srclen)
+{
+        uLongf dstlen_ulongf = dstlen;
+
+        compress2 ((Bytef *) dst, &dstlen_ulongf, (const Bytef *) src, srclen, 1);
+        return dstlen_ulongf;
+}
+
+static unsigned int
+bench_zlib_uncompress (char *dst, unsigned int dstlen, const char *src, unsigned int srclen)
+{
+        uLongf dstlen_ulongf = dstlen;
+
+        uncompress ((Bytef *) dst, &dstlen_ulongf, (const Bytef *) src, srclen);
+        return dstlen_ulongf;
+}
+
+static void
+bench_codecs (int argc, char **argv)
+{
+        static const struct {
+                const char *name;
+                VteBoaCodec codec;
+        } codecs[] = {
+                { "zlib", { bench_zlib_compressBound, bench_zlib_compress, bench_zlib_uncompress } },
+                { "lz", { _vte_lz_compressBound, _vte_lz_compress, _vte_lz_uncompress } },
+        };
+        int i;
+        unsigned int c;
+
+        for (i = 1; i < argc; i++) {
+                char *contents, *compressed, *uncompressed;
+                gsize len;
+                GError *error = NULL;
+
+                if (!g_file_get_contents (argv[i], &contents, &len, &error)) {
+                        g_printerr ("%s\n", error->message);
+                        g_error_free (error);
+                        continue;
+                }
+
+                for (c = 0; c < G_N_ELEMENTS (codecs); c++) {
+                        const VteBoaCodec *codec = &codecs[c].codec;
+                        gsize total = 0, total_compressed = 0, offset, rounds = 0;
+                        gint64 compress_time = 0, uncompress_time = 0, start;
+
+                        compressed = (char *) g_malloc (codec->compressBound (BENCH_BLOCKSIZE));
+                        uncompressed = (char *) g_malloc (BENCH_BLOCKSIZE);
+
+                        while (total < BENCH_BYTES && len) {
+                                for (offset = 0; offset < len; offset += BENCH_BLOCKSIZE) {
+                                        unsigned int l = MIN (len - offset, BENCH_BLOCKSIZE);
+                                        unsigned int compressed_len;
+
+                                        start = g_get_monotonic_time ();
+                                        compressed_len = codec->compress (compressed, codec->compressBound (BENCH_BLOCKSIZE),
+                                                                          contents + offset, l);
+                                        compress_time += g_get_monotonic_time () - start;
+
+                                        start = g_get_monotonic_time ();
+                                        g_assert_cmpuint (codec->uncompress (uncompressed, BENCH_BLOCKSIZE, compressed, compressed_len), ==, l);
+                                        uncompress_time += g_get_monotonic_time () - start;
+
+                                        g_assert (memcmp (uncompressed, contents + offset, l) == 0);
+                                        if (rounds == 0)
+                                                total_compressed += MIN (compressed_len, l);
+                                        total += l;
+                                }
+                                rounds++;
+                        }
+
+                        printf ("%-24s %-6s ratio %5.1f%%  compress %8.1f MB/s  uncompress %8.1f MB/s\n",
+                                argv[i], codecs[c].name,
+                                100.0 * total_compressed / MAX (len, 1),
+                                (double) total / MAX (compress_time, 1),
+                                (double) total / MAX (uncompress_time, 1));
+
+                        g_free (compressed);
+                        g_free (uncompressed);
+                }
+
+                g_free (contents);
+        }
+}
+
+/* In vtestream-memory.h */
+static void test_memory_stream (void);
+
 int
 main (int argc, char **argv)
 {
+        if (argc > 1) {
+                bench_codecs (argc, argv);
+                return 0;
+        }
+
         test_fakes();
 
-        test_snake();
+        test_snake(FALSE);
+        test_snake(TRUE);
         test_boa();
         test_stream();
+        test_stream_cache();
+        test_stream_async();
+        test_stream_usage();
+        test_stream_trim();
+        test_memory_stream();
+        test_lz();
 
         printf("vtestream-file tests passed :)\n");
         return 0;
@@ -0,0 +1,470 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * VteMemoryStream keeps the whole stream in memory, in a series of
+ * fixed size chunks. There's no temporary file, no syscalls and no
+ * encryption, which makes it the fastest choice for scrollbacks that
+ * comfortably fit in memory.
+ *
+ * The chunk at the head is the write buffer. Once it fills up it's
+ * optionally compressed with the fast LZ codec of VteBoa, and kept as
+ * is if that doesn't make it smaller. Compressed chunks are
+ * uncompressed into a read buffer when read.
+ */
+
+#include <string.h>
+
+G_BEGIN_DECLS
+
+#ifndef VTESTREAM_MAIN
+# define VTE_MEMORY_STREAM_CHUNKSIZE 65536
+#else
+/* Smaller size for unit testing */
+# define VTE_MEMORY_STREAM_CHUNKSIZE 16
+#endif
+
+#define ALIGN_CHUNK(x) ((x) / VTE_MEMORY_STREAM_CHUNKSIZE * VTE_MEMORY_STREAM_CHUNKSIZE)
+#define MOD_CHUNK(x)   ((x) % VTE_MEMORY_STREAM_CHUNKSIZE)
+
+typedef struct _VteMemoryChunk {
+        char *data;
+        guint len;             /* length of data, less than the chunk size if compressed */
+} VteMemoryChunk;
+
+typedef struct _VteMemoryStream {
+        GObject parent;
+
+        gboolean compress;
+
+        /* The full chunks; the first one begins at first_chunk * VTE_MEMORY_STREAM_CHUNKSIZE */
+        GArray *chunks;
+        gsize first_chunk;
+        gsize chunks_size;  /* total length of their data */
+
+        /* The uncompressed chunk, the offset is always a multiple of the chunk size,
+         * or 1 if none. */
+        char *rbuf;
+        gsize rbuf_offset;
+
+        /* The chunk following the full ones */
+        char *wbuf;
+        gsize wbuf_len;
+
+        gsize head, tail;
+} VteMemoryStream;
+
+typedef VteStreamClass VteMemoryStreamClass;
+
+static GType _vte_memory_stream_get_type (void);
+#define VTE_TYPE_MEMORY_STREAM _vte_memory_stream_get_type ()
+
+G_DEFINE_TYPE (VteMemoryStream, _vte_memory_stream, VTE_TYPE_STREAM)
+
+VteStream *
+_vte_memory_stream_new (gboolean compress)
+{
+        VteMemoryStream *stream;
+
+        stream = (VteMemoryStream *) g_object_new (VTE_TYPE_MEMORY_STREAM, NULL);
+        stream->compress = compress;
+
+        return (VteStream *) stream;
+}
+
+static void
+_vte_memory_stream_init (VteMemoryStream *stream)
+{
+        stream->chunks = g_array_new (FALSE, FALSE, sizeof (VteMemoryChunk));
+        stream->rbuf_offset = 1;  /* Invalidate */
+}
+
+/* The write buffer is only allocated once there's something to write */
+static inline void
+_vte_memory_stream_ensure_wbuf (VteMemoryStream *stream)
+{
+        if (G_UNLIKELY (stream->wbuf == NULL))
+                stream->wbuf = (char *) g_malloc (VTE_MEMORY_STREAM_CHUNKSIZE);
+}
+
+/* Free the data of the full chunks from index @from to @to */
+static void
+_vte_memory_stream_free_chunks (VteMemoryStream *stream, guint from, guint to)
+{
+        guint i;
+
+        for (i = from; i < to; i++) {
+                VteMemoryChunk *chunk = &g_array_index (stream->chunks, VteMemoryChunk, i);
+                stream->chunks_size -= chunk->len;
+                g_free (chunk->data);
+        }
+}
+
+static void
+_vte_memory_stream_finalize (GObject *object)
+{
+        VteMemoryStream *stream = (VteMemoryStream *) object;
+
+        _vte_memory_stream_free_chunks (stream, 0, stream->chunks->len);
+        g_array_free (stream->chunks, TRUE);
+        g_free (stream->rbuf);
+        g_free (stream->wbuf);
+
+        G_OBJECT_CLASS (_vte_memory_stream_parent_class)->finalize(object);
+}
+
+/* Uncompress, or copy if it wasn't compressed, the given full chunk to data */
+static void
+_vte_memory_stream_read_chunk (VteMemoryStream *stream, guint i, char *data)
+{
+        VteMemoryChunk *chunk = &g_array_index (stream->chunks, VteMemoryChunk, i);
+        unsigned int len;
+
+        if (chunk->len == VTE_MEMORY_STREAM_CHUNKSIZE) {
+                memcpy (data, chunk->data, VTE_MEMORY_STREAM_CHUNKSIZE);
+        } else {
+                len = _vte_lz_uncompress (data, VTE_MEMORY_STREAM_CHUNKSIZE, chunk->data, chunk->len);
+                g_assert_cmpuint (len, ==, VTE_MEMORY_STREAM_CHUNKSIZE);
+        }
+}
+
+/* Turn the full write buffer into a chunk */
+static void
+_vte_memory_stream_add_chunk (VteMemoryStream *stream)
+{
+        VteMemoryChunk chunk;
+        char *buf;
+        unsigned int len;
+
+        chunk.data = stream->wbuf;
+        chunk.len = VTE_MEMORY_STREAM_CHUNKSIZE;
+        stream->wbuf = (char *) g_malloc (VTE_MEMORY_STREAM_CHUNKSIZE);
+
+        if (stream->compress) {
+                buf = (char *) g_malloc (_vte_lz_compressBound (VTE_MEMORY_STREAM_CHUNKSIZE));
+                len = _vte_lz_compress (buf, _vte_lz_compressBound (VTE_MEMORY_STREAM_CHUNKSIZE),
+                                        chunk.data, VTE_MEMORY_STREAM_CHUNKSIZE);
+                if (len < VTE_MEMORY_STREAM_CHUNKSIZE) {
+                        /* Reuse the old buffer as the next write buffer */
+                        g_free (stream->wbuf);
+                        stream->wbuf = chunk.data;
+                        chunk.data = (char *) g_realloc (buf, len);
+                        chunk.len = len;
+                } else {
+                        g_free (buf);
+                }
+        }
+
+        g_array_append_val (stream->chunks, chunk);
+        stream->chunks_size += chunk.len;
+}
+
+static void
+_vte_memory_stream_reset (VteStream *astream, gsize offset)
+{
+        VteMemoryStream *stream = (VteMemoryStream *) astream;
+
+        _vte_memory_stream_free_chunks (stream, 0, stream->chunks->len);
+        g_array_set_size (stream->chunks, 0);
+        stream->first_chunk = offset / VTE_MEMORY_STREAM_CHUNKSIZE;
+
+        if (MOD_CHUNK(offset)) {
+                _vte_memory_stream_ensure_wbuf (stream);
+                memset (stream->wbuf, 0, MOD_CHUNK(offset));
+        }
+        stream->wbuf_len = MOD_CHUNK(offset);
+        stream->rbuf_offset = 1;  /* Invalidate */
+        stream->tail = stream->head = offset;
+}
+
+static gboolean
+_vte_memory_stream_read (VteStream *astream, gsize offset, char *data, gsize len)
+{
+        VteMemoryStream *stream = (VteMemoryStream *) astream;
+        gsize wbuf_offset = stream->head - stream->wbuf_len;
+
+        /* Out of bounds request, see _vte_file_stream_read(). */
+        if (G_UNLIKELY (offset < stream->tail || offset + len > stream->head || offset + len < offset)) {
+                if (G_LIKELY (offset + len <= stream->tail || offset >= stream->head))
+                        return FALSE;
+                g_assert_not_reached();
+        }
+
+        while (len && offset < wbuf_offset) {
+                gsize l = MIN(VTE_MEMORY_STREAM_CHUNKSIZE - MOD_CHUNK(offset), len);
+                guint i = offset / VTE_MEMORY_STREAM_CHUNKSIZE - stream->first_chunk;
+                VteMemoryChunk *chunk = &g_array_index (stream->chunks, VteMemoryChunk, i);
+                const char *buf;
+
+                if (chunk->len == VTE_MEMORY_STREAM_CHUNKSIZE) {
+                        buf = chunk->data;
+                } else {
+                        if (ALIGN_CHUNK(offset) != stream->rbuf_offset) {
+                                if (stream->rbuf == NULL)
+                                        stream->rbuf = (char *) g_malloc (VTE_MEMORY_STREAM_CHUNKSIZE);
+                                _vte_memory_stream_read_chunk (stream, i, stream->rbuf);
+                                stream->rbuf_offset = ALIGN_CHUNK(offset);
+                        }
+                        buf = stream->rbuf;
+                }
+                memcpy (data, buf + MOD_CHUNK(offset), l);
+                offset += l; data += l; len -= l;
+        }
+        if (len) {
+                g_assert_cmpuint (offset - wbuf_offset + len, <=, stream->wbuf_len);
+                memcpy (data, stream->wbuf + (offset - wbuf_offset), len);
+        }
+        return TRUE;
+}
+
+static gboolean
+_vte_memory_stream_read_concurrent (VteStream *astream, gsize offset, char *data, gsize len)
+{
+        VteMemoryStream *stream = (VteMemoryStream *) astream;
+        gsize wbuf_offset = stream->head - stream->wbuf_len;
+        char *buf = NULL;
+
+        if (G_UNLIKELY (offset < stream->tail || offset + len > stream->head || offset + len < offset)) {
+                if (G_LIKELY (offset + len <= stream->tail || offset >= stream->head))
+                        return FALSE;
+                g_assert_not_reached();
+        }
+
+        /* Like _vte_memory_stream_read(), with a buffer of our own instead of rbuf */
+        while (len && offset < wbuf_offset) {
+                gsize l = MIN(VTE_MEMORY_STREAM_CHUNKSIZE - MOD_CHUNK(offset), len);
+                guint i = offset / VTE_MEMORY_STREAM_CHUNKSIZE - stream->first_chunk;
+                VteMemoryChunk *chunk = &g_array_index (stream->chunks, VteMemoryChunk, i);
+
+                if (chunk->len == VTE_MEMORY_STREAM_CHUNKSIZE) {
+                        memcpy (data, chunk->data + MOD_CHUNK(offset), l);
+                } else if (l == VTE_MEMORY_STREAM_CHUNKSIZE) {
+                        _vte_memory_stream_read_chunk (stream, i, data);
+                } else {
+                        if (buf == NULL)
+                                buf = (char *) g_malloc (VTE_MEMORY_STREAM_CHUNKSIZE);
+                        _vte_memory_stream_read_chunk (stream, i, buf);
+                        memcpy (data, buf + MOD_CHUNK(offset), l);
+                }
+                offset += l; data += l; len -= l;
+        }
+        if (len) {
+                g_assert_cmpuint (offset - wbuf_offset + len, <=, stream->wbuf_len);
+                memcpy (data, stream->wbuf + (offset - wbuf_offset), len);
+        }
+        g_free (buf);
+        return TRUE;
+}
+
+static void
+_vte_memory_stream_append (VteStream *astream, const char *data, gsize len)
+{
+        VteMemoryStream *stream = (VteMemoryStream *) astream;
+
+        while (len) {
+                gsize l = MIN(VTE_MEMORY_STREAM_CHUNKSIZE - stream->wbuf_len, len);
+                _vte_memory_stream_ensure_wbuf (stream);
+                memcpy (stream->wbuf + stream->wbuf_len, data, l);
+                stream->wbuf_len += l; data += l; len -= l;
+                stream->head += l;
+                if (stream->wbuf_len == VTE_MEMORY_STREAM_CHUNKSIZE) {
+                        _vte_memory_stream_add_chunk (stream);
+                        stream->wbuf_len = 0;
+                }
+        }
+}
+
+static void
+_vte_memory_stream_truncate (VteStream *astream, gsize offset)
+{
+        VteMemoryStream *stream = (VteMemoryStream *) astream;
+        guint i;
+
+        g_assert_cmpuint (offset, >=, stream->tail);
+        g_assert_cmpuint (offset, <=, stream->head);
+
+        i = offset / VTE_MEMORY_STREAM_CHUNKSIZE - stream->first_chunk;
+        if (i < stream->chunks->len) {
+                /* Going back to a full chunk, make it the write buffer again */
+                _vte_memory_stream_ensure_wbuf (stream);
+                _vte_memory_stream_read_chunk (stream, i, stream->wbuf);
+                _vte_memory_stream_free_chunks (stream, i, stream->chunks->len);
+                g_array_set_size (stream->chunks, i);
+
+                if (stream->rbuf_offset != 1 && stream->rbuf_offset >= ALIGN_CHUNK(offset))
+                        stream->rbuf_offset = 1;  /* Invalidate */
+        }
+        stream->wbuf_len = MOD_CHUNK(offset);
+        stream->head = offset;
+}
+
+static void
+_vte_memory_stream_advance_tail (VteStream *astream, gsize offset)
+{
+        VteMemoryStream *stream = (VteMemoryStream *) astream;
+        guint n;
+
+        g_assert_cmpuint (offset, >=, stream->tail);
+        g_assert_cmpuint (offset, <=, stream->head);
+
+        /* Drop the full chunks that are entirely before the new tail */
+        n = MIN (offset / VTE_MEMORY_STREAM_CHUNKSIZE - stream->first_chunk, stream->chunks->len);
+        if (n) {
+                _vte_memory_stream_free_chunks (stream, 0, n);
+                g_array_remove_range (stream->chunks, 0, n);
+                stream->first_chunk += n;
+        }
+
+        stream->tail = offset;
+}
+
+static gsize
+_vte_memory_stream_tail (VteStream *astream)
+{
+        VteMemoryStream *stream = (VteMemoryStream *) astream;
+
+        return stream->tail;
+}
+
+static gsize
+_vte_memory_stream_head (VteStream *astream)
+{
+        VteMemoryStream *stream = (VteMemoryStream *) astream;
+
+        return stream->head;
+}
+
+static void
+_vte_memory_stream_get_usage (VteStream *astream, gsize *memory, gsize *disk G_GNUC_UNUSED)
+{
+        VteMemoryStream *stream = (VteMemoryStream *) astream;
+
+        *memory += stream->chunks_size + stream->chunks->len * sizeof (VteMemoryChunk);
+        if (stream->wbuf != NULL)
+                *memory += VTE_MEMORY_STREAM_CHUNKSIZE;
+        if (stream->rbuf != NULL)
+                *memory += VTE_MEMORY_STREAM_CHUNKSIZE;
+}
+
+static void
+_vte_memory_stream_trim (VteStream *astream)
+{
+        VteMemoryStream *stream = (VteMemoryStream *) astream;
+
+        g_free (stream->rbuf);
+        stream->rbuf = NULL;
+        stream->rbuf_offset = 1;  /* Invalidate */
+
+        if (stream->wbuf_len == 0) {
+                g_free (stream->wbuf);
+                stream->wbuf = NULL;
+        }
+}
+
+static void
+_vte_memory_stream_class_init (VteMemoryStreamClass *klass)
+{
+        GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+        gobject_class->finalize = _vte_memory_stream_finalize;
+
+        klass->reset = _vte_memory_stream_reset;
+        klass->read = _vte_memory_stream_read;
+        klass->read_concurrent = _vte_memory_stream_read_concurrent;
+        klass->append = _vte_memory_stream_append;
+        klass->truncate = _vte_memory_stream_truncate;
+        klass->advance_tail = _vte_memory_stream_advance_tail;
+        klass->tail = _vte_memory_stream_tail;
+        klass->head = _vte_memory_stream_head;
+        klass->get_usage = _vte_memory_stream_get_usage;
+        klass->trim = _vte_memory_stream_trim;
+}
+
+G_END_DECLS
+
+/******************************************************************************************/
+
+#ifdef VTESTREAM_MAIN
+
+static void
+test_memory_stream (void)
+{
+        gboolean compress;
+
+        for (compress = FALSE; compress <= TRUE; compress++) {
+                VteStream *astream = _vte_memory_stream_new (compress);
+                VteMemoryStream *stream = (VteMemoryStream *) astream;
+
+                /* Append, crossing chunks */
+                stream_append (astream, "axolotl");
+                assert_stream (astream, 0, 7, "axolotl");
+                g_assert_cmpuint (stream->chunks->len, ==, 0);
+
+                stream_append (astream, "bisoncame" "eeeeeeeeeeeeeeee" "fox");
+                assert_stream (astream, 0, 35, "axolotlbisoncame" "eeeeeeeeeeeeeeee" "fox");
+                g_assert_cmpuint (stream->chunks->len, ==, 2);
+                /* A run of the same char compresses well, the first chunk doesn't */
+                g_assert_cmpuint (g_array_index (stream->chunks, VteMemoryChunk, 0).len, ==, 16);
+                g_assert_cmpuint (g_array_index (stream->chunks, VteMemoryChunk, 1).len, ==, compress ? 10 : 16);
+                g_assert_cmpuint (stream->chunks_size, ==, compress ? 26 : 32);
+
+                /* Truncate back into a full chunk */
+                _vte_stream_truncate (astream, 20);
+                assert_stream (astream, 0, 20, "axolotlbisoncame" "eeee");
+                g_assert_cmpuint (stream->chunks->len, ==, 1);
+                stream_append (astream, "dolphin");
+                assert_stream (astream, 0, 27, "axolotlbisoncame" "eeeedolphin");
+
+                /* Advance tail drops full chunks only */
+                _vte_stream_advance_tail (astream, 7);
+                g_assert_cmpuint (stream->chunks->len, ==, 1);
+                assert_stream (astream, 7, 27, "bisoncame" "eeeedolphin");
+                _vte_stream_advance_tail (astream, 25);
+                g_assert_cmpuint (stream->chunks->len, ==, 0);
+                g_assert_cmpuint (stream->first_chunk, ==, 1);
+                g_assert_cmpuint (stream->chunks_size, ==, 0);
+                assert_stream (astream, 25, 27, "in");
+
+                /* Out of bounds */
+                g_assert_false (_vte_stream_read (astream, 0, NULL, 7));
+                g_assert_false (_vte_stream_read (astream, 27, NULL, 1));
+
+                /* Reset to the middle of a chunk */
+                _vte_stream_reset (astream, 40);
+                stream_append (astream, "zebra");
+                assert_stream (astream, 40, 45, "zebra");
+                g_assert_cmpuint (stream->chunks->len, ==, 0);
+                g_assert_cmpuint (stream->first_chunk, ==, 2);
+
+                /* Trim frees the buffers that aren't needed */
+                stream_append (astream, "eeeeeeeeeee" "gnu");
+                assert_stream (astream, 40, 59, "zebra" "eeeeeeeeeee" "gnu");
+                _vte_stream_trim (astream);
+                g_assert (stream->rbuf == NULL);
+                g_assert (stream->wbuf != NULL);
+                assert_stream (astream, 40, 59, "zebra" "eeeeeeeeeee" "gnu");
+                stream_append (astream, "hippopotamus" "jackal" "yak");
+                g_assert_cmpuint (stream->wbuf_len, ==, 0);
+                _vte_stream_trim (astream);
+                g_assert (stream->wbuf == NULL);
+                stream_append (astream, "ibis");
+                assert_stream (astream, 40, 84, "zebra" "eeeeeeeeeee" "gnu" "hippopotamus" "jackal" "yak" "ibis");
+
+                g_object_unref (astream);
+        }
+}
+
+#endif /* VTESTREAM_MAIN */
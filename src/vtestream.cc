@@ -31,3 +31,4 @@
 
 #include "vtestream-base.h"
 #include "vtestream-file.h"
+#include "vtestream-memory.h"
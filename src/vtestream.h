@@ -30,17 +30,23 @@ typedef struct _VteStream VteStream;
 
 void _vte_stream_reset (VteStream *stream, gsize offset);
 gboolean _vte_stream_read (VteStream *stream, gsize offset, char *data, gsize len);
+gboolean _vte_stream_read_concurrent (VteStream *stream, gsize offset, char *data, gsize len);
 void _vte_stream_append (VteStream *stream, const char *data, gsize len);
 void _vte_stream_truncate (VteStream *stream, gsize offset);
 void _vte_stream_advance_tail (VteStream *stream, gsize offset);
 gsize _vte_stream_tail (VteStream *stream);
 gsize _vte_stream_head (VteStream *stream);
+void _vte_stream_get_usage (VteStream *stream, gsize *memory, gsize *disk);
+void _vte_stream_trim (VteStream *stream);
 
 /* Various streams */
 
 VteStream *
 _vte_file_stream_new (void);
 
+VteStream *
+_vte_memory_stream_new (gboolean compress);
+
 G_END_DECLS
 
 #endif